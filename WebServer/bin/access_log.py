@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+
+# access_log.py: Print a binary access log (spidey -L path,binary) as spidey's text log
+#
+#   bin/access_log.py access.bin    Print every record
+#   bin/access_log.py < access.bin  Same, from standard input
+
+import socket
+import struct
+import sys
+import time
+
+# Globals
+
+MAGIC  = b'SPIDEYA2'
+RECORD = struct.Struct('=QQ16sIHBBH6x')         # AccessRecord in include/spidey.h
+
+# Functions
+
+def address(family, raw):
+    if family == socket.AF_INET:
+        return socket.inet_ntop(socket.AF_INET, raw[:4])
+    if family == socket.AF_INET6:
+        return socket.inet_ntop(socket.AF_INET6, raw)
+    return 'unknown'
+
+def records(stream):
+    if stream.read(len(MAGIC)) != MAGIC:
+        raise ValueError('not a binary access log')
+    while True:
+        header = stream.read(RECORD.size)
+        if len(header) < RECORD.size:
+            return
+        fields = RECORD.unpack(header)
+        yield fields + (stream.read(fields[-1]).decode('utf-8', 'replace'),)
+
+def main():
+    stream = open(sys.argv[1], 'rb') if len(sys.argv) > 1 else sys.stdin.buffer
+    try:
+        for when, nbytes, raw, duration, status, family, version, _, line in records(stream):
+            stamp   = time.strftime('%d/%b/%Y:%H:%M:%S %z', time.localtime(when / 1e6))
+            request = '{} HTTP/{}.{}'.format(line, version // 10, version % 10) if line else '-'
+            print('{} - - [{}] "{}" {} {} {}'.format(
+                address(family, raw), stamp, request, status, nbytes or '-', duration))
+    except ValueError as error:
+        print('{}: {}'.format(sys.argv[0], error), file=sys.stderr)
+        return 1
+    except BrokenPipeError:
+        pass
+    return 0
+
+# Main Execution
+
+if __name__ == '__main__':
+    sys.exit(main())
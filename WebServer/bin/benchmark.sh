@@ -0,0 +1,86 @@
+#!/bin/bash
+
+# benchmark.sh: Compare throughput of plain, release, and profile-guided builds
+#
+#   bin/benchmark.sh            Build each variant, run the workload, report deltas
+#   bin/benchmark.sh -t spidey  Train a profile-generating build (used by make pgo)
+
+WORKSPACE=/tmp/spidey-benchmark.$(id -u)
+DURATION=${DURATION:-5}
+CLIENTS=${CLIENTS:-8}
+ROUNDS=${ROUNDS:-3}
+PORT=${PORT:-$((9000 + RANDOM % 500))}
+WORKLOAD=${WORKLOAD:-bin/workload}
+MODES="single forking"
+VARIANTS="plain release pgo"
+
+# Functions
+
+cleanup() {
+    rm -fr $WORKSPACE
+    exit ${1:-0}
+}
+
+# Run workload against binary in mode and set RATE to its request rate
+measure() {
+    $1 -r www -p $PORT -c $2 2> /dev/null &
+    pid=$!
+    sleep 0.5
+    RATE=$($WORKLOAD -c $CLIENTS -d $DURATION localhost $PORT | awk '/^requests/ { print $8 }')
+    RATE=${RATE:-0}
+    kill $pid
+    wait $pid 2> /dev/null
+    PORT=$((PORT + 1))          # Server sockets are not reusable right away
+}
+
+# Build variant with make target and keep a copy of the binary
+build() {
+    echo "Building $1 ..." 1>&2
+    if ! make -s $2 > $WORKSPACE/build.log 2>&1; then
+        cat $WORKSPACE/build.log 1>&2
+        cleanup 1
+    fi
+    cp bin/spidey $WORKSPACE/spidey.$1
+}
+
+# Main execution
+
+if [ "$1" = "-t" ]; then
+    for mode in $MODES; do
+        measure $2 $mode
+        echo "Training $2 ($mode): $RATE requests/s"
+    done
+    exit 0
+fi
+
+trap "cleanup 1" INT TERM
+mkdir -p $WORKSPACE
+
+build plain "-B all"
+cp bin/workload $WORKSPACE/workload
+WORKLOAD=$WORKSPACE/workload
+build release release
+build pgo pgo
+
+for mode in $MODES; do
+    declare -A best=()
+    for round in $(seq $ROUNDS); do
+        for variant in $VARIANTS; do
+            measure $WORKSPACE/spidey.$variant $mode
+            if [ -z "${best[$variant]}" ] || awk "BEGIN { exit !($RATE > ${best[$variant]}) }"; then
+                best[$variant]=$RATE
+            fi
+        done
+    done
+
+    echo "== $mode: best of $ROUNDS x ${DURATION}s, $CLIENTS clients"
+    for variant in $VARIANTS; do
+        awk -v v=$variant -v r=${best[$variant]} -v p=${best[plain]} \
+            'BEGIN { printf "   %-8s %10.1f requests/s %+7.1f%%\n", v, r, (p > 0 ? (r - p) * 100 / p : 0) }'
+    done
+    unset best
+done
+
+cleanup 0
+
+# vim: set sts=4 sw=4 ts=8 ft=sh:
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+
+# perf_check.py: Compare spidey's performance in each concurrency mode with a baseline
+#
+#   bin/perf_check.py               Measure and fail on regressions from bin/perf_baseline.json
+#   bin/perf_check.py -u            Measure and record the results as the new baseline
+
+import json
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# Globals
+
+SPIDEY    = 'bin/spidey'
+WORKLOAD  = 'bin/workload'
+BASELINE  = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'perf_baseline.json')
+DURATION  = int(os.environ.get('DURATION', 3))
+CLIENTS   = int(os.environ.get('CLIENTS', 8))
+MODES     = ('single', 'forking', 'cooperative')
+SCENARIOS = (                                   # Name, path requested
+    ('small',   '/html/index.html'),
+    ('large',   '/large.bin'),
+    ('listing', '/text/'),
+    ('cgi',     '/scripts/env.sh'),
+)
+LARGE     = 1024 * 1024                         # Bytes in /large.bin
+METRICS   = (                                   # Name, unit, whether higher is better
+    ('rate',   'requests/s', True),
+    ('p99_us', 'us p99',     False),
+    ('cpu_us', 'CPU us/req', False),
+    ('rss_kb', 'KB peak',    False),
+)
+
+# Functions
+
+def usage(status):
+    print('''Usage: {} [-u]
+    -h              Display help message
+    -u              Record results as the new baseline
+    '''.format(os.path.basename(sys.argv[0])))
+    sys.exit(status)
+
+def free_port():
+    ''' Return a local TCP port nobody is listening on. '''
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+def cpu_seconds(pid):
+    ''' Return CPU seconds used by process and its reaped children. '''
+    fields = open('/proc/{}/stat'.format(pid)).read().rsplit(')', 1)[1].split()
+    ticks  = sum(int(f) for f in fields[11:15])  # utime, stime, cutime, cstime
+    return ticks / os.sysconf('SC_CLK_TCK')
+
+def peak_rss(pid):
+    ''' Return peak resident set size of process in KB. '''
+    for line in open('/proc/{}/status'.format(pid)):
+        if line.startswith('VmHWM:'):
+            return int(line.split()[1])
+    return 0
+
+def run_workload(port, path):
+    ''' Drive path with the workload generator and return its counters. '''
+    output = subprocess.run([WORKLOAD, '-c', str(CLIENTS), '-d', str(DURATION), 'localhost', str(port), path],
+                            capture_output=True, text=True, check=True).stdout
+    counters = {}
+    for line in output.splitlines():
+        words = line.split()
+        if words and words[0] == 'status':     # status 2xx N 3xx N ...
+            words = words[1:]
+        for name, value in zip(words[::2], words[1::2]):
+            counters[(line.split()[0], name)] = float(value)
+    return counters
+
+def measure(mode, root):
+    ''' Serve root in mode and measure each scenario. '''
+    port    = free_port()
+    server  = subprocess.Popen([SPIDEY, '-r', root, '-p', str(port), '-c', mode],
+                               stderr=subprocess.DEVNULL)
+    results = {}
+    try:
+        time.sleep(0.5)
+        for name, path in SCENARIOS:
+            before   = cpu_seconds(server.pid)
+            counters = run_workload(port, path)
+            after    = cpu_seconds(server.pid)
+            requests = counters.get(('requests', 'requests'), 0)
+            failed   = counters.get(('requests', 'errors'), 0) + sum(
+                counters.get(('status', c), 0) for c in ('3xx', '4xx', '5xx', 'other'))
+            results[name] = {
+                'rate':   round(counters.get(('requests', 'rate'), 0), 1),
+                'p99_us': int(counters.get(('requests', 'p99_us'), 0)),
+                'cpu_us': round((after - before) * 1e6 / requests, 1) if requests else 0,
+                'rss_kb': peak_rss(server.pid),
+                'failed': int(failed),
+            }
+    finally:
+        server.terminate()
+        server.wait()
+    return results
+
+def compare(mode, name, result, baseline, tolerances):
+    ''' Print result against baseline and return the number of regressions. '''
+    regressions = 0
+    if result['failed']:
+        print('   {:<8} {} failed requests'.format(name, result['failed']))
+        regressions += 1
+
+    for metric, unit, higher in METRICS:
+        value    = result[metric]
+        expected = baseline.get(metric) if baseline else None
+        if not expected:
+            print('   {:<8} {:>12} {:<11} (no baseline)'.format(name, value, unit))
+            continue
+
+        change    = (value - expected) / expected
+        tolerance = tolerances[metric]
+        regressed = change < -tolerance if higher else change > tolerance
+        regressions += regressed
+        print('   {:<8} {:>12} {:<11} {:+7.1%} (limit {}{:.0%}){}'.format(
+            name, value, unit, change, '-' if higher else '+', tolerance,
+            '  REGRESSION' if regressed else ''))
+    return regressions
+
+# Main execution
+
+def main():
+    update = False
+    for argument in sys.argv[1:]:
+        if argument == '-u':
+            update = True
+        elif argument == '-h':
+            usage(0)
+        else:
+            usage(1)
+
+    baseline = json.load(open(BASELINE)) if os.path.exists(BASELINE) else {}
+    tolerances = baseline.get('tolerances', {'rate': 0.3, 'p99_us': 1.0, 'cpu_us': 0.5, 'rss_kb': 0.5})
+
+    # Serve a copy of www with a large file added
+    workspace = tempfile.mkdtemp(prefix='spidey-perf.')
+    root      = os.path.join(workspace, 'www')
+    shutil.copytree('www', root)
+    with open(os.path.join(root, 'large.bin'), 'wb') as stream:
+        stream.write(os.urandom(LARGE))
+
+    results, regressions = {}, 0
+    try:
+        for mode in MODES:
+            results[mode] = measure(mode, root)
+            print('== {}: {} clients, {}s per scenario'.format(mode, CLIENTS, DURATION))
+            for name, _ in SCENARIOS:
+                expected = baseline.get('modes', {}).get(mode, {}).get(name)
+                regressions += compare(mode, name, results[mode][name], expected, tolerances)
+    finally:
+        shutil.rmtree(workspace)
+
+    if update:
+        for mode in results.values():
+            for result in mode.values():
+                del result['failed']
+        json.dump({'tolerances': tolerances, 'modes': results}, open(BASELINE, 'w'), indent=4)
+        print('Recorded baseline in {}'.format(BASELINE))
+        return 0
+
+    print('perf-check: {}'.format('{} regressions'.format(regressions) if regressions else 'Success'))
+    return 1 if regressions else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
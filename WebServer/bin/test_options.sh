@@ -0,0 +1,402 @@
+#!/bin/bash
+
+# test_options.sh: Check optional features against servers this script starts
+#
+#   bin/test_options.sh [spidey]
+
+SPIDEY=${1:-bin/spidey}
+PLUGIN=${PLUGIN:-lib/plugin_hello.so}
+WORKSPACE=/tmp/spidey-options.$(id -u)
+PORT=${PORT:-$((9500 + RANDOM % 400))}
+FAILURES=0
+
+# Functions
+
+error() {
+    echo "$@"
+    [ -r $WORKSPACE/test ] && (echo; cat $WORKSPACE/test; echo)
+    FAILURES=$((FAILURES + 1))
+}
+
+cleanup() {
+    STATUS=${1:-$FAILURES}
+    stop_server
+    stop_upstream
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+# Start spidey on the next port with options after the root
+start_server() {
+    PORT=$((PORT + 2))                  # Server sockets are not reusable right away
+    $SPIDEY -r $WORKSPACE/www -p $PORT "$@" 2> $WORKSPACE/log &
+    SERVER=$!
+    sleep 0.5
+}
+
+stop_server() {
+    if [ -n "$SERVER" ]; then
+        kill $SERVER 2> /dev/null
+        wait $SERVER 2> /dev/null
+        SERVER=
+    fi
+}
+
+# Start a single mode spidey serving the upstream root on UPSTREAM_PORT
+start_upstream() {
+    UPSTREAM_PORT=$((PORT + 1))
+    $SPIDEY -r $WORKSPACE/upstream -p $UPSTREAM_PORT -c single 2> /dev/null &
+    UPSTREAM=$!
+    sleep 0.5
+}
+
+stop_upstream() {
+    if [ -n "$UPSTREAM" ]; then
+        kill $UPSTREAM 2> /dev/null
+        wait $UPSTREAM 2> /dev/null
+        UPSTREAM=
+    fi
+}
+
+# Print the server's counter
+server_stat() {
+    kill -USR2 $SERVER
+    sleep 0.1
+    awk -v name=$1 '$1 == name { value = $2 } END { print value + 0 }' $WORKSPACE/log
+}
+
+check_status() {
+    if [ $1 -ne $2 ]; then
+        echo "FAILURE: exit status $1 != $2" > $WORKSPACE/test
+        return 1
+    fi
+}
+
+# Print the inode of the socket listening on PORT
+listen_inode() {
+    ss -Hltne "sport = :$PORT" | grep -o 'ino:[0-9]*' | head -n 1
+}
+
+check_runs() {
+    runs=$(wc -l < $WORKSPACE/runs)
+    if [ $runs -ne $1 ]; then
+        echo "FAILURE: script ran $runs times, expected $1" > $WORKSPACE/test
+        return 1
+    fi
+}
+
+# Setup
+
+rm -fr $WORKSPACE
+mkdir -p $WORKSPACE/www/scripts $WORKSPACE/www/text
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+# Counts its runs; slow enough that concurrent requests overlap it
+cat > $WORKSPACE/www/scripts/count.sh <<EOF
+#!/bin/sh
+echo run >> $WORKSPACE/runs
+sleep 0.5
+echo "HTTP/1.0 200 OK"
+echo "Content-type: text/plain"
+echo "Cache-Control: max-age=1, stale-while-revalidate=0"
+echo
+echo counted
+EOF
+chmod +x $WORKSPACE/www/scripts/count.sh
+
+# Upstream for /api: a file, a script echoing the request body, and a
+# script whose unsized output is sent chunked; /apix.txt exists on both
+mkdir -p $WORKSPACE/upstream/api
+echo upstream > $WORKSPACE/upstream/api/hello.txt
+echo upstream > $WORKSPACE/upstream/apix.txt
+echo front > $WORKSPACE/www/apix.txt
+printf '#!/bin/sh\necho "HTTP/1.0 200 OK"\necho "Content-type: application/octet-stream"\necho\ncat\n' > $WORKSPACE/upstream/api/echo.sh
+printf '#!/bin/sh\necho "HTTP/1.0 200 OK"\necho "Content-type: text/plain"\necho\nseq 1 20000\n' > $WORKSPACE/upstream/api/chunks.sh
+chmod +x $WORKSPACE/upstream/api/*.sh
+head -c 300000 /dev/urandom > $WORKSPACE/upload
+head -c 200000 /dev/urandom > $WORKSPACE/replace
+head -c 1100000 /dev/urandom > $WORKSPACE/large
+seq 1 20000 > $WORKSPACE/chunks
+
+# A directory whose listing is a large in-memory body
+mkdir -p $WORKSPACE/www/many
+for i in $(seq 1500); do
+    : > $WORKSPACE/www/many/a-file-with-a-rather-long-name-$i.txt
+done
+NAME=$(head -c 3000 /dev/zero | tr '\0' x)
+
+# Testing
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "CGI Cache (-C)"
+
+for mode in single forking cooperative; do
+    start_server -c $mode -C 5
+    : > $WORKSPACE/runs
+    rm -f $WORKSPACE/body.*
+
+    printf "     %-60s ... " "$mode: 6 concurrent misses run script once"
+    CURLS=
+    for i in $(seq 6); do
+        curl -s -o $WORKSPACE/body.$i localhost:$PORT/scripts/count.sh &
+        CURLS="$CURLS $!"
+    done
+    wait $CURLS
+    if ! check_runs 1 || [ $(cat $WORKSPACE/body.* | grep -c counted) -ne 6 ]; then
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    printf "     %-60s ... " "$mode: fresh entry is a hit"
+    curl -s -o $WORKSPACE/test localhost:$PORT/scripts/count.sh
+    if ! check_status $? 0 || ! check_runs 1 || [ "$(cat $WORKSPACE/test)" != counted ]; then
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    # max-age=1 with no stale-while-revalidate: the next request refills
+    printf "     %-60s ... " "$mode: expired entry runs script again"
+    sleep 1.5
+    curl -s -o $WORKSPACE/test localhost:$PORT/scripts/count.sh
+    curl -s -o /dev/null localhost:$PORT/scripts/count.sh
+    if ! check_status $? 0 || ! check_runs 2 || [ "$(cat $WORKSPACE/test)" != counted ]; then
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    stop_server
+done
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Uploads (-U)"
+
+for mode in single forking cooperative; do
+    start_server -c $mode -U /text,1
+    UPLOADED=$WORKSPACE/www/text/upload.bin
+
+    printf "     %-60s ... " "$mode: PUT /text/upload.bin (new file)"
+    code=$(curl -s -o /dev/null -w "%{http_code}" -T $WORKSPACE/upload localhost:$PORT/text/upload.bin)
+    curl -s -o $WORKSPACE/test localhost:$PORT/text/upload.bin
+    if [ "$code" != 201 ]; then
+        echo "FAILURE: status $code != 201" > $WORKSPACE/test
+        error "Failure"
+    elif ! cmp -s $WORKSPACE/test $WORKSPACE/upload; then
+        echo "FAILURE: uploaded file differs from request body" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    # Replacing renames a new inode over the name and leaves no temporary
+    printf "     %-60s ... " "$mode: PUT /text/upload.bin (chunked, replaces it)"
+    inode=$(stat -c %i $UPLOADED)
+    code=$(curl -s -o /dev/null -w "%{http_code}" -H "Transfer-Encoding: chunked" -T $WORKSPACE/replace localhost:$PORT/text/upload.bin)
+    curl -s -o $WORKSPACE/test localhost:$PORT/text/upload.bin
+    if [ "$code" != 200 ]; then
+        echo "FAILURE: status $code != 200" > $WORKSPACE/test
+        error "Failure"
+    elif ! cmp -s $WORKSPACE/test $WORKSPACE/replace; then
+        echo "FAILURE: replaced file differs from request body" > $WORKSPACE/test
+        error "Failure"
+    elif [ "$(stat -c %i $UPLOADED)" = "$inode" ] || [ "$(ls -A $WORKSPACE/www/text)" != upload.bin ]; then
+        echo "FAILURE: file rewritten in place or temporary left: $(ls -A $WORKSPACE/www/text)" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    printf "     %-60s ... " "$mode: PUT /text/upload.bin (over 1 MB limit)"
+    sized=$(curl -s -o /dev/null -w "%{http_code}" -T $WORKSPACE/large localhost:$PORT/text/upload.bin)
+    chunked=$(curl -s -o /dev/null -w "%{http_code}" -H "Transfer-Encoding: chunked" -T $WORKSPACE/large localhost:$PORT/text/upload.bin)
+    if [ "$sized $chunked" != "413 413" ]; then
+        echo "FAILURE: status $sized and $chunked != 413" > $WORKSPACE/test
+        error "Failure"
+    elif ! cmp -s $UPLOADED $WORKSPACE/replace || [ "$(ls -A $WORKSPACE/www/text)" != upload.bin ]; then
+        echo "FAILURE: refused upload changed the directory: $(ls -A $WORKSPACE/www/text)" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    stop_server
+    rm -f $UPLOADED
+done
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Reverse Proxy (-u)"
+
+start_upstream
+for mode in single forking cooperative; do
+    start_server -c $mode -u /api=localhost:$UPSTREAM_PORT -u /down=localhost:$((UPSTREAM_PORT + 2))
+
+    printf "     %-60s ... " "$mode: GET /api/hello.txt"
+    curl -s -o $WORKSPACE/test localhost:$PORT/api/hello.txt
+    if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != upstream ]; then
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    printf "     %-60s ... " "$mode: POST /api/echo.sh (300 KB body)"
+    curl -s -o $WORKSPACE/test --data-binary @$WORKSPACE/upload localhost:$PORT/api/echo.sh
+    if ! check_status $? 0 || ! cmp -s $WORKSPACE/test $WORKSPACE/upload; then
+        echo "FAILURE: echoed body differs from request body" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    printf "     %-60s ... " "$mode: GET /api/chunks.sh (chunked upstream response)"
+    curl -s -o $WORKSPACE/test -D $WORKSPACE/header localhost:$UPSTREAM_PORT/api/chunks.sh
+    if ! grep -qi "^transfer-encoding: chunked" $WORKSPACE/header; then
+        echo "FAILURE: upstream response is not chunked" > $WORKSPACE/test
+        error "Failure"
+    elif ! curl -s -o $WORKSPACE/test localhost:$PORT/api/chunks.sh || ! cmp -s $WORKSPACE/test $WORKSPACE/chunks; then
+        echo "FAILURE: proxied body differs from upstream output" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    # A forked child's pooled connection ends with it
+    if [ $mode != forking ]; then
+        printf "     %-60s ... " "$mode: upstream connection reused"
+        before=$(server_stat proxy_reused)
+        for i in $(seq 3); do
+            curl -s -o /dev/null localhost:$PORT/api/hello.txt
+        done
+        after=$(server_stat proxy_reused)
+        if [ $((after - before)) -lt 3 ]; then
+            echo "FAILURE: proxy_reused went from $before to $after, expected 3 more" > $WORKSPACE/test
+            error "Failure"
+        else
+            echo "Success"
+        fi
+    fi
+
+    printf "     %-60s ... " "$mode: GET /down/hello.txt (upstream down)"
+    code=$(curl -s -o /dev/null -w "%{http_code}" localhost:$PORT/down/hello.txt)
+    if [ "$code" != 502 ]; then
+        echo "FAILURE: status $code != 502" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    printf "     %-60s ... " "$mode: GET /apix.txt (not under /api)"
+    curl -s -o $WORKSPACE/test localhost:$PORT/apix.txt
+    if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != front ]; then
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    stop_server
+done
+stop_upstream
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Zero-Copy Sends (-z)"
+
+start_server -c single -P /hello=$PLUGIN
+curl -s -o $WORKSPACE/many.copied localhost:$PORT/many/
+curl -s -o $WORKSPACE/hello.copied localhost:$PORT/hello/$NAME
+stop_server
+
+for mode in single forking cooperative; do
+    start_server -c $mode -z 1024 -P /hello=$PLUGIN
+
+    printf "     %-60s ... " "$mode: /many/ (listing) matches plain writes"
+    curl -s -o $WORKSPACE/test localhost:$PORT/many/
+    if ! check_status $? 0 || ! cmp -s $WORKSPACE/test $WORKSPACE/many.copied; then
+        echo "FAILURE: listing differs from the one sent with plain writes" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    printf "     %-60s ... " "$mode: /hello/xxx... (plugin) matches plain writes"
+    curl -s -o $WORKSPACE/test localhost:$PORT/hello/$NAME
+    if ! check_status $? 0 || ! cmp -s $WORKSPACE/test $WORKSPACE/hello.copied; then
+        echo "FAILURE: plugin output differs from the one sent with plain writes" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    printf "     %-60s ... " "$mode: MSG_ZEROCOPY used"
+    sends=$(server_stat zerocopy_sends)
+    if [ $sends -lt 2 ]; then
+        echo "FAILURE: $sends zero-copy sends, expected 2 or more" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    stop_server
+done
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Upgrade (SIGHUP)"
+
+# The upgrade starts the binary at the path it was started from again
+cp $SPIDEY $WORKSPACE/spidey
+for mode in single forking cooperative; do
+    SPIDEY=$WORKSPACE/spidey start_server -c $mode
+    inode=$(listen_inode)
+
+    printf "     %-60s ... " "$mode: failed upgrade keeps serving, reaps it"
+    mv $WORKSPACE/spidey $WORKSPACE/spidey.new
+    printf '#!/bin/sh\nexit 1\n' > $WORKSPACE/spidey
+    chmod +x $WORKSPACE/spidey
+    kill -HUP $SERVER
+    sleep 0.5
+    mv $WORKSPACE/spidey.new $WORKSPACE/spidey
+    curl -s -o $WORKSPACE/test localhost:$PORT/apix.txt
+    if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != front ]; then
+        error "Failure"
+    elif [ -n "$(ps --ppid $SERVER -o stat= | grep Z)" ]; then
+        echo "FAILURE: failed new server left unreaped" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    printf "     %-60s ... " "$mode: new server accepts on inherited socket"
+    kill -HUP $SERVER
+    for i in $(seq 20); do
+        kill -0 $SERVER 2> /dev/null || break
+        sleep 0.1
+    done
+    previous=$SERVER
+    SERVER=$(sed -n "s/^\[ *\([0-9]*\)\] LOG .*Took over from server $previous\$/\1/p" $WORKSPACE/log)
+    curl -s -o $WORKSPACE/test localhost:$PORT/apix.txt
+    if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != front ]; then
+        error "Failure"
+    elif kill -0 $previous 2> /dev/null || [ -z "$SERVER" ]; then
+        echo "FAILURE: old server $previous still running or no new server took over" > $WORKSPACE/test
+        error "Failure"
+    elif [ "$(listen_inode)" != "$inode" ]; then
+        echo "FAILURE: listening socket $(listen_inode) is not $inode" > $WORKSPACE/test
+        error "Failure"
+    else
+        echo "Success"
+    fi
+
+    stop_server
+done
+
+echo
+exit $FAILURES
+
+# vim: set sts=4 sw=4 ts=8 ft=sh:
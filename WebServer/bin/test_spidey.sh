@@ -37,7 +37,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -88,7 +88,7 @@ echo
 cowsay -W 72 <<EOF
 On another machine, please run:
 
-    valgrind --leak-check=full ./bin/spidey -r ~pbui/pub/www -p PORT -c MODE
+    valgrind --leak-check=full ./bin/spidey -r ~pbui/pub/www -p PORT -c MODE -U /text
 
 - Where PORT is a number between 9000 - 9999
 
@@ -115,7 +115,7 @@ printf "\n %-64s ... \n" "Handle Browse Requests"
 
 printf "     %-60s ... " "/"
 HREFS="/..,/html,/scripts,/song.txt,/text"
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/ > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. html scripts text" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
@@ -138,9 +138,9 @@ fi
 sleep 2
 
 printf "     %-60s ... " "/scripts"
-HREFS="/scripts/..,/scripts/cowsay.sh,/scripts/env.sh"
+HREFS="/scripts/..,/scripts/cat.sh,/scripts/cowsay.sh,/scripts/env.sh"
 curl -s -D $WORKSPACE/header $HOST:$PORT/scripts > $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all ".. cowsay.sh env.sh" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+if ! check_status $? 0 || ! grep_all ".. cat.sh cowsay.sh env.sh" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
     error "Failure"
 else
     echo "Success"
@@ -163,7 +163,7 @@ printf "\n %-64s ... \n" "Handle File Requests"
 
 printf "     %-60s ... " "/html/index.html"
 MD5SUM=36fcc1da4afe58242350ee3940bb4220
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "Spidey html thumbnail" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
@@ -260,12 +260,79 @@ fi
 
 sleep 2
 
+printf "     %-60s ... " "/scripts/env.sh (chunked, kept alive)"
+curl -s -D $WORKSPACE/header -w '%{num_connects}\n' $HOST:$PORT/scripts/env.sh $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$HEADERS" $WORKSPACE/test; then
+    error "Failure"
+elif [ $(grep -i -c "^Transfer-Encoding: chunked" $WORKSPACE/header) -ne 2 ] || [ "$(tail -n 1 $WORKSPACE/test)" != 0 ]; then
+    echo "FAILURE: CGI response not chunked or connection not reused" > $WORKSPACE/test
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/env.sh (POST)"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -d 'spidey=web' $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "CONTENT_LENGTH=10 CONTENT_TYPE=application/x-www-form-urlencoded REQUEST_METHOD=POST" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/env.sh (POST chunked, 100-continue, kept alive)"
+curl -s -D $WORKSPACE/header -w '%{num_connects}\n' -H 'Transfer-Encoding: chunked' -H 'Expect: 100-continue' -d 'spidey=web' $HOST:$PORT/scripts/env.sh $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REQUEST_METHOD=POST" $WORKSPACE/test; then
+    error "Failure"
+elif grep -q "CONTENT_LENGTH" $WORKSPACE/test || [ $(grep -c "^HTTP/1.1 100 Continue" $WORKSPACE/header) -ne 2 ] || [ "$(tail -n 1 $WORKSPACE/test)" != 0 ]; then
+    echo "FAILURE: chunked body not streamed or connection not reused" > $WORKSPACE/test
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/env.sh (POST, body looks like a request)"
+BODY=$'GET /song.txt HTTP/1.1\r\nHost: spidey\r\n\r\n'
+exec 3<>/dev/tcp/$HOST/$PORT
+printf "POST /scripts/env.sh HTTP/1.1\r\nHost: spidey\r\nContent-Length: ${#BODY}\r\n\r\n%sGET /asdf HTTP/1.1\r\nHost: spidey\r\nConnection: close\r\n\r\n" "$BODY" >&3
+timeout 10 cat <&3 > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "CONTENT_LENGTH=${#BODY} REQUEST_METHOD=POST" $WORKSPACE/test; then
+    error "Failure"
+elif grep -q "Right back into place" $WORKSPACE/test || [ $(grep -c "^HTTP/1.1 " $WORKSPACE/test) -ne 2 ] || ! grep -q "^HTTP/1.1 404" $WORKSPACE/test; then
+    echo "FAILURE: body served as a request, or the request after it was lost" > $WORKSPACE/test
+    error "Failure"
+else
+    echo "Success"
+fi
+exec 3<&-
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/cat.sh (POST 1 MB, echoed as it is read)"
+head -c 1048576 /dev/urandom > $WORKSPACE/body
+MD5SUM=$(md5sum $WORKSPACE/body | awk '{print $1}')
+CONTENT="application/octet-stream"
+curl -s -D $WORKSPACE/header --data-binary @$WORKSPACE/body $HOST:$PORT/scripts/cat.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
 # ------------------------------------------------------------------------------
 
 printf "\n %-64s ... \n" "Handle Errors"
 
 printf "     %-60s ... " "/asdf"
-STATUS="HTTP/1.0 404 Not Found"
+STATUS="HTTP/1.1 404 Not Found"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -297,3 +364,87 @@ if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$S
 else
     echo "Success"
 fi
+
+sleep 2
+
+# Uploads that land are checked by test_options.sh, whose root it can clean up
+printf "     %-60s ... " "/text/../song.txt (PUT out of the upload prefix)"
+MD5SUM=2a9842c501692e391206c2e7ebb3dbc9
+CODES=$(for uri in /text/../song.txt /text/../scripts/env.sh /text//../song.txt; do
+    curl -s --path-as-is -o /dev/null -w '%{http_code} ' -X PUT --data-binary 'Spidey was here' $HOST:$PORT$uri
+done)
+curl -s $HOST:$PORT/scripts/env.sh > $WORKSPACE/header
+curl -s $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "REQUEST_METHOD=GET" $WORKSPACE/header; then
+    error "Failure"
+elif [ -n "$(echo $CODES | tr ' ' '\n' | grep -v -E '^(403|404)$')" ]; then
+    echo "FAILURE: status $CODES" > $WORKSPACE/test
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle HTTP/2 Requests"
+
+printf "     %-60s ... " "/html/index.html (prior knowledge)"
+MD5SUM=36fcc1da4afe58242350ee3940bb4220
+STATUS="HTTP/2 200 "
+CONTENT="text/html"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/text/hackers.txt (upgrade)"
+MD5SUM=c77059544e187022e19b940d0c55f408
+VERSION=$(curl -s --http2 -w '%{http_version}' -o $WORKSPACE/test $HOST:$PORT/text/hackers.txt)
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || [ "$VERSION" != 2 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/env.sh (prior knowledge)"
+CONTENT="text/plain"
+HEADERS="REQUEST_URI SCRIPT_FILENAME HTTP_HOST HTTP_USER_AGENT"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$HEADERS" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/asdf (prior knowledge)"
+STATUS="HTTP/2 404 "
+CONTENT="text/html"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/cat.sh (prior knowledge, POST)"
+STATUS="HTTP/2 501 "
+CONTENT="text/html"
+head -c 200000 /dev/urandom > $WORKSPACE/body
+curl -s --http2-prior-knowledge -D $WORKSPACE/header --data-binary @$WORKSPACE/body $HOST:$PORT/scripts/cat.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "501" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
@@ -0,0 +1,77 @@
+#!/bin/bash
+
+# tls_benchmark.sh: Compare server CPU per GB sent over plain HTTP, kernel TLS, and userspace TLS
+#
+#   bin/tls_benchmark.sh [spidey]
+
+SPIDEY=${1:-bin/spidey}
+WORKSPACE=/tmp/spidey-tls-benchmark.$(id -u)
+SIZE=${SIZE:-256}                       # Megabytes per download
+DOWNLOADS=${DOWNLOADS:-8}
+PORT=${PORT:-$((9500 + RANDOM % 400))}
+VARIANTS="plain kernel userspace"
+
+# Functions
+
+cleanup() {
+    rm -fr $WORKSPACE
+    exit ${1:-0}
+}
+
+# Print user plus system CPU seconds used by process
+cpu_seconds() {
+    awk -v hz=$(getconf CLK_TCK) '{ printf "%.2f\n", ($14 + $15) / hz }' /proc/$1/stat
+}
+
+# Download the file with variant and set CPU to the server's CPU seconds per GB
+measure() {
+    local url flags
+    case $1 in
+    plain)      url=http://localhost:$PORT/large.bin ;;
+    kernel)     url=https://localhost:$((PORT + 1))/large.bin ;;
+    userspace)  url=https://localhost:$((PORT + 1))/large.bin; flags=-k ;;
+    esac
+
+    $SPIDEY -r $WORKSPACE/www -p $PORT -c single -S $((PORT + 1)),$WORKSPACE/cert.pem,$WORKSPACE/key.pem $flags 2> $WORKSPACE/$1.log &
+    pid=$!
+    sleep 0.5
+    before=$(cpu_seconds $pid)
+    for i in $(seq $DOWNLOADS); do
+        curl -sk -o /dev/null $url
+    done
+    after=$(cpu_seconds $pid)
+    kill -USR2 $pid
+    sleep 0.1
+    kill $pid
+    wait $pid 2> /dev/null
+    PORT=$((PORT + 2))                  # Server sockets are not reusable right away
+
+    CPU=$(awk -v b=$before -v a=$after -v mb=$((SIZE * DOWNLOADS)) \
+        'BEGIN { printf "%.3f", (a - b) * 1024 / mb }')
+    KERNEL=$(awk '/^tls_kernel/ { print $2 }' $WORKSPACE/$1.log)
+}
+
+# Main execution
+
+trap "cleanup 1" INT TERM
+mkdir -p $WORKSPACE/www
+dd if=/dev/urandom of=$WORKSPACE/www/large.bin bs=1M count=$SIZE status=none
+if ! openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -keyout $WORKSPACE/key.pem -out $WORKSPACE/cert.pem 2> /dev/null; then
+    echo "Unable to create self-signed certificate" 1>&2
+    cleanup 1
+fi
+
+echo "== single: $DOWNLOADS x ${SIZE}MB downloads"
+for variant in $VARIANTS; do
+    measure $variant
+    note=""
+    if [ $variant = kernel ] && [ "${KERNEL:-0}" = 0 ]; then
+        note="(kernel TLS unavailable; encrypted in userspace)"
+    fi
+    printf "   %-10s %8s CPU seconds/GB %s\n" $variant $CPU "$note"
+done
+
+cleanup 0
+
+# vim: set sts=4 sw=4 ts=8 ft=sh:
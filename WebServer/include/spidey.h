@@ -3,10 +3,12 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 
 /* Constants */
@@ -19,6 +21,7 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    COOPERATIVE,                        /**< Coroutine per request */
     UNKNOWN
 } ServerMode;
 
@@ -29,6 +32,45 @@ extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
 
+extern int   HeaderTimeout;             /**< Seconds to receive request headers */
+extern int   BodyTimeout;               /**< Seconds to receive request body */
+extern int   WriteTimeout;              /**< Seconds to send response */
+extern int   IdleTimeout;               /**< Seconds to keep idle connection open */
+extern off_t MaxBody;                   /**< Largest request body in bytes (0 disables) */
+
+extern int   MaxConnections;            /**< Open connections before shedding at accept */
+extern int   MaxRequests;               /**< Requests handled concurrently (upper bound) */
+extern int   MaxCGI;                    /**< CGI scripts running concurrently */
+extern int   QueueLength;               /**< Requests waiting for admission */
+extern int   QueueTimeout;              /**< Milliseconds a request may wait for admission */
+
+extern int   TraceSample;               /**< Trace 1 in TraceSample requests (0 disables) */
+extern char *CapturePath;               /**< Path to request capture log (NULL disables) */
+extern char *AccessPath;                /**< Path to access log (NULL disables) */
+extern int   AccessSample;              /**< Log 1 in AccessSample responses */
+extern int   FlushLowWater;             /**< Bytes of dynamic output buffered before sending */
+extern int   CacheTTL;                  /**< Seconds CGI output is cached by default (0 disables) */
+extern int   CacheEntries;              /**< CGI outputs cached at once */
+extern int   NegativeEntries;           /**< Missing paths remembered (0 disables) */
+extern int   RateRequests;              /**< Requests per second per client (0 disables) */
+extern int   RateConnections;           /**< Connections per second per client (0 disables) */
+extern int   RateEntries;               /**< Client and subnet buckets tracked */
+extern int   CgiCpu;                    /**< CPU seconds per CGI script (0 disables) */
+extern int   CgiMemory;                 /**< Megabytes of address space per CGI script (0 disables) */
+extern int   CgiTimeout;                /**< Seconds a CGI script may run (0 disables) */
+extern char *CgroupPath;                /**< cgroup v2 directory for CGI scripts (NULL disables) */
+extern int   CgroupCpu;                 /**< Percent of a CPU for all CGI scripts (0 for no limit) */
+extern int   CgroupMemory;              /**< Megabytes of memory for all CGI scripts (0 for no limit) */
+extern char *WarmupPath;                /**< Path to warmup manifest (NULL disables) */
+extern int   WarmupRate;                /**< Megabytes per second read ahead while warming up */
+extern int   ZerocopyMin;               /**< Bytes written at once to send with MSG_ZEROCOPY (0 disables) */
+extern int   NotsentLowat;              /**< Unsent bytes the kernel queues on zero-copy connections */
+
+extern char *TlsPort;                   /**< HTTPS port number (NULL disables) */
+extern char *TlsCertificate;            /**< Path to PEM certificate chain */
+extern char *TlsKey;                    /**< Path to PEM private key */
+extern bool  TlsKernel;                 /**< Whether to hand session keys to the kernel */
+
 /* Logging Macros */
 
 #ifdef NDEBUG
@@ -40,32 +82,415 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Statistics */
+
+#define STATS(X) \
+    X(connections_accepted)             /**< Client connections accepted */ \
+    X(connections_active)               /**< Client connections currently open */ \
+    X(requests)                         /**< Requests handled */ \
+    X(timeouts_header)                  /**< Connections evicted reading headers */ \
+    X(timeouts_body)                    /**< Connections evicted reading body */ \
+    X(timeouts_write)                   /**< Connections evicted writing response */ \
+    X(timeouts_idle)                    /**< Idle keep-alive connections closed */ \
+    X(requests_inflight)                /**< Requests currently being handled */ \
+    X(requests_queued)                  /**< Requests that waited for admission */ \
+    X(requests_shed)                    /**< Requests answered with 503 */ \
+    X(connections_shed)                 /**< Connections answered with 503 at accept */ \
+    X(requests_limited)                 /**< Requests answered with 429 */ \
+    X(connections_limited)              /**< Connections answered with 429 at accept */ \
+    X(admission_limit)                  /**< Current concurrent request limit */ \
+    X(http2_connections)                /**< Connections that spoke HTTP/2 */ \
+    X(http2_streams)                    /**< HTTP/2 streams served */ \
+    X(tls_handshakes)                   /**< TLS handshakes completed */ \
+    X(tls_resumed)                      /**< TLS handshakes that resumed a session */ \
+    X(tls_kernel)                       /**< TLS connections encrypted by the kernel */ \
+    X(cache_hits)                       /**< CGI requests served fresh from the cache */ \
+    X(cache_stale)                      /**< CGI requests served stale during a refresh */ \
+    X(cache_misses)                     /**< CGI requests that ran the script to fill the cache */ \
+    X(cache_collapsed)                  /**< CGI requests that waited for another's output */ \
+    X(negative_hits)                    /**< 404s answered from the negative cache */ \
+    X(negative_misses)                  /**< 404s that looked up the filesystem */ \
+    X(plugin_overruns)                  /**< Plugin calls that held their thread too long */ \
+    X(proxy_requests)                   /**< Requests passed to an upstream */ \
+    X(proxy_reused)                     /**< Proxied requests sent on a pooled connection */ \
+    X(proxy_errors)                     /**< Proxied requests answered with an error page */ \
+    X(uploads)                          /**< PUT uploads stored */ \
+    X(upload_bytes)                     /**< Bytes of PUT uploads stored */ \
+    X(zerocopy_sends)                   /**< Sends made with MSG_ZEROCOPY */ \
+    X(zerocopy_copied)                  /**< Zero-copy sends the kernel copied anyway */ \
+    X(cgi_killed)                       /**< CGI scripts killed before they finished */ \
+    X(cgi_limited)                      /**< CGI scripts ended by their CPU or memory limits */ \
+    X(cgi_throttled)                    /**< Periods the CGI cgroup was throttled */
+
+typedef struct {
+#define STATS_FIELD(name)   unsigned long name;
+    STATS(STATS_FIELD)
+#undef STATS_FIELD
+} Stats;
+
+extern Stats *Statistics;               /**< Counters shared by every process */
+
+#define stats_add(name, n)  __atomic_add_fetch(&Statistics->name, (n), __ATOMIC_RELAXED)
+#define stats_sub(name, n)  __atomic_sub_fetch(&Statistics->name, (n), __ATOMIC_RELAXED)
+#define stats_set(name, n)  __atomic_store_n(&Statistics->name, (n), __ATOMIC_RELAXED)
+
+void	    stats_init(void);
+void	    stats_dump(FILE *stream);
+
+/* Tracing */
+
+typedef struct request Request;
+
+/**
+ * Phase boundaries, in the order a request crosses them.  Each one is a USDT
+ * probe (spidey:<phase>, with the Request pointer as its argument) and a
+ * timestamp in sampled requests.
+ */
+#define TRACE(X) \
+    X(start)                            /**< Accepted (or kept-alive request begun) */ \
+    X(headers)                          /**< Header block complete */ \
+    X(parse)                            /**< Request parsed */ \
+    X(path)                             /**< Request path determined */ \
+    X(stat)                             /**< File type determined */ \
+    X(admit)                            /**< Admitted for handling */ \
+    X(mimetype)                         /**< Mimetype determined */ \
+    X(body)                             /**< Response body sent */ \
+    X(done)                             /**< Response flushed */
+
+#define TRACE_RING      1024            /* Sampled requests kept for dumping */
+#define TRACE_URI       64              /* Bytes of URI kept per sample */
+
+typedef struct {
+    unsigned long sequence;             /*< Sample number (0 if slot unused) */
+#define TRACE_FIELD(name)   uint64_t name;
+    TRACE(TRACE_FIELD)
+#undef TRACE_FIELD
+    pid_t    pid;                       /*< Process that finished request */
+    int      status;                    /*< Response status */
+    char     uri[TRACE_URI];            /*< Start of request URI */
+} TraceRecord;
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define trace_probe(phase, r)   DTRACE_PROBE1(spidey, phase, r)
+#elif defined(__x86_64__)
+/* Same ELF note sys/sdt.h emits, for systems without the systemtap headers */
+#define trace_probe(phase, r) \
+    __asm__ __volatile__ ( \
+        "990: nop\n" \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+        ".balign 4\n" \
+        ".4byte 992f-991f, 994f-993f, 3\n" \
+        "991: .asciz \"stapsdt\"\n" \
+        "992: .balign 4\n" \
+        "993: .8byte 990b, _.stapsdt.base, 0\n" \
+        ".asciz \"spidey\", \"" #phase "\", \"8@%0\"\n" \
+        "994: .balign 4\n" \
+        ".popsection\n" \
+        ".ifndef _.stapsdt.base\n" \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n" \
+        ".hidden _.stapsdt.base\n" \
+        "_.stapsdt.base: .space 1\n" \
+        ".size _.stapsdt.base, 1\n" \
+        ".popsection\n" \
+        ".endif\n" \
+        :: "nor"(r))
+#else
+#define trace_probe(phase, r)
+#endif
+
+/* Fire probe and, if request is sampled, record when it crossed phase */
+#define trace(r, phase) do { \
+    trace_probe(phase, r); \
+    if (__builtin_expect((r)->trace != NULL, 0)) { \
+        (r)->trace->phase = trace_clock(); \
+    } \
+} while (0)
+
+uint64_t    trace_clock(void);
+void	    trace_init(void);
+void	    trace_start(Request *request);
+void	    trace_finish(Request *request, int status);
+void	    trace_dump(FILE *stream);
+
+/* Capture */
+
+#define CAPTURE_MAGIC   "SPIDEYC1"      /* First 8 bytes of a capture log */
+#define CAPTURE_BUFFER  (64 * 1024)     /* Records buffered before writing */
+#define CAPTURE_FLUSH   1000            /* Milliseconds records may stay buffered */
+
+/**
+ * A capture log is CAPTURE_MAGIC followed by one CaptureRecord per request,
+ * each followed by the request's raw header block.  Fields are in host byte
+ * order.
+ */
+typedef struct {
+    uint64_t time;                      /*< Nanoseconds since capture began */
+    uint32_t connection;                /*< Connection request arrived on */
+    uint32_t length;                    /*< Bytes of request that follow */
+} CaptureRecord;
+
+int	    capture_open(const char *path);
+void	    capture_request(Request *request);
+void	    capture_flush(bool force);
+
+/* Access Log */
+
+#define ACCESS_MAGIC    "SPIDEYA2"      /* First 8 bytes of a binary access log (change with AccessRecord) */
+#define ACCESS_BUFFER   (64 * 1024)     /* Records buffered before writing */
+#define ACCESS_FLUSH    1000            /* Milliseconds records may stay buffered */
+#define ACCESS_LINE     2048            /* Longest record */
+
+typedef enum {
+    ACCESS_COMMON,                      /**< Common Log Format */
+    ACCESS_COMBINED,                    /**< Combined Log Format (adds Referer and User-Agent) */
+    ACCESS_BINARY,                      /**< AccessRecords */
+} AccessFormat;
+
+extern AccessFormat AccessLogFormat;    /**< How access log records are written */
+
+/**
+ * A binary access log is ACCESS_MAGIC followed by one AccessRecord per
+ * response, each followed by its request's method and URI (with query)
+ * separated by a space.  Fields are in host byte order.
+ */
+typedef struct {
+    uint64_t time;                      /*< Microseconds since the epoch when response finished */
+    uint64_t bytes;                     /*< Bytes of response body */
+    uint8_t  address[16];               /*< Client IPv4 or IPv6 address */
+    uint32_t duration;                  /*< Microseconds from complete request headers to response */
+    uint16_t status;                    /*< Response status code */
+    uint8_t  family;                    /*< AF_INET or AF_INET6 (0 if unknown) */
+    uint8_t  version;                   /*< HTTP version times 10 */
+    uint16_t length;                    /*< Bytes of request line that follow */
+    uint8_t  reserved[6];               /*< Zero */
+} AccessRecord;
+
+int	    access_open(const char *path);
+void	    access_reopen(void);
+void	    access_record(Request *request);
+void	    access_flush(bool force);
+int	    access_due(void);
+void	    access_child(void);
+
+/* Timer Wheel */
+
+#define TIMER_TICK_MS   10              /* Milliseconds per tick */
+#define TIMER_LEVELS    4               /* Levels of slots */
+#define TIMER_SLOTS     64              /* Slots per level */
+
+typedef enum {
+    TIMER_HEADER,                       /**< Reading request headers */
+    TIMER_BODY,                         /**< Reading request body */
+    TIMER_WRITE,                        /**< Writing response */
+    TIMER_IDLE,                         /**< Waiting for next keep-alive request */
+    TIMER_QUEUE,                        /**< Waiting for admission */
+} TimerKind;
+
+typedef struct timer Timer;
+struct timer {
+    Timer    *next;                     /*< Next timer in slot */
+    Timer    *prev;                     /*< Previous timer in slot */
+    uint64_t  expires;                  /*< Tick at which timer expires */
+    TimerKind kind;                     /*< What the deadline guards */
+};
+
+typedef struct {
+    Timer    slots[TIMER_LEVELS][TIMER_SLOTS];  /*< Slot list sentinels */
+    uint64_t tick;                      /*< Current tick */
+    size_t   count;                     /*< Number of pending timers */
+} TimerWheel;
+
+#define timer_pending(t)    ((t)->next != NULL)
+
+uint64_t    timer_now(void);
+void	    timer_wheel_init(TimerWheel *w);
+void	    timer_add(TimerWheel *w, Timer *t, TimerKind kind, uint64_t timeout);
+void	    timer_cancel(TimerWheel *w, Timer *t);
+uint64_t    timer_remaining(const Timer *t);
+size_t	    timer_expire(TimerWheel *w, void (*expire)(Timer *, void *), void *arg);
+void	    timer_each(TimerWheel *w, void (*each)(Timer *, void *), void *arg);
+int	    timer_next(TimerWheel *w);
+
+/* Coroutines */
+
+#define COROUTINE_STACK (64 * 1024)     /* Stack size of each coroutine */
+#define COROUTINE_POOL  1024            /* Stacks kept for reuse */
+
+int	    coroutine_init(void);
+int	    coroutine_spawn(void (*entry)(void *), void *arg);
+void	    coroutine_run(void);
+bool	    coroutine_active(void);
+size_t	    coroutine_count(void);
+void	    coroutine_yield(void);
+void	    coroutine_deadline(int timeout);
+bool	    coroutine_expired(void);
+int	    coroutine_poll(int fd, short events, int timeout);
+int	    coroutine_pollv(struct pollfd *fds, nfds_t n, int timeout);
+void	    coroutine_sleep(int timeout);
+ssize_t	    coroutine_read(int fd, void *buffer, size_t n);
+ssize_t	    coroutine_write(int fd, const void *buffer, size_t n);
+
 /* HTTP Request */
 
+#define REQUEST_CHUNK   1024            /* Initial request buffer size */
+#define REQUEST_MAX     BUFSIZ          /* Largest request header block */
+
+typedef enum {
+    HEADER_UNKNOWN = 0,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_HTTP2_SETTINGS,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_RANGE,
+    HEADER_REFERER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_USER_AGENT,
+    HEADER_X_FORWARDED_FOR,
+} HeaderId;
+
 typedef struct header Header;
 struct header {
     char    *name;                      /*< Name of header entry */
     char    *value;                     /*< Value of header entry */
+    HeaderId id;                        /*< Known header identifier */
     Header  *next;                      /*< Next header entry */
 };
 
+typedef enum {
+    ROUTE_NONE = 0,                     /**< Not routed yet */
+    ROUTE_BROWSE,                       /**< Directory listing */
+    ROUTE_FILE,                         /**< Static file */
+    ROUTE_CGI,                          /**< CGI script */
+    ROUTE_ERROR,                        /**< Error page */
+    ROUTE_HTTP2,                        /**< HTTP/2 connection (routes its own streams) */
+    ROUTE_MISSING,                      /**< Path known to be missing (404) */
+    ROUTE_PLUGIN,                       /**< In-process handler plugin */
+    ROUTE_PROXY,                        /**< Upstream server behind a reverse proxy */
+    ROUTE_UPLOAD,                       /**< PUT upload stored beneath RootPath */
+} Route;
+
+typedef enum {
+    BODY_NONE = 0,                      /**< No body (or all of it read) */
+    BODY_LENGTH,                        /**< Content-Length bytes remain */
+    BODY_CHUNK_SIZE,                    /**< Chunk size line expected */
+    BODY_CHUNK_DATA,                    /**< Chunk data remains */
+    BODY_CHUNK_END,                     /**< Line end after chunk data expected */
+    BODY_TRAILER,                       /**< Trailer lines expected until a blank one */
+} BodyState;
+
+typedef struct http2_stream Http2Stream;
+typedef struct ssl_st TlsConnection;
+typedef struct plugin Plugin;
+typedef struct proxy Proxy;
+typedef struct upload Upload;
+
+typedef enum {
+    ZEROCOPY_UNTRIED = 0,               /**< No large body sent on connection yet */
+    ZEROCOPY_ON,                        /**< Large bodies sent with MSG_ZEROCOPY */
+    ZEROCOPY_OFF,                       /**< Unsupported, or the kernel copies anyway */
+} ZerocopyState;
+
+/**
+ * Every handler answers through its request's Responder: start sends the
+ * status and headers (plus any extra headers), the body is written to
+ * request->file or, when its length is unknown, sent piece by piece with
+ * send, and finish ends the response.
+ */
 typedef struct {
+    void (*start)(Request *request, int code, const char *reason, const char *mimetype, off_t length, const Header *headers);
+    void (*send)(Request *request, const char *data, size_t n);
+    void (*finish)(Request *request);
+} Responder;
+
+extern const Responder Http1Responder;  /**< Text headers on the socket stream */
+extern const Responder Http2Responder;  /**< HEADERS and DATA frames on a stream */
+
+struct request {
     int     fd;                         /*< Client socket file descripter */
+    unsigned long number;               /*< Connection number (order accepted) */
     FILE    *file;                      /*< Client socket file stream */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
     char    *path;                      /*< Real path corrsponding to URI and RootPath */
+    int     target;                     /*< File descriptor of path (-1 if not open) */
     char    *query;                     /*< HTTP query string */
+    int     version;                    /*< HTTP minor version (0 or 1) */
+    bool    keep_alive;                 /*< Whether connection persists after response */
+    bool    chunked;                    /*< Whether response body is sent in chunks */
+    int     code;                       /*< Status code of response (0 until started) */
+    off_t   sent;                       /*< Bytes of response body (declared or sent) */
+    bool    unsized;                    /*< Whether response body has no declared length */
 
-    char     host[NI_MAXHOST];          /*< Host name of client */
-    char     port[NI_MAXSERV];          /*< Port number of client */
+    struct sockaddr_storage peer;       /*< Client address (see request_peer) */
 
     Header  *headers;                   /*< List of name, value Header pairs */
-} Request;
+
+    char    *buffer;                    /*< Bytes read from client socket */
+    size_t  nbuffer;                    /*< Number of bytes in buffer */
+    size_t  capacity;                   /*< Size of buffer */
+    size_t  scanned;                    /*< Bytes of buffer checked for complete lines */
+    size_t  nheader;                    /*< Length of header block (0 until complete) */
+    size_t  parsed;                     /*< Bytes of header block parsed */
+    bool    eof;                        /*< Whether client has stopped sending */
+
+    BodyState body;                     /*< Progress through request body */
+    bool    expect;                     /*< Whether client awaits 100 Continue */
+    off_t   length;                     /*< Content-Length of body (-1 if none or chunked) */
+    off_t   remaining;                  /*< Bytes of body (or current chunk) left to read */
+    off_t   received;                   /*< Bytes of body read so far */
+
+    Route    route;                     /*< Handler chosen for request */
+    int      error;                     /*< Status of error page (ROUTE_ERROR) */
+    Plugin  *plugin;                    /*< Plugin serving request (ROUTE_PLUGIN) */
+    Proxy   *proxy;                     /*< Reverse proxy serving request (ROUTE_PROXY) */
+    Upload  *upload;                    /*< Upload prefix storing request (ROUTE_UPLOAD) */
+    uint64_t begun;                     /*< Time header block was complete (trace_clock, 0 if not yet) */
+    uint64_t started;                   /*< Time request was admitted (us) */
+    uint64_t fill;                      /*< Cache fill claimed by request (see cache.c) */
+    TraceRecord *trace;                 /*< Sample being recorded (NULL if unsampled) */
+
+    const Responder *responder;         /*< How responses are framed */
+    Http2Stream *stream;                /*< HTTP/2 stream carrying request (or NULL) */
+    TlsConnection *tls;                 /*< TLS state of HTTPS connection (or NULL) */
+    bool    plaintext;                  /*< Whether bytes written to fd reach client as-is */
+    ZerocopyState zerocopy;             /*< Whether large writes skip the copy (see zerocopy.c) */
+
+    Timer   timer;                      /*< Pending connection deadline */
+    pid_t   pid;                        /*< Process handling request */
+    int     carry;                      /*< Pipe the child returns unread input on (-1 if none) */
+    Request *next;                      /*< Next request in list */
+};
 
 Request *   accept_request(int sfd);
 void	    free_request(Request *request);
+void	    reset_request(Request *request);
+int	    read_request(Request *request);
 int	    parse_request(Request *request);
+FILE *	    request_stream(Request *request);
+void	    request_idle(Request *request);
+bool	    request_carry(Request *request, const char *input, size_t n);
+char *	    request_host(const Request *request, char *host);
+int	    request_port(const Request *request);
+const char *request_peer(const Request *request);
+
+/* Request Bodies */
+
+ssize_t	    body_read(Request *request, char *buffer, size_t n);
+ssize_t	    body_splice(Request *request, int fd, size_t n);
+bool	    body_finish(Request *request);
 
 /* HTTP Request Handlers */
 
@@ -74,26 +499,225 @@ typedef enum {
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
+    HTTP_STATUS_GATEWAY_TIMEOUT,	/* 504 Gateway Timeout */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_FORBIDDEN,		/* 403 Forbidden */
+    HTTP_STATUS_INSUFFICIENT_STORAGE,	/* 507 Insufficient Storage */
+    HTTP_STATUS_NOT_IMPLEMENTED,	/* 501 Not Implemented */
 } Status;
 
+Route       route_request(Request *request);
 Status      handle_request(Request *request);
+const char *handle_missing(Request *request, size_t *n);
 
 /* HTTP Server */
 
+typedef enum {
+    CONNECTION_CLOSE,                   /**< Close connection */
+    CONNECTION_KEEPALIVE,               /**< Wait for another request */
+    CONNECTION_DETACHED,                /**< Handed off; resumed or closed later */
+} Disposition;
+
+#define EXIT_KEEPALIVE  3               /* Child exit status for a reusable connection */
+
 int         single_server(int sfd);
 int         forking_server(int sfd);
+int         cooperative_server(int sfd);
+
+int         server_loop(int sfd, Disposition (*dispatch)(Request *), void (*idle)(void));
+bool        serve_request(Request *request);
+void        server_resume(Request *request);
+void        server_close(Request *request);
+void        server_complete(Request *request, bool keep_alive);
+void        server_child(void);
+void        server_wake(int fd);
+void        server_deadline(Request *request, TimerKind kind);
+
+/* Admission Control */
+
+typedef enum {
+    ADMISSION_FIXED,                    /**< Always admit up to MaxRequests */
+    ADMISSION_AIMD,                     /**< Additive increase, multiplicative decrease */
+    ADMISSION_GRADIENT,                 /**< Track ratio of best to current latency */
+} AdmissionMode;
+
+extern AdmissionMode AdmissionPolicy;   /**< How the request limit adapts */
+extern int           AdmissionTarget;   /**< Latency target for AIMD (ms) */
+
+void        admission_init(void);
+bool        admission_acquire(Request *request);
+void        admission_release(Request *request);
+
+/* CGI Cache */
+
+#define CACHE_KEY       512             /* Largest cache key */
+#define CACHE_OUTPUT    (64 * 1024)     /* Largest CGI output cached */
+
+typedef enum {
+    CACHE_BYPASS,                       /**< Run script without caching */
+    CACHE_HIT,                          /**< Cached output copied */
+    CACHE_FILL,                         /**< Run script and store its output */
+} CacheResult;
+
+void        cache_init(void);
+CacheResult cache_lookup(Request *request, char *output, size_t *n);
+void        cache_store(Request *request, const char *output, size_t n);
+void        cache_abandon(Request *request);
+void        cache_invalidate(const char *path);
+
+/* Negative Cache */
+
+void        negative_init(void);
+bool        negative_lookup(const char *uri);
+void        negative_insert(const char *uri);
+void        negative_save(FILE *stream);
+void        negative_restore(const char *uri);
+
+/* Rate Limiting */
+
+void        ratelimit_init(void);
+bool        ratelimit_connection(Request *request);
+bool        ratelimit_request(Request *request);
+void        ratelimit_dump(FILE *stream);
+
+/* CGI Sandbox */
+
+void        sandbox_init(void);
+pid_t       sandbox_spawn(const char *path, int *input, int *output);
+void        sandbox_kill(pid_t pid);
+bool        sandbox_wait(pid_t pid, uint64_t deadline);
+
+/* Handler Plugins */
+
+int         plugin_add(char *spec);
+int         plugin_init(void);
+void        plugin_shutdown(void);
+bool        plugin_route(Request *request);
+Status      plugin_handle(Request *request);
+
+/* Reverse Proxy */
+
+int         proxy_add(char *spec);
+int         proxy_init(void);
+bool        proxy_route(Request *request);
+Status      proxy_handle(Request *request);
+int         proxy_due(void);
+void        proxy_tick(void);
+
+/* Uploads */
+
+int         upload_add(char *spec);
+bool        upload_route(Request *request);
+Status      upload_handle(Request *request);
+
+/* HTTP/2 */
+
+#define HTTP2_PREFACE       "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_FRAME_MAX     16384       /* Largest frame payload received */
+#define HTTP2_STREAMS_MAX   100         /* Streams open at once per connection */
+#define HTTP2_WINDOW        65535       /* Initial flow control window */
+
+bool        http2_detect(Request *request);
+bool        http2_serve(Request *request);
+
+/* HPACK */
+
+#define HPACK_TABLE_SIZE    4096        /* Largest dynamic table either side keeps */
+
+typedef struct {
+    char    *name;                      /*< Header name (value is stored after it) */
+    char    *value;                     /*< Header value */
+    size_t   size;                      /*< Size counted against the table */
+} HpackEntry;
+
+typedef struct {
+    HpackEntry *entries;                /*< Ring of entries, newest at head */
+    size_t   slots;                     /*< Size of ring */
+    size_t   head;                      /*< Slot of newest entry */
+    size_t   count;                     /*< Entries in table */
+    size_t   size;                      /*< Sum of entry sizes */
+    size_t   max;                       /*< Current maximum size */
+    size_t   limit;                     /*< Largest maximum the decoder allows */
+    bool     update;                    /*< Size update to send (encoder) */
+} HpackTable;
+
+void	    hpack_init(HpackTable *table);
+void	    hpack_free(HpackTable *table);
+void	    hpack_limit(HpackTable *table, size_t limit);
+int	    hpack_decode(HpackTable *table, const uint8_t *block, size_t n, int (*header)(void *, const char *, const char *), void *arg);
+size_t	    hpack_encode(HpackTable *table, uint8_t *out, size_t n, const char *name, const char *value, bool index);
+
+/* TLS */
+
+extern int  TlsSocket;                  /**< HTTPS server socket (-1 if disabled) */
+
+int	    tls_init(void);
+int	    tls_accept(Request *request);
+int	    tls_handshake(Request *request);
+ssize_t	    tls_recv(Request *request, char *buffer, size_t size);
+bool	    tls_pending(Request *request);
+FILE *	    tls_stream(Request *request);
+void	    tls_send(Request *request, const char *buffer, size_t size);
+void	    tls_shutdown(Request *request);
+void	    tls_free(Request *request);
+void	    tls_save(FILE *stream);
+void	    tls_restore(const char *keys);
+
+/* Warmup */
+
+void        warmup_start(void);
+void        warmup_record(Request *request, off_t size);
+void        warmup_latency(uint64_t us);
+void        warmup_save(void);
+int         warmup_due(void);
+void        warmup_tick(void);
+
+/* Upgrade */
+
+void        upgrade_init(int argc, char *argv[]);
+void        upgrade_handoff(const char *name, int fd);
+int         upgrade_inherited(const char *name);
+int         upgrade_start(void);
+bool        upgrade_finish(int fd);
+void        upgrade_ready(void);
 
 /* Socket */
 
 int	    socket_listen(const char *port);
 
+/* Zero-Copy Sends */
+
+ssize_t	    zerocopy_write(Request *request, const char *buffer, size_t n);
+
+/* Scanning */
+
+typedef enum {
+    SCAN_AUTO,                          /**< Best supported implementation */
+    SCAN_SCALAR,                        /**< Byte at a time */
+    SCAN_SSE42,                         /**< SSE4.2 string instructions */
+    SCAN_AVX2,                          /**< AVX2 byte compares */
+} ScanMode;
+
+bool	    scan_init(ScanMode mode);
+const char *scan_name(void);
+const char *scan_find(const char *s, size_t n, const char *set);
+const char *scan_skip(const char *s, size_t n, const char *set);
+HeaderId    scan_header(const char *name, size_t n);
+
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
+extern int  RootFd;                     /**< Root directory opened with O_PATH */
+
+int	    root_open(void);
 char *	    determine_mimetype(const char *path);
-char *	    determine_request_path(const char *uri);
+int	    determine_request_path(const char *uri, char **path);
+int	    determine_beneath_path(int dirfd, const char *directory, const char *relative, int flags);
 const char *http_status_string(Status status);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
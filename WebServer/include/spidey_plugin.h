@@ -0,0 +1,84 @@
+/* spidey_plugin.h: Spidey Handler Plugin ABI */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * A plugin is a shared object exporting one SpideyPlugin named spidey_plugin.
+ * The server loads it at startup (-P prefix=path.so[:argument]), calls init
+ * once with the argument, calls handle for every request whose URI starts
+ * with the prefix, and calls shutdown when the server exits.  Plugins link
+ * against nothing in the server: everything they need arrives through the
+ * request view and the response builder.
+ *
+ * The ABI only grows: fields are appended to the end of these structures and
+ * SPIDEY_PLUGIN_ABI increases when they are.  A plugin built for an older
+ * ABI keeps loading; one built for a newer ABI is refused.
+ *
+ * handle runs on the thread serving the request, which in the single and
+ * cooperative modes is the event loop's: it must not block.  The server logs
+ * a call that has run longer than a few milliseconds while it is still
+ * running, and counts those that finish late (plugin_overruns).
+ **/
+
+#define SPIDEY_PLUGIN_ABI   1           /* Current plugin ABI version */
+
+typedef struct spidey_request  SpideyRequest;
+typedef struct spidey_response SpideyResponse;
+
+/* Read-only view of a request */
+
+struct spidey_request {
+    const char *method;                 /**< HTTP method */
+    const char *uri;                    /**< Request URI (without query) */
+    const char *query;                  /**< Query string ("" if none) */
+    const char *path;                   /**< URI after the plugin's prefix */
+    const char *peer;                   /**< Client address */
+    int         version;                /**< HTTP version times 10 (10, 11, or 20) */
+
+    /** Value of a request header (NULL if absent); names ignore case */
+    const char *(*header)(const SpideyRequest *request, const char *name);
+
+    /** Read the next piece of the request body (0 at its end, -1 on error) */
+    ssize_t     (*read)(const SpideyRequest *request, void *buffer, size_t n);
+
+    void       *server;                 /**< Opaque to plugins */
+};
+
+/* Response builder: nothing is sent until handle returns */
+
+struct spidey_response {
+    /** Set status code and reason (default 200 OK) */
+    void (*status)(SpideyResponse *response, int code, const char *reason);
+
+    /** Add a response header (Content-Type replaces the default text/plain) */
+    void (*header)(SpideyResponse *response, const char *name, const char *value);
+
+    /** Append bytes to the body */
+    void (*write)(SpideyResponse *response, const void *data, size_t n);
+
+    /** Append formatted text to the body */
+    void (*printf)(SpideyResponse *response, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    void  *server;                      /**< Opaque to plugins */
+};
+
+/* Plugin entry points */
+
+typedef struct {
+    int         abi;                    /**< SPIDEY_PLUGIN_ABI the plugin was built for */
+    const char *name;                   /**< Name used in logs */
+
+    /** Prepare the plugin (0 on success, -1 refuses to start the server) */
+    int  (*init)(const char *argument);
+
+    /** Build the response to a request (0 on success, -1 sends a 500) */
+    int  (*handle)(const SpideyRequest *request, SpideyResponse *response);
+
+    /** Release everything before the server exits (may be NULL) */
+    void (*shutdown)(void);
+} SpideyPlugin;
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
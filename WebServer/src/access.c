@@ -0,0 +1,321 @@
+/* access.c: Buffered Access Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Every response is formatted into a buffer owned by the process that sent
+ * it, and the buffer is written to the log with a single O_APPEND write once
+ * it is half full or ACCESS_FLUSH milliseconds old.  A busy server thus makes
+ * a few large writes a second instead of one per request, and batches from
+ * different processes land whole, one after another.  The event loop flushes
+ * between iterations (waking up for it when records are due); a forked child
+ * drops the records it inherited, which the parent writes, and flushes its
+ * own before it exits.
+ *
+ * Text records are in Common or Combined Log Format, with the timestamp
+ * formatted once a second, followed by the microseconds from the complete
+ * request headers to the response (Apache's %D).  Binary records are an
+ * AccessRecord and the request line, for servers too busy to format text
+ * (bin/access_log.py prints them as text records).  With AccessSample above
+ * 1, only 1 in AccessSample responses is recorded, counted across every
+ * process.
+ *
+ * SIGUSR1 has the server reopen the log at its path, so rotating it only
+ * takes renaming the file and signalling the server.  Children already
+ * running finish writing into the renamed file.
+ **/
+
+/* Globals */
+
+static int      AccessFd = -1;
+static const char *Path  = NULL;
+static char     Buffer[ACCESS_BUFFER];
+static size_t   Buffered = 0;
+static uint64_t Flushed  = 0;           /* Time of last flush (ms) */
+static unsigned long *Counter = NULL;   /* Responses seen, shared with children */
+
+static time_t   Stamped  = 0;           /* Second Stamp was formatted for */
+static char     Stamp[32];
+
+/* Functions */
+
+/* Open the log at Path, starting a binary log with its magic */
+static int access_create(void) {
+    struct stat s;
+
+    AccessFd = open(Path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (AccessFd < 0) {
+        return -1;
+    }
+    if (AccessLogFormat == ACCESS_BINARY && fstat(AccessFd, &s) == 0 && s.st_size == 0) {
+        if (write(AccessFd, ACCESS_MAGIC, strlen(ACCESS_MAGIC)) < 0) {
+            close(AccessFd);
+            AccessFd = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Copy src into dst for a quoted field, escaping quotes, backslashes, and
+ * control characters; returns bytes written (never more than room) */
+static size_t access_quote(char *dst, size_t room, const char *src) {
+    static const char Hex[] = "0123456789abcdef";
+    size_t n = 0;
+
+    if (!src || !*src) {
+        src = "-";
+    }
+    for (; *src && n + 4 < room; src++) {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            dst[n++] = '\\';
+            dst[n++] = 'x';
+            dst[n++] = Hex[c >> 4];
+            dst[n++] = Hex[c & 0xf];
+        } else {
+            dst[n++] = c;
+        }
+    }
+    return n;
+}
+
+/* Value of a request header (NULL if absent) */
+static const char *access_header(const Request *r, const char *name) {
+    for (const Header *header = r->headers; header; header = header->next) {
+        if (strcasecmp(header->name, name) == 0) {
+            return header->value;
+        }
+    }
+    return NULL;
+}
+
+/* Microseconds from the request's complete header block until now (0 if unknown) */
+static uint32_t access_duration(const Request *r) {
+    if (!r->begun) {
+        return 0;
+    }
+    uint64_t us = (trace_clock() - r->begun) / 1000;
+    return us < UINT32_MAX ? us : UINT32_MAX;
+}
+
+/* Format a Common (or Combined) Log Format line into the buffer */
+static size_t access_text(Request *r, char *line) {
+    char   host[INET6_ADDRSTRLEN];
+    time_t now = time(NULL);
+
+    if (now != Stamped) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(Stamp, sizeof(Stamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        Stamped = now;
+    }
+
+    size_t n = snprintf(line, ACCESS_LINE, "%s - - [%s] \"", request_host(r, host), Stamp);
+    if (r->method) {
+        n += access_quote(line + n, ACCESS_LINE - n - 64, r->method);
+        line[n++] = ' ';
+        n += access_quote(line + n, ACCESS_LINE - n - 64, r->uri);
+        if (r->query && *r->query) {
+            line[n++] = '?';
+            n += access_quote(line + n, ACCESS_LINE - n - 64, r->query);
+        }
+        n += snprintf(line + n, ACCESS_LINE - n, " HTTP/%s", r->stream ? "2.0" : r->version ? "1.1" : "1.0");
+    } else {
+        line[n++] = '-';
+    }
+
+    if (r->sent > 0) {
+        n += snprintf(line + n, ACCESS_LINE - n, "\" %d %lld", r->code, (long long)r->sent);
+    } else {
+        n += snprintf(line + n, ACCESS_LINE - n, "\" %d -", r->code);
+    }
+
+    if (AccessLogFormat == ACCESS_COMBINED) {
+        size_t room = (ACCESS_LINE - n) / 2;
+        line[n++] = ' ';
+        line[n++] = '"';
+        n += access_quote(line + n, room - 3, access_header(r, "Referer"));
+        line[n++] = '"';
+        line[n++] = ' ';
+        line[n++] = '"';
+        n += access_quote(line + n, ACCESS_LINE - n - 16, access_header(r, "User-Agent"));
+        line[n++] = '"';
+    }
+    n += snprintf(line + n, ACCESS_LINE - n, " %u\n", access_duration(r));
+    return n;
+}
+
+/* Format an AccessRecord and request line into the buffer */
+static size_t access_binary(Request *r, char *line) {
+    struct timespec ts;
+    AccessRecord    record = {
+        .bytes    = r->sent > 0 ? r->sent : 0,
+        .status   = r->code,
+        .family   = r->peer.ss_family,
+        .version  = r->stream ? 20 : 10 + r->version,
+        .duration = access_duration(r),
+    };
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.time = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    if (r->peer.ss_family == AF_INET) {
+        memcpy(record.address, &((struct sockaddr_in *)&r->peer)->sin_addr, 4);
+    } else if (r->peer.ss_family == AF_INET6) {
+        memcpy(record.address, &((struct sockaddr_in6 *)&r->peer)->sin6_addr, 16);
+    } else {
+        record.family = 0;
+    }
+
+    char  *text = line + sizeof(record);
+    size_t room = ACCESS_LINE - sizeof(record);
+    int    n    = 0;
+    if (r->method) {
+        n = snprintf(text, room, "%s %s%s%s", r->method, r->uri ? r->uri : "",
+            r->query && *r->query ? "?" : "", r->query ? r->query : "");
+        if (n < 0) {
+            n = 0;
+        } else if ((size_t)n >= room) {
+            n = room - 1;
+        }
+    }
+    record.length = n;
+    memcpy(line, &record, sizeof(record));
+    return sizeof(record) + n;
+}
+
+/**
+ * Open access log for appending.
+ *
+ * @param   path        Path to access log.
+ * @return  0 on success, -1 on error.
+ **/
+int access_open(const char *path) {
+    Path    = path;
+    Flushed = timer_now();
+
+    if (AccessSample > 1) {
+        Counter = mmap(NULL, sizeof(*Counter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (Counter == MAP_FAILED) {
+            Counter = NULL;
+            return -1;
+        }
+    }
+    return access_create();
+}
+
+/**
+ * Reopen access log at its path (after it has been renamed for rotation).
+ **/
+void access_reopen(void) {
+    if (!Path) {
+        return;
+    }
+
+    access_flush(true);
+    if (AccessFd >= 0) {
+        close(AccessFd);
+    }
+    if (access_create() < 0) {
+        log("Unable to reopen access log %s: %s", Path, strerror(errno));
+        return;
+    }
+    log("Reopened access log %s", Path);
+}
+
+/**
+ * Write buffered records to access log.
+ *
+ * @param   force       Write even if the buffer is small and recent.
+ *
+ * Records that cannot be written are dropped; the log stays open in case the
+ * problem (such as a full disk) passes.
+ **/
+void access_flush(bool force) {
+    if (AccessFd < 0 || Buffered == 0) {
+        return;
+    }
+
+    uint64_t now = timer_now();
+    if (!force && Buffered < ACCESS_BUFFER / 2 && now - Flushed < ACCESS_FLUSH) {
+        return;
+    }
+
+    size_t written = 0;
+    while (written < Buffered) {
+        ssize_t n = write(AccessFd, Buffer + written, Buffered - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log("Unable to write access log: %s", strerror(errno));
+            break;
+        }
+        written += n;
+    }
+
+    Buffered = 0;
+    Flushed  = now;
+}
+
+/**
+ * Return milliseconds until buffered records are due to be written.
+ *
+ * @return  Milliseconds (0 if overdue), or -1 if nothing is buffered.
+ **/
+int access_due(void) {
+    if (AccessFd < 0 || Buffered == 0) {
+        return -1;
+    }
+
+    uint64_t elapsed = timer_now() - Flushed;
+    return elapsed >= ACCESS_FLUSH ? 0 : (int)(ACCESS_FLUSH - elapsed);
+}
+
+/**
+ * Forget the parent's buffered records in a forked child.
+ **/
+void access_child(void) {
+    Buffered = 0;
+}
+
+/**
+ * Record a finished response.
+ *
+ * @param   r           Request structure whose response has been sent.
+ **/
+void access_record(Request *r) {
+    if (AccessFd < 0) {
+        return;
+    }
+    if (Counter && __atomic_fetch_add(Counter, 1, __ATOMIC_RELAXED) % AccessSample != 0) {
+        return;
+    }
+
+    if (Buffered + ACCESS_LINE > ACCESS_BUFFER) {
+        access_flush(true);
+    }
+
+    char *line = Buffer + Buffered;
+    Buffered += AccessLogFormat == ACCESS_BINARY ? access_binary(r, line) : access_text(r, line);
+    if (Buffered >= ACCESS_BUFFER / 2) {
+        access_flush(true);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,162 @@
+/* admission.c: Admission Control */
+
+#include "spidey.h"
+
+#include <time.h>
+
+/**
+ * The event loop admits a routed request only while fewer requests than the
+ * current limit are in flight and, for CGI scripts, fewer than MaxCGI scripts
+ * are running; everything else waits in the loop's queue.  With
+ * ADMISSION_FIXED the limit is simply MaxRequests.  The adaptive policies move
+ * it between 1 and MaxRequests based on how long finished requests took:
+ *
+ *  AIMD        grows the limit by one for every limit's worth of requests that
+ *              finish within AdmissionTarget and cuts it by a tenth whenever
+ *              one takes longer.
+ *
+ *  GRADIENT    compares the best latency seen recently with a smoothed recent
+ *              latency.  While they agree the limit grows by roughly its square
+ *              root, leaving room for a small queue; once latency climbs the
+ *              limit shrinks in proportion.
+ **/
+
+#define ADAPTIVE_INITIAL    10          /* Starting limit for adaptive policies */
+#define AIMD_BACKOFF        0.9         /* Multiplier when a request is too slow */
+#define GRADIENT_TOLERANCE  2.0         /* Latency growth accepted before backing off */
+#define GRADIENT_SMOOTHING  0.2         /* Weight of each new limit estimate */
+#define GRADIENT_WINDOW     500         /* Samples before best latency is re-measured */
+
+/* Globals */
+
+static struct {
+    double   limit;                     /* Current request limit */
+    int      inflight;                  /* Requests admitted and not yet released */
+    int      cgi;                       /* CGI scripts admitted and not yet released */
+    double   latency;                   /* Smoothed latency (us) */
+    double   best;                      /* Lowest latency in window (us) */
+    unsigned samples;                   /* Samples in window */
+} Admission;
+
+/* Functions */
+
+static uint64_t admission_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double admission_sqrt(double x) {
+    double root = 1;
+    while ((root + 1) * (root + 1) <= x) {
+        root++;
+    }
+    return root;
+}
+
+/**
+ * Reset limits from MaxRequests and AdmissionPolicy.
+ **/
+void admission_init(void) {
+    if (MaxRequests < 1) {
+        MaxRequests = 1;
+    }
+
+    Admission.limit = MaxRequests;
+    if (AdmissionPolicy != ADMISSION_FIXED && MaxRequests > ADAPTIVE_INITIAL) {
+        Admission.limit = ADAPTIVE_INITIAL;
+    }
+    Admission.inflight = 0;
+    Admission.cgi      = 0;
+    Admission.latency  = 0;
+    Admission.best     = 0;
+    Admission.samples  = 0;
+    stats_set(admission_limit, (unsigned long)Admission.limit);
+}
+
+/**
+ * Admit request if the limits allow it.
+ *
+ * @param   r           Routed request structure.
+ * @return  Whether the request was admitted (and must later be released).
+ **/
+bool admission_acquire(Request *r) {
+    if (Admission.inflight >= (int)Admission.limit) {
+        return false;
+    }
+    if (r->route == ROUTE_CGI) {
+        if (Admission.cgi >= MaxCGI) {
+            return false;
+        }
+        Admission.cgi++;
+    }
+
+    Admission.inflight++;
+    stats_add(requests_inflight, 1);
+    r->started = admission_clock();
+    return true;
+}
+
+/**
+ * Release admitted request and adapt the limit to its latency.
+ *
+ * @param   r           Request structure.
+ **/
+void admission_release(Request *r) {
+    double latency = admission_clock() - r->started;
+    bool   busy    = Admission.inflight * 2 >= (int)Admission.limit;
+
+    Admission.inflight--;
+    stats_sub(requests_inflight, 1);
+    if (r->route == ROUTE_CGI) {
+        Admission.cgi--;
+    }
+    if (r->route == ROUTE_HTTP2) {
+        /* A session lasts as long as its client stays, not a request */
+        return;
+    }
+    warmup_latency(latency);
+
+    switch (AdmissionPolicy) {
+    case ADMISSION_FIXED:
+        return;
+    case ADMISSION_AIMD:
+        if (latency > AdmissionTarget * 1000.0) {
+            Admission.limit *= AIMD_BACKOFF;
+        } else if (busy) {
+            /* Only grow a limit that is actually being used */
+            Admission.limit += 1 / Admission.limit;
+        }
+        break;
+    case ADMISSION_GRADIENT:
+        Admission.latency = Admission.latency ? Admission.latency * (1 - GRADIENT_SMOOTHING) + latency * GRADIENT_SMOOTHING : latency;
+        if (!Admission.best || latency < Admission.best) {
+            Admission.best = latency;
+        }
+        if (++Admission.samples >= GRADIENT_WINDOW) {
+            /* Let the best latency drift up if the workload got slower */
+            Admission.best    = Admission.latency;
+            Admission.samples = 0;
+        }
+
+        double gradient = GRADIENT_TOLERANCE * Admission.best / Admission.latency;
+        if (gradient > 1.0) {
+            gradient = 1.0;
+        } else if (gradient < 0.5) {
+            gradient = 0.5;
+        }
+
+        double estimate = Admission.limit * gradient + (busy ? admission_sqrt(Admission.limit) : 0);
+        Admission.limit = Admission.limit * (1 - GRADIENT_SMOOTHING) + estimate * GRADIENT_SMOOTHING;
+        break;
+    }
+
+    if (Admission.limit < 1) {
+        Admission.limit = 1;
+    } else if (Admission.limit > MaxRequests) {
+        Admission.limit = MaxRequests;
+    }
+    stats_set(admission_limit, (unsigned long)Admission.limit);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,329 @@
+/* body.c: HTTP Request Bodies */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * A request body is read by the handler that wants it, never by the event
+ * loop, and never held whole: body_read decodes it into the caller's buffer
+ * piece by piece, and body_splice moves it into a pipe (a CGI script's
+ * stdin), inside the kernel when the connection is plain HTTP.  Bytes that
+ * arrived with the header block come first and are removed from the request
+ * buffer as they are read, so whatever follows the body stays there for the
+ * next request.  Chunk framing is parsed in the request buffer as well; the
+ * chunk data itself goes straight to the caller.
+ *
+ * While the body arrives, the request's deadline is BodyTimeout from the last
+ * progress instead of WriteTimeout for the whole response, so uploads of any
+ * size get through as long as they keep moving.
+ **/
+
+#define BODY_SPLICE     (1 << 20)       /* Largest piece spliced at once */
+#define BODY_DISCARD    (64 * 1024)     /* Unread body dropped to keep a connection */
+
+/* Globals */
+
+static const char ContinueResponse[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/* Functions */
+
+/* Bytes of body already in the request buffer */
+static size_t body_buffered(const Request *r) {
+    return r->nbuffer - r->nheader;
+}
+
+/* Drop n bytes from the front of the buffered body */
+static void body_consume(Request *r, size_t n) {
+    memmove(r->buffer + r->nheader, r->buffer + r->nheader + n, r->nbuffer - r->nheader - n);
+    r->nbuffer -= n;
+}
+
+/* Count n bytes of data read, restarting the deadline */
+static void body_advance(Request *r, size_t n) {
+    r->remaining -= n;
+    r->received  += n;
+    if (r->remaining == 0) {
+        r->body = r->body == BODY_LENGTH ? BODY_NONE : BODY_CHUNK_END;
+    }
+    server_deadline(r, r->body == BODY_NONE ? TIMER_WRITE : TIMER_BODY);
+}
+
+/* Ask a client awaiting 100 Continue for its body */
+static int body_continue(Request *r) {
+    if (!r->expect) {
+        return 0;
+    }
+    r->expect = false;
+    if (fputs(ContinueResponse, r->file) == EOF || fflush(r->file) == EOF) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Receive up to n bytes from the client, waiting until some arrive */
+static ssize_t body_recv(Request *r, char *buffer, size_t n) {
+    for (;;) {
+        if (!tls_pending(r)) {
+            int ready = coroutine_poll(r->fd, POLLIN, -1);
+            if (ready <= 0) {
+                if (ready == 0) {
+                    errno = ETIMEDOUT;
+                }
+                return -1;
+            }
+        }
+
+        ssize_t nread = r->tls ? tls_recv(r, buffer, n) : recv(r->fd, buffer, n, MSG_DONTWAIT);
+        if (nread > 0) {
+            return nread;
+        }
+        if (nread == 0) {
+            debug("Client closed connection in request body");
+            r->eof = true;
+            errno  = ECONNRESET;
+            return -1;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+    }
+}
+
+/* Read more of the body into the request buffer (for chunk framing) */
+static int body_fill(Request *r) {
+    /* The parsed header block is no longer needed once it fills the buffer */
+    if (r->nbuffer == r->capacity && r->nheader > 0) {
+        memmove(r->buffer, r->buffer + r->nheader, r->nbuffer - r->nheader);
+        r->nbuffer -= r->nheader;
+        r->nheader  = 0;
+    }
+    if (r->nbuffer == r->capacity) {
+        debug("Chunk framing line too long");
+        errno = EPROTO;
+        return -1;
+    }
+
+    ssize_t nread = body_recv(r, r->buffer + r->nbuffer, r->capacity - r->nbuffer);
+    if (nread < 0) {
+        return -1;
+    }
+    r->nbuffer += nread;
+    return 0;
+}
+
+/* Parse a chunk size line, checking the body stays within MaxBody */
+static int body_chunk(Request *r, const char *line) {
+    char *end;
+
+    if (!isxdigit((unsigned char)line[0])) {
+        errno = EPROTO;
+        return -1;
+    }
+    errno = 0;
+    unsigned long long size = strtoull(line, &end, 16);
+    if (errno || (*end != ';' && *end != '\r' && *end != '\n' && *end != ' ' && *end != '\t')) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (size > (1ULL << 62) || (MaxBody > 0 && r->received + (off_t)size > MaxBody)) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    r->remaining = size;
+    r->body      = size ? BODY_CHUNK_DATA : BODY_TRAILER;
+    return 0;
+}
+
+/* Parse chunk framing up to the next chunk data (or the end of the body) */
+static int body_frame(Request *r) {
+    while (r->body == BODY_CHUNK_SIZE || r->body == BODY_CHUNK_END || r->body == BODY_TRAILER) {
+        char *line = r->buffer + r->nheader;
+        char *nl   = memchr(line, '\n', body_buffered(r));
+        if (!nl) {
+            if (body_fill(r) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        size_t n     = nl + 1 - line;
+        bool   blank = n == 1 || (n == 2 && line[0] == '\r');
+        switch (r->body) {
+        case BODY_CHUNK_SIZE:
+            if (body_chunk(r, line) < 0) {
+                return -1;
+            }
+            break;
+        case BODY_CHUNK_END:
+            if (!blank) {
+                errno = EPROTO;
+                return -1;
+            }
+            r->body = BODY_CHUNK_SIZE;
+            break;
+        default:
+            /* Trailer fields are ignored */
+            if (blank) {
+                r->body = BODY_NONE;
+                server_deadline(r, TIMER_WRITE);
+            }
+            break;
+        }
+        body_consume(r, n);
+    }
+    return 0;
+}
+
+/**
+ * Read the next piece of the request body.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Where to store body bytes.
+ * @param   n           Size of buffer.
+ * @return  Bytes read, 0 at the end of the body, or -1 with errno set
+ * (EPROTO for bad chunk framing, EFBIG beyond MaxBody, ETIMEDOUT or EINTR at
+ * the deadline, and ECONNRESET if the client left early).
+ *
+ * The first read sends 100 Continue to a client that asked for it.
+ **/
+ssize_t body_read(Request *r, char *buffer, size_t n) {
+    if (body_continue(r) < 0 || body_frame(r) < 0) {
+        return -1;
+    }
+    if (r->body == BODY_NONE) {
+        return 0;
+    }
+
+    if ((off_t)n > r->remaining) {
+        n = r->remaining;
+    }
+
+    ssize_t nread;
+    size_t  buffered = body_buffered(r);
+    if (buffered > 0) {
+        nread = n < buffered ? n : buffered;
+        memcpy(buffer, r->buffer + r->nheader, nread);
+        body_consume(r, nread);
+    } else if ((nread = body_recv(r, buffer, n)) < 0) {
+        return -1;
+    }
+
+    body_advance(r, nread);
+    return nread;
+}
+
+/**
+ * Move the next piece of the request body into a pipe.
+ *
+ * @param   r           Request structure.
+ * @param   fd          Write end of a pipe.
+ * @param   n           Most bytes to move.
+ * @return  Bytes moved, 0 at the end of the body, or -1 with errno set as by
+ * body_read (or EPIPE if the reader closed the pipe).
+ *
+ * On a plain HTTP connection the body moves from the socket to the pipe with
+ * splice, never passing through user memory.  Bytes already buffered, and
+ * bodies that TLS has to decrypt, are copied.  When the pipe is full this
+ * waits for its reader.
+ **/
+ssize_t body_splice(Request *r, int fd, size_t n) {
+    if (body_continue(r) < 0 || body_frame(r) < 0) {
+        return -1;
+    }
+    if (r->body == BODY_NONE) {
+        return 0;
+    }
+
+    if (n > BODY_SPLICE) {
+        n = BODY_SPLICE;
+    }
+    if ((off_t)n > r->remaining) {
+        n = r->remaining;
+    }
+
+    /* Copy what has already been read (or has to be decrypted) */
+    if (body_buffered(r) > 0 || r->tls) {
+        char    chunk[BUFSIZ];
+        ssize_t nread = body_read(r, chunk, n < sizeof(chunk) ? n : sizeof(chunk));
+        for (ssize_t nwritten = 0, total = 0; nread > 0 && total < nread; total += nwritten) {
+            if ((nwritten = coroutine_write(fd, chunk + total, nread - total)) < 0) {
+                return -1;
+            }
+        }
+        return nread;
+    }
+
+    /* Splice the rest from the socket */
+    for (;;) {
+        int ready = coroutine_poll(r->fd, POLLIN, -1);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+
+        ssize_t moved = splice(r->fd, NULL, fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            body_advance(r, moved);
+            return moved;
+        }
+        if (moved == 0) {
+            debug("Client closed connection in request body");
+            r->eof = true;
+            errno  = ECONNRESET;
+            return -1;
+        }
+        if (errno != EAGAIN) {
+            return -1;
+        }
+
+        /* The socket is readable, so the pipe is full */
+        ready = coroutine_poll(fd, POLLOUT, -1);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+    }
+}
+
+/**
+ * Consume what the handler left of the request body.
+ *
+ * @param   r           Request structure.
+ * @return  Whether the connection can carry another request.
+ *
+ * Up to BODY_DISCARD bytes are read and dropped; a longer body, or one the
+ * client is still waiting to be asked for, ends the connection instead.
+ **/
+bool body_finish(Request *r) {
+    char  chunk[BUFSIZ];
+    off_t dropped = 0;
+
+    if (r->body != BODY_NONE && r->expect) {
+        return false;
+    }
+    while (r->body != BODY_NONE && dropped < BODY_DISCARD) {
+        ssize_t nread = body_read(r, chunk, sizeof(chunk));
+        if (nread < 0) {
+            return false;
+        }
+        dropped += nread;
+    }
+    return r->body == BODY_NONE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
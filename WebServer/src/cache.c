@@ -0,0 +1,418 @@
+/* cache.c: CGI Response Micro-Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Complete CGI output (header block and body) is kept for a few seconds in
+ * slots shared with forked children, keyed by script path, query and the
+ * request headers a script may vary on.  Each key maps to one slot, so the
+ * cache is bounded and a colliding key simply takes the slot over.
+ *
+ * The first request for a key claims its slot and runs the script; requests
+ * for the same key that arrive meanwhile wait for that output instead of
+ * running the script again.  The claim names the process and, within it, the
+ * fill, so coroutines of one cooperative server wait on each other too.  Once an entry expires it may still be served
+ * while stale: the first request after expiry runs the script to refresh it
+ * and everyone else keeps getting the stale copy until the refresh lands.
+ *
+ * The lifetime comes from the script's Cache-Control (s-maxage, max-age and
+ * stale-while-revalidate), defaulting to CacheTTL seconds with a stale window
+ * just as long; no-store, no-cache, private, a Set-Cookie header, or a status
+ * other than 200 keeps a response out of the cache.
+ *
+ * The slots live in a memfd that an upgrade hands to the new server, which
+ * maps the same slots (if their layout is the one it expects) and so starts
+ * with every entry still warm.
+ **/
+
+#define CACHE_POLL_MS   5               /* Milliseconds between checks while waiting */
+#define CACHE_WAIT_MS   5000            /* Longest wait for another process's output */
+#define CACHE_MAGIC     "SPIDEYC2"      /* Layout of slots (change with CacheSlot) */
+#define CACHE_HEADER    64              /* Bytes before the first slot */
+
+typedef struct {
+    int      lock;                      /*< Spinlock guarding slot */
+    uint64_t hash;                      /*< Hash of key */
+    char     key[CACHE_KEY];            /*< Path, query, and varying headers */
+    uint64_t expires;                   /*< Time output goes stale (ms) */
+    uint64_t stale;                     /*< Time output can no longer be served (ms) */
+    pid_t    filler;                    /*< Process running the script (0 if none) */
+    uint64_t fill;                      /*< Fill within that process (see Request.fill) */
+    size_t   length;                    /*< Bytes of output (0 if empty) */
+    char     output[CACHE_OUTPUT];      /*< Script output */
+} CacheSlot;
+
+/* Globals */
+
+static CacheSlot *Slots = NULL;
+static uint64_t   Fills = 0;            /* Fills this process has claimed */
+
+/* Functions */
+
+/* Take the slots handed over by the previous server if their layout matches */
+static int cache_inherit(size_t size) {
+    struct stat st;
+    char        magic[sizeof(CACHE_MAGIC)] = "";
+
+    int fd = upgrade_inherited("CACHE");
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != size ||
+        pread(fd, magic, strlen(CACHE_MAGIC), 0) != (ssize_t)strlen(CACHE_MAGIC) || !streq(magic, CACHE_MAGIC)) {
+        log("Not taking over the previous server's CGI cache (its layout differs)");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Map cache slots into memory shared with forked children.
+ *
+ * Does nothing if caching is disabled, and disables it if the mapping fails.
+ **/
+void cache_init(void) {
+    if (CacheTTL <= 0 || CacheEntries <= 0) {
+        CacheTTL = 0;
+        return;
+    }
+
+    size_t size = CACHE_HEADER + CacheEntries * sizeof(CacheSlot);
+    int    fd   = cache_inherit(size);
+    if (fd < 0) {
+        fd = memfd_create("spidey-cache", MFD_CLOEXEC);
+        if (fd >= 0 && (ftruncate(fd, size) < 0 || pwrite(fd, CACHE_MAGIC, strlen(CACHE_MAGIC), 0) < 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    char *base = fd < 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        debug("Unable to map CGI cache: %s", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        CacheTTL = 0;
+        return;
+    }
+    Slots = (CacheSlot *)(base + CACHE_HEADER);
+    upgrade_handoff("CACHE", fd);
+}
+
+static void slot_lock(CacheSlot *s) {
+    while (__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void slot_unlock(CacheSlot *s) {
+    __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* FNV-1a */
+static uint64_t cache_hash(const char *key, size_t n) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Build cache key for request.
+ *
+ * @param   r           Request structure.
+ * @param   key         Buffer of CACHE_KEY bytes.
+ * @return  Whether the request may be served from the cache.
+ *
+ * Only GETs without credentials are cached; the key is NUL padded so it can
+ * be compared whole.
+ **/
+static bool cache_key(Request *r, char *key) {
+    const char *accept = "", *encoding = "", *language = "";
+
+    if (!Slots || !streq(r->method, "GET")) {
+        return false;
+    }
+    for (Header *header = r->headers; header; header = header->next) {
+        switch (header->id) {
+        case HEADER_AUTHORIZATION:
+        case HEADER_COOKIE:
+            return false;
+        case HEADER_ACCEPT:
+            accept = header->value;
+            break;
+        case HEADER_ACCEPT_ENCODING:
+            encoding = header->value;
+            break;
+        case HEADER_ACCEPT_LANGUAGE:
+            language = header->value;
+            break;
+        default:
+            break;
+        }
+    }
+
+    memset(key, 0, CACHE_KEY);
+    int n = snprintf(key, CACHE_KEY, "%s?%s\n%s\n%s\n%s", r->path, r->query, accept, encoding, language);
+    return n > 0 && n < CACHE_KEY;
+}
+
+/**
+ * Whether someone else is still filling a slot.
+ *
+ * A fill by this process can only be in progress on another coroutine; without
+ * coroutines it was left behind, and the slot is free to claim.
+ **/
+static bool filler_alive(const CacheSlot *s) {
+    if (s->filler <= 0) {
+        return false;
+    }
+    if (s->filler == getpid()) {
+        return coroutine_active();
+    }
+    return kill(s->filler, 0) == 0 || errno != ESRCH;
+}
+
+/**
+ * Look up the cached output of a CGI request.
+ *
+ * @param   r           Request structure.
+ * @param   output      Buffer of CACHE_OUTPUT bytes for cached output.
+ * @param   n           Set to the length of cached output.
+ * @return  CACHE_HIT if output was copied, CACHE_FILL if the caller should
+ * run the script and pass its output to cache_store (or call cache_abandon),
+ * and CACHE_BYPASS if the script should run without caching.
+ **/
+CacheResult cache_lookup(Request *r, char *output, size_t *n) {
+    char key[CACHE_KEY];
+
+    if (!cache_key(r, key)) {
+        return CACHE_BYPASS;
+    }
+
+    uint64_t   hash    = cache_hash(key, strlen(key));
+    CacheSlot *s       = &Slots[hash % CacheEntries];
+    uint64_t   started = timer_now();
+    bool       waited  = false;
+
+    for (;;) {
+        uint64_t now = timer_now();
+
+        slot_lock(s);
+        bool match = s->hash == hash && memcmp(s->key, key, CACHE_KEY) == 0;
+        bool busy  = match && filler_alive(s);
+
+        /* Fresh output, or stale output someone is already refreshing */
+        if (match && s->length && (now < s->expires || (now < s->stale && busy))) {
+            bool fresh = now < s->expires;
+            memcpy(output, s->output, s->length);
+            *n = s->length;
+            slot_unlock(s);
+            if (fresh) {
+                stats_add(cache_hits, 1);
+            } else {
+                stats_add(cache_stale, 1);
+            }
+            if (waited) {
+                stats_add(cache_collapsed, 1);
+            }
+            return CACHE_HIT;
+        }
+
+        /* Someone else is running the script; wait for its output */
+        if (busy && now - started < CACHE_WAIT_MS) {
+            slot_unlock(s);
+            waited = true;
+            coroutine_sleep(CACHE_POLL_MS);
+            continue;
+        }
+
+        /* Claim slot and run the script (stale output stays until replaced) */
+        if (!match) {
+            memcpy(s->key, key, CACHE_KEY);
+            s->hash   = hash;
+            s->length = 0;
+        }
+        if (busy) {
+            slot_unlock(s);
+            return CACHE_BYPASS;
+        }
+        s->filler = getpid();
+        s->fill   = r->fill = ++Fills;
+        slot_unlock(s);
+        stats_add(cache_misses, 1);
+        return CACHE_FILL;
+    }
+}
+
+/* Parse seconds following directive in Cache-Control value (or -1) */
+static int cache_directive(const char *value, const char *directive) {
+    const char *p = strcasestr(value, directive);
+    return p ? atoi(p + strlen(directive)) : -1;
+}
+
+/**
+ * Determine how long CGI output may be cached.
+ *
+ * @param   output      Script output.
+ * @param   n           Length of output.
+ * @param   stale       Set to seconds it may be served stale afterwards.
+ * @return  Seconds output stays fresh (0 if it must not be cached).
+ **/
+static int cache_policy(const char *output, size_t n, int *stale) {
+    char block[BUFSIZ];
+    char *state;
+    int  ttl = CacheTTL;
+
+    /* Copy header block, which ends with a blank line */
+    size_t length = n < sizeof(block) - 1 ? n : sizeof(block) - 1;
+    memcpy(block, output, length);
+    block[length] = '\0';
+    char *end = strstr(block, "\n\n");
+    char *crlf = strstr(block, "\n\r\n");
+    if (!end || (crlf && crlf < end)) {
+        end = crlf;
+    }
+    if (!end) {
+        return 0;
+    }
+    end[1] = '\0';
+
+    *stale = -1;
+    for (char *line = strtok_r(block, "\r\n", &state); line; line = strtok_r(NULL, "\r\n", &state)) {
+        char *value = strchr(line, ':');
+        if (strncmp(line, "HTTP/", 5) == 0) {
+            if (atoi(skip_whitespace(skip_nonwhitespace(line))) != 200) {
+                return 0;
+            }
+            continue;
+        }
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+
+        if (strcasecmp(line, "Status") == 0 && atoi(skip_whitespace(value)) != 200) {
+            return 0;
+        } else if (strcasecmp(line, "Set-Cookie") == 0) {
+            return 0;
+        } else if (strcasecmp(line, "Cache-Control") == 0) {
+            if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private")) {
+                return 0;
+            }
+            int age = cache_directive(value, "s-maxage=");
+            if (age < 0) {
+                age = cache_directive(value, "max-age=");
+            }
+            if (age >= 0) {
+                ttl = age;
+            }
+            *stale = cache_directive(value, "stale-while-revalidate=");
+        }
+    }
+
+    if (*stale < 0) {
+        *stale = CacheTTL;
+    }
+    return ttl;
+}
+
+/* Find slot request is filling, locked (or NULL if it was taken over) */
+static CacheSlot *cache_filling(Request *r) {
+    char key[CACHE_KEY];
+
+    if (!cache_key(r, key)) {
+        return NULL;
+    }
+
+    uint64_t   hash = cache_hash(key, strlen(key));
+    CacheSlot *s    = &Slots[hash % CacheEntries];
+    slot_lock(s);
+    if (s->filler != getpid() || s->fill != r->fill || s->hash != hash || memcmp(s->key, key, CACHE_KEY) != 0) {
+        slot_unlock(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * Store output of a script run after CACHE_FILL.
+ *
+ * @param   r           Request structure.
+ * @param   output      Complete script output.
+ * @param   n           Length of output.
+ *
+ * Output the script marks as uncacheable empties the slot.
+ **/
+void cache_store(Request *r, const char *output, size_t n) {
+    int stale = 0;
+    int ttl   = n <= CACHE_OUTPUT ? cache_policy(output, n, &stale) : 0;
+
+    CacheSlot *s = cache_filling(r);
+    if (!s) {
+        return;
+    }
+
+    if (ttl > 0) {
+        memcpy(s->output, output, n);
+        s->length  = n;
+        s->expires = timer_now() + ttl * 1000;
+        s->stale   = s->expires + stale * 1000;
+    } else {
+        s->length  = 0;
+    }
+    s->filler = 0;
+    s->fill   = 0;
+    slot_unlock(s);
+}
+
+/**
+ * Give up filling after CACHE_FILL, keeping any stale output.
+ *
+ * @param   r           Request structure.
+ **/
+void cache_abandon(Request *r) {
+    CacheSlot *s = cache_filling(r);
+    if (s) {
+        s->filler = 0;
+        s->fill   = 0;
+        slot_unlock(s);
+    }
+}
+
+/**
+ * Empty every slot holding output of a script.
+ *
+ * @param   path        Path of script (as in Request.path).
+ *
+ * A fill in progress still stores its output when it finishes.
+ **/
+void cache_invalidate(const char *path) {
+    size_t n = strlen(path);
+
+    for (int i = 0; Slots && i < CacheEntries; i++) {
+        CacheSlot *s = &Slots[i];
+        slot_lock(s);
+        if (s->length > 0 && strncmp(s->key, path, n) == 0 && s->key[n] == '?') {
+            s->length = 0;
+        }
+        slot_unlock(s);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,113 @@
+/* capture.c: Request Capture Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/**
+ * The event loop hands every complete header block to capture_request, which
+ * only copies it into a buffer.  The buffer is written out once it is half
+ * full or CAPTURE_FLUSH milliseconds old, from the end of an event loop
+ * iteration rather than while a client waits.  Header blocks are always read
+ * by the server process, so forked children never touch the log (and exit
+ * without flushing their copy of the buffer).
+ **/
+
+/* Globals */
+
+static int      CaptureFd = -1;
+static char     Buffer[CAPTURE_BUFFER];
+static size_t   Buffered  = 0;
+static uint64_t Started   = 0;          /* Capture start (ns) */
+static uint64_t Flushed   = 0;          /* Time of last flush (ms) */
+
+/* Functions */
+
+/**
+ * Open capture log, truncating it.
+ *
+ * @param   path        Path to capture log.
+ * @return  0 on success, -1 on error.
+ **/
+int capture_open(const char *path) {
+    CaptureFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (CaptureFd < 0) {
+        return -1;
+    }
+
+    memcpy(Buffer, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC));
+    Buffered = strlen(CAPTURE_MAGIC);
+    Started  = trace_clock();
+    Flushed  = timer_now();
+    return 0;
+}
+
+/**
+ * Write buffered records to capture log.
+ *
+ * @param   force       Write even if the buffer is small and recent.
+ *
+ * A write error closes the log and stops capturing.
+ **/
+void capture_flush(bool force) {
+    if (CaptureFd < 0 || Buffered == 0) {
+        return;
+    }
+
+    uint64_t now = timer_now();
+    if (!force && Buffered < CAPTURE_BUFFER / 2 && now - Flushed < CAPTURE_FLUSH) {
+        return;
+    }
+
+    size_t written = 0;
+    while (written < Buffered) {
+        ssize_t n = write(CaptureFd, Buffer + written, Buffered - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log("Unable to write capture log: %s", strerror(errno));
+            close(CaptureFd);
+            CaptureFd = -1;
+            break;
+        }
+        written += n;
+    }
+
+    Buffered = 0;
+    Flushed  = now;
+}
+
+/**
+ * Record request's header block.
+ *
+ * @param   r           Request structure with a complete header block.
+ **/
+void capture_request(Request *r) {
+    if (CaptureFd < 0) {
+        return;
+    }
+
+    CaptureRecord record = {
+        .time       = trace_clock() - Started,
+        .connection = r->number,
+        .length     = r->nheader,
+    };
+
+    if (Buffered + sizeof(record) + r->nheader > CAPTURE_BUFFER) {
+        capture_flush(true);
+        if (CaptureFd < 0) {
+            return;
+        }
+    }
+
+    memcpy(Buffer + Buffered, &record, sizeof(record));
+    memcpy(Buffer + Buffered + sizeof(record), r->buffer, r->nheader);
+    Buffered += sizeof(record) + r->nheader;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,61 @@
+/* cooperative.c: Coroutine per Request HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Serve request on its coroutine, then hand the connection back */
+static void cooperative_serve(void *arg) {
+    Request *r = arg;
+    server_complete(r, serve_request(r));
+}
+
+/**
+ * Start a coroutine to handle request.
+ *
+ * @param   r           Request structure.
+ * @return  CONNECTION_DETACHED once the coroutine owns the request.
+ **/
+static Disposition cooperative_dispatch(Request *r) {
+    if (coroutine_spawn(cooperative_serve, r) < 0) {
+        return CONNECTION_CLOSE;
+    }
+    return CONNECTION_DETACHED;
+}
+
+/**
+ * Handle HTTP requests concurrently on coroutines in the server process.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Handlers keep their blocking style: the socket stays non-blocking, and
+ * whenever a write, sendfile, or CGI read would block, the handler's
+ * coroutine waits in the scheduler while the event loop and the other
+ * coroutines carry on.  The event loop resumes coroutines whenever the
+ * scheduler has work.
+ **/
+int cooperative_server(int sfd) {
+    int wake = coroutine_init();
+    if (wake < 0) {
+        return EXIT_FAILURE;
+    }
+    server_wake(wake);
+
+    /* Accept and handle HTTP requests */
+    int status = server_loop(sfd, cooperative_dispatch, coroutine_run);
+
+    /* Close server socket */
+    if (close(sfd) < 0) {
+        debug("Error closing server socket: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    debug("Success!");
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,550 @@
+/* coroutine.c: Stackful Coroutines */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+/**
+ * A coroutine runs a function on its own small stack, so code written in
+ * blocking style (stdio streams, read and write loops) can be suspended in
+ * the middle of a system call that would block and resumed once it can go
+ * on.  Each thread has its own scheduler: a run queue, an epoll instance for
+ * the descriptors its coroutines wait on, and a timer wheel (armed through a
+ * timerfd in the same epoll instance) for their timeouts.  The scheduler's
+ * epoll descriptor becomes readable whenever a coroutine can be resumed, so
+ * an event loop only has to watch it and call coroutine_run.
+ *
+ * Stacks are COROUTINE_STACK bytes with a guard page below them, so an
+ * overflow faults instead of corrupting a neighbour, and finished stacks are
+ * kept for reuse.  Switching saves only the callee-saved registers on the
+ * stack being left; everything else was already saved by the caller.
+ *
+ * coroutine_poll and the read and write helpers behave like their blocking
+ * counterparts when called outside a coroutine.
+ **/
+
+#define COROUTINE_EVENTS    64          /* Events handled per epoll_wait */
+#define COROUTINE_HEADER    ((sizeof(Coroutine) + 63) & ~(size_t)63)
+
+typedef struct coroutine Coroutine;
+struct coroutine {
+#if defined(__x86_64__)
+    void       *sp;                     /*< Saved stack pointer */
+#else
+    ucontext_t  context;                /*< Saved context */
+#endif
+    void      (*entry)(void *);         /*< Function run by coroutine */
+    void       *arg;                    /*< Argument of entry */
+    Coroutine  *next;                   /*< Next in run queue or stack pool */
+    Timer       timer;                  /*< Pending wait timeout */
+    uint64_t    deadline;               /*< Time every wait ends by (ms, 0 if none) */
+    bool        waiting;                /*< Whether suspended until an event or timeout */
+    bool        timedout;               /*< Whether the last wait timed out */
+    bool        expired;                /*< Whether a wait ran into the deadline */
+    bool        finished;               /*< Whether entry has returned */
+};
+
+typedef struct {
+#if defined(__x86_64__)
+    void       *sp;                     /*< Stack pointer of the scheduler */
+#else
+    ucontext_t  context;                /*< Context of the scheduler */
+#endif
+    Coroutine  *current;                /*< Coroutine running (NULL in scheduler) */
+    Coroutine  *head;                   /*< Run queue */
+    Coroutine  *tail;
+    Coroutine  *pool;                   /*< Stacks of finished coroutines */
+    size_t      pooled;                 /*< Stacks in pool */
+    size_t      live;                   /*< Coroutines not yet finished */
+    int         epoll;                  /*< Descriptors coroutines wait on */
+    int         timer;                  /*< Timerfd armed for the next timeout */
+    uint64_t    armed;                  /*< Time timerfd fires (ms, 0 if disarmed) */
+    TimerWheel  wheel;                  /*< Wait timeouts */
+} Scheduler;
+
+/* Globals */
+
+static __thread Scheduler Sched = { .epoll = -1, .timer = -1 };
+
+/* Context Switching */
+
+#if defined(__x86_64__)
+
+/* Push the callee-saved registers, store the stack pointer in *from, switch
+ * to stack to, and pop the registers saved there */
+void coroutine_swap(void **from, void *to);
+
+__asm__ (
+    ".text\n"
+    ".globl coroutine_swap\n"
+    ".hidden coroutine_swap\n"
+    ".type coroutine_swap, @function\n"
+    "coroutine_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq  %rsp, (%rdi)\n"
+    "    movq  %rsi, %rsp\n"
+    "    popq  %r15\n"
+    "    popq  %r14\n"
+    "    popq  %r13\n"
+    "    popq  %r12\n"
+    "    popq  %rbx\n"
+    "    popq  %rbp\n"
+    "    ret\n"
+    ".size coroutine_swap, .-coroutine_swap\n"
+);
+
+static void coroutine_start(void);
+
+/* Lay out a new stack so the first switch to it returns into coroutine_start */
+static void context_init(Coroutine *co, char *top) {
+    void **sp = (void **)((uintptr_t)top & ~(uintptr_t)15);
+    *--sp = NULL;                       /* Return address of coroutine_start (never used) */
+    *--sp = (void *)coroutine_start;
+    for (int i = 0; i < 6; i++) {
+        *--sp = NULL;                   /* rbp, rbx, r12 - r15 */
+    }
+    co->sp = sp;
+}
+
+#define context_to(co)      coroutine_swap(&Sched.sp, (co)->sp)
+#define context_from(co)    coroutine_swap(&(co)->sp, Sched.sp)
+
+#else
+
+static void coroutine_start(void);
+
+/* Portable fallback (swapcontext also saves the signal mask, so it is slower) */
+static void context_init(Coroutine *co, char *top) {
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp   = top - COROUTINE_STACK;
+    co->context.uc_stack.ss_size = COROUTINE_STACK;
+    co->context.uc_link          = NULL;
+    makecontext(&co->context, coroutine_start, 0);
+}
+
+#define context_to(co)      swapcontext(&Sched.context, &(co)->context)
+#define context_from(co)    swapcontext(&(co)->context, &Sched.context)
+
+#endif
+
+/* Stacks */
+
+/* Map a stack with a guard page below it; the Coroutine lives at its top */
+static Coroutine *stack_create(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (page + COROUTINE_STACK + COROUTINE_HEADER + page - 1) & ~(page - 1);
+
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(base, page, PROT_NONE) < 0) {
+        munmap(base, size);
+        return NULL;
+    }
+    return (Coroutine *)(base + size - COROUTINE_HEADER);
+}
+
+/* Return a finished coroutine's stack to the pool (or the system) */
+static void stack_release(Coroutine *co) {
+    if (Sched.pooled < COROUTINE_POOL) {
+        co->next = Sched.pool;
+        Sched.pool = co;
+        Sched.pooled++;
+        return;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (page + COROUTINE_STACK + COROUTINE_HEADER + page - 1) & ~(page - 1);
+    munmap((char *)co + COROUTINE_HEADER - size, size);
+}
+
+/* Scheduling */
+
+static void coroutine_ready(Coroutine *co) {
+    co->waiting = false;
+    co->next    = NULL;
+    if (Sched.tail) {
+        Sched.tail->next = co;
+    } else {
+        Sched.head = co;
+    }
+    Sched.tail = co;
+}
+
+/* First frame of every coroutine */
+static void coroutine_start(void) {
+    Coroutine *co = Sched.current;
+    co->entry(co->arg);
+    co->finished = true;
+    context_from(co);
+    __builtin_unreachable();
+}
+
+/* Suspend the running coroutine until something makes it ready again */
+static void coroutine_suspend(void) {
+    Coroutine *co = Sched.current;
+    co->waiting = true;
+    context_from(co);
+}
+
+/* Wait timed out */
+static void coroutine_timeout(Timer *t, void *arg) {
+    Coroutine *co = (Coroutine *)((char *)t - offsetof(Coroutine, timer));
+    (void)arg;
+    if (co->waiting) {
+        co->timedout = true;
+        coroutine_ready(co);
+    }
+}
+
+/* Fire the timerfd when the wheel next needs attention */
+static void coroutine_arm(void) {
+    int      next    = timer_next(&Sched.wheel);
+    uint64_t expires = next < 0 ? 0 : timer_now() + (next > 0 ? next : 1);
+    if (expires == Sched.armed) {
+        return;
+    }
+
+    struct itimerspec spec = {
+        .it_value = { .tv_sec = expires / 1000, .tv_nsec = expires % 1000 * 1000000 },
+    };
+    timerfd_settime(Sched.timer, TFD_TIMER_ABSTIME, &spec, NULL);
+    Sched.armed = expires;
+}
+
+/**
+ * Create the calling thread's scheduler.
+ *
+ * @return  Descriptor that becomes readable whenever coroutine_run has work
+ * (or -1 on failure).
+ **/
+int coroutine_init(void) {
+    if (Sched.epoll >= 0) {
+        return Sched.epoll;
+    }
+
+    Sched.epoll = epoll_create1(EPOLL_CLOEXEC);
+    Sched.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (Sched.epoll < 0 || Sched.timer < 0) {
+        goto fail;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(Sched.epoll, EPOLL_CTL_ADD, Sched.timer, &event) < 0) {
+        goto fail;
+    }
+    timer_wheel_init(&Sched.wheel);
+    return Sched.epoll;
+
+fail:
+    debug("Unable to create coroutine scheduler: %s", strerror(errno));
+    if (Sched.epoll >= 0) {
+        close(Sched.epoll);
+    }
+    if (Sched.timer >= 0) {
+        close(Sched.timer);
+    }
+    Sched.epoll = Sched.timer = -1;
+    return -1;
+}
+
+/**
+ * Start a coroutine (it first runs in the next coroutine_run).
+ *
+ * @param   entry       Function to run.
+ * @param   arg         Argument passed to entry.
+ * @return  0 on success, -1 on failure.
+ **/
+int coroutine_spawn(void (*entry)(void *), void *arg) {
+    Coroutine *co = Sched.pool;
+    if (co) {
+        Sched.pool = co->next;
+        Sched.pooled--;
+    } else if (!(co = stack_create())) {
+        debug("Unable to allocate coroutine stack: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(co, 0, sizeof(Coroutine));
+    co->entry = entry;
+    co->arg   = arg;
+    context_init(co, (char *)co);
+    coroutine_ready(co);
+    Sched.live++;
+    return 0;
+}
+
+/**
+ * Resume every coroutine whose wait is over, and run each until it waits
+ * again or finishes.
+ *
+ * Coroutines started meanwhile run too; any that become ready afterwards
+ * leave the scheduler's descriptor readable.
+ **/
+void coroutine_run(void) {
+    struct epoll_event events[COROUTINE_EVENTS];
+
+    if (Sched.epoll < 0) {
+        return;
+    }
+
+    int nevents = epoll_wait(Sched.epoll, events, COROUTINE_EVENTS, 0);
+    for (int i = 0; i < nevents; i++) {
+        Coroutine *co = events[i].data.ptr;
+        if (!co) {
+            uint64_t expirations;
+            if (read(Sched.timer, &expirations, sizeof(expirations)) > 0) {
+                Sched.armed = 0;
+            }
+        } else if (co->waiting) {
+            coroutine_ready(co);
+        }
+    }
+    timer_expire(&Sched.wheel, coroutine_timeout, NULL);
+
+    while (Sched.head) {
+        Coroutine *co = Sched.head;
+        Sched.head = co->next;
+        if (!Sched.head) {
+            Sched.tail = NULL;
+        }
+
+        Sched.current = co;
+        context_to(co);
+        Sched.current = NULL;
+
+        if (co->finished) {
+            Sched.live--;
+            stack_release(co);
+        }
+    }
+
+    coroutine_arm();
+}
+
+/**
+ * Return whether the caller is running on a coroutine.
+ **/
+bool coroutine_active(void) {
+    return Sched.current != NULL;
+}
+
+/**
+ * Return the number of coroutines that have not finished.
+ **/
+size_t coroutine_count(void) {
+    return Sched.live;
+}
+
+/**
+ * Let other ready coroutines run before continuing.
+ **/
+void coroutine_yield(void) {
+    Coroutine *co = Sched.current;
+    if (co) {
+        coroutine_ready(co);
+        context_from(co);
+    }
+}
+
+/**
+ * End every later wait of the running coroutine at a deadline.
+ *
+ * @param   timeout     Milliseconds from now (negative clears the deadline).
+ *
+ * A wait cut short by the deadline returns as if it timed out, and
+ * coroutine_expired reports it.
+ **/
+void coroutine_deadline(int timeout) {
+    Coroutine *co = Sched.current;
+    if (co) {
+        co->deadline = timeout < 0 ? 0 : timer_now() + timeout;
+        co->expired  = false;
+    }
+}
+
+/**
+ * Return whether a wait of the running coroutine ran into its deadline.
+ **/
+bool coroutine_expired(void) {
+    return Sched.current && Sched.current->expired;
+}
+
+/**
+ * Wait until a descriptor is ready.
+ *
+ * @param   fd          Descriptor (negative to just sleep).
+ * @param   events      POLLIN and/or POLLOUT.
+ * @param   timeout     Milliseconds to wait (negative waits indefinitely).
+ * @return  1 if ready, 0 on timeout, and -1 on error (like poll).
+ *
+ * On a coroutine, other coroutines run meanwhile; otherwise this is poll.
+ **/
+int coroutine_poll(int fd, short events, int timeout) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    return coroutine_pollv(&pfd, 1, timeout);
+}
+
+/**
+ * Wait until any of several descriptors is ready.
+ *
+ * @param   fds         Descriptors and the events wanted (negative ones are
+ *                      ignored); revents are set as by poll.
+ * @param   n           Number of descriptors.
+ * @param   timeout     Milliseconds to wait (negative waits indefinitely).
+ * @return  Descriptors ready, 0 on timeout, and -1 on error (like poll).
+ *
+ * On a coroutine, other coroutines run meanwhile; otherwise this is poll.
+ **/
+int coroutine_pollv(struct pollfd *fds, nfds_t n, int timeout) {
+    Coroutine *co = Sched.current;
+    if (!co) {
+        return poll(fds, n, timeout);
+    }
+
+    bool capped = false;
+    if (co->deadline) {
+        uint64_t now = timer_now();
+        if (now >= co->deadline) {
+            co->expired = true;
+            return 0;
+        }
+        if (timeout < 0 || (uint64_t)timeout > co->deadline - now) {
+            timeout = co->deadline - now;
+            capped  = true;
+        }
+    }
+
+    for (;;) {
+        /* poll and epoll share the values of POLLIN and POLLOUT */
+        int    ready = 0;
+        nfds_t added = 0;
+        for (; added < n && ready >= 0; added++) {
+            struct epoll_event event = { .events = (uint32_t)fds[added].events | EPOLLONESHOT, .data.ptr = co };
+            fds[added].revents = 0;
+            if (fds[added].fd < 0 || epoll_ctl(Sched.epoll, EPOLL_CTL_ADD, fds[added].fd, &event) == 0) {
+                continue;
+            }
+            /* Regular files are always ready */
+            if (errno == EPERM) {
+                fds[added].revents = fds[added].events;
+                ready++;
+            } else {
+                ready = -1;
+            }
+        }
+
+        if (ready == 0) {
+            if (timeout >= 0) {
+                timer_add(&Sched.wheel, &co->timer, TIMER_WRITE, timeout);
+            }
+            co->timedout = false;
+            coroutine_suspend();
+            timer_cancel(&Sched.wheel, &co->timer);
+        }
+        for (nfds_t i = 0; i < added; i++) {
+            if (fds[i].fd >= 0) {
+                epoll_ctl(Sched.epoll, EPOLL_CTL_DEL, fds[i].fd, NULL);
+            }
+        }
+        if (ready != 0) {
+            return ready;
+        }
+        if (co->timedout) {
+            co->expired = capped;
+            return 0;
+        }
+
+        /* A single descriptor is the one that woke us; of several, ask which */
+        if (n == 1) {
+            fds[0].revents = fds[0].events;
+            return 1;
+        }
+        if ((ready = poll(fds, n, 0)) != 0) {
+            return ready;
+        }
+    }
+}
+
+/**
+ * Sleep for a while (letting other coroutines run when called on one).
+ *
+ * @param   timeout     Milliseconds to sleep.
+ **/
+void coroutine_sleep(int timeout) {
+    if (!Sched.current) {
+        usleep(timeout * 1000);
+        return;
+    }
+    coroutine_poll(-1, 0, timeout);
+}
+
+/**
+ * Read from a descriptor, waiting for input if it is non-blocking.
+ *
+ * @param   fd          Descriptor.
+ * @param   buffer      Where to store bytes.
+ * @param   n           Size of buffer.
+ * @return  Bytes read, 0 at end of file, or -1 with errno set (ETIMEDOUT if
+ * the deadline passed).
+ **/
+ssize_t coroutine_read(int fd, void *buffer, size_t n) {
+    for (;;) {
+        ssize_t nread = read(fd, buffer, n);
+        if (nread >= 0 || errno != EAGAIN) {
+            return nread;
+        }
+        int ready = coroutine_poll(fd, POLLIN, -1);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+    }
+}
+
+/**
+ * Write to a descriptor, waiting for room if it is non-blocking.
+ *
+ * @param   fd          Descriptor.
+ * @param   buffer      Bytes to write.
+ * @param   n           Number of bytes.
+ * @return  Bytes written, or -1 with errno set (ETIMEDOUT if the deadline
+ * passed).
+ **/
+ssize_t coroutine_write(int fd, const void *buffer, size_t n) {
+    for (;;) {
+        ssize_t nwritten = write(fd, buffer, n);
+        if (nwritten >= 0 || errno != EAGAIN) {
+            return nwritten;
+        }
+        int ready = coroutine_poll(fd, POLLOUT, -1);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
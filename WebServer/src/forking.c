@@ -1,55 +1,140 @@
+/* forking.c: Process per Request HTTP Server */
+
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Requests being handled by child processes */
+static Request *Children = NULL;
+
 /**
- * Fork incoming HTTP requests to handle the concurrently.
+ * Fork off child process to handle request.
  *
- * @param   sfd         Server socket file descriptor.
- * @return  Exit status of server (EXIT_SUCCESS).
+ * @param   r           Request structure.
+ * @return  CONNECTION_DETACHED once the child owns the request.
+ *
+ * The child reports through its exit status whether the connection can be
+ * kept alive; forking_reap hands it back to the event loop accordingly.
  *
- * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * A request body is read by the child alone, so the parent's copy of the
+ * input no longer says where the next request starts.  The child of a
+ * request with a body writes whatever it read past the body into a pipe,
+ * and the parent takes that as its input before carrying on.  Userspace TLS
+ * (which also decrypts for kernel TLS) reads in the child's session only, so
+ * such connections are closed after a body.
  **/
+static Disposition forking_dispatch(Request *r) {
+    int  carry[2] = {-1, -1};
+    bool body     = r->body != BODY_NONE || r->length > 0;
+    if(body && !r->tls && pipe2(carry, O_CLOEXEC | O_NONBLOCK) < 0) {
+        debug("Unable to create pipe: %s", strerror(errno));
+        carry[0] = carry[1] = -1;
+    }
 
-
-int forking_server(int sfd) {
-    /* Accept and handle HTTP request */
-    while (true) {
-        /* Accept request */
-        Request *client_stream = accept_request(sfd);/*use free_request*/
-        if(!client_stream){
-            continue;
+    pid_t pid = fork();
+    if(pid < 0){
+        debug("Unable to fork: %s", strerror(errno));
+        if(carry[0] >= 0) {
+            close(carry[0]);
+            close(carry[1]);
         }
+        return CONNECTION_CLOSE;
+    }
 
-        pid_t pid = fork();
-        if(pid < 0){
-          debug("Unable to fork: %s", strerror(errno));
-          free_request(client_stream);
-          continue;
+    /* Fork off child process to handle request */
+    if(pid==0){
+        server_child();
+        bool keep_alive = serve_request(r);
+        /* Userspace TLS state advances only in this process, so the parent
+         * cannot carry on the connection */
+        if(keep_alive && (!r->plaintext || (body && r->tls))) {
+            tls_shutdown(r);
+            keep_alive = false;
         }
+        /* Hand the input read past the body back to the parent */
+        if(keep_alive && body) {
+            size_t  n = r->nbuffer - r->nheader;
+            ssize_t written = carry[1] >= 0 ? write(carry[1], r->buffer + r->nheader, n) : -1;
+            keep_alive = written == (ssize_t)n;
+        }
+        access_flush(true);
+        /* _exit skips the stdio teardown inherited from the parent (the
+         * response stream was flushed by serve_request) */
+        fflush(stderr);
+        _exit(keep_alive ? EXIT_KEEPALIVE : EXIT_SUCCESS);/*prevents fork bombs*/
+    }
 
-        /* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
+    if(carry[1] >= 0) {
+        close(carry[1]);
+    }
+    r->pid   = pid;
+    r->carry = carry[0];
+    r->trace = NULL;                    /* Child finishes any sample */
+    r->next  = Children;
+    Children = r;
+    return CONNECTION_DETACHED;
+}
 
-        /* Fork off child process to handle request */
-        if(pid==0){
-            Status status = handle_request(client_stream);
-            const char* returnStatus = http_status_string(status);
-            log("Return status: %s", returnStatus);
-            free_request(client_stream);
-            exit(EXIT_SUCCESS);/*prevents fork bombs*/
-        }else{
+/* Take the input the child read past the request body as the parent's own */
+static bool forking_carry(Request *r) {
+    char    input[REQUEST_MAX];
+    ssize_t n = read(r->carry, input, sizeof(input));
+    return n >= 0 && request_carry(r, input, n);
+}
 
+/**
+ * Reap finished children and return their connections to the event loop.
+ *
+ * Each reaped child frees an admission slot for the next queued request.
+ **/
+static void forking_reap(void) {
+    pid_t pid;
+    int   status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        Request **prev = &Children;
+        while (*prev && (*prev)->pid != pid) {
+            prev = &(*prev)->next;
         }
-        debug("Freeing request");
-        free_request(client_stream);
 
+        Request *r = *prev;
+        if (!r) {
+            continue;
+        }
+        *prev   = r->next;
+        r->next = NULL;
+        r->pid  = 0;
+
+        bool keep_alive = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_KEEPALIVE;
+        if (r->carry >= 0) {
+            keep_alive = keep_alive && forking_carry(r);
+            close(r->carry);
+            r->carry = -1;
+        }
+        server_complete(r, keep_alive);
     }
+}
+
+/**
+ * Fork incoming HTTP requests to handle the concurrently.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The parent reads request headers in its event loop and then forks off a
+ * child to handle each complete request.
+ **/
+int forking_server(int sfd) {
+    /* Accept and handle HTTP requests */
+    int status = server_loop(sfd, forking_dispatch, forking_reap);
 
     /* Close server socket */
     if(close(sfd) < 0) {
@@ -58,7 +143,7 @@ int forking_server(int sfd) {
     }
 
     debug("Success!");
-    return EXIT_SUCCESS;
+    return status;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
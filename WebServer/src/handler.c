@@ -1,76 +1,209 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <string.h>
+#include <strings.h>
 
+#include <arpa/inet.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#define SENDFILE_MAX    (1 << 30)      /* Largest file chunk sent at once */
+#define CGI_BUFFER      CACHE_OUTPUT   /* Largest CGI output buffered before sending */
+
+/* Request body going into a CGI script while its output is relayed */
+typedef struct {
+    int     fd;                         /* Script stdin (-1 once the body is in) */
+    Status  status;                     /* Status of receiving the body */
+} CgiInput;
+
 /* Internal Declarations */
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
 Status handle_error(Request *request, Status status);
+char * handle_error_page(Status status, size_t *size);
+void   handle_headers(Request *request, Status status, const char *mimetype, off_t length);
+off_t  handle_cgi_headers(Request *request, char *block, size_t n);
+Status handle_cgi_output(Request *request, int fd, CgiInput *input, char *buffer, size_t n, char *keep, size_t *nkeep, uint64_t deadline);
+static Status cgi_feed(Request *request, CgiInput *input);
+static int   cgi_wait(struct pollfd *fds, nfds_t n, uint64_t deadline);
+static ssize_t cgi_read(Request *request, int fd, CgiInput *input, char *buffer, size_t n, uint64_t deadline);
+static char *cgi_body(char *buffer, size_t n);
+static void  cgi_keep(char *keep, size_t total, const char *data, size_t n);
+static bool  cgi_ready(int fd);
+static bool  cgi_executable(const struct stat *s);
+static int   browse_scan(int fd, char ***entries);
 
 /**
- * Handle HTTP Request.
+ * Route HTTP Request.
  *
  * @param   r           HTTP Request structure
- * @return  Status of the HTTP request.
+ * @return  Handler that will serve the request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This parses a request, determines the request path, and determines the
+ * request type.  The event loop routes each request before admitting it, so
+ * CGI scripts can be limited separately; routing again returns the earlier
+ * result.  A connection that starts with the HTTP/2 preface, or asks to
+ * upgrade to h2c, is routed to HTTP/2 as a whole; its streams arrive parsed
+ * and are routed one by one.
  *
- * On error, handle_error should be used with an appropriate HTTP status code.
+ * On error, the route is ROUTE_ERROR and r->error holds the HTTP status code
+ * (413 if the Content-Length is beyond MaxBody).  A URI under a plugin's
+ * prefix is routed to ROUTE_PLUGIN, one under a reverse proxy's prefix to
+ * ROUTE_PROXY, a PUT under an upload prefix to ROUTE_UPLOAD, and a path the
+ * negative cache knows is missing to ROUTE_MISSING (also a 404), before the
+ * filesystem is consulted.
  **/
-Status  handle_request(Request *r) {
-    Status result;
+Route   route_request(Request *r) {
+    if(r->route != ROUTE_NONE) {
+        return r->route;
+    }
+
+    /* Parse request (HTTP/2 streams arrive parsed) */
+    if(!r->method) {
+        if(http2_detect(r)) {
+            return r->route = ROUTE_HTTP2;
+        }
+
+        debug("Parsing request");
+        int status = parse_request(r);
+        r->begun   = trace_clock();
+        if(status < 0) {
+            debug("Unable to parse request: %s", strerror(errno));
+            r->error      = HTTP_STATUS_BAD_REQUEST;
+            r->keep_alive = false;
+            return r->route = ROUTE_ERROR;
+        }
+        trace(r, parse);
+
+        if(http2_detect(r)) {
+            return r->route = ROUTE_HTTP2;
+        }
 
-    /* Parse request */
-    debug("Parsing request");
-    int status = parse_request(r);
-    if(status < 0) {
-        debug("Unable to parse request: %s", strerror(errno));
-        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        if(MaxBody > 0 && r->length > MaxBody) {
+            debug("Request body too large: %lld bytes", (long long)r->length);
+            r->error = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+            return r->route = ROUTE_ERROR;
+        }
     }
     
-    /* Determine request path */
+    /* Plugins, proxies, and uploads answer their prefixes before the filesystem is consulted */
+    if(plugin_route(r)) {
+        return r->route = ROUTE_PLUGIN;
+    }
+    if(proxy_route(r)) {
+        return r->route = ROUTE_PROXY;
+    }
+    if(upload_route(r)) {
+        return r->route = r->upload ? ROUTE_UPLOAD : ROUTE_ERROR;
+    }
+
+    /* Answer paths known to be missing without touching the filesystem */
+    if(negative_lookup(r->uri)) {
+        r->error = HTTP_STATUS_NOT_FOUND;
+        return r->route = ROUTE_MISSING;
+    }
+
+    /* Open request path beneath RootPath */
     debug("Determining request path...");
-    r->path = determine_request_path(r->uri);
-    if(r->path == NULL) {
+    r->target = determine_request_path(r->uri, &r->path);
+    if(r->target < 0) {
         debug("Unable to determine path: %s", strerror(errno));
-        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+        if(errno == ENOENT || errno == ENOTDIR) {
+            negative_insert(r->uri);
+        }
+        r->error = HTTP_STATUS_NOT_FOUND;
+        return r->route = ROUTE_ERROR;
     }
     debug("HTTP REQUEST PATH: %s", r->path);
+    trace(r, path);
 
 
-    /* Dispatch to appropriate request handler type based on file type */ 
+    /* Determine request type based on file type */ 
     struct stat s;
-    if( lstat(r->path, &s) < 0) {
+    if( fstat(r->target, &s) < 0) {
         debug("Unable to get file information: %s", strerror(errno));
-        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+        r->error = HTTP_STATUS_NOT_FOUND;
+        return r->route = ROUTE_ERROR;
     }
+    trace(r, stat);
 
 
     if(S_ISDIR(s.st_mode)){
         debug("Input type: Directory");
-        result = handle_browse_request(r);
+        r->route = ROUTE_BROWSE;
     }
-    else if(access(r->path, X_OK) == 0){
+    else if(S_ISREG(s.st_mode) && cgi_executable(&s)){
         debug("Input type: CGI");
-        result = handle_cgi_request(r);
+        r->route = ROUTE_CGI;
     }
-    else if(access(r->path, R_OK) == 0){
+    else if(S_ISREG(s.st_mode) && !(fcntl(r->target, F_GETFL) & O_PATH)){
         debug("Input type: File");
-        result = handle_file_request(r);
+        r->route = ROUTE_FILE;
     }
     else {
         debug("Input type: Bad --> ERROR");
-        result = HTTP_STATUS_BAD_REQUEST;
+        r->error = HTTP_STATUS_BAD_REQUEST;
+        r->route = ROUTE_ERROR;
+    }
+    return r->route;
+}
+
+/**
+ * Handle HTTP Request.
+ *
+ * @param   r           HTTP Request structure
+ * @return  Status of the HTTP request.
+ *
+ * This routes the request (if the event loop has not already) and then
+ * dispatches to the appropriate handler type.
+ *
+ * On error, handle_error should be used with an appropriate HTTP status code.
+ **/
+Status  handle_request(Request *r) {
+    Status result;
+
+    switch(route_request(r)) {
+        case ROUTE_BROWSE:
+            result = handle_browse_request(r);
+            break;
+        case ROUTE_CGI:
+            result = handle_cgi_request(r);
+            break;
+        case ROUTE_FILE:
+            result = handle_file_request(r);
+            break;
+        case ROUTE_PLUGIN:
+            result = plugin_handle(r);
+            if(result != HTTP_STATUS_OK) {
+                result = handle_error(r, result);
+            }
+            break;
+        case ROUTE_PROXY:
+            result = proxy_handle(r);
+            if(result != HTTP_STATUS_OK) {
+                result = handle_error(r, result);
+            }
+            break;
+        case ROUTE_UPLOAD:
+            result = upload_handle(r);
+            if(result != HTTP_STATUS_OK) {
+                result = handle_error(r, result);
+            }
+            break;
+        default:
+            result = handle_error(r, r->error);
+            break;
     }
 
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
@@ -90,36 +223,41 @@ Status  handle_request(Request *r) {
  * with HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_browse_request(Request *r) {
-    struct dirent **entries;
+    char **entries;
 
-    /* Open a directory for reading or scanning */
-    int n = scandir(r->path, &entries, NULL, alphasort);
+    /* Scan the directory opened while routing */
+    int n = browse_scan(r->target, &entries);
     if(n < 0) {
         debug("Error opening directory: %s", strerror(errno));
-        return HTTP_STATUS_BAD_REQUEST;
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
     debug("Scanned directory");
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    debug("HTTP Header...Status: OK  |  Content Type: text/html");
-    fprintf(r->file, "HTTP/1.0 200 OK\n");
-    fprintf(r->file, "Content-Type: text/html\n");
-    fprintf(r->file, "\r\n");
-
-
     /* For each entry in directory, emit HTML list item */
-    debug("Print directories to stream");
-    fprintf(r->file, "<ul type=\"square\">");
+    debug("Print directories to buffer");
+    char   *html = NULL;
+    size_t  size = 0;
+    FILE   *body = open_memstream(&html, &size);
+    if(!body) {
+        debug("Unable to open memory stream: %s", strerror(errno));
+        for(int i = 0; i < n; i++) {
+            free(entries[i]);
+        }
+        free(entries);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    fprintf(body, "<ul type=\"square\">");
     for(int i = 1; i < n; i++) {
         if(strcmp( &r->uri[strlen(r->uri) - 1], "/")) {
-            fprintf(r->file, "<li><a href=\"%s/%s\">%s</a></li>\n", r->uri, entries[i]->d_name, entries[i]->d_name);
+            fprintf(body, "<li><a href=\"%s/%s\">%s</a></li>\n", r->uri, entries[i], entries[i]);
         } 
         else {
-            fprintf(r->file, "<li><a href=\"%s%s\">%s</a></li>\n", r->uri, entries[i]->d_name, entries[i]->d_name);
+            fprintf(body, "<li><a href=\"%s%s\">%s</a></li>\n", r->uri, entries[i], entries[i]);
         }
     }
-    fprintf(r->file, "</ul>");
-
+    fprintf(body, "</ul>");
+    fclose(body);
 
     debug("Free directory entries");
     for(int i = 0; i < n; i++) {
@@ -127,9 +265,16 @@ Status  handle_browse_request(Request *r) {
     }
     free(entries);
 
-    /* Flush socket, return OK */
-    debug("Flush socket and return OK");
-    fflush(r->file);
+    /* Write HTTP Header with OK Status and text/html Content-Type */
+    debug("HTTP Header...Status: OK  |  Content Type: text/html");
+    handle_headers(r, HTTP_STATUS_OK, "text/html", size);
+    fwrite(html, 1, size, r->file);
+    free(html);
+    trace(r, body);
+
+    /* Finish response, return OK */
+    debug("Finish response and return OK");
+    r->responder->finish(r);
     return HTTP_STATUS_OK;
 }
 
@@ -139,51 +284,79 @@ Status  handle_browse_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This streams the contents of the file opened while routing to the socket.
+ * When the socket takes bytes as-is (plain HTTP or kernel TLS), the kernel
+ * copies the file with sendfile.
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * If the file cannot be read, then handle error with HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_file_request(Request *r) {
     FILE *fs;
     char buffer[BUFSIZ];
-    char *mimetype;
+    char *mimetype = NULL;
     size_t nread;
+    struct stat st;
 
-    /* Open file for reading */
-    fs = fopen(r->path, "r");
-    if(!fs) {
+    /* Read the file opened while routing */
+    int fd = dup(r->target);
+    fs = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if(!fs || fstat(fileno(fs), &st) < 0) {
         debug("Unable to open: %s", strerror(errno));
-        goto fail;
+        if(fs)
+            fclose(fs);
+        else if(fd >= 0)
+            close(fd);
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
     /* Determine mimetype */
     mimetype = determine_mimetype(r->path);
     if(!mimetype){
-        mimetype = DefaultMimeType;
+        mimetype = strdup(DefaultMimeType);
         debug("Mimetype set to Default");
     }
     debug("Mimetype: %s", mimetype);
+    trace(r, mimetype);
 
     /* Write HTTP Headers with OK status and determined Content-Type */
     debug("Write HTTP Header with OK status and MIMETYPE content type");
-    fprintf(r->file, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->file, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->file, "\r\n");
+    handle_headers(r, HTTP_STATUS_OK, mimetype, st.st_size);
 
-    
-    /* Read from file and write to socket in chunks */
-    while(0 < (nread = fread(buffer, 1, BUFSIZ, fs))) {
-        if( (fwrite(buffer, 1, nread, r->file)) != nread){
-            debug("Failure reading and writing socket: %s", strerror(errno));
-            goto fail;
+    /* Send file directly from the page cache when the socket allows it */
+    if(r->plaintext) {
+        off_t offset = 0;
+        fflush(r->file);
+        while(offset < st.st_size) {
+            size_t  count = st.st_size - offset < SENDFILE_MAX ? st.st_size - offset : SENDFILE_MAX;
+            ssize_t nsent = sendfile(r->fd, fileno(fs), &offset, count);
+            /* A coroutine's socket takes what fits and the loop waits for
+             * room; blocking sendfile only stops short when the deadline
+             * interrupts it */
+            if(nsent < 0 && errno == EAGAIN && coroutine_poll(r->fd, POLLOUT, -1) > 0) {
+                continue;
+            }
+            if(nsent < (ssize_t)count && (nsent <= 0 || !coroutine_active())) {
+                debug("Failure sending file to socket: %s", strerror(errno));
+                r->keep_alive = false;
+                goto fail;
+            }
+        }
+    } else {
+        /* Read from file and write to socket in chunks */
+        while(0 < (nread = fread(buffer, 1, BUFSIZ, fs))) {
+            if( (fwrite(buffer, 1, nread, r->file)) != nread){
+                debug("Failure reading and writing socket: %s", strerror(errno));
+                r->keep_alive = false;
+                goto fail;
+            }
         }
     }
-    
+    trace(r, body);
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    debug("Closing, flushing, freeing, OK");
+    /* Close file, finish response, deallocate mimetype, return OK */
+    debug("Closing, finishing, freeing, OK");
+    warmup_record(r, st.st_size);
     fclose(fs);
-    fflush(r->file);
+    r->responder->finish(r);
     free(mimetype);
 
     return HTTP_STATUS_OK;
@@ -191,7 +364,8 @@ Status  handle_file_request(Request *r) {
 fail:
     /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
     debug("Failed: exiting with internal server error");
-    fclose(fs);
+    if(fs)
+        fclose(fs);
     free(mimetype);
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
@@ -203,76 +377,267 @@ fail:
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This starts the specified executable, streams any request body into its
+ * stdin, and streams its output to the socket.  The script's header block is
+ * parsed into the response headers, and a body without Content-Length is
+ * sent in chunks (HTTP/1.1) so the connection can be kept alive.  Output is
+ * sent whenever FlushLowWater bytes are buffered or the script pauses, so
+ * large outputs stream in bounded memory.  With the micro-cache enabled,
+ * output may come from (or be kept for) identical requests instead.
+ *
+ * The body is spliced into the script as it arrives, so uploads of any size
+ * take constant memory.  CONTENT_LENGTH is only set for a body with a
+ * Content-Length; a script given a chunked body reads stdin to its end.  Its
+ * output is relayed while the body goes in, so a script that writes before it
+ * has read all of its input (a filter like cat) never stalls on a full pipe.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * Scripts run confined to their limits (see sandbox.c), and one still running
+ * CgiTimeout seconds after it started is killed.
+ *
+ * If the script cannot be started, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR, and if the body cannot be received,
+ * with the status cgi_feed returns.
  **/
 Status  handle_cgi_request(Request *r) {
-    FILE *pfs;
-    char buffer[BUFSIZ]; 
+    int input, output;
+    size_t n = 0;
+
+    /* Kept off the stack, which is small on a coroutine */
+    char *buffer = malloc(CGI_BUFFER);
+    if(!buffer) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Serve output cached from an earlier run of the script */
+    CacheResult cached = cache_lookup(r, buffer, &n);
+    if(cached == CACHE_HIT) {
+        debug("Serving cached CGI output");
+        Status status = handle_cgi_output(r, -1, NULL, buffer, n, NULL, &n, 0);
+        free(buffer);
+        return status;
+    }
 
     /* Export CGI environment variables from request:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
     debug("Setting initial enviromental variables...");
     setenv("DOCUMENT_ROOT", RootPath, true);
     setenv("QUERY_STRING", r->query, true);
-    setenv("REMOTE_ADDR", r->host, true);
-    setenv("REMOTE_PORT", r->port, true);
+    char host[INET6_ADDRSTRLEN], port[8];
+    snprintf(port, sizeof(port), "%d", request_port(r));
+    setenv("REMOTE_ADDR", request_host(r, host), true);
+    setenv("REMOTE_PORT", port, true);
     setenv("REQUEST_METHOD", r->method, true);
     setenv("REQUEST_URI", r->uri, true);
     setenv("SCRIPT_FILENAME", r->path, true);
     setenv("SERVER_PORT", Port, true);
-    
+    if(r->length >= 0) {
+        char length[24];
+        snprintf(length, sizeof(length), "%lld", (long long)r->length);
+        setenv("CONTENT_LENGTH", length, true);
+    } else {
+        unsetenv("CONTENT_LENGTH");
+    }
+    unsetenv("CONTENT_TYPE");
+
 
     /* Export CGI environment variables from request headers */
     for(Header *temp = r->headers; temp; temp = temp->next) {
-        if(streq(temp->name, "Host")){
+        switch (temp->id) {
+        case HEADER_HOST:
             setenv("HTTP_HOST", temp->value, true);
-        }
-        else if(streq(temp->name, "Connection")){
+            break;
+        case HEADER_CONNECTION:
             setenv("HTTP_CONNECTION", temp->value, true);
-        }
-        else if(streq(temp->name, "Accept")) {
+            break;
+        case HEADER_ACCEPT:
             setenv("HTTP_ACCEPT", temp->value, true);
-        }
-        else if(streq(temp->name, "Accept-Encoding")){
+            break;
+        case HEADER_ACCEPT_ENCODING:
             setenv("HTTP_ACCEPT_ENCODING", temp->value, true);
-        }
-        else if(streq(temp->name, "Accept-Language")) {
+            break;
+        case HEADER_ACCEPT_LANGUAGE:
             setenv("HTTP_ACCEPT_LANGUAGE", temp->value, true);
-        }
-        else if(streq(temp->name, "User-Agent")) {
+            break;
+        case HEADER_USER_AGENT:
             setenv("HTTP_USER_AGENT", temp->value, true);
+            break;
+        case HEADER_CONTENT_TYPE:
+            setenv("CONTENT_TYPE", temp->value, true);
+            break;
+        default:
+            break;
         }
-
-                
     }
     debug("All enviromental variables set");
 
-    /* POpen CGI Script */
+    /* Start CGI Script */
     log("Executing CGI Script: %s", r->path);
-    pfs = popen(r->path, "r");
-    if(!pfs) {
-        debug("CGI script not found");
-        return HTTP_STATUS_NOT_FOUND;
+    uint64_t deadline = CgiTimeout > 0 ? timer_now() + CgiTimeout * 1000ULL : 0;
+    pid_t    pid      = sandbox_spawn(r->path, &input, &output);
+    if(pid < 0) {
+        debug("Unable to start CGI script: %s", strerror(errno));
+        if(cached == CACHE_FILL) {
+            cache_abandon(r);
+        }
+        free(buffer);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Script pipes never block a coroutine's thread */
+    fcntl(input, F_SETFL, O_NONBLOCK);
+    fcntl(output, F_SETFL, O_NONBLOCK);
+
+    /* Start the body before any output, so a 100 Continue precedes the response */
+    CgiInput feed   = {.fd = input, .status = HTTP_STATUS_OK};
+    Status   status = cgi_feed(r, &feed);
+    if(status != HTTP_STATUS_OK) {
+        close(output);
+        sandbox_kill(pid);
+        if(cached == CACHE_FILL) {
+            cache_abandon(r);
+        }
+        free(buffer);
+        r->keep_alive = false;
+        return handle_error(r, status);
+    }
+
+    /* Relay output while feeding the rest of the body, keeping a copy for the
+     * cache if this run fills it */
+    char  *keep  = cached == CACHE_FILL ? malloc(CACHE_OUTPUT) : NULL;
+    size_t nkeep = 0;
+    status = handle_cgi_output(r, output, &feed, buffer, 0, keep, &nkeep, deadline);
+    if(feed.fd >= 0) {
+        close(feed.fd);
+    }
+    close(output);
+    if(feed.status != HTTP_STATUS_OK) {
+        sandbox_kill(pid);
+    } else if(!sandbox_wait(pid, deadline)) {
+        nkeep = 0;
+    }
+
+    if(cached == CACHE_FILL) {
+        if(keep && nkeep > 0) {
+            cache_store(r, keep, nkeep);
+        } else {
+            cache_abandon(r);
+        }
     }
+    free(keep);
+    free(buffer);
+    return status;
+}
 
-    /* Copy data from popen to socket */
-    debug("Copying popen to socket");
-    while(fgets(buffer, BUFSIZ, pfs)) {
-        fputs(buffer, r->file);
+/**
+ * Relay CGI output to the client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Script output (or -1 if buffer holds all of it).
+ * @param   input       Rest of the request body for the script (or NULL).
+ * @param   buffer      Buffer of CGI_BUFFER bytes.
+ * @param   n           Bytes of output already in buffer.
+ * @param   keep        Buffer of CACHE_OUTPUT bytes for a copy of the output
+ *                      (may be NULL).
+ * @param   nkeep       Set to the length of the copy (0 if the output did not
+ *                      fit or was not relayed completely).
+ * @param   deadline    timer_now() time the script must be done by (0 for none).
+ * @return  Status of the HTTP CGI request.
+ *
+ * The body is sent once the low-water mark is buffered or the script
+ * pauses, and never beyond the script's Content-Length.  A script that sends
+ * no header block by its deadline gets a 504; one that is still sending its
+ * body has the response cut off, with the connection closed so the client
+ * can tell.  A request body that cannot be received ends the response the
+ * same way, or gets its error page if no output was sent yet.
+ **/
+Status  handle_cgi_output(Request *r, int fd, CgiInput *input, char *buffer, size_t n, char *keep, size_t *nkeep, uint64_t deadline) {
+    size_t low_water = FlushLowWater < 1 ? 1 : FlushLowWater > CGI_BUFFER ? CGI_BUFFER : (size_t)FlushLowWater;
+    size_t total = 0;
+    ssize_t nread = 0;
+    char *body;
+
+    /* Read the script's header block */
+    while(!(body = cgi_body(buffer, n)) && n < BUFSIZ && fd >= 0) {
+        if((nread = cgi_read(r, fd, input, buffer + n, BUFSIZ - n, deadline)) <= 0) {
+            break;
+        }
+        cgi_keep(keep, total, buffer + n, nread);
+        total += nread;
+        n     += nread;
+    }
+    if(input && input->status != HTTP_STATUS_OK) {
+        r->keep_alive = false;
+        return handle_error(r, input->status);
+    }
+    if(!body && nread < 0 && errno == ETIME) {
+        log("CGI script sent no header block by its deadline");
+        return handle_error(r, HTTP_STATUS_GATEWAY_TIMEOUT);
+    }
+    if(!body) {
+        debug("CGI script sent no header block");
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
+    /* Start response from the script's headers */
+    size_t nheader = body - buffer;
+    off_t  length  = handle_cgi_headers(r, buffer, nheader);
+    n -= nheader;
+    memmove(buffer, body, n);
 
+    /* Stream body */
+    debug("Copying script output to socket");
+    off_t sent    = 0;
+    bool  eof     = fd < 0;
+    bool  expired = false;
+    while(!ferror(r->file)) {
+        if(!eof && n < low_water) {
+            nread = cgi_read(r, fd, input, buffer + n, CGI_BUFFER - n, deadline);
+            if(nread <= 0) {
+                eof     = true;
+                expired = nread < 0 && errno == ETIME;
+            } else {
+                cgi_keep(keep, total, buffer + n, nread);
+                total += nread;
+                n     += nread;
+            }
+        }
 
-    /* Close popen, flush socket, return OK */
-    debug("Closing, flushing, OK");
-    pclose(pfs);
-    fflush(r->file);
+        if(n > 0 && (n >= low_water || eof || !cgi_ready(fd))) {
+            if(length >= 0 && (off_t)n > length - sent) {
+                n = length - sent;
+            }
+            r->responder->send(r, buffer, n);
+            sent += n;
+            n     = 0;
+        }
+        if(eof) {
+            break;
+        }
+    }
+    trace(r, body);
+
+    /* A short body can only be ended by closing the connection */
+    if(length >= 0 && sent != length) {
+        r->keep_alive = false;
+    }
+
+    /* Only output read to its end without an error is worth keeping */
+    *nkeep = nread == 0 && total <= CACHE_OUTPUT && !ferror(r->file) ? total : 0;
+
+    /* A body cut off at the deadline, or by a failed request body, is left unfinished */
+    if(expired || (input && input->status != HTTP_STATUS_OK)) {
+        if(expired) {
+            log("CGI script still sending at its deadline");
+        }
+        r->keep_alive = false;
+        return HTTP_STATUS_OK;
+    }
+
+    /* Finish response, return OK */
+    debug("Finishing, OK");
+    r->responder->finish(r);
     return HTTP_STATUS_OK;
-} 
+}
 
 /**
  * Handle displaying error page
@@ -286,27 +651,385 @@ Status  handle_cgi_request(Request *r) {
 Status  handle_error(Request *r, Status status) {
     const char *status_string = http_status_string(status);
 
+    /* Write HTML Description of Error*/
+    size_t  size = 0;
+    char   *html = handle_error_page(status, &size);
+
     /* Write HTTP Header */
     debug("ERROR has occurred");
     debug("Error Status String: %s", status_string);
-    fprintf(r->file, "HTTP/1.0 %s\n", status_string);
-    fprintf(r->file, "Content-Type: text/html\n");
-    fprintf(r->file, "\r\n");
+    handle_headers(r, status, "text/html", html ? (off_t)size : -1);
+    if(html) {
+        fwrite(html, 1, size, r->file);
+        free(html);
+    }
+    trace(r, body);
 
+    /* Return specified status */
+    debug("Finishing and returning");
+    r->responder->finish(r);
+    return status;
+}
+
+/**
+ * Generate HTML page describing error.
+ *
+ * @param   status      HTTP status of error.
+ * @param   size        Set to length of page.
+ * @return  Newly allocated page (or NULL on failure).
+ **/
+char *  handle_error_page(Status status, size_t *size) {
+    char *html = NULL;
+    FILE *body = open_memstream(&html, size);
+    if(!body) {
+        return NULL;
+    }
 
-    /* Write HTML Description of Error*/
     char *terminator = "https://www.thewrap.com/wp-content/uploads/2017/09/terminator-timeline.jpg";
-    fprintf(r->file,"<h1>%s</h1>\n", status_string);
-    fprintf(r->file,"<h1>Hasta la vista, baby</h2>\n");
-    fprintf(r->file,"<center>\n");
-    fprintf(r->file,"<img src=\"%s\">\n", terminator);
-    fprintf(r->file,"</center>\r\n");
+    fprintf(body,"<h1>%s</h1>\n", http_status_string(status));
+    fprintf(body,"<h1>Hasta la vista, baby</h2>\n");
+    fprintf(body,"<center>\n");
+    fprintf(body,"<img src=\"%s\">\n", terminator);
+    fprintf(body,"</center>\r\n");
+    fclose(body);
+    return html;
+}
 
-    /* Return specified status */
-    debug("Flushing and returning");
+/**
+ * Return prebuilt 404 response for a path known to be missing.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   n           Set to length of response.
+ * @return  Complete HTTP/1 response for the request's version and keep-alive
+ * (or NULL on failure).
+ *
+ * Each variant is built the first time it is needed and then reused, so the
+ * event loop can answer scanner traffic without a handler.
+ **/
+const char * handle_missing(Request *r, size_t *n) {
+    static char  *Responses[2][2];
+    static size_t Lengths[2][2];
+    int version = r->version == 1;
+    int keep    = r->keep_alive;
+
+    if(!Responses[version][keep]) {
+        size_t size;
+        char  *html = handle_error_page(HTTP_STATUS_NOT_FOUND, &size);
+        FILE  *response = html ? open_memstream(&Responses[version][keep], &Lengths[version][keep]) : NULL;
+        if(!response) {
+            free(html);
+            return NULL;
+        }
+        fprintf(response, "HTTP/1.%d %s\r\n", version, http_status_string(HTTP_STATUS_NOT_FOUND));
+        fprintf(response, "Content-Type: text/html\r\n");
+        fprintf(response, "Content-Length: %zu\r\n", size);
+        fprintf(response, "Connection: %s\r\n", keep ? "keep-alive" : "close");
+        fprintf(response, "\r\n");
+        fwrite(html, 1, size, response);
+        fclose(response);
+        free(html);
+    }
+
+    *n = Lengths[version][keep];
+    return Responses[version][keep];
+}
+
+/**
+ * Start HTTP response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP status of response.
+ * @param   mimetype    Content-Type of response body.
+ * @param   length      Length of response body (or -1 if unknown).
+ **/
+void handle_headers(Request *r, Status status, const char *mimetype, off_t length) {
+    const char *status_string = http_status_string(status);
+    r->responder->start(r, atoi(status_string), status_string + 4, mimetype, length, NULL);
+}
+
+/**
+ * Start HTTP response from the header block of CGI script output.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   block       Header block (ending with its blank line).
+ * @param   n           Length of header block.
+ * @return  Content-Length given by the script (or -1 if none).
+ *
+ * The status comes from a leading HTTP status line or a Status header, as
+ * scripts print either, and defaults to 200 OK (302 Found with a Location).
+ * Headers other than those the response framing owns are passed through.
+ **/
+off_t handle_cgi_headers(Request *r, char *block, size_t n) {
+    int     code = 0;
+    char   *reason = "OK";
+    char   *mimetype = DefaultMimeType;
+    off_t   length = -1;
+    Header *headers = NULL;
+    Header **tail = &headers;
+    bool    location = false;
+    char   *state;
+
+    block[n - 1] = '\0';
+    for(char *line = strtok_r(block, "\r\n", &state); line; line = strtok_r(NULL, "\r\n", &state)) {
+        char *value  = strchr(line, ':');
+        char *status = NULL;
+        if(strncmp(line, "HTTP/", 5) == 0) {
+            status = skip_whitespace(skip_nonwhitespace(line));
+        } else if(!value) {
+            continue;
+        }
+
+        if(!status) {
+            *value++ = '\0';
+            value    = skip_whitespace(value);
+            if(strcasecmp(line, "Status") == 0) {
+                status = value;
+            } else if(strcasecmp(line, "Content-Type") == 0) {
+                mimetype = value;
+            } else if(strcasecmp(line, "Content-Length") == 0) {
+                length = strtoll(value, NULL, 10);
+            } else if(strcasecmp(line, "Connection") != 0 && strcasecmp(line, "Transfer-Encoding") != 0 &&
+                      strcasecmp(line, "Keep-Alive") != 0) {
+                Header *header = calloc(1, sizeof(Header));
+                if(header) {
+                    header->name  = line;
+                    header->value = value;
+                    *tail = header;
+                    tail  = &header->next;
+                }
+                location |= strcasecmp(line, "Location") == 0;
+            }
+        }
+
+        if(status && atoi(status) >= 100 && atoi(status) <= 999) {
+            code   = atoi(status);
+            reason = skip_whitespace(skip_nonwhitespace(status));
+        }
+    }
+
+    if(!code) {
+        code   = location ? 302 : 200;
+        reason = location ? "Found" : "OK";
+    }
+    r->responder->start(r, code, reason, mimetype, length < 0 ? -1 : length, headers);
+
+    while(headers) {
+        Header *next = headers->next;
+        free(headers);
+        headers = next;
+    }
+    return length < 0 ? -1 : length;
+}
+
+/* Splice the next piece of request body into the script, closing its stdin
+ * at the end; a script that stops reading gets the rest dropped */
+static Status cgi_feed(Request *r, CgiInput *input) {
+    /* Copies wait until all of a piece is written, so keep them to what a writable pipe takes */
+    size_t  n     = r->tls || r->nbuffer > r->nheader ? PIPE_BUF : SIZE_MAX;
+    ssize_t moved = body_splice(r, input->fd, n);
+    if(moved > 0) {
+        return HTTP_STATUS_OK;
+    }
+
+    if(moved < 0 && errno != EPIPE) {
+        debug("Unable to receive request body: %s", strerror(errno));
+        switch(errno) {
+        case EFBIG:
+            input->status = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+            break;
+        case ETIMEDOUT:
+        case EINTR:
+            input->status = HTTP_STATUS_REQUEST_TIMEOUT;
+            break;
+        default:
+            input->status = HTTP_STATUS_BAD_REQUEST;
+            break;
+        }
+    }
+    close(input->fd);
+    input->fd = -1;
+    return input->status;
+}
+
+/* Find the body after a CGI header block (NULL until the blank line arrives) */
+static char *cgi_body(char *buffer, size_t n) {
+    for(char *nl = memchr(buffer, '\n', n); nl; nl = memchr(nl + 1, '\n', n - (nl + 1 - buffer))) {
+        char *next = nl + 1;
+        if(next < buffer + n && *next == '\r') {
+            next++;
+        }
+        if(next < buffer + n && *next == '\n') {
+            return next + 1;
+        }
+    }
+    return NULL;
+}
+
+/* Copy output read after total bytes into keep while it fits */
+static void cgi_keep(char *keep, size_t total, const char *data, size_t n) {
+    if(keep && total + n <= CACHE_OUTPUT) {
+        memcpy(keep + total, data, n);
+    }
+}
+
+/* Wait for script pipes, failing with ETIME at the script's deadline (0 for none) */
+static int cgi_wait(struct pollfd *fds, nfds_t n, uint64_t deadline) {
+    uint64_t now   = timer_now();
+    int      ready = !deadline ? coroutine_pollv(fds, n, -1) :
+                     now < deadline ? coroutine_pollv(fds, n, deadline - now) : 0;
+    if(ready == 0) {
+        errno = deadline ? ETIME : ETIMEDOUT;
+    }
+    return ready;
+}
+
+/* Read script output, feeding it the request body until some arrives */
+static ssize_t cgi_read(Request *r, int fd, CgiInput *input, char *buffer, size_t n, uint64_t deadline) {
+    struct pollfd fds[2] = {{.fd = fd, .events = POLLIN}, {.fd = -1, .events = POLLOUT}};
+
+    while(input && input->fd >= 0) {
+        fds[1].fd = input->fd;
+        if(cgi_wait(fds, 2, deadline) <= 0) {
+            return -1;
+        }
+        if(fds[0].revents) {
+            break;
+        }
+        if(cgi_feed(r, input) != HTTP_STATUS_OK) {
+            return -1;
+        }
+    }
+    if(deadline && !fds[0].revents && cgi_wait(fds, 1, deadline) <= 0) {
+        return -1;
+    }
+    return coroutine_read(fd, buffer, n);
+}
+
+/* Check whether the script has more output ready */
+static bool cgi_ready(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Order directory entries as alphasort does */
+static int browse_compare(const void *a, const void *b) {
+    return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/* List sorted names in directory fd (like scandir), returning their count */
+static int browse_scan(int fd, char ***entries) {
+    int  dirfd = dup(fd);
+    DIR *dir   = dirfd >= 0 ? fdopendir(dirfd) : NULL;
+    if(!dir) {
+        if(dirfd >= 0) {
+            close(dirfd);
+        }
+        return -1;
+    }
+
+    char  **names = NULL;
+    size_t  n = 0, capacity = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir))) {
+        if(n == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if(!grown) {
+                goto fail;
+            }
+            names = grown;
+        }
+        if(!(names[n] = strdup(entry->d_name))) {
+            goto fail;
+        }
+        n++;
+    }
+    closedir(dir);
+
+    qsort(names, n, sizeof(char *), browse_compare);
+    *entries = names;
+    return n;
+
+fail:
+    while(n > 0) {
+        free(names[--n]);
+    }
+    free(names);
+    closedir(dir);
+    return -1;
+}
+
+/* Check whether the server may execute a file, from its already fetched
+ * status (as access(2) would, without supplementary groups) */
+static bool cgi_executable(const struct stat *s) {
+    if(geteuid() == 0) {
+        return s->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH);
+    }
+    if(s->st_uid == geteuid()) {
+        return s->st_mode & S_IXUSR;
+    }
+    if(s->st_gid == getegid()) {
+        return s->st_mode & S_IXGRP;
+    }
+    return s->st_mode & S_IXOTH;
+}
+
+/* HTTP/1 Responder: headers as text on the socket stream */
+
+static void http1_start(Request *r, int code, const char *reason, const char *mimetype, off_t length, const Header *headers) {
+    /* Without a length, HTTP/1.1 bodies are chunked and HTTP/1.0 bodies end
+     * with the connection */
+    r->chunked = length < 0 && r->version == 1;
+    r->code    = code;
+    r->sent    = length < 0 ? 0 : length;
+    r->unsized = length < 0;
+    if(length < 0 && !r->chunked) {
+        r->keep_alive = false;
+    }
+
+    fprintf(r->file, "HTTP/1.%d %d %s\r\n", r->version, code, reason);
+    fprintf(r->file, "Content-Type: %s\r\n", mimetype);
+    if(length >= 0) {
+        fprintf(r->file, "Content-Length: %lld\r\n", (long long)length);
+    } else if(r->chunked) {
+        fprintf(r->file, "Transfer-Encoding: chunked\r\n");
+    }
+    for(const Header *header = headers; header; header = header->next) {
+        fprintf(r->file, "%s: %s\r\n", header->name, header->value);
+    }
+    fprintf(r->file, "Connection: %s\r\n", r->keep_alive ? "keep-alive" : "close");
+    fprintf(r->file, "\r\n");
+}
+
+static void http1_send(Request *r, const char *data, size_t n) {
+    if(n == 0) {
+        return;
+    }
+    if(r->chunked) {
+        fprintf(r->file, "%zx\r\n", n);
+    }
+    fwrite(data, 1, n, r->file);
+    if(r->unsized) {
+        r->sent += n;
+    }
+    if(r->chunked) {
+        fprintf(r->file, "\r\n");
+    }
     fflush(r->file);
-    return status;
 }
 
+static void http1_finish(Request *r) {
+    if(r->chunked) {
+        fprintf(r->file, "0\r\n\r\n");
+    }
+    fflush(r->file);
+}
+
+const Responder Http1Responder = {
+    .start  = http1_start,
+    .send   = http1_send,
+    .finish = http1_finish,
+};
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
 
@@ -0,0 +1,566 @@
+/* hpack.c: HTTP/2 Header Compression */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/**
+ * HPACK (RFC 7541) as HTTP/2 connections need it: a decoder for request
+ * header blocks, which handles every representation and Huffman coded
+ * strings, and an encoder for response headers, which indexes repeated
+ * headers such as Content-Type and sends strings as plain literals.  Each
+ * direction of a connection has its own dynamic table.
+ **/
+
+/* Static Table (RFC 7541, Appendix A) */
+
+static const char *StaticTable[][2] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+#define STATIC_ENTRIES  (sizeof(StaticTable) / sizeof(StaticTable[0]) - 1)
+#define ENTRY_OVERHEAD  32              /* Bytes counted per entry besides its strings */
+#define TABLE_SLOTS     (HPACK_TABLE_SIZE / ENTRY_OVERHEAD)
+
+/* Huffman Code (RFC 7541, Appendix B)
+ *
+ * The code is canonical, so the code length of each symbol (256 is EOS) is
+ * enough to rebuild it: codes are assigned in order of length, then symbol. */
+
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_EOS     256
+#define HUFFMAN_LONGEST 30
+
+static const uint8_t HuffmanLengths[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static struct {
+    bool     built;
+    uint32_t first[HUFFMAN_LONGEST + 1];    /* First code of each length */
+    uint16_t count[HUFFMAN_LONGEST + 1];    /* Codes of each length */
+    uint16_t offset[HUFFMAN_LONGEST + 1];   /* Index of first code in symbols */
+    uint16_t symbols[HUFFMAN_SYMBOLS];      /* Symbols ordered by code */
+} Huffman;
+
+/* Build canonical decoding tables from the code lengths */
+static void huffman_build(void) {
+    uint32_t code  = 0;
+    uint16_t index = 0;
+
+    for (int length = 1; length <= HUFFMAN_LONGEST; length++) {
+        Huffman.first[length]  = code;
+        Huffman.offset[length] = index;
+        for (int symbol = 0; symbol < HUFFMAN_SYMBOLS; symbol++) {
+            if (HuffmanLengths[symbol] == length) {
+                Huffman.symbols[index++] = symbol;
+                Huffman.count[length]++;
+            }
+        }
+        code = (code + Huffman.count[length]) << 1;
+    }
+    Huffman.built = true;
+}
+
+/**
+ * Decode Huffman coded string.
+ *
+ * @param   s           Coded string.
+ * @param   n           Length of coded string.
+ * @param   out         Buffer for decoded string (at least n * 8 / 5 bytes).
+ * @return  Length of decoded string (or -1 if the coding is invalid).
+ **/
+static ssize_t huffman_decode(const uint8_t *s, size_t n, char *out) {
+    uint32_t code   = 0;
+    int      length = 0;
+    size_t   nout   = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = code << 1 | ((s[i] >> bit) & 1);
+            if (++length > HUFFMAN_LONGEST) {
+                return -1;
+            }
+
+            uint32_t index = code - Huffman.first[length];
+            if (code >= Huffman.first[length] && index < Huffman.count[length]) {
+                uint16_t symbol = Huffman.symbols[Huffman.offset[length] + index];
+                if (symbol == HUFFMAN_EOS) {
+                    return -1;
+                }
+                out[nout++] = symbol;
+                code   = 0;
+                length = 0;
+            }
+        }
+    }
+
+    /* Padding is the most significant bits of EOS (all ones), under a byte */
+    if (length > 7 || code != (1u << length) - 1) {
+        return -1;
+    }
+    return nout;
+}
+
+/* Dynamic Table */
+
+static HpackEntry *table_get(HpackTable *t, size_t index) {
+    return &t->entries[(t->head + t->slots - index) % t->slots];
+}
+
+static void table_evict(HpackTable *t, size_t max) {
+    while (t->count && t->size > max) {
+        HpackEntry *e = table_get(t, t->count - 1);
+        t->size -= e->size;
+        t->count--;
+        free(e->name);
+        e->name = e->value = NULL;
+    }
+}
+
+/* Add entry, evicting old ones to make room (an entry larger than the table
+ * just empties it) */
+static void table_add(HpackTable *t, const char *name, const char *value) {
+    size_t nname  = strlen(name);
+    size_t nvalue = strlen(value);
+    size_t size   = nname + nvalue + ENTRY_OVERHEAD;
+
+    /* Copy first: name may belong to an entry about to be evicted */
+    char *strings = malloc(nname + nvalue + 2);
+    if (!strings) {
+        return;
+    }
+    memcpy(strings, name, nname + 1);
+    memcpy(strings + nname + 1, value, nvalue + 1);
+
+    table_evict(t, size > t->max ? 0 : t->max - size);
+    if (size > t->max) {
+        free(strings);
+        return;
+    }
+
+    t->head = (t->head + 1) % t->slots;
+    HpackEntry *e = &t->entries[t->head];
+    e->name  = strings;
+    e->value = strings + nname + 1;
+    e->size  = size;
+    t->size += size;
+    t->count++;
+}
+
+/* Look up entry by HPACK index (static entries first, then newest dynamic) */
+static bool table_lookup(HpackTable *t, uint32_t index, const char **name, const char **value) {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= STATIC_ENTRIES) {
+        *name  = StaticTable[index][0];
+        *value = StaticTable[index][1];
+        return true;
+    }
+    index -= STATIC_ENTRIES + 1;
+    if (index >= t->count) {
+        return false;
+    }
+    HpackEntry *e = table_get(t, index);
+    *name  = e->name;
+    *value = e->value;
+    return true;
+}
+
+/* Find index of an exact entry (returned) or of an entry with name (*named) */
+static uint32_t table_find(HpackTable *t, const char *name, const char *value, uint32_t *named) {
+    *named = 0;
+    for (uint32_t i = 1; i <= STATIC_ENTRIES; i++) {
+        if (streq(StaticTable[i][0], name)) {
+            if (streq(StaticTable[i][1], value)) {
+                return i;
+            }
+            if (!*named) {
+                *named = i;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < t->count; i++) {
+        HpackEntry *e = table_get(t, i);
+        if (streq(e->name, name)) {
+            if (streq(e->value, value)) {
+                return i + STATIC_ENTRIES + 1;
+            }
+            if (!*named) {
+                *named = i + STATIC_ENTRIES + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Initialize HPACK table at the default size.
+ *
+ * @param   t           HPACK table.
+ **/
+void hpack_init(HpackTable *t) {
+    if (!Huffman.built) {
+        huffman_build();
+    }
+    memset(t, 0, sizeof(HpackTable));
+    t->entries = calloc(TABLE_SLOTS, sizeof(HpackEntry));
+    t->slots   = TABLE_SLOTS;
+    t->max     = HPACK_TABLE_SIZE;
+    t->limit   = HPACK_TABLE_SIZE;
+}
+
+/**
+ * Release HPACK table entries.
+ *
+ * @param   t           HPACK table.
+ **/
+void hpack_free(HpackTable *t) {
+    if (t->entries) {
+        table_evict(t, 0);
+        free(t->entries);
+        t->entries = NULL;
+    }
+}
+
+/**
+ * Apply the peer's SETTINGS_HEADER_TABLE_SIZE to an encoding table.
+ *
+ * @param   t           HPACK table.
+ * @param   limit       Largest table size the peer's decoder allows.
+ *
+ * The encoder never grows past HPACK_TABLE_SIZE; shrinking is announced at
+ * the start of the next header block.
+ **/
+void hpack_limit(HpackTable *t, size_t limit) {
+    t->limit = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+    if (t->limit != t->max) {
+        t->max    = t->limit;
+        t->update = true;
+        table_evict(t, t->max);
+    }
+}
+
+/* Integers (RFC 7541, 5.1) */
+
+static bool decode_integer(const uint8_t **s, const uint8_t *end, int prefix, uint32_t *value) {
+    uint32_t mask = (1u << prefix) - 1;
+
+    if (*s >= end) {
+        return false;
+    }
+    *value = *(*s)++ & mask;
+    if (*value < mask) {
+        return true;
+    }
+
+    for (int shift = 0; *s < end && shift <= 28; shift += 7) {
+        uint8_t byte = *(*s)++;
+        uint64_t next = *value + ((uint64_t)(byte & 0x7f) << shift);
+        if (next > UINT32_MAX) {
+            return false;
+        }
+        *value = next;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t encode_integer(uint8_t *out, size_t n, uint8_t flags, int prefix, uint32_t value) {
+    uint32_t mask = (1u << prefix) - 1;
+    size_t   i    = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+    if (value < mask) {
+        out[i++] = flags | value;
+        return i;
+    }
+
+    out[i++] = flags | mask;
+    for (value -= mask; value >= 0x80; value >>= 7) {
+        if (i == n) {
+            return 0;
+        }
+        out[i++] = (value & 0x7f) | 0x80;
+    }
+    if (i == n) {
+        return 0;
+    }
+    out[i++] = value;
+    return i;
+}
+
+/* Strings (RFC 7541, 5.2) */
+
+static const char *decode_string(const uint8_t **s, const uint8_t *end, char **scratch) {
+    bool     huffman = *s < end && (**s & 0x80);
+    uint32_t length;
+
+    if (!decode_integer(s, end, 7, &length) || length > (size_t)(end - *s)) {
+        return NULL;
+    }
+
+    char *string = *scratch;
+    if (huffman) {
+        ssize_t n = huffman_decode(*s, length, string);
+        if (n < 0) {
+            return NULL;
+        }
+        string[n] = '\0';
+        *scratch += n + 1;
+    } else {
+        memcpy(string, *s, length);
+        string[length] = '\0';
+        *scratch += length + 1;
+    }
+    *s += length;
+    return string;
+}
+
+static size_t encode_string(uint8_t *out, size_t n, const char *s) {
+    size_t length = strlen(s);
+    size_t i      = encode_integer(out, n, 0x00, 7, length);
+    if (i == 0 || n - i < length) {
+        return 0;
+    }
+    memcpy(out + i, s, length);
+    return i + length;
+}
+
+/**
+ * Decode header block.
+ *
+ * @param   t           Decoding HPACK table.
+ * @param   block       Header block.
+ * @param   n           Length of header block.
+ * @param   header      Function called with each header, in order.
+ * @param   arg         Argument passed to header.
+ * @return  0 on success and -1 on a compression error (errno is EPROTO) or a
+ * failure of header (errno is left as it set it).
+ *
+ * Decoding always updates the table, even if the caller discards the headers,
+ * so that the next block still decodes.
+ **/
+int hpack_decode(HpackTable *t, const uint8_t *block, size_t n, int (*header)(void *, const char *, const char *), void *arg) {
+    const uint8_t *s   = block;
+    const uint8_t *end = block + n;
+    bool  leading = true;               /* Size updates must come first */
+    int   status  = -1;
+
+    /* Each header's strings decode into scratch space: Huffman expands them
+     * to at most 8/5 of their coded length, and an indexed name is at most
+     * the size of the table */
+    char *strings = malloc(n * 2 + HPACK_TABLE_SIZE + 2);
+    if (!strings) {
+        return -1;
+    }
+    errno = EPROTO;
+
+    while (s < end) {
+        char       *scratch = strings;
+        const char *name;
+        const char *value;
+        uint32_t    index;
+
+        if (*s & 0x80) {
+            /* Indexed header field */
+            if (!decode_integer(&s, end, 7, &index) || !table_lookup(t, index, &name, &value)) {
+                goto fail;
+            }
+            leading = false;
+        } else if ((*s & 0xe0) == 0x20) {
+            /* Dynamic table size update */
+            if (!leading || !decode_integer(&s, end, 5, &index) || index > t->limit) {
+                goto fail;
+            }
+            t->max = index;
+            table_evict(t, t->max);
+            continue;
+        } else {
+            /* Literal header field with incremental indexing (6-bit prefix),
+             * without indexing or never indexed (4-bit prefix) */
+            bool indexing = (*s & 0xc0) == 0x40;
+            if (!decode_integer(&s, end, indexing ? 6 : 4, &index)) {
+                goto fail;
+            }
+            if (index) {
+                const char *unused;
+                if (!table_lookup(t, index, &name, &unused)) {
+                    goto fail;
+                }
+                /* Adding this header may evict the entry named */
+                name     = strcpy(scratch, name);
+                scratch += strlen(name) + 1;
+            } else if (!(name = decode_string(&s, end, &scratch))) {
+                goto fail;
+            }
+            if (!(value = decode_string(&s, end, &scratch))) {
+                goto fail;
+            }
+            if (indexing) {
+                table_add(t, name, value);
+            }
+            leading = false;
+        }
+
+        if (header(arg, name, value) < 0) {
+            goto fail;
+        }
+    }
+    status = 0;
+
+fail:
+    free(strings);
+    return status;
+}
+
+/* Encode one header field, indexed or literal */
+static size_t encode_field(HpackTable *t, uint8_t *out, size_t n, const char *name, const char *value, bool index) {
+    size_t   used = 0;
+    uint32_t named;
+
+    uint32_t exact = table_find(t, name, value, &named);
+    if (exact) {
+        return encode_integer(out, n, 0x80, 7, exact);
+    }
+
+    size_t i = index ? encode_integer(out, n, 0x40, 6, named)
+                     : encode_integer(out, n, 0x00, 4, named);
+    if (!i) {
+        return 0;
+    }
+    used += i;
+
+    if (!named) {
+        if (!(i = encode_string(out + used, n - used, name))) {
+            return 0;
+        }
+        used += i;
+    }
+    if (!(i = encode_string(out + used, n - used, value))) {
+        return 0;
+    }
+    used += i;
+
+    if (index) {
+        table_add(t, name, value);
+    }
+    return used;
+}
+
+/**
+ * Encode header into a header block.
+ *
+ * @param   t           Encoding HPACK table.
+ * @param   out         Buffer for encoded header.
+ * @param   n           Space left in buffer.
+ * @param   name        Header name (lowercase).
+ * @param   value       Header value.
+ * @param   index       Whether to add the header to the dynamic table.
+ * @return  Bytes of out used (or 0 if it does not fit, leaving the table
+ * as it was).
+ *
+ * A pending table size update is emitted first, so the first header of each
+ * block must be encoded after any hpack_limit.  The update stays pending
+ * until a header carrying it fits, so a header left out of a full block
+ * does not take the update with it.
+ **/
+size_t hpack_encode(HpackTable *t, uint8_t *out, size_t n, const char *name, const char *value, bool index) {
+    size_t used = 0;
+
+    if (t->update && !(used = encode_integer(out, n, 0x20, 5, t->max))) {
+        return 0;
+    }
+
+    size_t i = encode_field(t, out + used, n - used, name, value, index);
+    if (!i) {
+        return 0;
+    }
+    t->update = false;
+    return used + i;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
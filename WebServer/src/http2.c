@@ -0,0 +1,988 @@
+/* http2.c: HTTP/2 Connections */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * A connection that starts with the HTTP/2 preface (prior knowledge), or
+ * whose first request asks to upgrade to h2c, is handed to http2_serve for
+ * its lifetime.  Frames are read as they arrive and every complete stream is
+ * served, oldest first, by the same handlers as HTTP/1 requests: each stream
+ * gets its own Request whose Responder sends HEADERS and DATA frames.  While
+ * a response waits for flow control window the session keeps reading, so new
+ * streams, resets, settings and pings are handled while a large file is being
+ * sent, and a client can keep many requests in flight on one socket.
+ *
+ * Request bodies are not supported, since the handlers read them from the
+ * connection: a stream whose client sends one is answered with 501 Not
+ * Implemented once the body (which is dropped as it arrives) has ended.
+ **/
+
+/* Frames (RFC 7540, Section 6) */
+
+typedef enum {
+    FRAME_DATA = 0,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION,
+} FrameType;
+
+#define FLAG_END_STREAM     0x01
+#define FLAG_ACK            0x01
+#define FLAG_END_HEADERS    0x04
+#define FLAG_PADDED         0x08
+#define FLAG_PRIORITY       0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE      0x1
+#define SETTINGS_ENABLE_PUSH            0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define SETTINGS_MAX_FRAME_SIZE         0x5
+
+#define ERROR_NONE              0x0
+#define ERROR_PROTOCOL          0x1
+#define ERROR_INTERNAL          0x2
+#define ERROR_FLOW_CONTROL      0x3
+#define ERROR_STREAM_CLOSED     0x5
+#define ERROR_FRAME_SIZE        0x6
+#define ERROR_REFUSED_STREAM    0x7
+#define ERROR_COMPRESSION       0x9
+#define ERROR_ENHANCE_YOUR_CALM 0xb
+
+#define FRAME_HEADER        9           /* Bytes before each frame's payload */
+#define FRAME_DEFAULT       16384       /* Largest frame peers accept initially */
+#define WINDOW_MAX          0x7fffffff  /* Largest flow control window */
+#define BLOCK_MAX           (4 * REQUEST_MAX)   /* Largest header block accepted */
+
+typedef struct session Session;
+
+struct http2_stream {
+    uint32_t     id;                    /*< Stream identifier */
+    int64_t      window;                /*< Bytes of DATA that may be sent */
+    size_t       nheaders;              /*< Decoded size of request headers */
+    bool         ready;                 /*< Request complete (END_STREAM received) */
+    bool         refused;               /*< Request carries a body (answered with a 501) */
+    bool         reset;                 /*< Reset by either side */
+    bool         finished;              /*< Response ended */
+    Request     *request;               /*< Request carried by stream */
+    Session     *session;               /*< Connection stream belongs to */
+    Http2Stream *next;                  /*< Next open stream (in order opened) */
+};
+
+struct session {
+    Request     *connection;            /*< Connection request */
+    int          fd;                    /*< Client socket */
+    uint8_t      input[FRAME_HEADER + HTTP2_FRAME_MAX];
+    size_t       ninput;                /*< Bytes received but not processed */
+    bool         preface;               /*< Client preface still expected */
+
+    uint8_t     *block;                 /*< Header block being received */
+    size_t       nblock;                /*< Bytes of header block */
+    size_t       capacity;              /*< Size of block buffer */
+    uint32_t     block_stream;          /*< Stream of header block (0 if none) */
+    bool         block_end;             /*< Header block ends its stream */
+
+    HpackTable   decoder;               /*< Client's header compression */
+    HpackTable   encoder;               /*< Our header compression */
+    int64_t      window;                /*< Connection DATA window */
+    int64_t      initial_window;        /*< Client's initial stream window */
+    uint32_t     max_frame;             /*< Largest frame client accepts */
+
+    Http2Stream *streams;               /*< Open streams, oldest first */
+    Http2Stream *active;                /*< Stream being served */
+    size_t       nstreams;              /*< Number of open streams */
+    uint32_t     last_stream;           /*< Highest stream the client opened */
+
+    bool         goaway;                /*< Client will open no more streams */
+    bool         closing;               /*< Stop serving (error or end of input) */
+    bool         broken;                /*< Socket can no longer be written */
+    uint32_t     error;                 /*< Error code sent with GOAWAY */
+};
+
+static const char SwitchingResponse[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n";
+
+static int session_process(Session *s);
+static int session_receive(Session *s, int timeout);
+
+/* Byte Order */
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Output */
+
+/* Write vector to client completely, or mark the socket broken */
+static int session_write(Session *s, struct iovec *iov, int count) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+
+    while (!s->broken && msg.msg_iovlen > 0) {
+        ssize_t nwritten = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        if (nwritten < 0) {
+            /* Only a coroutine's socket is non-blocking */
+            if (errno == EINTR || (errno == EAGAIN && coroutine_poll(s->fd, POLLOUT, WriteTimeout * 1000) > 0)) {
+                continue;
+            }
+            debug("Unable to write HTTP/2 frame: %s", strerror(errno));
+            s->broken  = true;
+            s->closing = true;
+            break;
+        }
+
+        /* Skip what was written */
+        while (msg.msg_iovlen > 0 && (size_t)nwritten >= msg.msg_iov->iov_len) {
+            nwritten -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + nwritten;
+            msg.msg_iov->iov_len -= nwritten;
+        }
+    }
+    return s->broken ? -1 : 0;
+}
+
+static int session_send(Session *s, FrameType type, uint8_t flags, uint32_t id, const void *payload, size_t n) {
+    uint8_t header[FRAME_HEADER] = { n >> 16, n >> 8, n, type, flags };
+    put32(header + 5, id & WINDOW_MAX);
+
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = FRAME_HEADER },
+        { .iov_base = (void *)payload, .iov_len = n },
+    };
+    return session_write(s, iov, n ? 2 : 1);
+}
+
+static void session_reset(Session *s, uint32_t id, uint32_t code) {
+    uint8_t payload[4];
+    put32(payload, code);
+    session_send(s, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static void session_window(Session *s, uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    session_send(s, FRAME_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/* Stop serving the connection with a connection error */
+static int session_fail(Session *s, uint32_t code) {
+    debug("HTTP/2 connection error %u", code);
+    s->error   = code;
+    s->closing = true;
+    return -1;
+}
+
+/* Streams */
+
+static Http2Stream *stream_find(Session *s, uint32_t id) {
+    for (Http2Stream *st = s->streams; st; st = st->next) {
+        if (st->id == id) {
+            return st;
+        }
+    }
+    return NULL;
+}
+
+/* Allocate stream and the Request it carries */
+static Http2Stream *stream_open(Session *s, uint32_t id) {
+    Http2Stream *st = calloc(1, sizeof(Http2Stream));
+    Request     *r  = calloc(1, sizeof(Request));
+    if (!st || !r) {
+        free(st);
+        free(r);
+        return NULL;
+    }
+
+    r->fd        = -1;                  /* Streams share the connection's socket */
+    r->target    = -1;
+    r->number    = s->connection->number;
+    r->version   = 1;
+    r->responder = &Http2Responder;
+    r->stream    = st;
+    r->peer      = s->connection->peer;
+    r->begun     = trace_clock();
+
+    st->id      = id;
+    st->window  = s->initial_window;
+    st->request = r;
+    st->session = s;
+    return st;
+}
+
+/* Add stream to the end of the open streams */
+static void stream_add(Session *s, Http2Stream *st) {
+    Http2Stream **tail = &s->streams;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = st;
+    s->nstreams++;
+}
+
+/* Remove stream from the open streams and release it */
+static void stream_close(Session *s, Http2Stream *st) {
+    Http2Stream **prev = &s->streams;
+    while (*prev && *prev != st) {
+        prev = &(*prev)->next;
+    }
+    if (*prev) {
+        *prev = st->next;
+        s->nstreams--;
+    }
+    free_request(st->request);
+    free(st);
+}
+
+/* Reset stream on our side, releasing it unless it is being served */
+static void stream_reset(Session *s, Http2Stream *st, uint32_t code) {
+    session_reset(s, st->id, code);
+    st->reset = true;
+    if (st != s->active) {
+        stream_close(s, st);
+    }
+}
+
+/* Record decoded request header in stream's Request */
+static int stream_header(void *arg, const char *name, const char *value) {
+    Http2Stream *st = arg;
+    Request     *r  = st->request;
+
+    /* Headers beyond the limit are decoded (to keep the table in sync) and
+     * dropped; the stream is answered with a 400 */
+    st->nheaders += strlen(name) + strlen(value) + 32;
+    if (st->nheaders > REQUEST_MAX) {
+        return 0;
+    }
+
+    if (name[0] == ':') {
+        if (streq(name, ":method") && !r->method) {
+            r->method = strdup(value);
+        } else if (streq(name, ":path") && !r->uri) {
+            const char *query = strchr(value, '?');
+            r->uri   = query ? strndup(value, query - value) : strdup(value);
+            r->query = strdup(query ? query + 1 : "");
+        } else if (streq(name, ":authority")) {
+            return stream_header(arg, "host", value);
+        }
+        return 0;
+    }
+
+    Header *header = calloc(1, sizeof(Header));
+    if (!header) {
+        return 0;
+    }
+    header->name  = strdup(name);
+    header->value = strdup(value);
+    header->id    = scan_header(name, strlen(name));
+
+    Header **tail = &r->headers;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = header;
+    return 0;
+}
+
+static int stream_ignore(void *arg, const char *name, const char *value) {
+    (void)arg;
+    (void)name;
+    (void)value;
+    return 0;
+}
+
+/* Check request of stream with complete headers */
+static void stream_parsed(Http2Stream *st) {
+    Request *r = st->request;
+
+    if (st->nheaders > REQUEST_MAX || !r->method || !r->uri || r->uri[0] != '/') {
+        debug("Malformed HTTP/2 request on stream %u", st->id);
+        r->route = ROUTE_ERROR;
+        r->error = HTTP_STATUS_BAD_REQUEST;
+    }
+    if (!r->query) {
+        r->query = strdup("");
+    }
+    log("HTTP/2 stream %u: %s %s", st->id, r->method ? r->method : "-", r->uri ? r->uri : "-");
+}
+
+/* Answer a request that carries a body with a 501 */
+static void stream_refuse(Http2Stream *st) {
+    Request *r = st->request;
+
+    debug("Refusing body of HTTP/2 stream %u", st->id);
+    if (r->route != ROUTE_ERROR) {
+        r->route = ROUTE_ERROR;
+        r->error = HTTP_STATUS_NOT_IMPLEMENTED;
+    }
+    st->refused = true;
+}
+
+/* HTTP/2 Responder: HEADERS and DATA frames on the request's stream */
+
+static void stream_start(Request *r, int code, const char *reason, const char *mimetype, off_t length, const Header *headers) {
+    Http2Stream *st = r->stream;
+    Session     *s  = st->session;
+    uint8_t      block[BUFSIZ];
+    size_t       n = 0;
+    char         value[32];
+    char         name[64];
+    (void)reason;
+
+    r->code    = code;
+    r->sent    = length < 0 ? 0 : length;
+    r->unsized = length < 0;
+
+    snprintf(value, sizeof(value), "%d", code);
+    n += hpack_encode(&s->encoder, block + n, sizeof(block) - n, ":status", value, false);
+    n += hpack_encode(&s->encoder, block + n, sizeof(block) - n, "content-type", mimetype, true);
+    if (length >= 0) {
+        snprintf(value, sizeof(value), "%lld", (long long)length);
+        n += hpack_encode(&s->encoder, block + n, sizeof(block) - n, "content-length", value, false);
+    }
+
+    /* HTTP/2 header names are lowercase */
+    for (const Header *header = headers; header; header = header->next) {
+        size_t i;
+        for (i = 0; header->name[i] && i < sizeof(name) - 1; i++) {
+            name[i] = tolower((unsigned char)header->name[i]);
+        }
+        name[i] = '\0';
+        n += hpack_encode(&s->encoder, block + n, sizeof(block) - n, name, header->value, false);
+    }
+
+    /* Sent even on a reset stream, as the client's table now expects it */
+    session_send(s, FRAME_HEADERS, FLAG_END_HEADERS, st->id, block, n);
+}
+
+static void stream_send(Request *r, const char *data, size_t n) {
+    fwrite(data, 1, n, r->file);
+    if (r->unsized) {
+        r->sent += n;
+    }
+    fflush(r->file);
+}
+
+static void stream_finish(Request *r) {
+    Http2Stream *st = r->stream;
+
+    if (fflush(r->file) == 0 && !ferror(r->file) && !st->reset) {
+        session_send(st->session, FRAME_DATA, FLAG_END_STREAM, st->id, NULL, 0);
+        st->finished = true;
+    }
+}
+
+/* Body writes from the handlers become DATA frames as window allows */
+static ssize_t stream_write(void *cookie, const char *buffer, size_t size) {
+    Http2Stream *st = cookie;
+    Session     *s  = st->session;
+    size_t       sent = 0;
+
+    while (sent < size && !st->reset && !s->closing) {
+        int64_t window = st->window < s->window ? st->window : s->window;
+        if (window <= 0) {
+            /* Serve the client's frames until it opens the window */
+            int status = session_receive(s, WriteTimeout * 1000);
+            if (status == 0) {
+                log("HTTP/2 write deadline expired for %s", request_peer(s->connection));
+                stats_add(timeouts_write, 1);
+                s->closing = true;
+            }
+            continue;
+        }
+
+        size_t n = size - sent;
+        if ((int64_t)n > window) {
+            n = window;
+        }
+        if (n > s->max_frame) {
+            n = s->max_frame;
+        }
+        if (session_send(s, FRAME_DATA, 0, st->id, buffer + sent, n) < 0) {
+            break;
+        }
+        st->window -= n;
+        s->window  -= n;
+        sent       += n;
+    }
+
+    if (sent < size) {
+        errno = EPIPE;
+    }
+    return sent;
+}
+
+const Responder Http2Responder = {
+    .start  = stream_start,
+    .send   = stream_send,
+    .finish = stream_finish,
+};
+
+/* Serve one complete stream with the request handlers */
+static void session_serve(Session *s, Http2Stream *st) {
+    Request *r = st->request;
+    char     buffer[HTTP2_FRAME_MAX];
+
+    cookie_io_functions_t io = { .write = stream_write };
+    r->file = fopencookie(st, "w", io);
+    if (!r->file) {
+        debug("Unable to open stream: %s", strerror(errno));
+        stream_reset(s, st, ERROR_INTERNAL);
+        return;
+    }
+    setvbuf(r->file, buffer, _IOFBF, sizeof(buffer));
+
+    s->active = st;
+    handle_request(r);
+    if (!st->finished && !st->reset) {
+        session_reset(s, st->id, ERROR_INTERNAL);
+    }
+    access_record(r);
+    fclose(r->file);
+    r->file   = NULL;
+    s->active = NULL;
+
+    stats_add(requests, 1);
+    stats_add(http2_streams, 1);
+    stream_close(s, st);
+}
+
+/* Input */
+
+static int session_setting(Session *s, uint16_t key, uint32_t value) {
+    switch (key) {
+    case SETTINGS_HEADER_TABLE_SIZE:
+        hpack_limit(&s->encoder, value);
+        break;
+    case SETTINGS_ENABLE_PUSH:
+        if (value > 1) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        break;
+    case SETTINGS_INITIAL_WINDOW_SIZE:
+        if (value > WINDOW_MAX) {
+            return session_fail(s, ERROR_FLOW_CONTROL);
+        }
+        /* Open streams keep what they have used of the old window */
+        for (Http2Stream *st = s->streams; st; st = st->next) {
+            st->window += (int64_t)value - s->initial_window;
+        }
+        s->initial_window = value;
+        break;
+    case SETTINGS_MAX_FRAME_SIZE:
+        if (value < FRAME_DEFAULT || value > 0xffffff) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        s->max_frame = value;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+static int session_settings(Session *s, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i + 6 <= n; i += 6) {
+        if (session_setting(s, p[i] << 8 | p[i + 1], get32(p + i + 2)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Strip padding from frame payload */
+static bool frame_unpad(uint8_t flags, uint8_t **p, size_t *n) {
+    if (!(flags & FLAG_PADDED)) {
+        return true;
+    }
+    if (*n < 1 || (*p)[0] >= *n) {
+        return false;
+    }
+    *n -= 1 + (*p)[0];
+    *p += 1;
+    return true;
+}
+
+/* Handle a complete header block */
+static int session_headers(Session *s) {
+    uint32_t     id = s->block_stream;
+    Http2Stream *st = stream_find(s, id);
+    int          status;
+
+    s->block_stream = 0;
+    if (st || id <= s->last_stream) {
+        /* Trailers (or headers for a finished stream) only matter to the
+         * table */
+        if (hpack_decode(&s->decoder, s->block, s->nblock, stream_ignore, NULL) < 0) {
+            return session_fail(s, ERROR_COMPRESSION);
+        }
+        if (st && s->block_end) {
+            st->ready = true;
+        }
+        return 0;
+    }
+
+    s->last_stream = id;
+    if (s->nstreams >= HTTP2_STREAMS_MAX || !(st = stream_open(s, id))) {
+        status = hpack_decode(&s->decoder, s->block, s->nblock, stream_ignore, NULL);
+        session_reset(s, id, ERROR_REFUSED_STREAM);
+    } else {
+        status = hpack_decode(&s->decoder, s->block, s->nblock, stream_header, st);
+        stream_parsed(st);
+        st->ready = s->block_end;
+        stream_add(s, st);
+    }
+    return status < 0 ? session_fail(s, ERROR_COMPRESSION) : 0;
+}
+
+/* Handle one complete frame */
+static int session_frame(Session *s, FrameType type, uint8_t flags, uint32_t id, uint8_t *p, size_t n) {
+    Http2Stream *st;
+
+    /* A header block must be continued before anything else */
+    if (s->block_stream ? type != FRAME_CONTINUATION || id != s->block_stream : type == FRAME_CONTINUATION) {
+        return session_fail(s, ERROR_PROTOCOL);
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        if (id == 0 || id > s->last_stream) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        /* Request bodies are dropped; give the window straight back (it
+         * counts the padding too) */
+        if (n > 0) {
+            session_window(s, 0, n);
+        }
+        if (!frame_unpad(flags, &p, &n)) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        if ((st = stream_find(s, id))) {
+            if (n > 0 && !st->ready && !st->refused) {
+                stream_refuse(st);
+            }
+            if (st->ready) {
+                stream_reset(s, st, ERROR_STREAM_CLOSED);
+            } else if (flags & FLAG_END_STREAM) {
+                st->ready = true;
+            } else if (n > 0) {
+                session_window(s, id, n);
+            }
+        }
+        break;
+
+    case FRAME_HEADERS:
+        if (id == 0 || id % 2 == 0 || !frame_unpad(flags, &p, &n)) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        if (flags & FLAG_PRIORITY) {
+            if (n < 5) {
+                return session_fail(s, ERROR_FRAME_SIZE);
+            }
+            p += 5;
+            n -= 5;
+        }
+        s->block_stream = id;
+        s->block_end    = flags & FLAG_END_STREAM;
+        s->nblock       = 0;
+        /* Fall through */
+
+    case FRAME_CONTINUATION:
+        if (s->nblock + n > BLOCK_MAX) {
+            return session_fail(s, ERROR_ENHANCE_YOUR_CALM);
+        }
+        if (s->nblock + n > s->capacity) {
+            size_t   capacity = s->capacity ? s->capacity * 2 : REQUEST_CHUNK;
+            while (capacity < s->nblock + n) {
+                capacity *= 2;
+            }
+            uint8_t *block = realloc(s->block, capacity);
+            if (!block) {
+                return session_fail(s, ERROR_INTERNAL);
+            }
+            s->block    = block;
+            s->capacity = capacity;
+        }
+        memcpy(s->block + s->nblock, p, n);
+        s->nblock += n;
+        if (flags & FLAG_END_HEADERS) {
+            return session_headers(s);
+        }
+        break;
+
+    case FRAME_RST_STREAM:
+        if (id == 0 || id > s->last_stream) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        if (n != 4) {
+            return session_fail(s, ERROR_FRAME_SIZE);
+        }
+        if ((st = stream_find(s, id))) {
+            st->reset = true;
+            if (st != s->active) {
+                stream_close(s, st);
+            }
+        }
+        break;
+
+    case FRAME_SETTINGS:
+        if (id != 0) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        if (flags & FLAG_ACK) {
+            return n == 0 ? 0 : session_fail(s, ERROR_FRAME_SIZE);
+        }
+        if (n % 6) {
+            return session_fail(s, ERROR_FRAME_SIZE);
+        }
+        if (session_settings(s, p, n) < 0) {
+            return -1;
+        }
+        session_send(s, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        break;
+
+    case FRAME_PUSH_PROMISE:
+        return session_fail(s, ERROR_PROTOCOL);
+
+    case FRAME_PING:
+        if (id != 0) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        if (n != 8) {
+            return session_fail(s, ERROR_FRAME_SIZE);
+        }
+        if (!(flags & FLAG_ACK)) {
+            session_send(s, FRAME_PING, FLAG_ACK, 0, p, n);
+        }
+        break;
+
+    case FRAME_GOAWAY:
+        if (id != 0) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        s->goaway = true;
+        break;
+
+    case FRAME_WINDOW_UPDATE: {
+        if (n != 4) {
+            return session_fail(s, ERROR_FRAME_SIZE);
+        }
+        uint32_t increment = get32(p) & WINDOW_MAX;
+        if (id == 0) {
+            if (increment == 0 || (s->window += increment) > WINDOW_MAX) {
+                return session_fail(s, increment ? ERROR_FLOW_CONTROL : ERROR_PROTOCOL);
+            }
+        } else if (id > s->last_stream) {
+            return session_fail(s, ERROR_PROTOCOL);
+        } else if ((st = stream_find(s, id))) {
+            if (increment == 0) {
+                stream_reset(s, st, ERROR_PROTOCOL);
+            } else if ((st->window += increment) > WINDOW_MAX) {
+                stream_reset(s, st, ERROR_FLOW_CONTROL);
+            }
+        }
+        break;
+    }
+
+    default:
+        /* PRIORITY is advisory and unknown frames are ignored */
+        break;
+    }
+
+    return s->closing ? -1 : 0;
+}
+
+/* Handle every complete frame that has been received */
+static int session_process(Session *s) {
+    size_t offset = 0;
+    int    status = 0;
+
+    if (s->preface) {
+        size_t n = sizeof(HTTP2_PREFACE) - 1;
+        if (s->ninput < n) {
+            return memcmp(s->input, HTTP2_PREFACE, s->ninput) ? session_fail(s, ERROR_PROTOCOL) : 0;
+        }
+        if (memcmp(s->input, HTTP2_PREFACE, n)) {
+            return session_fail(s, ERROR_PROTOCOL);
+        }
+        s->preface = false;
+        offset     = n;
+    }
+
+    while (status == 0 && s->ninput - offset >= FRAME_HEADER) {
+        uint8_t *frame  = s->input + offset;
+        size_t   length = (size_t)frame[0] << 16 | frame[1] << 8 | frame[2];
+        if (length > HTTP2_FRAME_MAX) {
+            status = session_fail(s, ERROR_FRAME_SIZE);
+            break;
+        }
+        if (s->ninput - offset < FRAME_HEADER + length) {
+            break;
+        }
+
+        offset += FRAME_HEADER + length;
+        status  = session_frame(s, frame[3], frame[4], get32(frame + 5) & WINDOW_MAX, frame + FRAME_HEADER, length);
+    }
+
+    memmove(s->input, s->input + offset, s->ninput - offset);
+    s->ninput -= offset;
+    return status;
+}
+
+/**
+ * Receive and handle frames from client.
+ *
+ * @param   s           HTTP/2 session.
+ * @param   timeout     Milliseconds to wait for input.
+ * @return  1 if input was handled, 0 if none arrived in time, and -1 if the
+ * connection is ending.
+ **/
+static int session_receive(Session *s, int timeout) {
+    int ready = coroutine_poll(s->fd, POLLIN, timeout);
+    if (ready < 0 && errno == EINTR) {
+        return 1;
+    }
+    if (ready <= 0) {
+        return ready;
+    }
+
+    ssize_t nread = recv(s->fd, s->input + s->ninput, sizeof(s->input) - s->ninput, 0);
+    if (nread < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 1;
+    }
+    if (nread <= 0) {
+        debug("HTTP/2 client closed connection");
+        s->closing = true;
+        return -1;
+    }
+    s->ninput += nread;
+    return session_process(s) < 0 ? -1 : 1;
+}
+
+/* Upgrade */
+
+/* Decode base64url HTTP2-Settings header in place, returning its length */
+static size_t base64url_decode(char *s) {
+    static const char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t bits  = 0;
+    int      nbits = 0;
+    size_t   n     = 0;
+
+    for (char *c = s; *c && *c != '='; c++) {
+        const char *p = strchr(Alphabet, *c);
+        if (!p) {
+            return 0;
+        }
+        bits   = bits << 6 | (p - Alphabet);
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            s[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/* Answer the upgrade request and make it stream 1 */
+static int session_upgrade(Session *s, Request *r) {
+    for (Header *header = r->headers; header; header = header->next) {
+        if (header->id == HEADER_HTTP2_SETTINGS) {
+            size_t n = base64url_decode(header->value);
+            if (n % 6 || session_settings(s, (uint8_t *)header->value, n) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    struct iovec iov = { .iov_base = (void *)SwitchingResponse, .iov_len = sizeof(SwitchingResponse) - 1 };
+    if (session_write(s, &iov, 1) < 0) {
+        return -1;
+    }
+
+    Http2Stream *st = stream_open(s, 1);
+    if (!st) {
+        return -1;
+    }
+    st->request->method  = r->method;
+    st->request->uri     = r->uri;
+    st->request->query   = r->query;
+    st->request->headers = r->headers;
+    r->method  = r->uri = r->query = NULL;
+    r->headers = NULL;
+
+    log("HTTP/2 stream 1: %s %s (upgrade)", st->request->method, st->request->uri);
+    st->ready      = true;
+    s->last_stream = 1;
+    stream_add(s, st);
+    return 0;
+}
+
+/**
+ * Check whether request starts an HTTP/2 connection.
+ *
+ * @param   r           Request structure.
+ * @return  Whether the connection should be served with http2_serve.
+ *
+ * Before parsing, this looks for the prior knowledge preface; after parsing,
+ * for an HTTP/1.1 request without a body that asks to upgrade to h2c and
+ * carries its HTTP2-Settings.  HTTPS connections stay on HTTP/1, as h2 over
+ * TLS is not offered.
+ **/
+bool http2_detect(Request *r) {
+    if (r->tls) {
+        return false;
+    }
+    if (!r->method) {
+        return r->nbuffer >= 14 && strncmp(r->buffer, HTTP2_PREFACE, 14) == 0;
+    }
+    if (r->version != 1) {
+        return false;
+    }
+
+    bool upgrade  = false;
+    bool settings = false;
+    for (Header *header = r->headers; header; header = header->next) {
+        switch (header->id) {
+        case HEADER_UPGRADE:
+            upgrade = strcasestr(header->value, "h2c") != NULL;
+            break;
+        case HEADER_HTTP2_SETTINGS:
+            settings = true;
+            break;
+        case HEADER_CONTENT_LENGTH:
+            if (atol(header->value) > 0) {
+                return false;
+            }
+            break;
+        case HEADER_TRANSFER_ENCODING:
+            return false;
+        default:
+            break;
+        }
+    }
+    return upgrade && settings;
+}
+
+/**
+ * Serve HTTP/2 connection until the client is done with it.
+ *
+ * @param   r           Request structure of the connection.
+ * @return  Whether the connection can be kept alive (never).
+ *
+ * The connection ends when the client closes it or sends GOAWAY, when it is
+ * idle for IdleTimeout seconds, or on a connection error, which is reported
+ * with GOAWAY.
+ **/
+bool http2_serve(Request *r) {
+    Session *s = calloc(1, sizeof(Session));
+    if (!s) {
+        debug("Unable to allocate HTTP/2 session: %s", strerror(errno));
+        return false;
+    }
+
+    s->connection     = r;
+    s->fd             = r->fd;
+    s->preface        = true;
+    s->window         = HTTP2_WINDOW;
+    s->initial_window = HTTP2_WINDOW;
+    s->max_frame      = FRAME_DEFAULT;
+    hpack_init(&s->decoder);
+    hpack_init(&s->encoder);
+
+    struct timeval timeout = { .tv_sec = WriteTimeout };
+    setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    stats_add(http2_connections, 1);
+    log("HTTP/2 connection from %s", request_peer(r));
+
+    /* An upgraded request is answered on stream 1; input after its header
+     * block (or the whole buffer with prior knowledge) is HTTP/2 */
+    size_t offset = 0;
+    if (r->method) {
+        if (session_upgrade(s, r) < 0) {
+            goto done;
+        }
+        offset = r->nheader;
+    }
+
+    uint8_t settings[12];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, HTTP2_STREAMS_MAX);
+    settings[6] = 0;
+    settings[7] = SETTINGS_ENABLE_PUSH;
+    put32(settings + 8, 0);
+    session_send(s, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    s->ninput = r->nbuffer - offset;
+    memcpy(s->input, r->buffer + offset, s->ninput);
+    session_process(s);
+
+    while (!s->closing) {
+        Http2Stream *st = s->streams;
+        while (st && (!st->ready || st->reset)) {
+            st = st->next;
+        }
+        if (st) {
+            session_serve(s, st);
+            continue;
+        }
+        if (s->goaway) {
+            break;
+        }
+
+        int status = session_receive(s, IdleTimeout * 1000);
+        if (status == 0) {
+            debug("Idle HTTP/2 connection expired for %s", request_peer(r));
+            stats_add(timeouts_idle, 1);
+            break;
+        }
+    }
+
+    /* Tell the client which streams were processed */
+    uint8_t goaway[8];
+    put32(goaway, s->last_stream);
+    put32(goaway + 4, s->error);
+    session_send(s, FRAME_GOAWAY, 0, 0, goaway, sizeof(goaway));
+
+done:
+    while (s->streams) {
+        stream_close(s, s->streams);
+    }
+    hpack_free(&s->decoder);
+    hpack_free(&s->encoder);
+    free(s->block);
+    free(s);
+    return false;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
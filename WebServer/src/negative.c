@@ -0,0 +1,259 @@
+/* negative.c: Negative Lookup Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Scanners probe for paths that do not exist (/wp-admin, /.env, ...), and
+ * each probe costs a path lookup beneath the root before it becomes a 404.
+ * The event loop remembers the shortest missing prefix of every such URI, so
+ * a probe of /wp-admin/setup.php is answered from the entry for /wp-admin
+ * without touching the filesystem.
+ *
+ * Every directory under RootPath is watched with inotify, and anything
+ * created or moved into one of them empties the cache; pending events are
+ * read before each lookup, so an entry is never used after its path
+ * appeared.  The cache holds at most NegativeEntries paths and is emptied
+ * when full.  Only the process that created it uses it, as forked children
+ * would otherwise consume its events.  An upgrade hands the remembered paths
+ * to the new server, which checks each one again before trusting it.
+ **/
+
+#define NEGATIVE_WATCH  (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+/* Globals */
+
+static char  **Entries   = NULL;        /* Open addressing table of missing URIs */
+static size_t  Capacity  = 0;           /* Slots in table (power of two) */
+static size_t  Count     = 0;           /* Entries in table */
+static int     InotifyFd = -1;
+static pid_t   Owner     = 0;
+
+/* Functions */
+
+/* FNV-1a */
+static uint64_t negative_hash(const char *s, size_t n) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        hash = (hash ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void negative_clear(void) {
+    for (size_t i = 0; i < Capacity; i++) {
+        free(Entries[i]);
+        Entries[i] = NULL;
+    }
+    Count = 0;
+}
+
+static int negative_watch_directory(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_D && inotify_add_watch(InotifyFd, path, NEGATIVE_WATCH) < 0) {
+        debug("Unable to watch %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Watch every directory under RootPath (watching one twice is harmless) */
+static bool negative_watch(void) {
+    return nftw(RootPath, negative_watch_directory, 16, FTW_PHYS) == 0;
+}
+
+/* Disable cache, as changes can no longer be noticed */
+static void negative_disable(void) {
+    negative_clear();
+    free(Entries);
+    Entries  = NULL;
+    Capacity = 0;
+    close(InotifyFd);
+    InotifyFd = -1;
+}
+
+/* Empty cache if anything appeared under RootPath */
+static void negative_poll(void) {
+    char    events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t nread;
+    bool    changed = false;
+    bool    rewatch = false;
+
+    while ((nread = read(InotifyFd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + nread; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            changed  = true;
+            rewatch |= (event->mask & (IN_ISDIR | IN_Q_OVERFLOW)) != 0;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (changed) {
+        debug("Paths appeared under %s; emptying negative cache", RootPath);
+        negative_clear();
+    }
+    if (rewatch && !negative_watch()) {
+        negative_disable();
+    }
+}
+
+/**
+ * Start watching RootPath and enable the negative cache.
+ *
+ * Does nothing if NegativeEntries is 0, and leaves the cache disabled if
+ * RootPath cannot be watched.
+ **/
+void negative_init(void) {
+    if (NegativeEntries <= 0) {
+        return;
+    }
+
+    InotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (InotifyFd < 0) {
+        debug("Unable to initialize inotify: %s", strerror(errno));
+        return;
+    }
+
+    for (Capacity = 16; Capacity < (size_t)NegativeEntries * 2; Capacity *= 2);
+    Entries = calloc(Capacity, sizeof(char *));
+    if (!Entries || !negative_watch()) {
+        negative_disable();
+        return;
+    }
+    Owner = getpid();
+}
+
+/* Find slot holding the first n bytes of uri, or the empty slot ending its probe */
+static size_t negative_slot(const char *uri, size_t n) {
+    size_t i = negative_hash(uri, n) & (Capacity - 1);
+    while (Entries[i] && (strlen(Entries[i]) != n || memcmp(Entries[i], uri, n) != 0)) {
+        i = (i + 1) & (Capacity - 1);
+    }
+    return i;
+}
+
+/**
+ * Check whether URI (or one of its directories) is known to be missing.
+ *
+ * @param   uri         Request URI.
+ * @return  Whether the request can be answered with 404 right away.
+ **/
+bool negative_lookup(const char *uri) {
+    if (!Entries || Owner != getpid()) {
+        return false;
+    }
+
+    negative_poll();
+    if (!Entries || Count == 0) {
+        return false;
+    }
+
+    for (size_t n = 1; ; n++) {
+        if ((uri[n] == '/' || uri[n] == '\0') && Entries[negative_slot(uri, n)]) {
+            stats_add(negative_hits, 1);
+            return true;
+        }
+        if (uri[n] == '\0') {
+            return false;
+        }
+    }
+}
+
+/* Store the shortest missing prefix of uri */
+static void negative_remember(const char *uri) {
+    char path[BUFSIZ];
+    struct stat st;
+
+    if (!Entries || Owner != getpid() || uri[0] != '/') {
+        return;
+    }
+
+    if (strlen(uri) >= sizeof(path)) {
+        return;
+    }
+    strcpy(path, uri);
+
+    for (size_t n = 1, start = 1; ; n++) {
+        if (uri[n] != '/' && uri[n] != '\0') {
+            continue;
+        }
+
+        /* Only remember plain prefixes ("//", "." and ".." name nothing new) */
+        size_t length = n - start;
+        if (length == 0 || (uri[start] == '.' && (length == 1 || (length == 2 && uri[start + 1] == '.')))) {
+            return;
+        }
+        start = n + 1;
+
+        path[n] = '\0';
+        int missing = fstatat(RootFd, path + 1, &st, AT_SYMLINK_NOFOLLOW) < 0 && (errno == ENOENT || errno == ENOTDIR);
+        path[n] = uri[n];
+
+        if (missing) {
+            if (Count >= (size_t)NegativeEntries) {
+                negative_clear();
+            }
+            size_t i = negative_slot(uri, n);
+            if (!Entries[i] && (Entries[i] = strndup(uri, n))) {
+                Count++;
+            }
+            return;
+        }
+        if (uri[n] == '\0') {
+            return;
+        }
+    }
+}
+
+/**
+ * Remember that URI was not found.
+ *
+ * @param   uri         Request URI whose path does not exist.
+ *
+ * The shortest prefix of the URI that is missing is stored, so every path
+ * below it is known to be missing as well.
+ **/
+void negative_insert(const char *uri) {
+    stats_add(negative_misses, 1);
+    negative_remember(uri);
+}
+
+/**
+ * Write every remembered path as a "missing" line (for an upgrade).
+ *
+ * @param   stream      Stream to write to.
+ **/
+void negative_save(FILE *stream) {
+    if (!Entries || Owner != getpid()) {
+        return;
+    }
+
+    negative_poll();
+    for (size_t i = 0; Entries && i < Capacity; i++) {
+        if (Entries[i] && !strchr(Entries[i], '\n')) {
+            fprintf(stream, "missing %s\n", Entries[i]);
+        }
+    }
+}
+
+/**
+ * Remember a path saved by negative_save, if it is still missing.
+ *
+ * @param   uri         Path to remember.
+ **/
+void negative_restore(const char *uri) {
+    negative_remember(uri);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,393 @@
+/* plugin.c: In-process Handler Plugins */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+#include "spidey_plugin.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+/**
+ * Plugins answer their URI prefixes in the serving process instead of a
+ * forked CGI script, so a dynamic response costs a function call.  The route
+ * table is sorted longest prefix first and consulted by route_request before
+ * the filesystem; a prefix matches its own URI and everything beneath it.
+ *
+ * A plugin runs on the thread serving the request, which in the single and
+ * cooperative modes is the event loop's, so every call is watched: a POSIX
+ * timer fires after PLUGIN_BUDGET milliseconds (and every second after that)
+ * while the call is still running and logs the plugin and URI.  The timer
+ * notifies a thread of its own, so the plugin is never interrupted.  Calls
+ * that end late are logged again and counted in plugin_overruns.
+ *
+ * A call on a coroutine gives up the thread while it waits for its request
+ * body, and other requests (and their plugin calls) run meanwhile.  Each call
+ * therefore keeps its own budget: it takes the watchdog whenever it gets the
+ * thread back, and only the time it held the thread counts against it.
+ **/
+
+#define PLUGIN_MAX      16              /* Plugins loaded at once */
+#define PLUGIN_BUDGET   10              /* Milliseconds a call may run before it is reported */
+#define PLUGIN_REPEAT   1000            /* Milliseconds between reports of a stuck call */
+
+struct plugin {
+    char               *prefix;         /* URI prefix served */
+    size_t              length;         /* Length of prefix */
+    char               *path;           /* Shared object */
+    char               *argument;       /* Passed to init (NULL if none) */
+    void               *object;         /* dlopen handle */
+    const SpideyPlugin *entry;          /* Exported entry points */
+};
+
+typedef struct {
+    SpideyRequest   public;             /* View handed to the plugin */
+    const Plugin   *plugin;             /* Plugin called */
+    bool            watched;            /* Whether the watchdog reports the call */
+    uint64_t        started;            /* When the call last got the thread (ms) */
+    uint64_t        running;            /* Milliseconds it held the thread before that */
+} Call;
+
+typedef struct {
+    SpideyResponse  public;             /* Builder handed to the plugin */
+    int             code;
+    char            reason[64];
+    char           *mimetype;
+    Header         *headers;
+    Header        **tail;
+    FILE           *body;
+    char           *data;
+    size_t          size;
+} Response;
+
+/* Globals */
+
+static Plugin   Plugins[PLUGIN_MAX];
+static size_t   NPlugins = 0;
+
+static timer_t  Watchdog;
+static pid_t    WatchdogPid = 0;        /* Process the watchdog belongs to */
+static char     Overrun[512];           /* Report logged by the watchdog */
+
+/* Functions */
+
+/* Report the call still running (on the timer's thread) */
+static void plugin_watchdog(union sigval value) {
+    (void)value;
+    fputs(Overrun, stderr);
+}
+
+/* Create the watchdog timer in this process (timers are not inherited by fork) */
+static bool plugin_watch(void) {
+    if (WatchdogPid == getpid()) {
+        return true;
+    }
+
+    struct sigevent event = {
+        .sigev_notify          = SIGEV_THREAD,
+        .sigev_notify_function = plugin_watchdog,
+    };
+    if (timer_create(CLOCK_MONOTONIC, &event, &Watchdog) < 0) {
+        debug("Unable to create plugin watchdog: %s", strerror(errno));
+        return false;
+    }
+    WatchdogPid = getpid();
+    return true;
+}
+
+/* Arm (or with 0, disarm) the watchdog */
+static void plugin_arm(int budget) {
+    struct itimerspec spec = {
+        .it_value    = { budget / 1000, budget % 1000 * 1000000L },
+        .it_interval = { budget ? PLUGIN_REPEAT / 1000 : 0, 0 },
+    };
+    timer_settime(Watchdog, 0, &spec, NULL);
+}
+
+/* Give a call the thread, pointing the watchdog at what is left of its budget */
+static void plugin_resume(Call *call) {
+    const Request *r = call->public.server;
+
+    call->started = timer_now();
+    if (call->watched) {
+        snprintf(Overrun, sizeof(Overrun), "[%5d] LOG   %10s:%-4d Plugin %s still running on %s\n",
+            getpid(), __FILE__, __LINE__, call->plugin->entry->name, r->uri);
+        plugin_arm(call->running < PLUGIN_BUDGET ? PLUGIN_BUDGET - (int)call->running : PLUGIN_REPEAT);
+    }
+}
+
+/* Take the thread from a call, counting the time it held it */
+static void plugin_suspend(Call *call) {
+    call->running += timer_now() - call->started;
+    if (call->watched) {
+        plugin_arm(0);
+    }
+}
+
+/* Longest prefixes first */
+static int plugin_compare(const void *a, const void *b) {
+    const Plugin *pa = a;
+    const Plugin *pb = b;
+    return (pb->length > pa->length) - (pb->length < pa->length);
+}
+
+/* Request view: header lookup */
+static const char *plugin_header(const SpideyRequest *request, const char *name) {
+    const Request *r = request->server;
+    for (const Header *header = r->headers; header; header = header->next) {
+        if (strcasecmp(header->name, name) == 0) {
+            return header->value;
+        }
+    }
+    return NULL;
+}
+
+/* Request view: body (a coroutine waiting for it gives up the thread) */
+static ssize_t plugin_read(const SpideyRequest *request, void *buffer, size_t n) {
+    Call *call = (Call *)request;
+    if (!coroutine_active()) {
+        return body_read(call->public.server, buffer, n);
+    }
+
+    plugin_suspend(call);
+    ssize_t nread = body_read(call->public.server, buffer, n);
+    plugin_resume(call);
+    return nread;
+}
+
+/* Response builder: status line */
+static void plugin_status(SpideyResponse *response, int code, const char *reason) {
+    Response *p = (Response *)response;
+    p->code = code;
+    snprintf(p->reason, sizeof(p->reason), "%s", reason ? reason : "");
+}
+
+/* Response builder: headers */
+static void plugin_add_header(SpideyResponse *response, const char *name, const char *value) {
+    Response *p = (Response *)response;
+    if (strcasecmp(name, "Content-Type") == 0) {
+        free(p->mimetype);
+        p->mimetype = strdup(value);
+        return;
+    }
+
+    Header *header = calloc(1, sizeof(Header));
+    if (!header) {
+        return;
+    }
+    header->name  = strdup(name);
+    header->value = strdup(value);
+    *p->tail = header;
+    p->tail  = &header->next;
+}
+
+/* Response builder: body */
+static void plugin_write(SpideyResponse *response, const void *data, size_t n) {
+    Response *p = (Response *)response;
+    fwrite(data, 1, n, p->body);
+}
+
+/* Response builder: formatted body */
+static void plugin_printf(SpideyResponse *response, const char *format, ...) {
+    Response *p = (Response *)response;
+    va_list args;
+    va_start(args, format);
+    vfprintf(p->body, format, args);
+    va_end(args);
+}
+
+/* Release the response built by a plugin */
+static void plugin_release(Response *p) {
+    if (p->body) {
+        fclose(p->body);
+    }
+    free(p->data);
+    free(p->mimetype);
+    for (Header *header = p->headers, *next; header; header = next) {
+        next = header->next;
+        free(header->name);
+        free(header->value);
+        free(header);
+    }
+}
+
+/**
+ * Add a plugin to the route table.
+ *
+ * @param   spec        prefix=path.so[:argument]
+ * @return  0 on success, -1 if spec is malformed or the table is full.
+ **/
+int plugin_add(char *spec) {
+    char *equals = strchr(spec, '=');
+    if (!equals || equals == spec || spec[0] != '/' || NPlugins == PLUGIN_MAX) {
+        return -1;
+    }
+    *equals = '\0';
+
+    Plugin *plugin   = &Plugins[NPlugins++];
+    plugin->prefix   = spec;
+    plugin->length   = strlen(spec);
+    plugin->path     = equals + 1;
+    plugin->argument = strchr(plugin->path, ':');
+    if (plugin->argument) {
+        *plugin->argument++ = '\0';
+    }
+    return 0;
+}
+
+/**
+ * Load and initialize every plugin.
+ *
+ * @return  0 on success, -1 if any plugin cannot be loaded or refuses to start.
+ **/
+int plugin_init(void) {
+    if (NPlugins == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < NPlugins; i++) {
+        Plugin *plugin = &Plugins[i];
+
+        plugin->object = dlopen(plugin->path, RTLD_NOW | RTLD_LOCAL);
+        if (!plugin->object) {
+            log("Unable to load plugin: %s", dlerror());
+            return -1;
+        }
+        plugin->entry = dlsym(plugin->object, "spidey_plugin");
+        if (!plugin->entry) {
+            log("Plugin %s does not export spidey_plugin", plugin->path);
+            return -1;
+        }
+        if (plugin->entry->abi < 1 || plugin->entry->abi > SPIDEY_PLUGIN_ABI || !plugin->entry->handle) {
+            log("Plugin %s needs ABI %d (server has %d)", plugin->path, plugin->entry->abi, SPIDEY_PLUGIN_ABI);
+            return -1;
+        }
+        if (plugin->entry->init && plugin->entry->init(plugin->argument) < 0) {
+            log("Plugin %s failed to initialize", plugin->path);
+            return -1;
+        }
+        log("Serving %s with plugin %s", plugin->prefix, plugin->entry->name);
+    }
+    qsort(Plugins, NPlugins, sizeof(Plugin), plugin_compare);
+    return 0;
+}
+
+/**
+ * Shut down and unload every plugin.
+ **/
+void plugin_shutdown(void) {
+    for (size_t i = 0; i < NPlugins; i++) {
+        Plugin *plugin = &Plugins[i];
+        if (plugin->entry && plugin->entry->shutdown) {
+            plugin->entry->shutdown();
+        }
+        if (plugin->object) {
+            dlclose(plugin->object);
+        }
+        plugin->entry  = NULL;
+        plugin->object = NULL;
+    }
+    NPlugins = 0;
+}
+
+/**
+ * Find the plugin serving a request.
+ *
+ * @param   r           Request structure.
+ * @return  Whether a plugin serves the request (stored in r->plugin).
+ **/
+bool plugin_route(Request *r) {
+    for (size_t i = 0; i < NPlugins; i++) {
+        Plugin *plugin = &Plugins[i];
+        if (strncmp(r->uri, plugin->prefix, plugin->length) == 0) {
+            char next = r->uri[plugin->length];
+            if (next == '\0' || next == '/' || plugin->prefix[plugin->length - 1] == '/') {
+                r->plugin = plugin;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Handle a request with its plugin.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the plugin request.
+ *
+ * The plugin builds its response in memory, which is then sent with a
+ * Content-Length.  If the plugin fails, nothing is sent and
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR is returned for the caller's error page.
+ **/
+Status plugin_handle(Request *r) {
+    Plugin *plugin = r->plugin;
+    char    host[INET6_ADDRSTRLEN];
+
+    Call call = {
+        .public = {
+            .method  = r->method,
+            .uri     = r->uri,
+            .query   = r->query,
+            .path    = r->uri + plugin->length,
+            .peer    = request_host(r, host),
+            .version = r->stream ? 20 : 10 + r->version,
+            .header  = plugin_header,
+            .read    = plugin_read,
+            .server  = r,
+        },
+        .plugin = plugin,
+    };
+    Response response = {
+        .public = {
+            .status = plugin_status,
+            .header = plugin_add_header,
+            .write  = plugin_write,
+            .printf = plugin_printf,
+        },
+        .code   = 200,
+        .reason = "OK",
+    };
+    response.public.server = &response;
+    response.tail = &response.headers;
+    response.body = open_memstream(&response.data, &response.size);
+    if (!response.body) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Call the plugin under the watchdog */
+    call.watched = plugin_watch();
+    plugin_resume(&call);
+    int result = plugin->entry->handle(&call.public, &response.public);
+    plugin_suspend(&call);
+    trace(r, body);
+
+    if (call.running > PLUGIN_BUDGET) {
+        log("Plugin %s took %lu ms on %s", plugin->entry->name, (unsigned long)call.running, r->uri);
+        stats_add(plugin_overruns, 1);
+    }
+
+    fflush(response.body);
+    if (result < 0) {
+        debug("Plugin %s failed on %s", plugin->entry->name, r->uri);
+        plugin_release(&response);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Send the response */
+    r->responder->start(r, response.code, response.reason,
+        response.mimetype ? response.mimetype : "text/plain", response.size, response.headers);
+    fwrite(response.data, 1, response.size, r->file);
+    r->responder->finish(r);
+    plugin_release(&response);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,57 @@
+/* plugin_hello.c: Sample handler plugin */
+
+#include "spidey_plugin.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Greets whatever follows its prefix, and reports the size of any request
+ * body it is sent:
+ *
+ *  bin/spidey -P /hello=lib/plugin_hello.so:Howdy
+ *  curl localhost:9898/hello/world         # Howdy, world!
+ **/
+
+/* Globals */
+
+static char Greeting[64] = "Hello";
+
+/* Functions */
+
+static int hello_init(const char *argument) {
+    if (argument) {
+        snprintf(Greeting, sizeof(Greeting), "%s", argument);
+    }
+    return 0;
+}
+
+static int hello_handle(const SpideyRequest *request, SpideyResponse *response) {
+    const char *name = request->path[0] == '/' ? request->path + 1 : request->path;
+
+    response->header(response, "Cache-Control", "no-store");
+    response->printf(response, "%s, %s!\n", Greeting, name[0] ? name : "world");
+
+    char    buffer[BUFSIZ];
+    ssize_t nread;
+    long    total = 0;
+    while ((nread = request->read(request, buffer, sizeof(buffer))) > 0) {
+        total += nread;
+    }
+    if (nread < 0) {
+        return -1;
+    }
+    if (total > 0) {
+        response->printf(response, "You sent %ld bytes.\n", total);
+    }
+    return 0;
+}
+
+const SpideyPlugin spidey_plugin = {
+    .abi    = SPIDEY_PLUGIN_ABI,
+    .name   = "hello",
+    .init   = hello_init,
+    .handle = hello_handle,
+};
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,984 @@
+/* proxy.c: Reverse Proxy */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * A URI prefix can be passed on to one or more upstream HTTP/1.1 servers,
+ * reached over TCP (host:port) or a Unix socket (unix:path).  The route table
+ * is consulted by route_request right after the plugins', longest prefix
+ * first, and the request goes out with its URI unchanged.
+ *
+ * Each request goes to the upstream with the fewest requests outstanding,
+ * counted across every process, on a connection left open by an earlier
+ * request when one is idle, so a proxied request usually costs a write and a
+ * read on a warm socket instead of a connect.  Idle connections are pooled
+ * per upstream (PROXY_IDLE at most) in the process that used them; one the
+ * upstream closed meanwhile is noticed before it is reused, and a request
+ * without a body that still finds its pooled connection closed is retried
+ * once on a new one.  In forking mode every request has a process of its
+ * own, so its connection ends with it.
+ *
+ * Bodies stream in both directions without being held: the request body is
+ * spliced from the client into a pipe and on to the upstream, and the
+ * response body from the upstream into a pipe and on to a plain HTTP client,
+ * so neither passes through user memory.  Chunked bodies are framed again on
+ * the way, reading only the framing lines.  Responses to HTTPS and HTTP/2
+ * clients are copied through the responder instead.
+ *
+ * The event loop checks every upstream each PROXY_CHECK milliseconds by
+ * connecting to it without waiting: one that refused, or had not accepted by
+ * the next check, is marked down, as is one a request fails to connect to.
+ * Requests skip upstreams that are down (moving on to the next least loaded
+ * one if a connect fails) until a check succeeds again; with every upstream
+ * down, each is still tried in turn.
+ **/
+
+#define PROXY_MAX       16              /* URI prefixes proxied */
+#define PROXY_UPSTREAMS 8               /* Upstreams per prefix */
+#define PROXY_IDLE      32              /* Idle connections pooled per upstream */
+#define PROXY_PIPES     16              /* Empty pipes kept for splicing */
+#define PROXY_SPLICE    (1 << 16)       /* Largest piece spliced at once (fits an empty pipe) */
+#define PROXY_CHECK     1000            /* Milliseconds between health checks */
+
+typedef struct {
+    unsigned long   outstanding;        /* Requests in flight (every process) */
+    bool            down;               /* Whether the upstream failed its last check */
+} UpstreamState;
+
+typedef struct {
+    char           *name;               /* As configured */
+    struct sockaddr_storage address;
+    socklen_t       length;
+    UpstreamState  *state;              /* Shared with every process */
+    int             idle[PROXY_IDLE];   /* Pooled connections, most recent last */
+    size_t          nidle;
+    int             probe;              /* Health check connecting (-1 if none) */
+} Upstream;
+
+struct proxy {
+    char           *prefix;             /* URI prefix served */
+    size_t          length;             /* Length of prefix */
+    Upstream        upstreams[PROXY_UPSTREAMS];
+    size_t          nupstreams;
+};
+
+typedef struct {
+    int             fd;                 /* Upstream connection (-1 if none) */
+    bool            tcp;                /* Whether the connection is TCP */
+    char            buffer[BUFSIZ];     /* Response read so far (header block and framing) */
+    size_t          start;              /* First byte not yet consumed */
+    size_t          end;                /* End of bytes read */
+} Connection;
+
+/* Globals */
+
+static Proxy    Proxies[PROXY_MAX];
+static size_t   NProxies = 0;
+
+static int      Pipes[PROXY_PIPES][2];  /* Empty pipes for the next requests */
+static size_t   NPipes   = 0;
+static uint64_t Checked  = 0;           /* Time of last health check */
+static unsigned Turn     = 0;           /* Rotates ties between upstreams */
+
+/* Functions */
+
+/* Longest prefixes first */
+static int proxy_compare(const void *a, const void *b) {
+    const Proxy *pa = a;
+    const Proxy *pb = b;
+    return (pb->length > pa->length) - (pb->length < pa->length);
+}
+
+/* Resolve an upstream given as host:port, [host]:port, or unix:path */
+static int proxy_resolve(Upstream *u, char *spec) {
+    u->name  = spec;
+    u->probe = -1;
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *address = (struct sockaddr_un *)&u->address;
+        if (!spec[5] || strlen(spec + 5) >= sizeof(address->sun_path)) {
+            return -1;
+        }
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, spec + 5);
+        u->length = sizeof(*address);
+        return 0;
+    }
+
+    char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || !colon[1]) {
+        return -1;
+    }
+    const char *host  = spec;
+    int         nhost = colon - spec;
+    if (spec[0] == '[' && colon[-1] == ']') {
+        host++;
+        nhost -= 2;
+    }
+
+    char             name[NI_MAXHOST];
+    struct addrinfo *results;
+    struct addrinfo  hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    snprintf(name, sizeof(name), "%.*s", nhost, host);
+    int status = getaddrinfo(name, colon + 1, &hints, &results);
+    if (status != 0) {
+        log("Unable to resolve upstream %s: %s", spec, gai_strerror(status));
+        return -1;
+    }
+    memcpy(&u->address, results->ai_addr, results->ai_addrlen);
+    u->length = results->ai_addrlen;
+    freeaddrinfo(results);
+    return 0;
+}
+
+/* Start connecting to an upstream, returning the socket (with *pending set
+ * while the connect is in progress) or -1 */
+static int proxy_open(Upstream *u, bool *pending) {
+    int fd = socket(u->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (u->address.ss_family != AF_UNIX) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    *pending = false;
+    if (connect(fd, (struct sockaddr *)&u->address, u->length) < 0) {
+        if (errno != EINPROGRESS) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        *pending = true;
+    }
+    return fd;
+}
+
+/* Mark an upstream up (error 0) or down, logging changes */
+static void proxy_mark(Upstream *u, int error) {
+    bool down = error != 0;
+    if (__atomic_exchange_n(&u->state->down, down, __ATOMIC_RELAXED) == down) {
+        return;
+    }
+    if (down) {
+        log("Upstream %s is down: %s", u->name, strerror(error));
+    } else {
+        log("Upstream %s is up", u->name);
+    }
+}
+
+/* Open a new connection to an upstream, waiting for it to be accepted */
+static int proxy_connect(Upstream *u) {
+    bool pending;
+    int  fd = proxy_open(u, &pending);
+    if (fd < 0 || !pending) {
+        return fd;
+    }
+
+    int       error  = 0;
+    socklen_t length = sizeof(error);
+    int       ready  = coroutine_poll(fd, POLLOUT, -1);
+    if (ready <= 0) {
+        error = ready == 0 ? ETIMEDOUT : errno;
+    } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+        error = errno;
+    }
+    if (error) {
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/* Take an idle connection to an upstream, dropping any it has closed */
+static int proxy_idle(Upstream *u) {
+    while (u->nidle > 0) {
+        int           fd  = u->idle[--u->nidle];
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 0) {
+            return fd;
+        }
+        /* Readable while idle means closed (or sending what nobody asked for) */
+        close(fd);
+    }
+    return -1;
+}
+
+/* Keep a connection for the upstream's next request */
+static void proxy_release(Upstream *u, int fd) {
+    if (u->nidle < PROXY_IDLE) {
+        u->idle[u->nidle++] = fd;
+    } else {
+        close(fd);
+    }
+}
+
+/* Choose the least loaded upstream not yet tried, preferring those up */
+static Upstream *proxy_pick(Proxy *p, unsigned tried) {
+    Upstream     *best  = NULL;
+    bool          up    = false;
+    unsigned long least = 0;
+    size_t        first = Turn++ % p->nupstreams;
+
+    for (size_t i = 0; i < p->nupstreams; i++) {
+        size_t    index = (first + i) % p->nupstreams;
+        Upstream *u     = &p->upstreams[index];
+        if (tried & (1u << index)) {
+            continue;
+        }
+        bool          healthy     = !__atomic_load_n(&u->state->down, __ATOMIC_RELAXED);
+        unsigned long outstanding = __atomic_load_n(&u->state->outstanding, __ATOMIC_RELAXED);
+        if (!best || (healthy && !up) || (healthy == up && outstanding < least)) {
+            best  = u;
+            up    = healthy;
+            least = outstanding;
+        }
+    }
+    return best;
+}
+
+/* Take an empty pipe for splicing */
+static int proxy_pipe(int fds[2]) {
+    if (NPipes > 0) {
+        NPipes--;
+        fds[0] = Pipes[NPipes][0];
+        fds[1] = Pipes[NPipes][1];
+        return 0;
+    }
+    return pipe2(fds, O_NONBLOCK | O_CLOEXEC);
+}
+
+/* Keep a pipe for a later request if it is empty, otherwise close it */
+static void proxy_unpipe(int fds[2], bool empty) {
+    if (fds[0] < 0) {
+        return;
+    }
+    if (empty && NPipes < PROXY_PIPES) {
+        Pipes[NPipes][0] = fds[0];
+        Pipes[NPipes][1] = fds[1];
+        NPipes++;
+    } else {
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+
+/* Whether a header only concerns one connection (and is not passed on) */
+static bool proxy_hop(const char *name) {
+    static const char *Hops[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+        "Transfer-Encoding", "Upgrade", "Content-Length", "Expect", "HTTP2-Settings",
+    };
+    for (size_t i = 0; i < sizeof(Hops) / sizeof(Hops[0]); i++) {
+        if (strcasecmp(name, Hops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Format the request line and headers for the upstream */
+static char *proxy_head(Request *r, Upstream *u, bool chunked, size_t *size) {
+    char        host[INET6_ADDRSTRLEN];
+    char       *head      = NULL;
+    const char *forwarded = NULL;
+    bool        hosted    = false;
+    FILE       *stream    = open_memstream(&head, size);
+    if (!stream) {
+        return NULL;
+    }
+
+    fprintf(stream, "%s %s%s%s HTTP/1.1\r\n", r->method, r->uri, *r->query ? "?" : "", r->query);
+    for (const Header *header = r->headers; header; header = header->next) {
+        if (header->id == HEADER_X_FORWARDED_FOR) {
+            forwarded = header->value;
+            continue;
+        }
+        if (proxy_hop(header->name)) {
+            continue;
+        }
+        hosted |= header->id == HEADER_HOST;
+        fprintf(stream, "%s: %s\r\n", header->name, header->value);
+    }
+    if (!hosted) {
+        fprintf(stream, "Host: %s\r\n", u->address.ss_family == AF_UNIX ? "localhost" : u->name);
+    }
+    fprintf(stream, "X-Forwarded-For: %s%s%s\r\n", forwarded ? forwarded : "", forwarded ? ", " : "", request_host(r, host));
+    fprintf(stream, "X-Forwarded-Proto: %s\r\n", r->tls ? "https" : "http");
+    if (r->length >= 0) {
+        fprintf(stream, "Content-Length: %lld\r\n", (long long)r->length);
+    } else if (chunked) {
+        fprintf(stream, "Transfer-Encoding: chunked\r\n");
+    }
+    fprintf(stream, "\r\n");
+
+    if (fclose(stream) != 0) {
+        free(head);
+        return NULL;
+    }
+    return head;
+}
+
+/* Send all of a buffer to the upstream */
+static int proxy_send(int fd, const char *data, size_t n, int flags) {
+    while (n > 0) {
+        ssize_t nsent = send(fd, data, n, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nsent < 0) {
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            int ready = coroutine_poll(fd, POLLOUT, -1);
+            if (ready <= 0) {
+                if (ready == 0) {
+                    errno = ETIMEDOUT;
+                }
+                return -1;
+            }
+            continue;
+        }
+        data += nsent;
+        n    -= nsent;
+    }
+    return 0;
+}
+
+/* Splice from a socket into an empty pipe, returning bytes moved (0 at end
+ * of file, -1 on error) */
+static ssize_t proxy_fill(int from, int pipe, size_t n) {
+    for (;;) {
+        ssize_t moved = splice(from, NULL, pipe, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved >= 0 || errno != EAGAIN) {
+            return moved;
+        }
+        int ready = coroutine_poll(from, POLLIN, -1);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+    }
+}
+
+/* Splice n bytes out of a pipe into a socket */
+static int proxy_drain(int pipe, int to, size_t n) {
+    while (n > 0) {
+        ssize_t moved = splice(pipe, NULL, to, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            n -= moved;
+            continue;
+        }
+        if (moved == 0 || errno != EAGAIN) {
+            return -1;
+        }
+        /* The pipe holds the bytes, so the socket is full */
+        int ready = coroutine_poll(to, POLLOUT, -1);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Stream the request body to the upstream, framing a chunked one again */
+static Status proxy_feed(Request *r, int fd, int pipe[2], bool chunked) {
+    char    line[32];
+    ssize_t moved;
+
+    while ((moved = body_splice(r, pipe[1], PROXY_SPLICE)) > 0) {
+        int n = chunked ? snprintf(line, sizeof(line), "%zx\r\n", (size_t)moved) : 0;
+        if (proxy_send(fd, line, n, MSG_MORE) < 0 || proxy_drain(pipe[0], fd, moved) < 0 ||
+            (chunked && proxy_send(fd, "\r\n", 2, MSG_MORE) < 0)) {
+            debug("Unable to send request body upstream: %s", strerror(errno));
+            return HTTP_STATUS_BAD_GATEWAY;
+        }
+    }
+    if (moved < 0) {
+        debug("Unable to receive request body: %s", strerror(errno));
+        switch (errno) {
+        case EFBIG:
+            return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+        case ETIMEDOUT:
+        case EINTR:
+            return HTTP_STATUS_REQUEST_TIMEOUT;
+        default:
+            return HTTP_STATUS_BAD_REQUEST;
+        }
+    }
+    if (chunked && proxy_send(fd, "0\r\n\r\n", 5, 0) < 0) {
+        debug("Unable to send request body upstream: %s", strerror(errno));
+        return HTTP_STATUS_BAD_GATEWAY;
+    }
+    return HTTP_STATUS_OK;
+}
+
+/* Read more of the response into the buffer, returning bytes read (0 at end
+ * of file, -1 on error) */
+static ssize_t proxy_read(Connection *c) {
+    if (c->start == c->end) {
+        c->start = c->end = 0;
+    } else if (c->end == sizeof(c->buffer) && c->start > 0) {
+        memmove(c->buffer, c->buffer + c->start, c->end - c->start);
+        c->end  -= c->start;
+        c->start = 0;
+    }
+    if (c->end == sizeof(c->buffer)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    for (;;) {
+        ssize_t nread = recv(c->fd, c->buffer + c->end, sizeof(c->buffer) - c->end, MSG_DONTWAIT);
+        if (nread >= 0) {
+            c->end += nread;
+            return nread;
+        }
+        if (errno != EAGAIN) {
+            return -1;
+        }
+        int ready = coroutine_poll(c->fd, POLLIN, -1);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+    }
+}
+
+/* Take the next line of the response, without its line end (NULL on error) */
+static char *proxy_line(Connection *c) {
+    char *nl;
+    while (!(nl = memchr(c->buffer + c->start, '\n', c->end - c->start))) {
+        ssize_t nread = proxy_read(c);
+        if (nread <= 0) {
+            if (nread == 0) {
+                errno = EPROTO;
+            }
+            return NULL;
+        }
+    }
+
+    char *line = c->buffer + c->start;
+    c->start = nl + 1 - c->buffer;
+    *nl = '\0';
+    if (nl > line && nl[-1] == '\r') {
+        nl[-1] = '\0';
+    }
+    return line;
+}
+
+/* Find the end of the header block at the start of the buffer (NULL until
+ * its blank line arrives) */
+static char *proxy_blank(Connection *c) {
+    char *buffer = c->buffer + c->start;
+    size_t n     = c->end - c->start;
+    for (char *nl = memchr(buffer, '\n', n); nl; nl = memchr(nl + 1, '\n', n - (nl + 1 - buffer))) {
+        char *next = nl + 1;
+        if (next < buffer + n && *next == '\r') {
+            next++;
+        }
+        if (next < buffer + n && *next == '\n') {
+            return next + 1;
+        }
+    }
+    return NULL;
+}
+
+/* Wait for the response's header block, skipping interim (1xx) responses */
+static Status proxy_await(Connection *c) {
+    for (;;) {
+        char *end = proxy_blank(c);
+        if (end && c->end - c->start > 9 && c->buffer[c->start + 9] == '1') {
+            c->start = end - c->buffer;
+            continue;
+        }
+        if (end) {
+            /* An upstream that writes its headers and body separately holds
+             * a small body back (Nagle) until the headers are acknowledged,
+             * so acknowledge them now rather than at the delayed ACK timer */
+            if (c->tcp) {
+                int on = 1;
+                setsockopt(c->fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+            }
+            return HTTP_STATUS_OK;
+        }
+
+        ssize_t nread = proxy_read(c);
+        if (nread > 0) {
+            continue;
+        }
+        if (nread < 0 && (errno == ETIMEDOUT || errno == EINTR)) {
+            return HTTP_STATUS_GATEWAY_TIMEOUT;
+        }
+        debug("Upstream sent no header block: %s", nread == 0 ? "closed" : strerror(errno));
+        return HTTP_STATUS_BAD_GATEWAY;
+    }
+}
+
+/**
+ * Start the response from the upstream's header block.
+ *
+ * Sets the body's length (-1 until the upstream closes), whether it comes in
+ * chunks, and whether the connection can carry another request afterwards.
+ * Returns false if the header block is malformed.
+ **/
+static bool proxy_start(Request *r, Connection *c, off_t *length, bool *chunked, bool *persist) {
+    char   *block    = c->buffer + c->start;
+    char   *end      = proxy_blank(c);
+    char   *mimetype = DefaultMimeType;
+    Header *headers  = NULL;
+    Header **tail    = &headers;
+    char   *state;
+    int     minor, code, offset = 0;
+
+    end[-1]  = '\0';
+    c->start = end - c->buffer;
+    *length  = -1;
+    *chunked = false;
+
+    char *line = strtok_r(block, "\r\n", &state);
+    if (!line || sscanf(line, "HTTP/1.%d %3d%n", &minor, &code, &offset) < 2 || code < 200) {
+        return false;
+    }
+    char *reason = skip_whitespace(line + offset);
+    *persist = minor >= 1;
+
+    for (line = strtok_r(NULL, "\r\n", &state); line; line = strtok_r(NULL, "\r\n", &state)) {
+        char *value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        value    = skip_whitespace(value);
+
+        if (strcasecmp(line, "Content-Type") == 0) {
+            mimetype = value;
+        } else if (strcasecmp(line, "Content-Length") == 0) {
+            *length = strtoll(value, NULL, 10);
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            *chunked = strcasestr(value, "chunked") != NULL;
+        } else if (strcasecmp(line, "Connection") == 0) {
+            *persist &= !strcasestr(value, "close");
+        } else if (!proxy_hop(line)) {
+            Header *header = calloc(1, sizeof(Header));
+            if (header) {
+                header->name  = line;
+                header->value = value;
+                *tail = header;
+                tail  = &header->next;
+            }
+        }
+    }
+
+    /* Responses to HEAD, 204, and 304 have no body, whatever their headers say */
+    bool bodiless = streq(r->method, "HEAD") || code == 204 || code == 304;
+    if (*chunked) {
+        *length = -1;
+    }
+    r->responder->start(r, code, reason, mimetype, bodiless ? (*length > 0 ? *length : 0) : *length, headers);
+    if (bodiless) {
+        *length  = 0;
+        *chunked = false;
+    } else if (*length < 0 && !*chunked) {
+        *persist = false;
+    }
+
+    while (headers) {
+        Header *next = headers->next;
+        free(headers);
+        headers = next;
+    }
+    return true;
+}
+
+/* Relay n bytes of response body (everything until the upstream closes if n
+ * is negative), splicing when there is a pipe */
+static int proxy_relay(Request *r, Connection *c, int pipe[2], off_t n) {
+    while (n != 0) {
+        size_t  want = n < 0 || n > PROXY_SPLICE ? PROXY_SPLICE : (size_t)n;
+        ssize_t moved;
+
+        if (c->start < c->end) {
+            /* Bytes read along with the header block or framing go first */
+            moved = c->end - c->start < want ? c->end - c->start : want;
+            r->responder->send(r, c->buffer + c->start, moved);
+            c->start += moved;
+        } else if (pipe[0] >= 0) {
+            moved = proxy_fill(c->fd, pipe[1], want);
+            if (moved > 0) {
+                if (r->chunked) {
+                    fprintf(r->file, "%zx\r\n", (size_t)moved);
+                }
+                if (fflush(r->file) != 0 || proxy_drain(pipe[0], r->fd, moved) < 0) {
+                    return -1;
+                }
+                if (r->chunked) {
+                    fputs("\r\n", r->file);
+                }
+                if (r->unsized) {
+                    r->sent += moved;
+                }
+            }
+        } else {
+            moved = proxy_read(c);
+            if (moved > 0) {
+                continue;
+            }
+        }
+
+        if (moved == 0) {
+            if (n < 0) {
+                return 0;
+            }
+            errno = EPROTO;
+            return -1;
+        }
+        if (moved < 0 || ferror(r->file)) {
+            return -1;
+        }
+        if (n > 0) {
+            n -= moved;
+        }
+    }
+    return 0;
+}
+
+/* Relay a chunked response body, dropping any trailer */
+static int proxy_chunks(Request *r, Connection *c, int pipe[2]) {
+    char *line, *end;
+
+    for (;;) {
+        if (!(line = proxy_line(c))) {
+            return -1;
+        }
+        errno = 0;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (end == line || errno || size > (1ULL << 62)) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (proxy_relay(r, c, pipe, size) < 0) {
+            return -1;
+        }
+        if (!(line = proxy_line(c)) || *line) {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    while ((line = proxy_line(c)) && *line) {
+    }
+    return line ? 0 : -1;
+}
+
+/**
+ * Add a reverse proxy to the route table.
+ *
+ * @param   spec        prefix=upstream[,upstream...], each upstream being
+ *                      host:port or unix:path.
+ * @return  0 on success, -1 if spec is malformed, an upstream cannot be
+ * resolved, or the table is full.
+ **/
+int proxy_add(char *spec) {
+    char *equals = strchr(spec, '=');
+    if (!equals || equals == spec || spec[0] != '/' || NProxies == PROXY_MAX) {
+        return -1;
+    }
+    *equals = '\0';
+
+    Proxy *proxy  = &Proxies[NProxies];
+    proxy->prefix = spec;
+    proxy->length = strlen(spec);
+
+    char *state;
+    for (char *upstream = strtok_r(equals + 1, ",", &state); upstream; upstream = strtok_r(NULL, ",", &state)) {
+        if (proxy->nupstreams == PROXY_UPSTREAMS || proxy_resolve(&proxy->upstreams[proxy->nupstreams], upstream) < 0) {
+            return -1;
+        }
+        proxy->nupstreams++;
+    }
+    if (proxy->nupstreams == 0) {
+        return -1;
+    }
+    NProxies++;
+    return 0;
+}
+
+/**
+ * Share the upstreams' load and health with every process.
+ *
+ * @return  0 on success, -1 on failure.
+ **/
+int proxy_init(void) {
+    size_t n = 0;
+
+    if (NProxies == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < NProxies; i++) {
+        n += Proxies[i].nupstreams;
+    }
+
+    UpstreamState *states = mmap(NULL, n * sizeof(UpstreamState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (states == MAP_FAILED) {
+        log("Unable to share upstream state: %s", strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < NProxies; i++) {
+        for (size_t j = 0; j < Proxies[i].nupstreams; j++) {
+            Proxies[i].upstreams[j].state = states++;
+            log("Proxying %s to %s", Proxies[i].prefix, Proxies[i].upstreams[j].name);
+        }
+    }
+    qsort(Proxies, NProxies, sizeof(Proxy), proxy_compare);
+    Checked = timer_now();
+    return 0;
+}
+
+/**
+ * Find the reverse proxy serving a request.
+ *
+ * @param   r           Request structure.
+ * @return  Whether a proxy serves the request (stored in r->proxy).
+ **/
+bool proxy_route(Request *r) {
+    for (size_t i = 0; i < NProxies; i++) {
+        Proxy *proxy = &Proxies[i];
+        if (strncmp(r->uri, proxy->prefix, proxy->length) == 0) {
+            char next = r->uri[proxy->length];
+            if (next == '\0' || next == '/' || proxy->prefix[proxy->length - 1] == '/') {
+                r->proxy = proxy;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Handle a request by passing it to an upstream.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the proxied request.
+ *
+ * If no upstream takes the request, nothing is sent and
+ * HTTP_STATUS_BAD_GATEWAY is returned for the caller's error page
+ * (HTTP_STATUS_GATEWAY_TIMEOUT if the upstream sends no response by the
+ * deadline, and the status of the failure if the request body cannot be
+ * received).  A response cut off midway leaves the connection to be closed.
+ **/
+Status proxy_handle(Request *r) {
+    Proxy    *proxy   = r->proxy;
+    Upstream *u       = NULL;
+    bool      body    = r->body != BODY_NONE;
+    bool      chunked = body && r->length < 0;
+    bool      reused  = false;
+    bool      empty   = true;
+    unsigned  tried   = 0;
+    int       pipe[2] = {-1, -1};
+    char     *head    = NULL;
+    size_t    nhead   = 0;
+    Status    status  = HTTP_STATUS_BAD_GATEWAY;
+
+    /* Kept off the stack, which is small on a coroutine */
+    Connection *c = malloc(sizeof(Connection));
+    if (!c) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    c->fd    = -1;
+    c->start = c->end = 0;
+    if ((body || (r->plaintext && !r->stream)) && proxy_pipe(pipe) < 0) {
+        pipe[0] = pipe[1] = -1;
+        if (body) {
+            free(c);
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+    }
+    stats_add(proxy_requests, 1);
+
+    /* Take a connection to the least loaded upstream, moving on from any
+     * that cannot be reached */
+    while (c->fd < 0 && (u = proxy_pick(proxy, tried))) {
+        tried |= 1u << (u - proxy->upstreams);
+        if ((c->fd = proxy_idle(u)) >= 0) {
+            reused = true;
+        } else if ((c->fd = proxy_connect(u)) < 0) {
+            int error = errno;
+            log("Unable to connect to upstream %s: %s", u->name, strerror(error));
+            if (error == EINTR || error == ETIMEDOUT) {
+                status = HTTP_STATUS_GATEWAY_TIMEOUT;
+                break;
+            }
+            proxy_mark(u, error);
+        }
+    }
+    if (c->fd < 0) {
+        u = NULL;
+        goto done;
+    }
+    __atomic_add_fetch(&u->state->outstanding, 1, __ATOMIC_RELAXED);
+    c->tcp = u->address.ss_family != AF_UNIX;
+
+    /* Send the request and wait for the response to start */
+    if (!(head = proxy_head(r, u, chunked, &nhead))) {
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        goto done;
+    }
+    for (;;) {
+        if (proxy_send(c->fd, head, nhead, body ? MSG_MORE : 0) < 0) {
+            debug("Unable to send request upstream: %s", strerror(errno));
+            status = HTTP_STATUS_BAD_GATEWAY;
+        } else {
+            status = body ? proxy_feed(r, c->fd, pipe, chunked) : HTTP_STATUS_OK;
+            empty  = status == HTTP_STATUS_OK;
+        }
+        if (status == HTTP_STATUS_OK) {
+            status = proxy_await(c);
+        }
+        if (status != HTTP_STATUS_BAD_GATEWAY || !reused || body || c->end > 0) {
+            break;
+        }
+
+        /* The upstream closed the pooled connection just as it was reused */
+        debug("Retrying on a new connection to upstream %s", u->name);
+        close(c->fd);
+        reused = false;
+        if ((c->fd = proxy_connect(u)) < 0) {
+            int error = errno;
+            log("Unable to connect to upstream %s: %s", u->name, strerror(error));
+            proxy_mark(u, error);
+            goto done;
+        }
+    }
+    if (status != HTTP_STATUS_OK) {
+        log("Upstream %s failed: %s", u->name, http_status_string(status));
+        goto done;
+    }
+    if (reused) {
+        stats_add(proxy_reused, 1);
+    }
+
+    /* Relay the response */
+    off_t length;
+    bool  chunks, persist;
+    if (!proxy_start(r, c, &length, &chunks, &persist)) {
+        log("Upstream %s sent a malformed header block", u->name);
+        status = HTTP_STATUS_BAD_GATEWAY;
+        goto done;
+    }
+    if ((chunks ? proxy_chunks(r, c, pipe) : proxy_relay(r, c, pipe, length)) < 0) {
+        log("Response from upstream %s cut off: %s", u->name, strerror(errno));
+        r->keep_alive = false;
+        empty = false;
+        goto done;
+    }
+    r->responder->finish(r);
+
+    if (persist && c->start == c->end) {
+        proxy_release(u, c->fd);
+        c->fd = -1;
+    }
+
+done:
+    trace(r, body);
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    if (u) {
+        __atomic_sub_fetch(&u->state->outstanding, 1, __ATOMIC_RELAXED);
+    }
+    if (status != HTTP_STATUS_OK) {
+        stats_add(proxy_errors, 1);
+        if (body) {
+            r->keep_alive = false;
+        }
+    }
+    proxy_unpipe(pipe, empty);
+    free(head);
+    free(c);
+    return status;
+}
+
+/**
+ * Return milliseconds until the upstreams are due to be checked.
+ *
+ * @return  Milliseconds (0 if overdue), or -1 if nothing is proxied.
+ **/
+int proxy_due(void) {
+    if (NProxies == 0) {
+        return -1;
+    }
+
+    uint64_t now = timer_now();
+    return Checked + PROXY_CHECK > now ? (int)(Checked + PROXY_CHECK - now) : 0;
+}
+
+/**
+ * Check every upstream when due: each check started last time is judged
+ * (connected by now or down), and a new one is started.
+ **/
+void proxy_tick(void) {
+    if (NProxies == 0 || timer_now() < Checked + PROXY_CHECK) {
+        return;
+    }
+    Checked = timer_now();
+
+    for (size_t i = 0; i < NProxies; i++) {
+        for (size_t j = 0; j < Proxies[i].nupstreams; j++) {
+            Upstream *u = &Proxies[i].upstreams[j];
+
+            if (u->probe >= 0) {
+                int           error  = 0;
+                socklen_t     length = sizeof(error);
+                struct pollfd pfd    = { .fd = u->probe, .events = POLLOUT };
+                if (poll(&pfd, 1, 0) <= 0) {
+                    error = ETIMEDOUT;
+                } else if (getsockopt(u->probe, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+                    error = errno;
+                }
+                close(u->probe);
+                u->probe = -1;
+                proxy_mark(u, error);
+            }
+
+            bool pending;
+            int  fd = proxy_open(u, &pending);
+            if (fd < 0) {
+                proxy_mark(u, errno);
+            } else if (!pending) {
+                close(fd);
+                proxy_mark(u, 0);
+            } else {
+                u->probe = fd;
+            }
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,284 @@
+/* ratelimit.c: Per-Client Rate Limiting */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+/**
+ * Each client address, and each subnet (/24 for IPv4, /48 for IPv6), has a
+ * token bucket for new connections and one for requests.  A bucket refills
+ * at its rate per second up to RATE_BURST seconds' worth, and every
+ * connection or request takes one token; a client whose own bucket or whose
+ * subnet's bucket is empty is answered with a prebuilt 429.  Subnets get
+ * RATE_SUBNET times the client rate, so a crowd behind one NAT still fits
+ * while a spread-out scan is caught.
+ *
+ * Buckets live in a fixed-size open addressing table shared with forked
+ * children.  A bucket's refill time and tokens share one 64-bit word updated
+ * with compare-and-swap, so every process enforces the same limits without
+ * locks.  A slot is claimed by swapping its key in; one whose bucket has
+ * refilled completely has nothing to remember and can be taken over by
+ * another client.  If every slot in a key's probe window is busy, the client
+ * is let through rather than limited by accident.
+ **/
+
+#define RATE_BURST      2               /* Seconds of tokens a bucket holds */
+#define RATE_SUBNET     8               /* Subnet rate as multiple of client rate */
+#define RATE_PROBES     8               /* Slots checked for a key */
+#define RATE_MAX        1000000         /* Largest rate (fits milli-tokens in 32 bits) */
+#define RATE_TOP        10              /* Offenders listed in the statistics */
+
+typedef enum {
+    BUCKET_CONNECTIONS,
+    BUCKET_REQUESTS,
+} BucketKind;
+
+typedef struct {
+    uint64_t key;                       /*< Hash of kind and address prefix (0 if free) */
+    uint64_t state;                     /*< Refill time (ms, high half) | milli-tokens (low half) */
+    uint64_t rejected;                  /*< Connections or requests refused */
+    uint8_t  address[16];               /*< Address prefix (for reporting) */
+    uint8_t  family;                    /*< AF_INET or AF_INET6 */
+    uint8_t  prefix;                    /*< Prefix length in bits */
+    uint8_t  kind;                      /*< BucketKind */
+} RateBucket;
+
+/* Globals */
+
+static RateBucket *Buckets = NULL;
+static size_t      Slots   = 0;         /* Power of two */
+static uint64_t    Epoch   = 0;         /* Time buckets are measured from (ms) */
+
+/* Functions */
+
+/**
+ * Map bucket table into memory shared with forked children.
+ *
+ * Does nothing if both rates are 0, and disables limiting if the mapping
+ * fails.
+ **/
+void ratelimit_init(void) {
+    if ((RateRequests <= 0 && RateConnections <= 0) || RateEntries <= 0) {
+        RateRequests = RateConnections = 0;
+        return;
+    }
+    if (RateRequests > RATE_MAX / RATE_SUBNET) {
+        RateRequests = RATE_MAX / RATE_SUBNET;
+    }
+    if (RateConnections > RATE_MAX / RATE_SUBNET) {
+        RateConnections = RATE_MAX / RATE_SUBNET;
+    }
+
+    for (Slots = 64; Slots < (size_t)RateEntries; Slots *= 2);
+    Buckets = mmap(NULL, Slots * sizeof(RateBucket), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Buckets == MAP_FAILED) {
+        debug("Unable to map rate limit buckets: %s", strerror(errno));
+        Buckets      = NULL;
+        RateRequests = RateConnections = 0;
+        return;
+    }
+    Epoch = timer_now();
+}
+
+/* Tokens per second of bucket */
+static uint64_t bucket_rate(BucketKind kind, int prefix, int family) {
+    uint64_t rate = kind == BUCKET_CONNECTIONS ? RateConnections : RateRequests;
+    return prefix == (family == AF_INET ? 32 : 128) ? rate : rate * RATE_SUBNET;
+}
+
+/* Milli-tokens in bucket state after refilling until now */
+static uint64_t bucket_tokens(uint64_t state, uint32_t now, uint64_t rate) {
+    uint64_t capacity = rate * RATE_BURST * 1000;
+    uint32_t elapsed  = now - (uint32_t)(state >> 32);
+    uint64_t tokens   = (state & UINT32_MAX) + (uint64_t)elapsed * rate;
+    return tokens < capacity ? tokens : capacity;
+}
+
+/* FNV-1a over kind and address prefix */
+static uint64_t bucket_key(BucketKind kind, const uint8_t *address, int length, int prefix) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint8_t  head[2] = { kind, prefix };
+    for (int i = 0; i < 2; i++) {
+        hash = (hash ^ head[i]) * 1099511628211ULL;
+    }
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ address[i]) * 1099511628211ULL;
+    }
+    return hash | 1;
+}
+
+/**
+ * Find or claim bucket for an address prefix.
+ *
+ * @return  Bucket (or NULL if the probe window is full of active buckets).
+ **/
+static RateBucket *bucket_find(BucketKind kind, const uint8_t *address, int family, int prefix, uint32_t now) {
+    uint8_t masked[16] = {0};
+    int     length = prefix / 8;
+    memcpy(masked, address, length);
+
+    uint64_t key = bucket_key(kind, masked, length, prefix);
+    uint64_t rate = bucket_rate(kind, prefix, family);
+
+    for (size_t probe = 0; probe < RATE_PROBES; probe++) {
+        RateBucket *b = &Buckets[(key + probe) & (Slots - 1)];
+        uint64_t current = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+        if (current == key) {
+            return b;
+        }
+
+        /* Claim a free slot, or one whose bucket has nothing left to remember */
+        if (current != 0) {
+            uint64_t held = bucket_rate(b->kind, b->prefix, b->family);
+            uint64_t state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+            if (bucket_tokens(state, now, held) < held * RATE_BURST * 1000) {
+                continue;
+            }
+        }
+        if (__atomic_compare_exchange_n(&b->key, &current, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            b->kind   = kind;
+            b->family = family;
+            b->prefix = prefix;
+            memcpy(b->address, masked, sizeof(masked));
+            __atomic_store_n(&b->rejected, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->state, ((uint64_t)now << 32) | (rate * RATE_BURST * 1000), __ATOMIC_RELEASE);
+            return b;
+        }
+        if (current == key) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/* Take a token from bucket for address prefix, returning whether one was left */
+static bool bucket_take(BucketKind kind, const uint8_t *address, int family, int prefix, uint32_t now) {
+    RateBucket *b = bucket_find(kind, address, family, prefix, now);
+    if (!b) {
+        return true;
+    }
+
+    uint64_t rate  = bucket_rate(kind, prefix, family);
+    uint64_t state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint64_t tokens = bucket_tokens(state, now, rate);
+        if (tokens < 1000) {
+            __atomic_add_fetch(&b->rejected, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        uint64_t next = ((uint64_t)now << 32) | (tokens - 1000);
+        if (__atomic_compare_exchange_n(&b->state, &state, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+}
+
+/**
+ * Take a token from the client's and its subnet's buckets.
+ *
+ * @param   r           Request structure.
+ * @param   kind        Bucket to take from.
+ * @return  Whether the client is within its limits.
+ **/
+static bool ratelimit_take(Request *r, BucketKind kind) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&r->peer;
+    const struct sockaddr_in  *in  = (const struct sockaddr_in *)&r->peer;
+    const uint8_t *address;
+    int            family;
+
+    if (r->peer.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+        family  = AF_INET;
+        address = in6->sin6_addr.s6_addr + 12;
+    } else if (r->peer.ss_family == AF_INET6) {
+        family  = AF_INET6;
+        address = in6->sin6_addr.s6_addr;
+    } else if (r->peer.ss_family == AF_INET) {
+        family  = AF_INET;
+        address = (const uint8_t *)&in->sin_addr;
+    } else {
+        return true;
+    }
+
+    uint32_t now  = timer_now() - Epoch;
+    int      bits = family == AF_INET ? 32 : 128;
+    int      net  = family == AF_INET ? 24 : 48;
+    return bucket_take(kind, address, family, bits, now) && bucket_take(kind, address, family, net, now);
+}
+
+/**
+ * Check whether a newly accepted client may open another connection.
+ *
+ * @param   r           Accepted request structure.
+ * @return  Whether the connection is within its client's limits.
+ **/
+bool ratelimit_connection(Request *r) {
+    if (!Buckets || RateConnections <= 0 || ratelimit_take(r, BUCKET_CONNECTIONS)) {
+        return true;
+    }
+    stats_add(connections_limited, 1);
+    return false;
+}
+
+/**
+ * Check whether a client may make another request.
+ *
+ * @param   r           Request structure with complete headers.
+ * @return  Whether the request is within its client's limits.
+ **/
+bool ratelimit_request(Request *r) {
+    if (!Buckets || RateRequests <= 0 || ratelimit_take(r, BUCKET_REQUESTS)) {
+        return true;
+    }
+    stats_add(requests_limited, 1);
+    return false;
+}
+
+/**
+ * Write the clients and subnets refused most often as "limited" lines.
+ *
+ * @param   stream      Stream to write to.
+ **/
+void ratelimit_dump(FILE *stream) {
+    RateBucket *top[RATE_TOP];
+    uint64_t    counts[RATE_TOP];
+    size_t      ntop = 0;
+
+    if (!Buckets) {
+        return;
+    }
+
+    /* Keep the busiest offenders in descending order */
+    for (size_t i = 0; i < Slots; i++) {
+        RateBucket *b = &Buckets[i];
+        uint64_t rejected = __atomic_load_n(&b->rejected, __ATOMIC_RELAXED);
+        if (!__atomic_load_n(&b->key, __ATOMIC_ACQUIRE) || rejected == 0) {
+            continue;
+        }
+        if (ntop == RATE_TOP && counts[ntop - 1] >= rejected) {
+            continue;
+        }
+
+        size_t j = ntop < RATE_TOP ? ntop++ : RATE_TOP - 1;
+        for (; j > 0 && counts[j - 1] < rejected; j--) {
+            top[j]    = top[j - 1];
+            counts[j] = counts[j - 1];
+        }
+        top[j]    = b;
+        counts[j] = rejected;
+    }
+
+    for (size_t i = 0; i < ntop; i++) {
+        char address[INET6_ADDRSTRLEN];
+        inet_ntop(top[i]->family, top[i]->address, address, sizeof(address));
+        fprintf(stream, "limited %-12s %s/%-3d %lu\n",
+            top[i]->kind == BUCKET_CONNECTIONS ? "connections" : "requests",
+            address, top[i]->prefix, (unsigned long)counts[i]);
+    }
+    fflush(stream);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,514 @@
+/* replay.c: Replay Captured Requests */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <search.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Plays a capture log written by spidey -w back against a server.  Requests
+ * that arrived on the same connection are sent in order on one connection
+ * (reconnecting whenever the server closes it), and each connection opens at
+ * its first request's capture time.  Later requests wait for both their own
+ * capture time and the previous response.  Times are divided by the speed, so
+ * -s 1 is the original timing, -s 10 is ten times faster, and -s 0 sends
+ * everything as fast as the connection limit allows.
+ **/
+
+/* Globals */
+
+static double       Speed      = 1;
+static int          MaxActive  = 256;
+static const char  *Host       = "localhost";
+static const char  *ServerPort = "9898";
+
+typedef struct {
+    uint64_t    time;                   /*< Capture time (ns) */
+    const char *data;                   /*< Raw request bytes */
+    size_t      length;                 /*< Length of request */
+    size_t      uri;                    /*< Index of request's URI statistics */
+} Entry;
+
+typedef enum {
+    REPLAY_WAITING,                     /**< Waiting for next request to be due */
+    REPLAY_SENDING,                     /**< Sending request */
+    REPLAY_READING,                     /**< Reading response */
+    REPLAY_DONE,                        /**< Every request replayed */
+} ReplayState;
+
+typedef struct {
+    Entry   **entries;                  /*< Requests sent on connection */
+    size_t    count;                    /*< Number of requests */
+    size_t    next;                     /*< Request being replayed */
+    int       fd;                       /*< Socket (-1 when closed) */
+    ReplayState state;                  /*< Progress of current request */
+    size_t    sent;                     /*< Bytes of request sent */
+    char     *head;                     /*< Start of response (BUFSIZ bytes while active) */
+    size_t    nhead;                    /*< Bytes of head received */
+    ssize_t   body;                     /*< Bytes of body left (-1 until known, -2 until close) */
+    bool      close;                    /*< Whether server closes after response */
+    uint64_t  started;                  /*< Time request was sent (us) */
+} Connection;
+
+typedef struct {
+    char     *uri;                      /*< Request URI (without query) */
+    uint64_t *latencies;                /*< Response times (us) */
+    size_t    count;
+    size_t    capacity;
+    unsigned long errors;
+} Uri;
+
+static Entry      *Entries     = NULL;
+static size_t      NEntries    = 0;
+static Connection *Connections = NULL;
+static size_t      NConnections = 0;
+static Uri        *Uris        = NULL;
+static size_t      NUris       = 0;
+
+static uint64_t    Start       = 0;     /* Replay start (us) */
+static int         Active      = 0;     /* Connections started and not done */
+static size_t      Finished    = 0;     /* Connections done */
+static int         EventFd     = -1;
+static struct addrinfo *Address = NULL;
+
+/* Functions */
+
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [-c connections -s speed] capture host port\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c count      Most connections open at once (256)\n");
+    fprintf(stderr, "    -s speed      Multiple of captured speed, 0 for as fast as possible (1)\n");
+    exit(status);
+}
+
+static uint64_t replay_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Return index of statistics for URI in request line */
+static size_t uri_index(const char *data, size_t length) {
+    const char *start = memchr(data, ' ', length);
+    start = start ? start + 1 : data + length;
+    const char *end = start;
+    while (end < data + length && !strchr(" ?\r\n", *end)) {
+        end++;
+    }
+
+    char  *uri = strndup(start, end - start);
+    ENTRY  item = { .key = uri }, *found = hsearch(item, FIND);
+    if (found) {
+        free(uri);
+        return (size_t)found->data;
+    }
+
+    Uris = realloc(Uris, (NUris + 1) * sizeof(Uri));
+    memset(&Uris[NUris], 0, sizeof(Uri));
+    Uris[NUris].uri = uri;
+    item.data = (void *)NUris;
+    hsearch(item, ENTER);
+    return NUris++;
+}
+
+/* Load capture log and group its requests by connection */
+static int replay_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        return -1;
+    }
+
+    size_t      size = st.st_size;
+    const char *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED || size < strlen(CAPTURE_MAGIC) || memcmp(data, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* First pass counts requests and connections */
+    uint32_t maxid = 0;
+    for (size_t offset = strlen(CAPTURE_MAGIC); offset + sizeof(CaptureRecord) <= size; ) {
+        CaptureRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        if (offset + sizeof(record) + record.length > size) {
+            break;
+        }
+        offset += sizeof(record) + record.length;
+        maxid   = record.connection > maxid ? record.connection : maxid;
+        NEntries++;
+    }
+
+    Entries = calloc(NEntries, sizeof(Entry));
+    size_t *slots = calloc((size_t)maxid + 1, sizeof(size_t));
+    size_t *counts = calloc(NEntries + 1, sizeof(size_t));
+    if ((NEntries && !Entries) || !slots || !counts || !hcreate(NEntries * 2 + 16)) {
+        return -1;
+    }
+
+    /* Second pass numbers connections in order of their first request */
+    size_t offset = strlen(CAPTURE_MAGIC);
+    for (size_t i = 0; i < NEntries; i++) {
+        CaptureRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        Entries[i].time   = record.time;
+        Entries[i].data   = data + offset + sizeof(record);
+        Entries[i].length = record.length;
+        Entries[i].uri    = uri_index(Entries[i].data, record.length);
+        offset += sizeof(record) + record.length;
+
+        if (!slots[record.connection]) {
+            slots[record.connection] = ++NConnections;
+        }
+        counts[slots[record.connection] - 1]++;
+    }
+
+    Connections = calloc(NConnections, sizeof(Connection));
+    for (size_t c = 0; c < NConnections; c++) {
+        Connections[c].entries = calloc(counts[c], sizeof(Entry *));
+        Connections[c].fd      = -1;
+    }
+
+    offset = strlen(CAPTURE_MAGIC);
+    for (size_t i = 0; i < NEntries; i++) {
+        CaptureRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        offset += sizeof(record) + record.length;
+
+        Connection *c = &Connections[slots[record.connection] - 1];
+        c->entries[c->count++] = &Entries[i];
+    }
+
+    free(slots);
+    free(counts);
+    return 0;
+}
+
+/* Return replay time (us) at which connection's next request is due */
+static uint64_t replay_due(Connection *c) {
+    if (Speed <= 0) {
+        return Start;
+    }
+    return Start + (uint64_t)(c->entries[c->next]->time / 1000 / Speed);
+}
+
+/* Open connection to server */
+static int connection_open(Connection *c) {
+    c->fd = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, Address->ai_protocol);
+    if (c->fd < 0) {
+        return -1;
+    }
+    if (connect(c->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = c };
+    epoll_ctl(EventFd, EPOLL_CTL_ADD, c->fd, &event);
+    return 0;
+}
+
+static void connection_close(Connection *c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+/* Start sending connection's next request, reconnecting if needed */
+static void connection_done(Connection *c, bool failed);
+
+static void connection_send(Connection *c) {
+    if (!c->head && !(c->head = malloc(BUFSIZ))) {
+        connection_done(c, true);
+        return;
+    }
+    if (c->fd < 0 && connection_open(c) < 0) {
+        connection_done(c, true);
+        return;
+    }
+
+    c->state   = REPLAY_SENDING;
+    c->sent    = 0;
+    c->nhead   = 0;
+    c->body    = -1;
+    c->close   = false;
+    c->started = replay_clock();
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = c };
+    epoll_ctl(EventFd, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+/* Record response to connection's current request and move to the next */
+static void connection_done(Connection *c, bool failed) {
+    Uri *u = &Uris[c->entries[c->next]->uri];
+    if (failed) {
+        u->errors++;
+    } else {
+        if (u->count == u->capacity) {
+            u->capacity  = u->capacity ? u->capacity * 2 : 16;
+            u->latencies = realloc(u->latencies, u->capacity * sizeof(uint64_t));
+        }
+        u->latencies[u->count++] = replay_clock() - c->started;
+    }
+
+    c->next++;
+    c->state = REPLAY_WAITING;
+    if (failed || c->close || c->next == c->count) {
+        connection_close(c);
+    } else {
+        /* Any input before the next request means the server closed it */
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+        epoll_ctl(EventFd, EPOLL_CTL_MOD, c->fd, &event);
+    }
+
+    if (c->next == c->count) {
+        free(c->head);
+        c->head  = NULL;
+        c->state = REPLAY_DONE;
+        Active--;
+        Finished++;
+    }
+}
+
+/* Parse response head once complete: learn how the body ends */
+static void connection_head(Connection *c, char *end) {
+    *end = '\0';
+    bool http10 = strncmp(c->head, "HTTP/1.0", 8) == 0;
+    c->close = http10;
+
+    for (char *line = strstr(c->head, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        char *name = line + 2;
+        if (strncasecmp(name, "Content-Length:", 15) == 0) {
+            c->body = strtol(name + 15, NULL, 10);
+        } else if (strncasecmp(name, "Connection:", 11) == 0) {
+            c->close = strcasestr(name, "close") != NULL ||
+                (http10 && !strcasestr(name, "keep-alive"));
+        }
+    }
+    if (c->body < 0) {
+        c->body  = -2;
+        c->close = true;
+    }
+}
+
+/* Make progress on connection's current request */
+static void connection_event(Connection *c) {
+    Entry *e = c->entries[c->next];
+
+    if (c->state == REPLAY_WAITING) {
+        connection_close(c);
+        return;
+    }
+
+    if (c->state == REPLAY_SENDING) {
+        ssize_t n = send(c->fd, e->data + c->sent, e->length - c->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                connection_done(c, true);
+            }
+            return;
+        }
+        c->sent += n;
+        if (c->sent == e->length) {
+            c->state = REPLAY_READING;
+            struct epoll_event event = { .events = EPOLLIN, .data.ptr = c };
+            epoll_ctl(EventFd, EPOLL_CTL_MOD, c->fd, &event);
+        }
+        return;
+    }
+
+    char buffer[BUFSIZ];
+    while (true) {
+        ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                connection_done(c, true);
+            }
+            return;
+        }
+        if (n == 0) {
+            /* Close ends a response of unknown length (CGI output may not even
+             * end its head with CRLFs); otherwise it is an error */
+            c->close = true;
+            connection_done(c, c->nhead == 0 || c->body >= 0);
+            return;
+        }
+
+        char *data = buffer;
+        if (c->body == -1) {
+            size_t room = BUFSIZ - 1 - c->nhead;
+            size_t copy = (size_t)n < room ? (size_t)n : room;
+            memcpy(c->head + c->nhead, buffer, copy);
+            c->nhead += copy;
+            c->head[c->nhead] = '\0';
+
+            char *end = strstr(c->head, "\r\n\r\n");
+            if (!end) {
+                if (c->nhead == BUFSIZ - 1) {
+                    connection_done(c, true);
+                    return;
+                }
+                continue;
+            }
+            size_t headlength = end + 4 - c->head;
+            connection_head(c, end);
+            data = buffer + copy - (c->nhead - headlength);
+            n    = buffer + n - data;
+        }
+
+        if (c->body >= 0) {
+            c->body -= n;
+            if (c->body <= 0) {
+                connection_done(c, false);
+                return;
+            }
+        }
+    }
+}
+
+/* Print per-URI latency, busiest first */
+static int compare_uri(const void *a, const void *b) {
+    const Uri *x = a, *y = b;
+    return (y->count + y->errors > x->count + x->errors) - (y->count + y->errors < x->count + x->errors);
+}
+
+static void replay_report(double elapsed) {
+    unsigned long total = 0, errors = 0;
+    qsort(Uris, NUris, sizeof(Uri), compare_uri);
+
+    printf("%-40s %8s %8s %10s %10s %10s %10s\n", "uri", "count", "errors", "mean_us", "p50_us", "p99_us", "max_us");
+    for (size_t i = 0; i < NUris; i++) {
+        Uri     *u   = &Uris[i];
+        uint64_t sum = 0;
+        qsort(u->latencies, u->count, sizeof(uint64_t), compare_latency);
+        for (size_t j = 0; j < u->count; j++) {
+            sum += u->latencies[j];
+        }
+        printf("%-40.40s %8zu %8lu %10lu %10lu %10lu %10lu\n", u->uri[0] ? u->uri : "-", u->count, u->errors,
+            (unsigned long)(u->count ? sum / u->count : 0),
+            (unsigned long)(u->count ? u->latencies[u->count / 2] : 0),
+            (unsigned long)(u->count ? u->latencies[u->count * 99 / 100] : 0),
+            (unsigned long)(u->count ? u->latencies[u->count - 1] : 0));
+        total  += u->count;
+        errors += u->errors;
+    }
+    printf("requests %lu errors %lu connections %zu seconds %.2f rate %.1f\n",
+        total, errors, NConnections, elapsed, total / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        switch (arg[1]) {
+        case 'c':
+            MaxActive = argind < argc ? atoi(argv[argind++]) : 0;
+            break;
+        case 's':
+            Speed = argind < argc ? atof(argv[argind++]) : -1;
+            break;
+        case 'h':
+            usage(argv[0], EXIT_SUCCESS);
+            break;
+        default:
+            usage(argv[0], EXIT_FAILURE);
+            break;
+        }
+    }
+    if (argc - argind != 3 || MaxActive < 1 || Speed < 0) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    const char *path = argv[argind++];
+    Host       = argv[argind++];
+    ServerPort = argv[argind++];
+
+    if (replay_load(path) < 0) {
+        fprintf(stderr, "Unable to load capture %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int status = getaddrinfo(Host, ServerPort, &hints, &Address);
+    if (status != 0) {
+        fprintf(stderr, "Unable to lookup %s:%s: %s\n", Host, ServerPort, gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+    if ((EventFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "Unable to create epoll instance: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    Start = replay_clock();
+    size_t started = 0;                 /* Connections started so far */
+    size_t first   = 0;                 /* Oldest connection not done */
+
+    while (Finished < NConnections) {
+        uint64_t now  = replay_clock();
+        uint64_t wake = now + 100000;
+
+        /* Start connections whose first request is due */
+        while (started < NConnections && Active < MaxActive) {
+            Connection *c   = &Connections[started];
+            uint64_t    due = replay_due(c);
+            if (due > now) {
+                wake = due < wake ? due : wake;
+                break;
+            }
+            Active++;
+            started++;
+            connection_send(c);
+        }
+
+        /* Send requests that are due on connections waiting between them */
+        while (first < started && Connections[first].state == REPLAY_DONE) {
+            first++;
+        }
+        for (size_t i = first; i < started; i++) {
+            Connection *c = &Connections[i];
+            if (c->state != REPLAY_WAITING) {
+                continue;
+            }
+            uint64_t due = replay_due(c);
+            if (due <= now) {
+                connection_send(c);
+            } else {
+                wake = due < wake ? due : wake;
+            }
+        }
+
+        struct epoll_event events[64];
+        int timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        int nevents = epoll_wait(EventFd, events, 64, timeout);
+        for (int i = 0; i < nevents; i++) {
+            connection_event(events[i].data.ptr);
+        }
+    }
+
+    replay_report((replay_clock() - Start) / 1e6);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,14 +1,97 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
+#include <arpa/inet.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+/**
+ * An idle kept-alive connection holds nothing but its Request: the input
+ * buffer goes back to a pool of size classes (REQUEST_CHUNK doubling up to
+ * REQUEST_MAX) once every byte has been handled, the response stream and its
+ * stdio buffer exist only while a request is served, and the client address
+ * is kept in binary and formatted only for logs and CGI scripts.  The
+ * static assertion below keeps an idle plain HTTP/1 connection under
+ * REQUEST_IDLE_MAX bytes of user memory, so 100k of them fit in ~100 MB.
+ * HTTPS connections also hold their TLS session (buffers released while
+ * idle), and HTTP/2 connections their session for as long as they last.
+ **/
+
+#define REQUEST_IDLE_MAX    1024        /* Bytes per idle connection */
+#define BUFFER_CLASSES      4           /* REQUEST_CHUNK << class up to REQUEST_MAX */
+#define BUFFER_POOL         256         /* Free buffers kept per class */
+
+_Static_assert(sizeof(Request) + 16 <= REQUEST_IDLE_MAX, "idle connection exceeds REQUEST_IDLE_MAX");
+_Static_assert((REQUEST_CHUNK << (BUFFER_CLASSES - 1)) == REQUEST_MAX, "buffer classes do not reach REQUEST_MAX");
+
+/* Globals */
+
+static struct {
+    char   *free;                       /* Free buffers, linked through their first bytes */
+    size_t  count;
+} Pool[BUFFER_CLASSES];
+
+/* Functions */
+
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
+static int parse_request_body(Request *r);
+
+/* Size class of buffer capacity */
+static int buffer_class(size_t capacity) {
+    int class = 0;
+    while ((REQUEST_CHUNK << class) < capacity) {
+        class++;
+    }
+    return class;
+}
+
+/* Take buffer with capacity (plus room for a NUL) from the pool */
+static char *buffer_get(size_t capacity) {
+    int class = buffer_class(capacity);
+    char *buffer = Pool[class].free;
+    if (buffer) {
+        Pool[class].free = *(char **)buffer;
+        Pool[class].count--;
+        return buffer;
+    }
+    return malloc(capacity + 1);
+}
+
+/* Return buffer to the pool (or free it if the pool is full) */
+static void buffer_put(char *buffer, size_t capacity) {
+    if (!buffer) {
+        return;
+    }
+    int class = buffer_class(capacity);
+    if (Pool[class].count >= BUFFER_POOL) {
+        free(buffer);
+        return;
+    }
+    *(char **)buffer = Pool[class].free;
+    Pool[class].free = buffer;
+    Pool[class].count++;
+}
+
+/* Plain HTTP and kernel TLS: the response stream writes to the socket (and
+ * waits for room on a coroutine), large writes without a copy */
+
+static ssize_t socket_write(void *cookie, const char *buffer, size_t size) {
+    Request *r = cookie;
+    return zerocopy_write(r, buffer, size);
+}
+
+static const cookie_io_functions_t SocketStream = {
+    .write = socket_write,
+};
 
 /**
  * Accept request from server socket.
@@ -20,48 +103,55 @@ int parse_request_headers(Request *r);
  *
  *  1. Allocates a request struct initialized to 0.
  *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  3. Accepts a client connection from the server socket, storing the
+ *     client address in the request struct.
+ *  4. Starts TLS on an HTTPS connection.
+ *  5. Returns the request struct.
+ *
+ * The client socket is non-blocking; the headers are read as they arrive with
+ * read_request.  If no client is waiting, NULL is returned with errno set to
+ * EAGAIN.
  *
  * The returned request struct must be deallocated using free_request.
  **/
 Request * accept_request(int sfd) {
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(raddr);
-
+    socklen_t rlen = sizeof(struct sockaddr_storage);
 
     /* Allocate request struct (zeroed) */
     Request *r = calloc(1, sizeof(Request));
+    if (!r) {
+        debug("Unable to allocate request: %s", strerror(errno));
+        return NULL;
+    }
+    r->target = -1;
+    r->length = -1;
+    r->carry  = -1;
 
     /* Accept a client */
-    r->fd = accept(sfd, &raddr, &rlen);
+    r->fd = accept4(sfd, (struct sockaddr *)&r->peer, &rlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if(r->fd < 0) {
-        debug("Unable to accept: %s", strerror(errno));
-        goto fail;
+        int error = errno;
+        free(r);
+        if (error != EAGAIN && error != EWOULDBLOCK) {
+            debug("Unable to accept: %s", strerror(error));
+            log("Failed to accept request");
+        }
+        errno = error;
+        return NULL;
     }
     debug("Client Accepted");
+    trace_start(r);
 
-
-    /* Lookup client information */
-    int flags = NI_NUMERICHOST | NI_NUMERICSERV;
-    int status  = getnameinfo(&raddr, rlen, r->host, NI_MAXHOST, r->port, NI_MAXSERV, flags);
-    if(status < 0) {
-        debug("Unable to get name info: %s", gai_strerror(status));
-        goto fail;
-    }
-    debug("Client Information...Host: %s | Port: %s", r->host, r->port);
-
-    /* Open socket stream */
-    r->file = fdopen(r->fd, "w+");
-    if(!r->file) {
-        debug("Unable to fdopen: %s\n", strerror(errno));
-        fclose(r->file);
-        goto fail;
+    /* Start TLS (the response stream is opened for each request) */
+    if(sfd == TlsSocket) {
+        if(tls_accept(r) < 0) {
+            goto fail;
+        }
+    } else {
+        r->plaintext = true;
     }
-    debug("Socket stream opened");
-    log("Accepted request from %s:%s", r->host, r->port);
+    r->responder = &Http1Responder;
+    log("Accepted request from %s", request_peer(r));
     return r;
 
 fail:
@@ -78,68 +168,347 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the request stream and socket (and releases any TLS state).
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
  **/
 void free_request(Request *r) {
     log("Attempting to free request struct");
-    
-    /* Close socket or fd */
+
     if(!r) {
         debug("NULL request struct");
-        free(r);
         return;
     }
 
-    if( fclose(r->file) < 0) {
+    /* Close stream and socket */
+    if (r->file) {
+        fclose(r->file);
+    }
+    if (r->fd >= 0) {
         close(r->fd);
-        return;
     }
+    tls_free(r);
 
-    /* Free allocated strings */
-    debug("Free Allocated strings");
-    if(r->method)
-        free(r->method);
-    if(r->uri) 
-        free(r->uri);
-    if(r->query)
-        free(r->query);
-    if(r->path)
-        free(r->path);
+    /* Free allocated strings and headers */
+    reset_request(r);
+    buffer_put(r->buffer, r->capacity);
+
+    /* Free request */
+    debug("Free request struct");
+    free(r);
+    log("Request freed");
+}
 
+/**
+ * Reset request struct for the next request on the same connection.
+ *
+ * @param   r           Request structure.
+ *
+ * This frees everything parsed from the current request and discards its
+ * header block from the input buffer, keeping any bytes the client has
+ * already sent for the next request.  Body bytes are removed from the buffer
+ * as they are read (see body_read), so whatever follows the header block by
+ * now belongs to the next request.
+ **/
+void reset_request(Request *r) {
+    /* Free allocated strings and close resolved file */
+    debug("Free Allocated strings");
+    free(r->method);
+    free(r->uri);
+    free(r->query);
+    free(r->path);
+    r->method = r->uri = r->query = r->path = NULL;
+
+    if (r->target >= 0) {
+        close(r->target);
+        r->target = -1;
+    }
 
-    
     /* Free headers */
     debug("Free Headers");
-    if(r->headers) {
-        Header *curr = r->headers;
-        Header *temp;
-        while(curr) {
-            temp = curr->next;
-            if(curr->name)
-                free(curr->name);
-
-            if(curr->value)
-                free(curr->value);
-
-            free(curr);
-            if(temp)
-                curr = temp;
-            else{
-                free(temp);
+    Header *curr = r->headers;
+    while(curr) {
+        Header *temp = curr->next;
+        free(curr->name);
+        free(curr->value);
+        free(curr);
+        curr = temp;
+    }
+    r->headers = NULL;
+
+    /* Discard consumed header block */
+    if (r->nheader) {
+        memmove(r->buffer, r->buffer + r->nheader, r->nbuffer - r->nheader);
+        r->nbuffer -= r->nheader;
+    }
+    r->nheader    = 0;
+    r->scanned    = 0;
+    r->parsed     = 0;
+    r->version    = 0;
+    r->keep_alive = false;
+    r->chunked    = false;
+    r->code       = 0;
+    r->sent       = 0;
+    r->unsized    = false;
+    r->route      = ROUTE_NONE;
+    r->error      = 0;
+    r->body       = BODY_NONE;
+    r->expect     = false;
+    r->length     = -1;
+    r->remaining  = 0;
+    r->received   = 0;
+    r->begun      = 0;
+}
+
+/**
+ * Open the response stream of a request.
+ *
+ * @param   r           Request structure.
+ * @return  Stream written by the handlers (or NULL on error).
+ *
+ * The stream stays open for the requests that follow at once and is closed by
+ * request_idle.
+ **/
+FILE * request_stream(Request *r) {
+    if (!r->file) {
+        r->file = r->plaintext ? fopencookie(r, "w", SocketStream) : tls_stream(r);
+        if (!r->file) {
+            debug("Unable to open response stream: %s", strerror(errno));
+        }
+    }
+    return r->file;
+}
+
+/**
+ * Replace the input of a request with what another process left unread.
+ *
+ * @param   r           Request structure (already parsed).
+ * @param   input       Bytes the process that served the request read past
+ * its body.
+ * @param   n           Number of bytes (at most REQUEST_MAX).
+ * @return  Whether the input was taken (otherwise the connection must close).
+ *
+ * A forked child reads the request body from its own copy of the buffer (and
+ * from the socket), so whatever the parent holds after the header block may
+ * be body bytes rather than the next request.
+ **/
+bool request_carry(Request *r, const char *input, size_t n) {
+    if (n > r->capacity) {
+        size_t capacity = REQUEST_CHUNK << buffer_class(n);
+        char  *buffer   = buffer_get(capacity);
+        if (!buffer) {
+            return false;
+        }
+        buffer_put(r->buffer, r->capacity);
+        r->buffer   = buffer;
+        r->capacity = capacity;
+    }
+    memcpy(r->buffer, input, n);
+    r->nbuffer = n;
+    r->nheader = 0;
+    return true;
+}
+
+/**
+ * Release what an idle connection does not need.
+ *
+ * @param   r           Request structure waiting for its next request.
+ *
+ * This closes the response stream and, unless the client has already sent
+ * part of its next request, returns the input buffer to the pool.
+ **/
+void request_idle(Request *r) {
+    if (r->file) {
+        fclose(r->file);
+        r->file = NULL;
+    }
+    if (r->nbuffer == 0) {
+        buffer_put(r->buffer, r->capacity);
+        r->buffer   = NULL;
+        r->capacity = 0;
+    }
+}
+
+/**
+ * Format client address.
+ *
+ * @param   r           Request structure.
+ * @param   host        Buffer of at least INET6_ADDRSTRLEN bytes.
+ * @return  host, holding the numeric address of the client.
+ **/
+char * request_host(const Request *r, char *host) {
+    const struct sockaddr_in  *in  = (const struct sockaddr_in *)&r->peer;
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&r->peer;
+
+    if (r->peer.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, INET6_ADDRSTRLEN);
+    } else if (r->peer.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &in->sin_addr, host, INET6_ADDRSTRLEN);
+    } else {
+        strcpy(host, "unknown");
+    }
+    return host;
+}
+
+/**
+ * Return client port.
+ *
+ * @param   r           Request structure.
+ * @return  Port number of the client (0 if unknown).
+ **/
+int request_port(const Request *r) {
+    switch (r->peer.ss_family) {
+    case AF_INET:
+        return ntohs(((const struct sockaddr_in *)&r->peer)->sin_port);
+    case AF_INET6:
+        return ntohs(((const struct sockaddr_in6 *)&r->peer)->sin6_port);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Format client address and port for logging.
+ *
+ * @param   r           Request structure.
+ * @return  Static string such as "127.0.0.1:5000" or "[::1]:5000",
+ * overwritten by the next call.
+ **/
+const char * request_peer(const Request *r) {
+    static char peer[INET6_ADDRSTRLEN + 16];
+    char host[INET6_ADDRSTRLEN];
+
+    request_host(r, host);
+    snprintf(peer, sizeof(peer), r->peer.ss_family == AF_INET6 ? "[%s]:%d" : "%s:%d", host, request_port(r));
+    return peer;
+}
+
+/**
+ * Check buffered input for a complete header block.
+ *
+ * @param   r           Request structure.
+ * @return  Whether the header block (or an unrecoverable part of it) is complete.
+ *
+ * Besides the blank line ending the headers, a request line without a URI or
+ * a header line without a colon also completes the block so the client gets
+ * its 400 without waiting for a deadline.
+ **/
+static bool request_complete(Request *r) {
+    const char *nl;
+
+    while ((nl = scan_find(r->buffer + r->scanned, r->nbuffer - r->scanned, "\n"))) {
+        const char *line = r->buffer + r->scanned;
+        size_t      n    = nl - line;
+        if (n > 0 && line[n - 1] == '\r') {
+            n--;
+        }
+
+        r->scanned = nl + 1 - r->buffer;
+        if (n == 0 && line != r->buffer) {
+            r->nheader = r->scanned;
+            return true;
+        }
+
+        const char *mark = line == r->buffer ? " " : ":";
+        if (n == 0 || !scan_find(line, n, mark)) {
+            r->nheader = r->scanned;
+            return true;
+        }
+    }
+
+    if (r->eof && r->nbuffer > 0) {
+        r->nheader = r->nbuffer;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Read available request bytes from client socket.
+ *
+ * @param   r           Request structure.
+ * @return  1 if the header block is complete, 0 if more input is needed, and
+ * -1 if the connection was closed (or errno is E2BIG if the headers are too
+ * large).
+ **/
+int read_request(Request *r) {
+    while (!r->eof) {
+        /* Grow buffer on demand so a client trickling bytes stays small */
+        if (r->nbuffer == r->capacity) {
+            if (r->capacity == REQUEST_MAX) {
                 break;
             }
+            size_t capacity = r->capacity ? r->capacity * 2 : REQUEST_CHUNK;
+            if (capacity > REQUEST_MAX) {
+                capacity = REQUEST_MAX;
+            }
+            char *buffer = buffer_get(capacity);
+            if (!buffer) {
+                return -1;
+            }
+            memcpy(buffer, r->buffer, r->nbuffer);
+            buffer_put(r->buffer, r->capacity);
+            r->buffer   = buffer;
+            r->capacity = capacity;
         }
+
+        size_t  size  = r->capacity - r->nbuffer;
+        ssize_t nread = r->tls ? tls_recv(r, r->buffer + r->nbuffer, size)
+                               : recv(r->fd, r->buffer + r->nbuffer, size, 0);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            debug("Unable to read request: %s", strerror(errno));
+            return -1;
+        }
+        if (nread == 0) {
+            r->eof = true;
+            break;
+        }
+        r->nbuffer += nread;
     }
-    else
-        free(r->headers);
 
-    /* Free request */
-    debug("Free request struct");
-    free(r);
-    log("Request freed");
+    if (request_complete(r)) {
+        return 1;
+    }
+    if (r->eof) {
+        return -1;
+    }
+    if (r->nbuffer == REQUEST_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Return next line of the header block.
+ *
+ * @param   r           Request structure.
+ * @return  Pointer to NUL-terminated line without its line ending (or NULL at
+ * the end of the header block).
+ **/
+static char * request_line(Request *r) {
+    if (r->parsed >= r->nheader) {
+        return NULL;
+    }
+
+    char       *line = r->buffer + r->parsed;
+    size_t      left = r->nheader - r->parsed;
+    const char *nl   = scan_find(line, left, "\n");
+    size_t      n    = nl ? (size_t)(nl - line) : left;
+
+    r->parsed += nl ? n + 1 : n;
+    if (n > 0 && line[n - 1] == '\r') {
+        n--;
+    }
+    line[n] = '\0';
+    return line;
 }
 
 /**
@@ -148,11 +517,11 @@ void free_request(Request *r) {
  * @param   r           Request structure.
  * @return  -1 on error and 0 on success.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This function first parses the request method, any query, the headers,
+ * and then how any body is framed, returning 0 on success, and -1 on error.
  **/
 int parse_request(Request *r) {
-   if(!r) {
+   if(!r || !r->nheader) {
        debug("NULL Request. Can not parse");
        return -1;
    }
@@ -172,6 +541,12 @@ int parse_request(Request *r) {
         debug("Unable to parse request headers: %s", strerror(errno));
         return -1;
     }
+
+    /* Parse HTTP Request Body framing */
+    if(parse_request_body(r) < 0) {
+        debug("Unable to parse request body framing");
+        return -1;
+    }
     return 0;
 }
 
@@ -190,44 +565,47 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and version.
  **/
 int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
+    char *buffer;
     char *method;
     char *uri;
     char *query;
+    char *version;
+    char *state;
 
-    /* Read line from socket */
-    if(!fgets(buffer, BUFSIZ, r->file)) {
-        debug("Fgets failed: %s", strerror(errno));
+    /* Read line from header block */
+    if(!(buffer = request_line(r))) {
+        debug("No request line");
         goto fail;
     }
-    debug("Initial input buffer: %s", buffer); 
+    debug("Initial input buffer: %s", buffer);
 
-    /* Parse method and uri */
-    method = strtok(buffer, WHITESPACE);
-    r->method = strdup(method);
-    uri = strtok(NULL, WHITESPACE);
-
-    query = strtok(uri, "?");
-    query = strtok(NULL, WHITESPACE);
+    /* Parse method, uri, and version */
+    method  = strtok_r(buffer, WHITESPACE, &state);
+    uri     = strtok_r(NULL, WHITESPACE, &state);
+    version = strtok_r(NULL, WHITESPACE, &state);
+    if(!method || !uri) {
+        goto fail;
+    }
 
     /* Parse query from uri */
+    query = strchr(uri, '?');
     if(query) {
-        uri = strtok(uri, "?");
-        r->query = strdup(query);
+        *query++ = '\0';
     } else {
-        query = " ";
-        r->query = strdup(query);
+        query = "";
     }
 
-    if(uri)
-        r->uri = strdup(uri);
-    else 
-        goto fail;
-
     /* Record method, uri, and query in request struct */
+    r->method = strdup(method);
+    r->uri    = strdup(uri);
+    r->query  = strdup(query);
+
+    /* HTTP/1.1 connections persist unless the client says otherwise */
+    r->version    = version && streq(version, "HTTP/1.1") ? 1 : 0;
+    r->keep_alive = r->version == 1;
 
     log("HTTP METHOD: %s", r->method);
     log("HTTP URI:    %s", r->uri);
@@ -259,58 +637,71 @@ fail:
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
- * This function parses the stream from the request socket using the following
- * pseudo-code:
+ * This function parses the header block read from the request socket using
+ * the following pseudo-code:
  *
- *  while (buffer = read_from_socket() and buffer is not empty):
+ *  while (buffer = next_line() and buffer is not empty):
  *      name, value = buffer.split(':')
  *      header      = new Header(name, value)
  *      headers.append(header)
  **/
 int parse_request_headers(Request *r) {
-    Header *tail;
-    char buffer[BUFSIZ];
-    char *name;
-    char *value;
-
-    /* Parse headers from socket */
-    while( fgets(buffer, BUFSIZ, r->file) && strlen(buffer) > 2){
-        Header *curr = calloc(1, sizeof(Header));
-
-        chomp(buffer);
+    Header *tail = NULL;
+    char *buffer;
+
+    /* Parse headers from header block */
+    while ((buffer = request_line(r))) {
+        size_t length = strlen(buffer);
+        if (length == 0) {
+            break;
+        }
         debug("Current header buffer: %s", buffer);
 
-        name = strtok(buffer,":");
-        if(!name){
-            free(curr);
+        /* Split name and value on the first colon */
+        const char *colon = scan_find(buffer, length, ":");
+        if (!colon || colon == buffer) {
             goto fail;
         }
-        value = strtok(NULL, WHITESPACE);
-        if(!value){
-            free(curr);
+
+        const char *value = scan_skip(colon + 1, buffer + length - colon - 1, " \t");
+        if (!value) {
             goto fail;
         }
+        const char *end = buffer + length;
+        while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
 
-        value = skip_whitespace(value); 
-
-        curr->name = strdup(name);
-        curr->value = strdup(value);
+        Header *curr = calloc(1, sizeof(Header));
+        if (!curr) {
+            goto fail;
+        }
+        curr->name  = strndup(buffer, colon - buffer);
+        curr->value = strndup(value, end - value);
+        curr->id    = scan_header(buffer, colon - buffer);
 
         debug("Current name: %s", curr->name);
         debug("Current value: %s", curr->value);
-    
-        if(!(r->headers))
+
+        if (curr->id == HEADER_CONNECTION) {
+            if (strcasestr(curr->value, "close")) {
+                r->keep_alive = false;
+            } else if (strcasestr(curr->value, "keep-alive")) {
+                r->keep_alive = true;
+            }
+        }
+
+        if (!(r->headers))
             r->headers = curr;
         else
             tail->next = curr;
 
-
         tail = curr;
     }
 
     if(r->headers == NULL)
         goto fail;
- 
+
 
 #ifndef NDEBUG
    for (struct header *header = r->headers; header; header = header->next) {
@@ -324,6 +715,65 @@ fail:
     return -1;
 }
 
-/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
+/**
+ * Determine how the request body is framed.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * A body is announced by Content-Length or by Transfer-Encoding: chunked.  A
+ * request with both, with two different lengths, or with any other transfer
+ * coding is refused, since a proxy in front of the server might frame it
+ * differently.  Expect: 100-continue is remembered so the interim response
+ * is only sent once a handler reads the body (see body_read).
+ **/
+static int parse_request_body(Request *r) {
+    bool chunked = false;
+
+    for (Header *header = r->headers; header; header = header->next) {
+        switch (header->id) {
+        case HEADER_CONTENT_LENGTH: {
+            char *end;
+            errno = 0;
+            long long length = strtoll(header->value, &end, 10);
+            if (!isdigit((unsigned char)header->value[0]) || *end || errno) {
+                goto fail;
+            }
+            if (r->length >= 0 && r->length != length) {
+                goto fail;
+            }
+            r->length = length;
+            break;
+        }
+        case HEADER_TRANSFER_ENCODING:
+            if (strcasecmp(header->value, "chunked") != 0) {
+                goto fail;
+            }
+            chunked = true;
+            break;
+        case HEADER_EXPECT:
+            r->expect = strcasecmp(header->value, "100-continue") == 0;
+            break;
+        default:
+            break;
+        }
+    }
 
+    if (chunked) {
+        if (r->length >= 0) {
+            goto fail;
+        }
+        r->body = BODY_CHUNK_SIZE;
+    } else if (r->length > 0) {
+        r->body      = BODY_LENGTH;
+        r->remaining = r->length;
+    }
+    r->expect = r->expect && r->body != BODY_NONE && r->version == 1;
+    return 0;
+
+fail:
+    log("Parse request body framing failed");
+    return -1;
+}
 
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
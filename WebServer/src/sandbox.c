@@ -0,0 +1,283 @@
+/* sandbox.c: Confined CGI Script Processes */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+
+#include <linux/magic.h>
+#include <sys/pidfd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * CGI scripts run through a short sh prologue that confines them before the
+ * script itself is exec'd: it moves the shell into the CGI cgroup and sets
+ * the CPU time (CgiCpu) and address space (CgiMemory) limits, so there is no
+ * moment in which a script runs unconfined.  Each script leads a process
+ * group of its own, and at its deadline (CgiTimeout seconds after it
+ * started, or the request's write deadline) the whole group is killed.
+ * Waiting for a script to exit polls a pidfd, so on a coroutine the rest of
+ * the server keeps running meanwhile.
+ *
+ * The cgroup (a cgroup v2 directory, created if needed) holds every script
+ * at once, and its cpu.max and memory.max cap what they take together, so
+ * static files keep the rest of the machine however busy the scripts are.
+ * If cgroup v2 is unavailable, or the limits cannot be set because the
+ * controllers are not delegated, the server says so at startup and carries
+ * on with what it has.
+ *
+ * Scripts the server kills are counted in cgi_killed, scripts ended by their
+ * own CPU or memory limits in cgi_limited, and cgi_throttled follows the
+ * cgroup's count of periods in which the scripts were throttled.
+ **/
+
+#define SANDBOX_PERIOD  100000          /* cpu.max period (us) */
+
+/* Globals */
+
+static char Command[PATH_MAX + 128] = "exec \"$0\"";   /* Prologue run by sh -c */
+static int  CgroupFd = -1;              /* CGI cgroup directory (-1 if none) */
+
+/* Functions */
+
+/* Write a value to a cgroup control file */
+static int sandbox_write(const char *directory, const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+/* Set a cgroup limit, enabling its controller in the parent if needed */
+static void sandbox_limit(const char *controller, const char *file, const char *value) {
+    char parent[PATH_MAX];
+    char enable[32];
+
+    if (sandbox_write(CgroupPath, file, value) == 0) {
+        return;
+    }
+
+    snprintf(parent, sizeof(parent), "%s/..", CgroupPath);
+    snprintf(enable, sizeof(enable), "+%s", controller);
+    if (sandbox_write(parent, "cgroup.subtree_control", enable) < 0 ||
+        sandbox_write(CgroupPath, file, value) < 0) {
+        log("Unable to set %s for CGI scripts (is the %s controller delegated?)", file, controller);
+    }
+}
+
+/* Create and limit the CGI cgroup */
+static int sandbox_cgroup(void) {
+    struct statfs fs;
+    char          value[64];
+
+    if (strchr(CgroupPath, '\'')) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mkdir(CgroupPath, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (statfs(CgroupPath, &fs) < 0) {
+        return -1;
+    }
+    if (fs.f_type != CGROUP2_SUPER_MAGIC) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    CgroupFd = open(CgroupPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (CgroupFd < 0) {
+        return -1;
+    }
+    if (faccessat(CgroupFd, "cgroup.procs", W_OK, 0) < 0) {
+        close(CgroupFd);
+        CgroupFd = -1;
+        return -1;
+    }
+
+    if (CgroupCpu > 0) {
+        snprintf(value, sizeof(value), "%d %d", CgroupCpu * (SANDBOX_PERIOD / 100), SANDBOX_PERIOD);
+        sandbox_limit("cpu", "cpu.max", value);
+    }
+    if (CgroupMemory > 0) {
+        snprintf(value, sizeof(value), "%lld", (long long)CgroupMemory << 20);
+        sandbox_limit("memory", "memory.max", value);
+    }
+    return 0;
+}
+
+/* Follow the cgroup's throttling count */
+static void sandbox_throttled(void) {
+    char  line[BUFSIZ];
+    int   fd = openat(CgroupFd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+    FILE *stream = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (!stream) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    unsigned long throttled;
+    while (fgets(line, sizeof(line), stream)) {
+        if (sscanf(line, "nr_throttled %lu", &throttled) == 1) {
+            stats_set(cgi_throttled, throttled);
+            break;
+        }
+    }
+    fclose(stream);
+}
+
+/**
+ * Prepare the confinement of CGI scripts.
+ *
+ * Limits that cannot be applied are reported and left out.
+ **/
+void sandbox_init(void) {
+    size_t n = 0;
+
+    if (CgroupPath && sandbox_cgroup() < 0) {
+        log("CGI scripts run outside cgroup %s: %s", CgroupPath, strerror(errno));
+    }
+
+    if (CgroupFd >= 0) {
+        n += snprintf(Command + n, sizeof(Command) - n, "echo $$ > '%s/cgroup.procs' && ", CgroupPath);
+    }
+    if (CgiCpu > 0) {
+        n += snprintf(Command + n, sizeof(Command) - n, "ulimit -t %d && ", CgiCpu);
+    }
+    if (CgiMemory > 0) {
+        n += snprintf(Command + n, sizeof(Command) - n, "ulimit -v %ld && ", (long)CgiMemory * 1024);
+    }
+    snprintf(Command + n, sizeof(Command) - n, "exec \"$0\"");
+    debug("CGI prologue: %s", Command);
+}
+
+/**
+ * Start a CGI script with pipes to its stdin and from its stdout.
+ *
+ * @param   path        Path of script.
+ * @param   input       Set to the write end of the script's stdin.
+ * @param   output      Set to the read end of the script's stdout.
+ * @return  Process ID of the script (and its process group), or -1 with
+ * errno set.
+ **/
+pid_t sandbox_spawn(const char *path, int *input, int *output) {
+    extern char **environ;
+    int   in[2], out[2];
+    pid_t pid;
+
+    if (pipe2(in, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+
+    /* Scripts start with no signals blocked and SIGPIPE at its default */
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attributes;
+    sigset_t                   signals;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+
+    char *argv[] = {"sh", "-c", Command, (char *)path, NULL};
+    int error = posix_spawn(&pid, "/bin/sh", &actions, &attributes, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+
+    close(in[0]);
+    close(out[1]);
+    if (error) {
+        close(in[1]);
+        close(out[0]);
+        errno = error;
+        return -1;
+    }
+    *input  = in[1];
+    *output = out[0];
+    return pid;
+}
+
+/**
+ * Kill a CGI script (and everything it started) and reap it.
+ *
+ * @param   pid         Process ID returned by sandbox_spawn.
+ **/
+void sandbox_kill(pid_t pid) {
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    stats_add(cgi_killed, 1);
+}
+
+/**
+ * Wait for a CGI script to exit, killing it at its deadline.
+ *
+ * @param   pid         Process ID returned by sandbox_spawn.
+ * @param   deadline    timer_now() time to kill the script at (0 for none).
+ * @return  Whether the script exited on its own.
+ *
+ * The request's write deadline also ends the wait.
+ **/
+bool sandbox_wait(pid_t pid, uint64_t deadline) {
+    int   status;
+    pid_t reaped = 0;
+    int   pidfd  = pidfd_open(pid, 0);
+
+    if (pidfd >= 0) {
+        uint64_t now   = timer_now();
+        int      ready = deadline == 0 ? coroutine_poll(pidfd, POLLIN, -1) :
+                         now < deadline ? coroutine_poll(pidfd, POLLIN, deadline - now) : 0;
+        close(pidfd);
+
+        /* A wait interrupted by another signal may have seen the exit */
+        if (ready <= 0 && (reaped = waitpid(pid, &status, WNOHANG)) == 0) {
+            log("Killing CGI script %d at its deadline", pid);
+            sandbox_kill(pid);
+            return false;
+        }
+    }
+
+    if (reaped == 0) {
+        reaped = waitpid(pid, &status, 0);
+    }
+    if (reaped < 0) {
+        return false;
+    }
+    if (WIFSIGNALED(status) && (WTERMSIG(status) == SIGXCPU || WTERMSIG(status) == SIGKILL)) {
+        log("CGI script %d ended by its limits", pid);
+        stats_add(cgi_limited, 1);
+    }
+    if (CgroupFd >= 0) {
+        sandbox_throttled();
+    }
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,386 @@
+/* scan.c: Vectorized header scanning */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/* Known Header Names */
+
+typedef struct {
+    const char *name;                   /*< Lowercase header name */
+    size_t      length;                 /*< Length of header name */
+    HeaderId    id;                     /*< Header identifier */
+} HeaderName;
+
+#define HEADER_NAME(s, id)  { s, sizeof(s) - 1, id }
+
+static const HeaderName HeaderNames[] = {
+    HEADER_NAME("accept",               HEADER_ACCEPT),
+    HEADER_NAME("accept-encoding",      HEADER_ACCEPT_ENCODING),
+    HEADER_NAME("accept-language",      HEADER_ACCEPT_LANGUAGE),
+    HEADER_NAME("authorization",        HEADER_AUTHORIZATION),
+    HEADER_NAME("cache-control",        HEADER_CACHE_CONTROL),
+    HEADER_NAME("connection",           HEADER_CONNECTION),
+    HEADER_NAME("content-length",       HEADER_CONTENT_LENGTH),
+    HEADER_NAME("content-type",         HEADER_CONTENT_TYPE),
+    HEADER_NAME("cookie",               HEADER_COOKIE),
+    HEADER_NAME("expect",               HEADER_EXPECT),
+    HEADER_NAME("host",                 HEADER_HOST),
+    HEADER_NAME("http2-settings",       HEADER_HTTP2_SETTINGS),
+    HEADER_NAME("if-modified-since",    HEADER_IF_MODIFIED_SINCE),
+    HEADER_NAME("if-none-match",        HEADER_IF_NONE_MATCH),
+    HEADER_NAME("range",                HEADER_RANGE),
+    HEADER_NAME("referer",              HEADER_REFERER),
+    HEADER_NAME("transfer-encoding",    HEADER_TRANSFER_ENCODING),
+    HEADER_NAME("upgrade",              HEADER_UPGRADE),
+    HEADER_NAME("user-agent",           HEADER_USER_AGENT),
+    HEADER_NAME("x-forwarded-for",      HEADER_X_FORWARDED_FOR),
+};
+
+#define NHEADER_NAMES   (sizeof(HeaderNames) / sizeof(HeaderNames[0]))
+#define SCAN_NAME_MAX   32              /* Longest name the vector lookup handles */
+
+/* Header names zero-padded to a full vector, indexed like HeaderNames */
+static char HeaderVectors[NHEADER_NAMES][SCAN_NAME_MAX] __attribute__((aligned(32)));
+
+/* Scalar Implementation */
+
+static const char * scan_find_scalar(const char *s, size_t n, const char *set, size_t nset) {
+    for (const char *end = s + n; s < end; s++) {
+        if (memchr(set, *s, nset)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static const char * scan_skip_scalar(const char *s, size_t n, const char *set, size_t nset) {
+    for (const char *end = s + n; s < end; s++) {
+        if (!memchr(set, *s, nset)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static HeaderId scan_header_scalar(const char *name, size_t n) {
+    for (size_t i = 0; i < NHEADER_NAMES; i++) {
+        if (HeaderNames[i].length == n && strncasecmp(HeaderNames[i].name, name, n) == 0) {
+            return HeaderNames[i].id;
+        }
+    }
+    return HEADER_UNKNOWN;
+}
+
+#ifdef SCAN_X86
+
+/* SSE4.2 Implementation
+ *
+ * PCMPESTRI compares each byte of a 16 byte block against every byte of the
+ * set at once, so each iteration consumes 16 bytes regardless of set size.
+ * The final partial block is copied into a local buffer so we never read past
+ * the end of the caller's data.
+ */
+
+#define SSE_FIND    (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT)
+#define SSE_SKIP    (SSE_FIND | _SIDD_MASKED_NEGATIVE_POLARITY)
+
+__attribute__((target("sse4.2")))
+static const char * scan_find_sse42(const char *s, size_t n, const char *set, size_t nset) {
+    char   pad[16] __attribute__((aligned(16))) = {0};
+    memcpy(pad, set, nset);
+    __m128i vset = _mm_load_si128((const __m128i *)pad);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+        int     index = _mm_cmpestri(vset, nset, block, 16, SSE_FIND);
+        if (index < 16) {
+            return s + i + index;
+        }
+    }
+
+    if (i < n) {
+        char tail[16] __attribute__((aligned(16)));
+        memcpy(tail, s + i, n - i);
+        __m128i block = _mm_load_si128((const __m128i *)tail);
+        int     index = _mm_cmpestri(vset, nset, block, n - i, SSE_FIND);
+        if (index < (int)(n - i)) {
+            return s + i + index;
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("sse4.2")))
+static const char * scan_skip_sse42(const char *s, size_t n, const char *set, size_t nset) {
+    char   pad[16] __attribute__((aligned(16))) = {0};
+    memcpy(pad, set, nset);
+    __m128i vset = _mm_load_si128((const __m128i *)pad);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+        int     index = _mm_cmpestri(vset, nset, block, 16, SSE_SKIP);
+        if (index < 16) {
+            return s + i + index;
+        }
+    }
+
+    if (i < n) {
+        char tail[16] __attribute__((aligned(16)));
+        memcpy(tail, s + i, n - i);
+        __m128i block = _mm_load_si128((const __m128i *)tail);
+        int     index = _mm_cmpestri(vset, nset, block, n - i, SSE_SKIP);
+        if (index < (int)(n - i)) {
+            return s + i + index;
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i scan_lower_sse(__m128i v) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse4.2")))
+static HeaderId scan_header_sse42(const char *name, size_t n) {
+    if (n == 0 || n > SCAN_NAME_MAX) {
+        return HEADER_UNKNOWN;
+    }
+
+    char pad[SCAN_NAME_MAX] __attribute__((aligned(16))) = {0};
+    memcpy(pad, name, n);
+    __m128i lo = scan_lower_sse(_mm_load_si128((const __m128i *)pad));
+    __m128i hi = scan_lower_sse(_mm_load_si128((const __m128i *)(pad + 16)));
+
+    for (size_t i = 0; i < NHEADER_NAMES; i++) {
+        if (HeaderNames[i].length != n) {
+            continue;
+        }
+        __m128i elo = _mm_cmpeq_epi8(lo, _mm_load_si128((const __m128i *)HeaderVectors[i]));
+        __m128i ehi = _mm_cmpeq_epi8(hi, _mm_load_si128((const __m128i *)(HeaderVectors[i] + 16)));
+        if (_mm_movemask_epi8(_mm_and_si128(elo, ehi)) == 0xFFFF) {
+            return HeaderNames[i].id;
+        }
+    }
+    return HEADER_UNKNOWN;
+}
+
+/* AVX2 Implementation
+ *
+ * AVX2 has no string compare instruction, so each set byte is broadcast into
+ * its own register and compared 32 bytes at a time.  Header scans use sets of
+ * one to four bytes, which keeps this cheaper than PCMPESTRI per byte.
+ */
+
+__attribute__((target("avx2")))
+static inline unsigned int scan_mask_avx2(__m256i block, const __m256i *vset, size_t nset) {
+    __m256i hits = _mm256_cmpeq_epi8(block, vset[0]);
+    for (size_t k = 1; k < nset; k++) {
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, vset[k]));
+    }
+    return (unsigned int)_mm256_movemask_epi8(hits);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_avx2(const char *s, size_t n, const char *set, size_t nset, bool skip) {
+    __m256i vset[16];
+    for (size_t k = 0; k < nset; k++) {
+        vset[k] = _mm256_set1_epi8(set[k]);
+    }
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i      block = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned int mask  = scan_mask_avx2(block, vset, nset);
+        if (skip) {
+            mask = ~mask;
+        }
+        if (mask) {
+            return s + i + __builtin_ctz(mask);
+        }
+    }
+
+    if (i < n) {
+        char tail[32] __attribute__((aligned(32)));
+        memcpy(tail, s + i, n - i);
+        __m256i      block = _mm256_load_si256((const __m256i *)tail);
+        unsigned int mask  = scan_mask_avx2(block, vset, nset);
+        if (skip) {
+            mask = ~mask;
+        }
+        mask &= (n - i == 32) ? ~0u : ((1u << (n - i)) - 1);
+        if (mask) {
+            return s + i + __builtin_ctz(mask);
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static const char * scan_find_avx2(const char *s, size_t n, const char *set, size_t nset) {
+    return scan_avx2(s, n, set, nset, false);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_skip_avx2(const char *s, size_t n, const char *set, size_t nset) {
+    return scan_avx2(s, n, set, nset, true);
+}
+
+__attribute__((target("avx2")))
+static HeaderId scan_header_avx2(const char *name, size_t n) {
+    if (n == 0 || n > SCAN_NAME_MAX) {
+        return HEADER_UNKNOWN;
+    }
+
+    char pad[SCAN_NAME_MAX] __attribute__((aligned(32))) = {0};
+    memcpy(pad, name, n);
+    __m256i v     = _mm256_load_si256((const __m256i *)pad);
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    v = _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+
+    for (size_t i = 0; i < NHEADER_NAMES; i++) {
+        if (HeaderNames[i].length != n) {
+            continue;
+        }
+        __m256i eq = _mm256_cmpeq_epi8(v, _mm256_load_si256((const __m256i *)HeaderVectors[i]));
+        if ((unsigned int)_mm256_movemask_epi8(eq) == 0xFFFFFFFFu) {
+            return HeaderNames[i].id;
+        }
+    }
+    return HEADER_UNKNOWN;
+}
+
+#endif
+
+/* Dispatch */
+
+typedef const char * (*ScanFunction)(const char *, size_t, const char *, size_t);
+typedef HeaderId     (*HeaderFunction)(const char *, size_t);
+
+static ScanFunction   ScanFind   = scan_find_scalar;
+static ScanFunction   ScanSkip   = scan_skip_scalar;
+static HeaderFunction ScanHeader = scan_header_scalar;
+
+/**
+ * Select scanning implementation.
+ *
+ * @param   mode        Requested implementation (SCAN_AUTO picks the best one
+ *                      the CPU supports).
+ * @return  Whether or not the requested implementation is supported.
+ *
+ * Unsupported requests leave the current selection alone.
+ **/
+bool scan_init(ScanMode mode) {
+    static bool initialized = false;
+    if (!initialized) {
+        for (size_t i = 0; i < NHEADER_NAMES; i++) {
+            memcpy(HeaderVectors[i], HeaderNames[i].name, HeaderNames[i].length);
+        }
+        initialized = true;
+    }
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (mode == SCAN_AUTO) {
+        mode = __builtin_cpu_supports("avx2")   ? SCAN_AVX2  :
+               __builtin_cpu_supports("sse4.2") ? SCAN_SSE42 : SCAN_SCALAR;
+    }
+
+    switch (mode) {
+    case SCAN_AVX2:
+        if (!__builtin_cpu_supports("avx2")) {
+            return false;
+        }
+        ScanFind   = scan_find_avx2;
+        ScanSkip   = scan_skip_avx2;
+        ScanHeader = scan_header_avx2;
+        break;
+    case SCAN_SSE42:
+        if (!__builtin_cpu_supports("sse4.2")) {
+            return false;
+        }
+        ScanFind   = scan_find_sse42;
+        ScanSkip   = scan_skip_sse42;
+        ScanHeader = scan_header_sse42;
+        break;
+    default:
+        ScanFind   = scan_find_scalar;
+        ScanSkip   = scan_skip_scalar;
+        ScanHeader = scan_header_scalar;
+        break;
+    }
+    debug("Scanning implementation: %s", scan_name());
+    return true;
+#else
+    if (mode != SCAN_AUTO && mode != SCAN_SCALAR) {
+        return false;
+    }
+    return true;
+#endif
+}
+
+/**
+ * Return name of current scanning implementation.
+ **/
+const char * scan_name(void) {
+#ifdef SCAN_X86
+    if (ScanFind == scan_find_avx2) {
+        return "avx2";
+    }
+    if (ScanFind == scan_find_sse42) {
+        return "sse4.2";
+    }
+#endif
+    return "scalar";
+}
+
+/**
+ * Find first byte in set.
+ *
+ * @param   s           Data to scan.
+ * @param   n           Number of bytes in s.
+ * @param   set         String of bytes to look for (at most 16).
+ * @return  Pointer to first byte of s that is in set (or NULL if none).
+ **/
+const char * scan_find(const char *s, size_t n, const char *set) {
+    return ScanFind(s, n, set, strlen(set));
+}
+
+/**
+ * Find first byte not in set.
+ *
+ * @param   s           Data to scan.
+ * @param   n           Number of bytes in s.
+ * @param   set         String of bytes to skip over (at most 16).
+ * @return  Pointer to first byte of s that is not in set (or NULL if none).
+ **/
+const char * scan_skip(const char *s, size_t n, const char *set) {
+    return ScanSkip(s, n, set, strlen(set));
+}
+
+/**
+ * Identify header name.
+ *
+ * @param   name        Header name (not necessarily NUL-terminated).
+ * @param   n           Length of name.
+ * @return  Corresponding HeaderId (HEADER_UNKNOWN if not a known header).
+ *
+ * Header names are matched case-insensitively.
+ **/
+HeaderId scan_header(const char *name, size_t n) {
+    return ScanHeader(name, n);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
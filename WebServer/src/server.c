@@ -0,0 +1,785 @@
+/* server.c: Connection Event Loop */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/**
+ * Every concurrency mode shares this loop.  It accepts clients, reads their
+ * request headers without blocking, and enforces every connection deadline
+ * with one timer wheel, so a client that trickles its headers (or never sends
+ * them) only costs a file descriptor and a Request until it is evicted with a
+ * 408.  Once a header block is complete the request is routed and, if the
+ * admission limits allow, handed to the mode's dispatch function.  Otherwise
+ * it waits in a bounded queue and is shed with a prebuilt 503 if the queue is
+ * full or it is not admitted within QueueTimeout milliseconds, so an overload
+ * costs the excess clients one short response instead of slowing everyone.
+ *
+ * HTTPS clients arrive on a second server socket and finish their TLS
+ * handshake under the header deadline before any input is read.
+ *
+ * A mode that keeps work of its own (such as coroutines waiting for their
+ * sockets) can have the loop wake up when a descriptor becomes readable; its
+ * idle function then picks up the work.
+ *
+ * SIGHUP starts an upgraded server on the same sockets.  Once it is serving,
+ * this loop stops accepting, closes idle connections, answers every request
+ * still arriving with Connection: close, and returns when the last connection
+ * is done or WriteTimeout seconds have passed.
+ **/
+
+#define MAX_EVENTS      64
+
+#define request_of(t)   ((Request *)((char *)(t) - offsetof(Request, timer)))
+
+/* Globals */
+
+static TimerWheel   Wheel;
+static int          ServerFd = -1;
+static int          EventFd  = -1;
+static int          WakeFd   = -1;     /* Extra descriptor that wakes the loop */
+static int          UpgradeFd = -1;     /* Readiness pipe of upgraded server (-1 if none) */
+static uint64_t     Retiring = 0;       /* Time to stop draining connections (0 if serving) */
+static Request     *Ready    = NULL;    /* Kept-alive requests with buffered input */
+static Request     *Queue    = NULL;    /* Requests waiting for admission */
+static Request    **QueueTail = &Queue;
+static int          Queued   = 0;
+static bool         Draining = false;
+static Disposition (*Dispatch)(Request *);
+static sigset_t     BlockedSignals;
+static sigset_t     OriginalSignals;
+
+static volatile sig_atomic_t DumpStats = 0;
+static volatile sig_atomic_t ReopenLog = 0;
+static volatile sig_atomic_t Upgrade   = 0;
+static volatile sig_atomic_t Shutdown  = 0;
+
+static const char TimeoutResponse[] =
+    "HTTP/1.0 408 Request Timeout\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: 29\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "<h1>408 Request Timeout</h1>\n";
+
+static const char TooLargeResponse[] =
+    "HTTP/1.0 400 Bad Request\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: 25\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "<h1>400 Bad Request</h1>\n";
+
+static const char UnavailableResponse[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: 33\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "<h1>503 Service Unavailable</h1>\n";
+
+static const char TooManyResponse[] =
+    "HTTP/1.0 429 Too Many Requests\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: 31\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "<h1>429 Too Many Requests</h1>\n";
+
+/* Signal Handlers */
+
+static void signal_interrupt(int signum) {
+    /* Only here to interrupt blocking system calls */
+    (void)signum;
+}
+
+static void signal_stats(int signum) {
+    (void)signum;
+    DumpStats = 1;
+}
+
+static void signal_reopen(int signum) {
+    (void)signum;
+    ReopenLog = 1;
+}
+
+static void signal_upgrade(int signum) {
+    (void)signum;
+    Upgrade = 1;
+}
+
+static void signal_shutdown(int signum) {
+    (void)signum;
+    Shutdown = 1;
+}
+
+/* Connection Functions */
+
+static void server_watch(Request *r) {
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLRDHUP,
+        .data.ptr = r,
+    };
+    if (epoll_ctl(EventFd, EPOLL_CTL_ADD, r->fd, &event) < 0) {
+        debug("Unable to watch client: %s", strerror(errno));
+    }
+}
+
+static void server_unwatch(Request *r) {
+    epoll_ctl(EventFd, EPOLL_CTL_DEL, r->fd, NULL);
+}
+
+static void set_blocking(int fd, bool blocking) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+    }
+}
+
+/**
+ * Close connection and release request.
+ *
+ * @param   r           Request structure.
+ **/
+void server_close(Request *r) {
+    timer_cancel(&Wheel, &r->timer);
+    server_unwatch(r);
+    stats_sub(connections_active, 1);
+    free_request(r);
+}
+
+/* Record a prebuilt response in the access log */
+static void server_logged(Request *r, const char *response, size_t length) {
+    const char *body = memmem(response, length, "\r\n\r\n", 4);
+    r->code = atoi(response + strlen("HTTP/1.x "));
+    r->sent = body ? length - (body + 4 - response) : 0;
+    access_record(r);
+}
+
+/* Answer client with a prebuilt response without blocking */
+static void server_reply(Request *r, const char *response, size_t length) {
+    char discard[BUFSIZ];
+
+    if (response) {
+        server_logged(r, response, length);
+    }
+    if (r->tls && !r->plaintext) {
+        tls_send(r, response, length);
+    } else {
+        send(r->fd, response, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    tls_shutdown(r);
+
+    /* Closing with unread input resets the connection, which can destroy the
+     * response before the client reads it */
+    shutdown(r->fd, SHUT_WR);
+    for (int i = 0; i < 4 && recv(r->fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++);
+}
+
+/**
+ * Wait for the next request on a kept-alive connection.
+ *
+ * @param   r           Request structure.
+ **/
+void server_resume(Request *r) {
+    reset_request(r);
+    trace_start(r);
+    set_blocking(r->fd, false);
+
+    if (r->nbuffer > 0 || tls_pending(r)) {
+        /* Client pipelined its next request; handle it without waiting */
+        timer_add(&Wheel, &r->timer, TIMER_HEADER, HeaderTimeout * 1000);
+        r->next = Ready;
+        Ready   = r;
+    } else {
+        request_idle(r);
+        timer_add(&Wheel, &r->timer, TIMER_IDLE, IdleTimeout * 1000);
+        server_watch(r);
+    }
+}
+
+/* Answer request for a path known to be missing from the event loop,
+ * returning false if the prebuilt 404 is unavailable */
+static bool server_missing(Request *r) {
+    size_t      length;
+    const char *response = handle_missing(r, &length);
+    if (!response) {
+        return false;
+    }
+
+    bool sent = send(r->fd, response, length, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)length;
+    trace_finish(r, HTTP_STATUS_NOT_FOUND);
+    server_logged(r, response, length);
+    stats_add(requests, 1);
+
+    if (sent && r->keep_alive && !r->eof) {
+        server_resume(r);
+    } else {
+        server_reply(r, NULL, 0);
+        server_close(r);
+    }
+    return true;
+}
+
+/**
+ * Handle one complete request on the calling process.
+ *
+ * @param   r           Request structure.
+ * @return  Whether the connection can be kept alive.
+ *
+ * The socket is switched to blocking mode so the handlers can use stdio.  The
+ * write deadline is taken from the timer wheel and enforced with an interval
+ * timer whose signal interrupts any stuck write.  On a coroutine the socket
+ * stays non-blocking instead, the handlers' writes wait in the coroutine
+ * scheduler, and the deadline ends those waits.
+ *
+ * A request body the handler did not read is discarded if it is short, and
+ * otherwise ends the connection.  An HTTP/2 connection is served here until
+ * the client is done with it, with its own idle and write deadlines.
+ **/
+bool serve_request(Request *r) {
+    bool cooperative = coroutine_active();
+    if (!cooperative) {
+        set_blocking(r->fd, true);
+    }
+
+    if (route_request(r) == ROUTE_HTTP2) {
+        http2_serve(r);
+        trace_finish(r, HTTP_STATUS_OK);
+        return false;
+    }
+    if (!request_stream(r)) {
+        return false;
+    }
+
+    server_deadline(r, TIMER_WRITE);
+    if (!cooperative) {
+        sigprocmask(SIG_SETMASK, &OriginalSignals, NULL);
+    }
+
+    Status status = handle_request(r);
+    fflush(r->file);
+    if (r->keep_alive && !body_finish(r)) {
+        r->keep_alive = false;
+    }
+    trace_finish(r, status);
+    access_record(r);
+
+    bool expired;
+    if (cooperative) {
+        expired = coroutine_expired();
+        coroutine_deadline(-1);
+    } else {
+        struct itimerval deadline = {{0}};
+        sigprocmask(SIG_BLOCK, &BlockedSignals, NULL);
+        setitimer(ITIMER_REAL, &deadline, NULL);
+        expired = timer_remaining(&r->timer) == 0;
+        timer_cancel(&Wheel, &r->timer);
+    }
+
+    stats_add(requests, 1);
+    log("Returned status: %s", http_status_string(status));
+
+    if (expired && r->timer.kind == TIMER_BODY) {
+        log("Body deadline expired for %s", request_peer(r));
+        stats_add(timeouts_body, 1);
+        return false;
+    }
+    if (expired) {
+        log("Write deadline expired for %s", request_peer(r));
+        stats_add(timeouts_write, 1);
+        return false;
+    }
+
+    bool keep_alive = r->keep_alive && !r->eof && !ferror(r->file);
+    if (!keep_alive) {
+        tls_shutdown(r);
+    }
+    return keep_alive;
+}
+
+/* Hand request to the concurrency mode */
+static void server_dispatch(Request *r) {
+    trace(r, admit);
+    switch (Dispatch(r)) {
+    case CONNECTION_KEEPALIVE:
+        server_complete(r, true);
+        break;
+    case CONNECTION_CLOSE:
+        server_complete(r, false);
+        break;
+    case CONNECTION_DETACHED:
+        break;
+    }
+}
+
+/* Remove request from admission queue */
+static void server_dequeue(Request *r) {
+    Request **prev = &Queue;
+    while (*prev && *prev != r) {
+        prev = &(*prev)->next;
+    }
+    if (!*prev) {
+        return;
+    }
+    *prev = r->next;
+    if (QueueTail == &r->next) {
+        QueueTail = prev;
+    }
+    r->next = NULL;
+    Queued--;
+}
+
+/* Admit as many queued requests as the limits allow, oldest first */
+static void server_drain(void) {
+    if (Draining) {
+        return;
+    }
+    Draining = true;
+
+    Request *r = Queue;
+    while (r) {
+        Request *next = r->next;
+        if (admission_acquire(r)) {
+            server_dequeue(r);
+            timer_cancel(&Wheel, &r->timer);
+            server_dispatch(r);
+            /* Dispatching may have shed or admitted others; start over */
+            next = Queue;
+        }
+        r = next;
+    }
+
+    Draining = false;
+}
+
+/**
+ * Restart the deadline of the request being handled.
+ *
+ * @param   r           Request structure.
+ * @param   kind        TIMER_BODY while the request body arrives, and
+ *                      TIMER_WRITE while the response is sent.
+ *
+ * An upload can take much longer than WriteTimeout, so while it keeps
+ * arriving the deadline is BodyTimeout from the latest progress.  A restart
+ * while most of the same deadline is left is skipped so the interval timer
+ * is rarely touched.
+ **/
+void server_deadline(Request *r, TimerKind kind) {
+    uint64_t timeout = (kind == TIMER_BODY ? BodyTimeout : WriteTimeout) * 1000;
+
+    if (coroutine_active()) {
+        r->timer.kind = kind;
+        coroutine_deadline(timeout);
+        return;
+    }
+    if (timer_pending(&r->timer) && r->timer.kind == kind && timer_remaining(&r->timer) > timeout * 3 / 4) {
+        return;
+    }
+
+    struct itimerval deadline = {{0}};
+    timer_add(&Wheel, &r->timer, kind, timeout);
+    deadline.it_value.tv_sec  = timer_remaining(&r->timer) / 1000;
+    deadline.it_value.tv_usec = timer_remaining(&r->timer) % 1000 * 1000 + 1;
+    setitimer(ITIMER_REAL, &deadline, NULL);
+}
+
+/* Refuse over-limit clients, then admit, queue, or shed request with complete headers */
+static void server_admit(Request *r) {
+    if (Retiring) {
+        r->keep_alive = false;
+    }
+
+    if (!ratelimit_request(r)) {
+        server_reply(r, TooManyResponse, sizeof(TooManyResponse) - 1);
+        server_close(r);
+        return;
+    }
+
+    if (route_request(r) == ROUTE_MISSING && r->plaintext && r->body == BODY_NONE && server_missing(r)) {
+        return;
+    }
+
+    if (admission_acquire(r)) {
+        server_dispatch(r);
+        return;
+    }
+
+    if (Queued >= QueueLength) {
+        stats_add(requests_shed, 1);
+        server_reply(r, UnavailableResponse, sizeof(UnavailableResponse) - 1);
+        server_close(r);
+        return;
+    }
+
+    timer_add(&Wheel, &r->timer, TIMER_QUEUE, QueueTimeout);
+    r->next    = NULL;
+    *QueueTail = r;
+    QueueTail  = &r->next;
+    Queued++;
+    stats_add(requests_queued, 1);
+}
+
+/**
+ * Finish an admitted request.
+ *
+ * @param   r           Request structure.
+ * @param   keep_alive  Whether the connection can be kept alive.
+ *
+ * This releases the request's admission slot, which may admit queued
+ * requests, and then waits for the next request or closes the connection.
+ **/
+void server_complete(Request *r, bool keep_alive) {
+    admission_release(r);
+
+    if (keep_alive) {
+        server_resume(r);
+    } else {
+        server_close(r);
+    }
+
+    server_drain();
+}
+
+/**
+ * Release event loop resources in a forked child.
+ **/
+void server_child(void) {
+    access_child();
+    close(ServerFd);
+    close(EventFd);
+    if (TlsSocket >= 0) {
+        close(TlsSocket);
+    }
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &OriginalSignals, NULL);
+}
+
+/**
+ * Also wake the event loop when a descriptor becomes readable.
+ *
+ * @param   fd          Descriptor (watched once server_loop starts).
+ *
+ * The idle function passed to server_loop is expected to consume whatever
+ * made the descriptor readable.
+ **/
+void server_wake(int fd) {
+    WakeFd = fd;
+}
+
+/* Evict connection whose deadline passed */
+static void server_expire(Timer *t, void *arg) {
+    Request *r = request_of(t);
+    (void)arg;
+
+    switch (t->kind) {
+    case TIMER_HEADER:
+    case TIMER_BODY:
+        log("Request deadline expired for %s", request_peer(r));
+        if (t->kind == TIMER_HEADER) {
+            stats_add(timeouts_header, 1);
+        } else {
+            stats_add(timeouts_body, 1);
+        }
+        server_reply(r, TimeoutResponse, sizeof(TimeoutResponse) - 1);
+        break;
+    case TIMER_QUEUE:
+        log("Admission deadline expired for %s", request_peer(r));
+        stats_add(requests_shed, 1);
+        server_dequeue(r);
+        server_reply(r, UnavailableResponse, sizeof(UnavailableResponse) - 1);
+        break;
+    case TIMER_WRITE:
+        stats_add(timeouts_write, 1);
+        break;
+    case TIMER_IDLE:
+        debug("Idle connection expired for %s", request_peer(r));
+        stats_add(timeouts_idle, 1);
+        break;
+    }
+
+    server_close(r);
+}
+
+/* Read input from client and dispatch once the headers are complete */
+static void server_input(Request *r) {
+    if (r->tls) {
+        switch (tls_handshake(r)) {
+        case 0:
+            return;
+        case -1:
+            server_close(r);
+            return;
+        }
+    }
+
+    switch (read_request(r)) {
+    case 0:
+        /* First bytes of a kept-alive request restart the header deadline */
+        if (r->timer.kind == TIMER_IDLE && r->nbuffer > 0) {
+            timer_add(&Wheel, &r->timer, TIMER_HEADER, HeaderTimeout * 1000);
+        }
+        return;
+    case 1:
+        trace(r, headers);
+        capture_request(r);
+        break;
+    default:
+        if (errno == E2BIG) {
+            server_reply(r, TooLargeResponse, sizeof(TooLargeResponse) - 1);
+        }
+        server_close(r);
+        return;
+    }
+
+    timer_cancel(&Wheel, &r->timer);
+    server_unwatch(r);
+    server_admit(r);
+}
+
+/* Accept every waiting client */
+static void server_accept(int sfd) {
+    Request *r;
+    while ((r = accept_request(sfd))) {
+        r->number = stats_add(connections_accepted, 1);
+        if (!ratelimit_connection(r)) {
+            server_reply(r, TooManyResponse, sizeof(TooManyResponse) - 1);
+            free_request(r);
+            continue;
+        }
+        if (Statistics->connections_active >= (unsigned long)MaxConnections) {
+            stats_add(connections_shed, 1);
+            server_reply(r, UnavailableResponse, sizeof(UnavailableResponse) - 1);
+            free_request(r);
+            continue;
+        }
+        stats_add(connections_active, 1);
+        timer_add(&Wheel, &r->timer, TIMER_HEADER, HeaderTimeout * 1000);
+        server_watch(r);
+    }
+}
+
+/* Start an upgraded server and watch for it to report that it is serving */
+static void server_upgrade(void) {
+    if (UpgradeFd >= 0 || Retiring) {
+        return;
+    }
+    if ((UpgradeFd = upgrade_start()) < 0) {
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &UpgradeFd };
+    if (epoll_ctl(EventFd, EPOLL_CTL_ADD, UpgradeFd, &event) < 0) {
+        debug("Unable to watch upgrade: %s", strerror(errno));
+        close(UpgradeFd);
+        UpgradeFd = -1;
+    }
+}
+
+/* Close connection waiting for its next request */
+static void server_close_idle(Timer *t, void *arg) {
+    (void)arg;
+    if (t->kind == TIMER_IDLE) {
+        server_close(request_of(t));
+    }
+}
+
+/* Leave the sockets to the upgraded server once it serves, and drain */
+static void server_retire(void) {
+    epoll_ctl(EventFd, EPOLL_CTL_DEL, UpgradeFd, NULL);
+    bool serving = upgrade_finish(UpgradeFd);
+    UpgradeFd = -1;
+    if (!serving) {
+        return;
+    }
+
+    epoll_ctl(EventFd, EPOLL_CTL_DEL, ServerFd, NULL);
+    if (TlsSocket >= 0) {
+        epoll_ctl(EventFd, EPOLL_CTL_DEL, TlsSocket, NULL);
+    }
+    timer_each(&Wheel, server_close_idle, NULL);
+    Retiring = timer_now() + WriteTimeout * 1000;
+}
+
+/**
+ * Run connection event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   dispatch    Function that handles a request with complete headers.
+ * @param   idle        Function called once per loop iteration (may be NULL).
+ * @return  Exit status of server (EXIT_FAILURE if the loop cannot start).
+ **/
+int server_loop(int sfd, Disposition (*dispatch)(Request *), void (*idle)(void)) {
+    struct epoll_event events[MAX_EVENTS];
+
+    ServerFd = sfd;
+    Dispatch = dispatch;
+    timer_wheel_init(&Wheel);
+    admission_init();
+
+    if ((EventFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        debug("Unable to create epoll instance: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    set_blocking(sfd, false);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(EventFd, EPOLL_CTL_ADD, sfd, &event) < 0) {
+        debug("Unable to watch server socket: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (TlsSocket >= 0) {
+        set_blocking(TlsSocket, false);
+        event.data.ptr = &TlsSocket;
+        if (epoll_ctl(EventFd, EPOLL_CTL_ADD, TlsSocket, &event) < 0) {
+            debug("Unable to watch HTTPS socket: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (WakeFd >= 0) {
+        event.data.ptr = &WakeFd;
+        if (epoll_ctl(EventFd, EPOLL_CTL_ADD, WakeFd, &event) < 0) {
+            debug("Unable to watch wakeup descriptor: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Signals only arrive while waiting for events (or handling requests) */
+    struct sigaction action = { .sa_handler = signal_interrupt };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, NULL);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &action, NULL);
+    action.sa_handler = signal_stats;
+    sigaction(SIGUSR2, &action, NULL);
+    action.sa_handler = signal_reopen;
+    sigaction(SIGUSR1, &action, NULL);
+    action.sa_handler = signal_upgrade;
+    sigaction(SIGHUP, &action, NULL);
+    action.sa_handler = signal_shutdown;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    sigemptyset(&BlockedSignals);
+    sigaddset(&BlockedSignals, SIGALRM);
+    sigaddset(&BlockedSignals, SIGCHLD);
+    sigaddset(&BlockedSignals, SIGUSR1);
+    sigaddset(&BlockedSignals, SIGUSR2);
+    sigaddset(&BlockedSignals, SIGHUP);
+    sigaddset(&BlockedSignals, SIGTERM);
+    sigaddset(&BlockedSignals, SIGINT);
+    sigprocmask(SIG_BLOCK, &BlockedSignals, &OriginalSignals);
+
+    /* Run until asked to stop, so the server exits normally (and flushes
+     * anything registered with atexit, such as profile counters) */
+    while (!Shutdown) {
+        int timeout = Ready ? 0 : timer_next(&Wheel);
+        int due     = access_due();
+        if (due >= 0 && (timeout < 0 || due < timeout)) {
+            timeout = due;
+        }
+        due = warmup_due();
+        if (due >= 0 && (timeout < 0 || due < timeout)) {
+            timeout = due;
+        }
+        due = proxy_due();
+        if (due >= 0 && (timeout < 0 || due < timeout)) {
+            timeout = due;
+        }
+        if (Retiring) {
+            uint64_t now  = timer_now();
+            int      left = Retiring > now ? (int)(Retiring - now) : 0;
+            if (timeout < 0 || left < timeout) {
+                timeout = left;
+            }
+        }
+        int nevents = epoll_pwait(EventFd, events, MAX_EVENTS, timeout, &OriginalSignals);
+        if (nevents < 0 && errno != EINTR) {
+            debug("Unable to wait for events: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            if (events[i].data.ptr == NULL) {
+                server_accept(sfd);
+            } else if (events[i].data.ptr == &TlsSocket) {
+                server_accept(TlsSocket);
+            } else if (events[i].data.ptr == &WakeFd) {
+                continue;               /* Handled by idle below */
+            } else if (events[i].data.ptr == &UpgradeFd) {
+                server_retire();
+            } else {
+                server_input(events[i].data.ptr);
+            }
+        }
+
+        while (Ready) {
+            Request *r = Ready;
+            Ready = r->next;
+            r->next = NULL;
+            server_watch(r);
+            server_input(r);
+        }
+
+        timer_expire(&Wheel, server_expire, NULL);
+
+        if (idle) {
+            idle();
+        }
+
+        if (DumpStats) {
+            DumpStats = 0;
+            stats_dump(stderr);
+            ratelimit_dump(stderr);
+            trace_dump(stderr);
+        }
+
+        if (ReopenLog) {
+            ReopenLog = 0;
+            access_reopen();
+        }
+
+        if (Upgrade) {
+            Upgrade = 0;
+            server_upgrade();
+        }
+
+        capture_flush(false);
+        access_flush(false);
+        warmup_tick();
+        proxy_tick();
+
+        if (Retiring) {
+            if (Statistics->connections_active == 0) {
+                log("Drained every connection; exiting");
+                break;
+            }
+            if (timer_now() >= Retiring) {
+                log("Exiting with %lu connections still open", Statistics->connections_active);
+                break;
+            }
+        }
+    }
+
+    capture_flush(true);
+    access_flush(true);
+    warmup_save();
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
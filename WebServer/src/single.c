@@ -7,34 +7,28 @@
 
 #include <unistd.h>
 
+/**
+ * Handle request in the server process.
+ *
+ * @param   r           Request structure.
+ * @return  Whether to keep the connection open.
+ **/
+static Disposition single_dispatch(Request *r) {
+    return serve_request(r) ? CONNECTION_KEEPALIVE : CONNECTION_CLOSE;
+}
+
 /**
  * Handle one HTTP request at a time.
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Connections still sending their headers wait in the event loop, so a slow
+ * client does not hold up the request being handled.
  **/
 int single_server(int sfd) {
-    /* Accept and handle HTTP request */
-    Request *r;
-    while (true) {
-        /* Accept request */
-        r = accept_request(sfd);
-        if(!r) {
-            debug("Error accepting request: %s", strerror(errno));
-            debug("Free request and return");
-            free_request(r);
-            return EXIT_FAILURE;
-        }
-
-        /* Handle request */
-        Status status = handle_request(r);
-        const char *returnStatus = http_status_string(status);
-        log("Returned status: %s", returnStatus);
-
-        /* Free request */
-        free_request(r);
-        debug("Reached end \n\n");
-    }
+    /* Accept and handle HTTP requests */
+    int status = server_loop(sfd, single_dispatch, NULL);
 
     /* Close server socket */
     if( close(sfd) < 0) {
@@ -43,8 +37,7 @@ int single_server(int sfd) {
     }
 
     debug("Success!");
-    return EXIT_SUCCESS;
+    return status;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
-
@@ -16,11 +16,23 @@
  * Allocate socket, bind it, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * @return  Allocated server socket file descriptor (-1 on failure).
+ *
+ * A socket handed over by the server this one upgraded from is used as it
+ * is, and every socket is handed over in turn on the next upgrade.
  **/
 const char *host = NULL;
 
 int socket_listen(const char *port) {
+    char name[32];
+    snprintf(name, sizeof(name), "LISTEN_%s", port);
+
+    int inherited = upgrade_inherited(name);
+    if(inherited >= 0) {
+        debug("Inherited socket listening on port %s", port);
+        upgrade_handoff(name, inherited);
+        return inherited;
+    }
 
     /* Lookup server address information */
     struct addrinfo hints = {
@@ -46,6 +58,12 @@ int socket_listen(const char *port) {
         } 
         debug("Socket allocated");
 
+        /* Rebind right after a restart despite connections in TIME_WAIT */
+        int on = 1;
+        if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+            debug("Unable to reuse address: %s", strerror(errno));
+        }
+
         /* Bind socket */
         if(bind(server_fd, p->ai_addr, p->ai_addrlen) < 0) {
             debug("Unable to bind: %s", strerror(errno));
@@ -70,9 +88,10 @@ int socket_listen(const char *port) {
 
     if(server_fd < 0) {
         debug("Failled to allocate and connect to socket");
-        return EXIT_FAILURE;
+        return -1;
     }
 
+    upgrade_handoff(name, server_fd);
 
     return server_fd;
 }
@@ -3,6 +3,7 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -14,6 +15,49 @@ char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath        = "www";
 
+int   HeaderTimeout   = 10;
+int   BodyTimeout     = 30;
+int   WriteTimeout    = 30;
+int   IdleTimeout     = 5;
+off_t MaxBody         = 1L << 30;
+
+int   MaxConnections  = 1024;
+int   MaxRequests     = 64;
+int   MaxCGI          = 8;
+int   QueueLength     = 128;
+int   QueueTimeout    = 1000;
+
+int   TraceSample     = 0;
+char *CapturePath     = NULL;
+char *AccessPath      = NULL;
+int   AccessSample    = 1;
+AccessFormat AccessLogFormat = ACCESS_COMMON;
+int   FlushLowWater   = 4096;
+int   CacheTTL        = 0;
+int   CacheEntries    = 64;
+int   NegativeEntries = 1024;
+int   RateRequests    = 0;
+int   RateConnections = 0;
+int   RateEntries     = 4096;
+int   CgiCpu          = 0;
+int   CgiMemory       = 0;
+int   CgiTimeout      = 0;
+char *CgroupPath      = NULL;
+int   CgroupCpu       = 0;
+int   CgroupMemory    = 0;
+char *WarmupPath      = NULL;
+int   WarmupRate      = 32;
+int   ZerocopyMin     = 0;
+int   NotsentLowat    = 131072;
+
+char *TlsPort         = NULL;
+char *TlsCertificate  = NULL;
+char *TlsKey          = NULL;
+bool  TlsKernel       = true;
+
+AdmissionMode AdmissionPolicy = ADMISSION_FIXED;
+int           AdmissionTarget = 100;
+
 /**
  * Display usage message and exit with specified status code.
  *
@@ -21,17 +65,65 @@ char *RootPath        = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [habcCfgkmMlLnpPqrRsStuUwWxz]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -a policy     Request limit: fixed, aimd[,target ms], or gradient\n");
+    fprintf(stderr, "    -b bytes      Largest request body, 0 for no limit (1073741824)\n");
+    fprintf(stderr, "    -c mode       Single, Forking, or Cooperative (coroutine) mode\n");
+    fprintf(stderr, "    -C cache      Cache CGI output: default seconds[,entries] (0,64)\n");
+    fprintf(stderr, "    -f bytes      Send dynamic output once this much is buffered (4096)\n");
+    fprintf(stderr, "    -g cgroup     Run CGI scripts in cgroup v2 path[,CPU percent[,memory MB]]\n");
+    fprintf(stderr, "    -k            Encrypt HTTPS in userspace instead of the kernel\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -l limits     Connections,requests,CGI scripts at once (1024,64,8)\n");
+    fprintf(stderr, "    -L log        Access log: path[,common|combined|binary[,1 in n]], reopened with SIGUSR1\n");
+    fprintf(stderr, "    -n entries    Missing paths to remember, 0 to disable (1024)\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -P plugin     Serve URI prefix with plugin: prefix=path.so[:argument]\n");
+    fprintf(stderr, "    -q queue      Admission queue length,wait in milliseconds (128,1000)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -R rates      Requests,connections per second per client[,buckets] (0,0,4096)\n");
+    fprintf(stderr, "    -s n          Trace 1 in n requests, dumped with SIGUSR2 (0)\n");
+    fprintf(stderr, "    -S https      HTTPS port,certificate[,key] in PEM files\n");
+    fprintf(stderr, "    -t timeouts   Header,body,write,idle timeouts in seconds (10,30,30,5)\n");
+    fprintf(stderr, "    -u proxy      Proxy URI prefix to upstreams: prefix=host:port|unix:path[,...]\n");
+    fprintf(stderr, "    -U upload     Store PUTs under URI prefix[,largest MB]\n");
+    fprintf(stderr, "    -w path       Capture requests to log for bin/replay\n");
+    fprintf(stderr, "    -W manifest   Warm up from and save hottest files to path[,MB per second] (32)\n");
+    fprintf(stderr, "    -x limits     CGI script CPU seconds,memory MB,run seconds, 0 for none (0,0,0)\n");
+    fprintf(stderr, "    -z zerocopy   Send writes from bytes with MSG_ZEROCOPY[,unsent bytes in kernel] (0,131072)\n");
     exit(status);
 }
 
+/**
+ * Parse access log option.
+ *
+ * @param   spec        path[,format[,sample]]
+ * @return  true if spec names a known format and a positive sample.
+ */
+static bool parse_access(char *spec) {
+    AccessPath = strtok(spec, ",");
+    char *format = strtok(NULL, ",");
+    char *sample = strtok(NULL, ",");
+
+    if (!AccessPath) {
+        return false;
+    }
+    if (!format || streq(format, "common")) {
+        AccessLogFormat = ACCESS_COMMON;
+    } else if (streq(format, "combined")) {
+        AccessLogFormat = ACCESS_COMBINED;
+    } else if (streq(format, "binary")) {
+        AccessLogFormat = ACCESS_BINARY;
+    } else {
+        return false;
+    }
+    AccessSample = sample ? atoi(sample) : 1;
+    return AccessSample > 0;
+}
+
 /**
  * Parse command-line options.
  *
@@ -40,39 +132,192 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, MimeTypesPath, DefaultMimeType, Port, RootPath, the
+ * connection timeouts, the request body limit, the admission limits, the trace
+ * sampling rate, the capture log, the access log, the dynamic output low-water
+ * mark, the CGI cache, the CGI limits and cgroup, the negative cache, the
+ * client rate limits, the handler plugins, the reverse proxies, the upload
+ * prefixes, the warmup manifest, the zero-copy threshold, and the HTTPS
+ * listener if specified.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
     int argind = 1;
     while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
         char *arg = argv[argind++];
         switch (arg[1]) {
+        case 'a':
+            if (argind >= argc) {
+                return false;
+            }
+            if (streq(argv[argind], "fixed")) {
+                AdmissionPolicy = ADMISSION_FIXED;
+            } else if (strncmp(argv[argind], "aimd", 4) == 0) {
+                AdmissionPolicy = ADMISSION_AIMD;
+                sscanf(argv[argind], "aimd,%d", &AdmissionTarget);
+            } else if (streq(argv[argind], "gradient")) {
+                AdmissionPolicy = ADMISSION_GRADIENT;
+            } else {
+                return false;
+            }
+            argind++;
+            break;
+        case 'b':
+            if (argind >= argc) {
+                return false;
+            }
+            MaxBody = strtoll(argv[argind++], NULL, 10);
+            break;
         case 'c':
             if (streq(argv[argind], "single")) {
                 *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
                 *mode = FORKING;
+            } else if (streq(argv[argind], "cooperative")) {
+                *mode = COOPERATIVE;
             } else {
                 return false;
             }
             argind++;
             break;
+        case 'C':
+            if (argind >= argc || sscanf(argv[argind++], "%d,%d",
+                &CacheTTL, &CacheEntries) < 1) {
+                return false;
+            }
+            break;
+        case 'f':
+            if (argind >= argc) {
+                return false;
+            }
+            FlushLowWater = atoi(argv[argind++]);
+            break;
+        case 'g':
+            if (argind >= argc) {
+                return false;
+            }
+            CgroupPath = argv[argind++];
+            char *limits = strchr(CgroupPath, ',');
+            if (limits) {
+                *limits++ = '\0';
+                sscanf(limits, "%d,%d", &CgroupCpu, &CgroupMemory);
+            }
+            break;
         case 'h':
             usage(argv[0], EXIT_SUCCESS);
             break;
+        case 'k':
+            TlsKernel = false;
+            break;
         case 'm':
             MimeTypesPath = argv[argind++];
             break;
         case 'M':
             DefaultMimeType = argv[argind++];
             break;
+        case 'l':
+            if (argind >= argc || sscanf(argv[argind++], "%d,%d,%d",
+                &MaxConnections, &MaxRequests, &MaxCGI) < 1) {
+                return false;
+            }
+            break;
+        case 'L':
+            if (argind >= argc || !parse_access(argv[argind++])) {
+                return false;
+            }
+            break;
+        case 'n':
+            if (argind >= argc) {
+                return false;
+            }
+            NegativeEntries = atoi(argv[argind++]);
+            break;
         case 'p':
             Port = argv[argind++];
             break;
+        case 'P':
+            if (argind >= argc || plugin_add(argv[argind++]) < 0) {
+                return false;
+            }
+            break;
+        case 'q':
+            if (argind >= argc || sscanf(argv[argind++], "%d,%d",
+                &QueueLength, &QueueTimeout) < 1) {
+                return false;
+            }
+            break;
         case 'r':
             RootPath = argv[argind++];
             break;
+        case 'R':
+            if (argind >= argc || sscanf(argv[argind++], "%d,%d,%d",
+                &RateRequests, &RateConnections, &RateEntries) < 1) {
+                return false;
+            }
+            break;
+        case 's':
+            if (argind >= argc) {
+                return false;
+            }
+            TraceSample = atoi(argv[argind++]);
+            break;
+        case 'S':
+            if (argind >= argc) {
+                return false;
+            }
+            TlsPort        = strtok(argv[argind++], ",");
+            TlsCertificate = strtok(NULL, ",");
+            TlsKey         = strtok(NULL, ",");
+            if (!TlsPort || !TlsCertificate) {
+                return false;
+            }
+            if (!TlsKey) {
+                TlsKey = TlsCertificate;
+            }
+            break;
+        case 't':
+            if (argind >= argc || sscanf(argv[argind++], "%d,%d,%d,%d",
+                &HeaderTimeout, &BodyTimeout, &WriteTimeout, &IdleTimeout) < 1) {
+                return false;
+            }
+            break;
+        case 'u':
+            if (argind >= argc || proxy_add(argv[argind++]) < 0) {
+                return false;
+            }
+            break;
+        case 'U':
+            if (argind >= argc || upload_add(argv[argind++]) < 0) {
+                return false;
+            }
+            break;
+        case 'w':
+            if (argind >= argc) {
+                return false;
+            }
+            CapturePath = argv[argind++];
+            break;
+        case 'W':
+            if (argind >= argc) {
+                return false;
+            }
+            WarmupPath = argv[argind++];
+            char *rate = strchr(WarmupPath, ',');
+            if (rate) {
+                *rate++ = '\0';
+                WarmupRate = atoi(rate);
+            }
+            break;
+        case 'x':
+            if (argind >= argc || sscanf(argv[argind++], "%d,%d,%d",
+                &CgiCpu, &CgiMemory, &CgiTimeout) < 1) {
+                return false;
+            }
+            break;
+        case 'z':
+            if (argind >= argc || sscanf(argv[argind++], "%d,%d", &ZerocopyMin, &NotsentLowat) < 1) {
+                return false;
+            }
+            break;
         default:
             return false;
             break;
@@ -89,6 +334,9 @@ int main(int argc, char *argv[]) {
     ServerMode mode = UNKNOWN;
     int status = EXIT_SUCCESS;
 
+    /* Remember how this server was started, to start its upgrade the same way */
+    upgrade_init(argc, argv);
+
     /* Parse command line options */
     debug("Parsing command line arguments...");
     status = parse_options(argc, argv, &mode);
@@ -97,6 +345,25 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    /* Select header scanning implementation */
+    scan_init(SCAN_AUTO);
+
+    /* Share statistics, trace samples, cached CGI output, and rate limits with
+     * children and survive clients that disconnect */
+    stats_init();
+    trace_init();
+    cache_init();
+    ratelimit_init();
+    if (CapturePath && capture_open(CapturePath) < 0) {
+        log("Unable to open capture log %s: %s", CapturePath, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (AccessPath && access_open(AccessPath) < 0) {
+        log("Unable to open access log %s: %s", AccessPath, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
     /* Listen to server socket */
     debug("Listening to server socket...");
     int socket_fd = socket_listen(Port);
@@ -105,24 +372,65 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    /* Determine real RootPath */
+    /* Listen to HTTPS socket */
+    if (TlsPort && tls_init() < 0) {
+        debug("Failure to acquire HTTPS socket");
+        return EXIT_FAILURE;
+    }
+
+    /* Open RootPath to resolve request paths beneath */
+    if (root_open() < 0) {
+        log("Unable to open root directory %s: %s", RootPath, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Remember missing paths until something appears under RootPath */
+    negative_init();
+
+    /* Warm up the files that were hottest before the restart */
+    warmup_start();
+
+    /* Confine CGI scripts */
+    sandbox_init();
+
+    /* Load handler plugins */
+    if (plugin_init() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Share upstream load and health with children */
+    if (proxy_init() < 0) {
+        return EXIT_FAILURE;
+    }
+
     log("Listening on port %s", Port);
+    if (TlsPort) {
+        log("Listening for HTTPS on port %s", TlsPort);
+    }
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" : "Cooperative");
+
+    /* Take over from the server this one upgrades, if any */
+    upgrade_ready();
 
     
     /* Start either forking or single HTTP server */
     switch(mode) {
         case SINGLE:
             debug("Single server");
-            single_server(socket_fd);
+            status = single_server(socket_fd);
             break;
 
         case FORKING:
             debug("Forking server");
-            forking_server(socket_fd);
+            status = forking_server(socket_fd);
+            break;
+
+        case COOPERATIVE:
+            debug("Cooperative server");
+            status = cooperative_server(socket_fd);
             break;
 
         case UNKNOWN:
@@ -130,6 +438,8 @@ int main(int argc, char *argv[]) {
             usage(argv[0], EXIT_FAILURE);
             break;
     }
+
+    plugin_shutdown();
     return status; 
 }
 
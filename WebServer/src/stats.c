@@ -0,0 +1,47 @@
+/* stats.c: Server Statistics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Counters live in a local struct until stats_init maps the shared ones */
+static Stats LocalStats;
+Stats *Statistics = &LocalStats;
+
+/**
+ * Map statistics counters into memory shared with forked children.
+ *
+ * Must be called before any process is forked.  If the mapping fails the
+ * counters simply stay process local.
+ **/
+void stats_init(void) {
+    Stats *shared = mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        debug("Unable to map shared statistics: %s", strerror(errno));
+        return;
+    }
+    memcpy(shared, Statistics, sizeof(Stats));
+    Statistics = shared;
+}
+
+/**
+ * Write every counter as a "name value" line, followed by the share of 404s
+ * answered from the negative cache.
+ *
+ * @param   stream      Stream to write to.
+ **/
+void stats_dump(FILE *stream) {
+#define STATS_DUMP(name)    fprintf(stream, "%-24s %lu\n", #name, __atomic_load_n(&Statistics->name, __ATOMIC_RELAXED));
+    STATS(STATS_DUMP)
+#undef STATS_DUMP
+
+    unsigned long hits    = __atomic_load_n(&Statistics->negative_hits, __ATOMIC_RELAXED);
+    unsigned long lookups = hits + __atomic_load_n(&Statistics->negative_misses, __ATOMIC_RELAXED);
+    fprintf(stream, "%-24s %.1f%%\n", "negative_hit_rate", lookups ? 100.0 * hits / lookups : 0.0);
+    fflush(stream);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,188 @@
+/* test_access.c: Check the access log across forked children and its durations */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Globals (normally defined by spidey.c) */
+
+int          AccessSample    = 1;
+AccessFormat AccessLogFormat = ACCESS_COMMON;
+
+static uint64_t Clock = 5000000000;     /* Returned by trace_clock (ns) */
+
+/* Functions */
+
+/**
+ * Format the client address (normally defined by request.c).
+ **/
+char *request_host(const Request *r, char *host) {
+    return strcpy(host, "127.0.0.1");
+}
+
+/**
+ * Read the monotonic clock (normally defined by trace.c).
+ **/
+uint64_t trace_clock(void) {
+    return Clock;
+}
+
+/**
+ * Create an empty log and open it (NULL on error).
+ **/
+static char *open_log(char *path) {
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to create log: %s\n", strerror(errno));
+        return NULL;
+    }
+    close(fd);
+
+    if (access_open(path) < 0) {
+        fprintf(stderr, "Unable to open log: %s\n", strerror(errno));
+        unlink(path);
+        return NULL;
+    }
+    return path;
+}
+
+/**
+ * Count the lines in a file (-1 if it cannot be read).
+ **/
+static int count_lines(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    int lines = 0;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        lines += c == '\n';
+    }
+    fclose(file);
+    return lines;
+}
+
+/**
+ * Record responses in a parent and a forked child, each once, and check the
+ * log holds each record once (the child must not write the parent's).
+ **/
+static int test_access(void) {
+    char path[] = "/tmp/test_access.XXXXXX";
+    if (!open_log(path)) {
+        return 1;
+    }
+
+    Request r = {
+        .method  = "GET",
+        .uri     = "/song.txt",
+        .query   = "",
+        .code    = 200,
+        .sent    = 42,
+        .version = 1,
+    };
+    r.peer.ss_family = AF_INET;
+
+    /* Buffered in the parent when the child is forked */
+    access_record(&r);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        unlink(path);
+        return 1;
+    }
+    if (pid == 0) {
+        access_child();
+        r.uri = "/html/index.html";
+        access_record(&r);
+        access_flush(true);
+        _exit(EXIT_SUCCESS);
+    }
+    waitpid(pid, NULL, 0);
+    access_flush(true);
+
+    int failures = 0;
+    int lines    = count_lines(path);
+    if (lines != 2) {
+        fprintf(stderr, "%d records in log, expected 2\n", lines);
+        failures++;
+    }
+    unlink(path);
+    return failures;
+}
+
+/**
+ * Record a response 1.5 ms after its headers completed, and one whose headers
+ * never did, in format, and check the durations logged (1500 and 0 us).
+ **/
+static int test_duration(AccessFormat format) {
+    char path[] = "/tmp/test_access.XXXXXX";
+    AccessLogFormat = format;
+    if (!open_log(path)) {
+        return 1;
+    }
+
+    Request r = {
+        .method  = "GET",
+        .uri     = "/song.txt",
+        .query   = "",
+        .code    = 200,
+        .sent    = 42,
+        .version = 1,
+        .begun   = Clock - 1500000,
+    };
+    r.peer.ss_family = AF_INET;
+    access_record(&r);
+    r.begun = 0;
+    access_record(&r);
+    access_flush(true);
+
+    unsigned durations[2] = {-1, -1};
+    FILE    *file = fopen(path, "r");
+    if (file && format == ACCESS_BINARY) {
+        char         magic[sizeof(ACCESS_MAGIC)] = "";
+        AccessRecord record;
+        char         line[BUFSIZ];
+        if (fread(magic, strlen(ACCESS_MAGIC), 1, file) == 1 && streq(magic, ACCESS_MAGIC)) {
+            for (int i = 0; i < 2 && fread(&record, sizeof(record), 1, file) == 1 &&
+                            fread(line, record.length, 1, file) == 1; i++) {
+                durations[i] = record.duration;
+            }
+        }
+    } else if (file) {
+        char line[BUFSIZ];
+        for (int i = 0; i < 2 && fgets(line, sizeof(line), file); i++) {
+            char *field = strrchr(line, ' ');
+            durations[i] = field ? strtoul(field + 1, NULL, 10) : -1;
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+
+    int failures = 0;
+    if (durations[0] != 1500 || durations[1] != 0) {
+        fprintf(stderr, "%s durations %d and %d, expected 1500 and 0\n",
+            format == ACCESS_BINARY ? "Binary" : "Text", (int)durations[0], (int)durations[1]);
+        failures++;
+    }
+    unlink(path);
+    return failures;
+}
+
+int main(void) {
+    int failures = test_access();
+    failures += test_duration(ACCESS_COMMON);
+    failures += test_duration(ACCESS_BINARY);
+    printf("test_access: %s\n", failures ? "Failure" : "Success");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
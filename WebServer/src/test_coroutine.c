@@ -0,0 +1,241 @@
+/* test_coroutine.c: Check and benchmark the coroutine runtime */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#define MANY        10000               /* Coroutines started at once */
+
+/* Globals */
+
+static int  Scheduler = -1;             /* Descriptor of the scheduler */
+static char Order[16];                  /* Steps taken by the ping-pong test */
+static int  Steps     = 0;
+static int  Finished  = 0;
+static bool Release   = false;
+
+typedef struct {
+    int     fds[2];                     /* Pipe between reader and writer */
+    ssize_t result;                     /* What the reader got */
+    int     error;                      /* errno after the read */
+    bool    expired;                    /* coroutine_expired after the read */
+} Pipe;
+
+/* Functions */
+
+/* Run coroutines until every one has finished */
+static void run_all(void) {
+    coroutine_run();
+    while (coroutine_count() > 0) {
+        struct pollfd pfd = { .fd = Scheduler, .events = POLLIN };
+        poll(&pfd, 1, -1);
+        coroutine_run();
+    }
+}
+
+/* Take three steps, yielding after each */
+static void ping_pong(void *arg) {
+    for (int i = 0; i < 3; i++) {
+        Order[Steps++] = *(char *)arg;
+        coroutine_yield();
+    }
+}
+
+/* Read from pipe, waiting for the writer */
+static void pipe_reader(void *arg) {
+    Pipe *p = arg;
+    char  buffer[16] = {0};
+    p->result  = coroutine_read(p->fds[0], buffer, sizeof(buffer));
+    p->error   = errno;
+    p->expired = coroutine_expired();
+    if (p->result > 0 && !streq(buffer, "spidey")) {
+        p->result = -2;
+    }
+}
+
+/* Write to pipe after a while */
+static void pipe_writer(void *arg) {
+    Pipe *p = arg;
+    coroutine_sleep(20);
+    if (coroutine_write(p->fds[1], "spidey", 7) != 7) {
+        p->result = -3;
+    }
+}
+
+/* Read from a pipe nobody writes to until the deadline */
+static void pipe_deadline(void *arg) {
+    coroutine_deadline(30);
+    pipe_reader(arg);
+}
+
+/* Sleep briefly and count */
+static void sleeper(void *arg) {
+    (void)arg;
+    coroutine_sleep(10);
+    Finished++;
+}
+
+/* Wait until released */
+static void parked(void *arg) {
+    (void)arg;
+    while (!Release) {
+        coroutine_sleep(10);
+    }
+    Finished++;
+}
+
+/* Yield arg times */
+static void yielder(void *arg) {
+    for (long i = (long)arg; i > 0; i--) {
+        coroutine_yield();
+    }
+}
+
+static bool open_pipe(Pipe *p) {
+    memset(p, 0, sizeof(Pipe));
+    return pipe2(p->fds, O_NONBLOCK) == 0;
+}
+
+static void close_pipe(Pipe *p) {
+    close(p->fds[0]);
+    close(p->fds[1]);
+}
+
+/**
+ * Check interleaving, waiting on descriptors, deadlines, and many coroutines.
+ **/
+static int test_coroutine(void) {
+    int  failures = 0;
+    Pipe p;
+
+    /* Yielding alternates between ready coroutines */
+    coroutine_spawn(ping_pong, "a");
+    coroutine_spawn(ping_pong, "b");
+    run_all();
+    if (!streq(Order, "ababab")) {
+        printf("ping-pong: expected ababab, got %s\n", Order);
+        failures++;
+    }
+
+    /* A read waits for the writer instead of failing with EAGAIN */
+    if (!open_pipe(&p)) {
+        return failures + 1;
+    }
+    coroutine_spawn(pipe_reader, &p);
+    coroutine_spawn(pipe_writer, &p);
+    run_all();
+    if (p.result != 7) {
+        printf("pipe: expected 7 bytes, got %zd (%s)\n", p.result, strerror(p.error));
+        failures++;
+    }
+    close_pipe(&p);
+
+    /* A wait ends at the deadline */
+    if (!open_pipe(&p)) {
+        return failures + 1;
+    }
+    coroutine_spawn(pipe_deadline, &p);
+    run_all();
+    if (p.result != -1 || p.error != ETIMEDOUT || !p.expired) {
+        printf("deadline: expected ETIMEDOUT, got %zd (%s)\n", p.result, strerror(p.error));
+        failures++;
+    }
+    close_pipe(&p);
+
+    /* Outside a coroutine the helpers simply block */
+    if (coroutine_active() || coroutine_poll(-1, 0, 1) != 0) {
+        printf("outside: expected poll semantics\n");
+        failures++;
+    }
+
+    /* Many coroutines at once */
+    Finished = 0;
+    for (int i = 0; i < MANY; i++) {
+        if (coroutine_spawn(sleeper, NULL) < 0) {
+            break;
+        }
+    }
+    run_all();
+    if (Finished != MANY) {
+        printf("many: expected %d to finish, got %d\n", MANY, Finished);
+        failures++;
+    }
+    return failures;
+}
+
+/* Resident memory of this process in KB */
+static long resident_kb(void) {
+    char line[BUFSIZ];
+    long kb = 0;
+    FILE *stream = fopen("/proc/self/status", "r");
+    while (stream && fgets(line, sizeof(line), stream)) {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1) {
+            break;
+        }
+    }
+    if (stream) {
+        fclose(stream);
+    }
+    return kb;
+}
+
+/**
+ * Report the cost of a switch and the memory of a waiting coroutine.
+ **/
+static void benchmark_coroutine(long iterations) {
+    struct timespec start, stop;
+
+    /* Two coroutines yielding to each other: each yield switches twice */
+    coroutine_spawn(yielder, (void *)iterations);
+    coroutine_spawn(yielder, (void *)iterations);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_all();
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    double elapsed = (stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec);
+    printf("switch   %8.1f ns (%ld yields through the scheduler)\n", elapsed / (iterations * 4), iterations * 2);
+
+    /* Park many coroutines in a wait and measure what they hold */
+    long before = resident_kb();
+    Finished = 0;
+    Release  = false;
+    for (int i = 0; i < MANY; i++) {
+        coroutine_spawn(parked, NULL);
+    }
+    coroutine_run();
+    long after = resident_kb();
+    printf("memory   %8.1f KB resident per waiting coroutine (%d KB stack reserved)\n",
+        (double)(after - before) / MANY, COROUTINE_STACK / 1024);
+
+    Release = true;
+    run_all();
+}
+
+int main(int argc, char *argv[]) {
+    bool benchmark = argc > 1 && streq(argv[1], "-b");
+
+    Scheduler = coroutine_init();
+    if (Scheduler < 0) {
+        fprintf(stderr, "Unable to create scheduler: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    if (benchmark) {
+        benchmark_coroutine(argc > 2 ? atol(argv[2]) : 1000000);
+    } else {
+        failures = test_coroutine();
+        printf("test_coroutine: %s\n", failures ? "Failure" : "Success");
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,200 @@
+/* test_resolve.c: Check and benchmark request path resolution */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Globals (normally defined by spidey.c) */
+
+char *RootPath        = NULL;
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+
+#define DEPTH       12                  /* Directories above the deep file */
+
+typedef struct {
+    const char *uri;
+    int         error;                  /* Expected errno (0 if the open succeeds) */
+} Case;
+
+static const Case Cases[] = {
+    { "/",                          0 },
+    { "/index.html",                0 },
+    { "//index.html",               0 },
+    { "/./d0/../index.html",        0 },
+    { "/inside",                    0 },
+    { "/missing",                   ENOENT },
+    { "/index.html/missing",        ENOTDIR },
+    { "/..",                        EXDEV },
+    { "/d0/../../etc/passwd",       EXDEV },
+    { "/outside",                   EXDEV },
+};
+
+#define NCASES      (sizeof(Cases) / sizeof(Cases[0]))
+
+/* Functions */
+
+/**
+ * Build a root with a deep file and symlinks that stay inside or escape it.
+ **/
+static bool build_root(char *root, char *deep, size_t n) {
+    char path[PATH_MAX];
+
+    if (!mkdtemp(root)) {
+        return false;
+    }
+    snprintf(path, sizeof(path), "%s/index.html", root);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fputs("<h1>spidey</h1>\n", file);
+    fclose(file);
+
+    snprintf(path, sizeof(path), "%s/inside", root);
+    if (symlink("index.html", path) < 0) {
+        return false;
+    }
+    snprintf(path, sizeof(path), "%s/outside", root);
+    if (symlink("/etc/passwd", path) < 0) {
+        return false;
+    }
+
+    int length = 0;
+    for (int i = 0; i < DEPTH; i++) {
+        length += snprintf(deep + length, n - length, "/d%d", i);
+        snprintf(path, sizeof(path), "%s%s", root, deep);
+        if (mkdir(path, 0755) < 0) {
+            return false;
+        }
+    }
+    snprintf(deep + length, n - length, "/page.html");
+    snprintf(path, sizeof(path), "%s%s", root, deep);
+    file = fopen(path, "w");
+    return file && fclose(file) == 0;
+}
+
+/**
+ * Check that every case resolves (or is refused) as expected.
+ **/
+static int test_resolve(const char *deep) {
+    int failures = 0;
+
+    for (size_t c = 0; c < NCASES + 1; c++) {
+        const char *uri   = c < NCASES ? Cases[c].uri : deep;
+        int         error = c < NCASES ? Cases[c].error : 0;
+        char       *path  = NULL;
+
+        errno = 0;
+        int fd = determine_request_path(uri, &path);
+        int result = fd < 0 ? errno : 0;
+        if (result != error) {
+            printf("%-28s expected %s, got %s\n", uri, strerror(error), strerror(result));
+            failures++;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(path);
+    }
+    return failures;
+}
+
+/* Resolve the way spidey did before openat2: realpath, then open */
+static int resolve_realpath(const char *uri) {
+    char path[BUFSIZ];
+    char real[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s%s", RootPath, uri);
+    if (!realpath(path, real) || strncmp(real, RootPath, strlen(RootPath)) != 0) {
+        return -1;
+    }
+    return open(real, O_RDONLY | O_CLOEXEC);
+}
+
+/* Resolve with determine_request_path */
+static int resolve_openat2(const char *uri) {
+    char *path = NULL;
+    int   fd   = determine_request_path(uri, &path);
+    free(path);
+    return fd;
+}
+
+/**
+ * Report microseconds per resolution of the deep file for each approach.
+ **/
+static void benchmark_resolve(const char *deep, long iterations) {
+    static const struct {
+        const char *name;
+        int (*resolve)(const char *uri);
+    } Resolvers[] = {
+        { "realpath", resolve_realpath },
+        { "openat2",  resolve_openat2 },
+    };
+
+    printf("URI: %s (%d directories), %ld iterations\n", deep, DEPTH, iterations);
+    for (size_t i = 0; i < sizeof(Resolvers) / sizeof(Resolvers[0]); i++) {
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long n = 0; n < iterations; n++) {
+            int fd = Resolvers[i].resolve(deep);
+            if (fd < 0) {
+                printf("%-8s unable to resolve: %s\n", Resolvers[i].name, strerror(errno));
+                break;
+            }
+            close(fd);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        double elapsed = (stop.tv_sec - start.tv_sec) * 1e6 + (stop.tv_nsec - start.tv_nsec) / 1e3;
+        printf("%-8s %8.3f us/path\n", Resolvers[i].name, elapsed / iterations);
+    }
+}
+
+/* Remove the temporary root */
+static void remove_root(const char *root) {
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -fr '%s'", root);
+    if (system(command) != 0) {
+        fprintf(stderr, "Unable to remove %s\n", root);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char root[] = "/tmp/spidey-resolve.XXXXXX";
+    char deep[PATH_MAX];
+    bool benchmark = argc > 1 && streq(argv[1], "-b");
+
+    if (!build_root(root, deep, sizeof(deep))) {
+        fprintf(stderr, "Unable to build %s: %s\n", root, strerror(errno));
+        remove_root(root);
+        return EXIT_FAILURE;
+    }
+
+    RootPath = root;
+    if (root_open() < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", root, strerror(errno));
+        remove_root(root);
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    if (benchmark) {
+        benchmark_resolve(deep, argc > 2 ? atol(argv[2]) : 100000);
+    } else {
+        failures = test_resolve(deep);
+        printf("test_resolve: %s\n", failures ? "Failure" : "Success");
+    }
+
+    remove_root(root);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
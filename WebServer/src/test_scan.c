@@ -0,0 +1,180 @@
+/* test_scan.c: Check and benchmark header scanning implementations */
+
+#include "spidey.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+/* Globals */
+
+static const char *Sets[] = { "\r\n", ":", " \t", WHITESPACE, "\n", "?&=#" };
+
+#define NSETS       (sizeof(Sets) / sizeof(Sets[0]))
+#define MAXLENGTH   300
+
+static const char *Names[] = {
+    "Host", "host", "HOST", "User-Agent", "user-agent", "Accept", "Accept-Encoding",
+    "accept-LANGUAGE", "Connection", "Content-Length", "Content-Type", "Cookie",
+    "Expect", "Transfer-Encoding", "Upgrade", "HTTP2-Settings", "X-Forwarded-For",
+    "Referer", "Range", "If-None-Match", "If-Modified-Since", "Cache-Control",
+    "Authorization", "X-Unknown", "Hos", "Hostt", "", "Accept-Encodinh",
+    "a-very-long-header-name-that-exceeds-the-vector-width",
+};
+
+#define NNAMES      (sizeof(Names) / sizeof(Names[0]))
+
+static const char *HeaderBlock =
+    "Host: localhost:9898\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1700000000; session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "If-None-Match: \"5e1a2b3c-3a2\"\r\n"
+    "If-Modified-Since: Sat, 29 Feb 2020 12:00:00 GMT\r\n"
+    "X-Forwarded-For: 203.0.113.7, 198.51.100.23\r\n"
+    "\r\n";
+
+static const ScanMode Modes[] = { SCAN_SCALAR, SCAN_SSE42, SCAN_AVX2 };
+
+#define NMODES      (sizeof(Modes) / sizeof(Modes[0]))
+
+/* Functions */
+
+/**
+ * Record results of every scan on buffer for the current implementation.
+ **/
+static size_t record_scans(const char *buffer, ptrdiff_t *results) {
+    size_t count = 0;
+    for (size_t set = 0; set < NSETS; set++) {
+        for (size_t offset = 0; offset < 40; offset++) {
+            for (size_t length = 0; offset + length <= MAXLENGTH; length += 1 + length / 8) {
+                const char *f = scan_find(buffer + offset, length, Sets[set]);
+                const char *s = scan_skip(buffer + offset, length, Sets[set]);
+                results[count++] = f ? f - buffer : -1;
+                results[count++] = s ? s - buffer : -1;
+            }
+        }
+    }
+    for (size_t i = 0; i < NNAMES; i++) {
+        results[count++] = scan_header(Names[i], strlen(Names[i]));
+    }
+    return count;
+}
+
+/**
+ * Compare every vectorized implementation against the scalar one.
+ **/
+static int test_scans(void) {
+    static ptrdiff_t expected[1 << 20];
+    static ptrdiff_t actual[1 << 20];
+    char buffer[MAXLENGTH + 1];
+    int  failures = 0;
+
+    srand(20289);
+    for (int round = 0; round < 64; round++) {
+        /* Mostly header-like bytes, with runs of the interesting ones */
+        static const char alphabet[] = "abcXYZ-:;,= \t\r\n?&#\x80\xff";
+        for (size_t i = 0; i < MAXLENGTH; i++) {
+            buffer[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+        buffer[MAXLENGTH] = '\0';
+        if (round % 4 == 0) {
+            memset(buffer + rand() % 100, ' ', 100);
+        }
+
+        scan_init(SCAN_SCALAR);
+        size_t nexpected = record_scans(buffer, expected);
+
+        for (size_t m = 1; m < NMODES; m++) {
+            if (!scan_init(Modes[m])) {
+                continue;
+            }
+            size_t nactual = record_scans(buffer, actual);
+            if (nactual != nexpected || memcmp(expected, actual, nactual * sizeof(ptrdiff_t))) {
+                fprintf(stderr, "%s: mismatch with scalar in round %d\n", scan_name(), round);
+                failures++;
+            }
+        }
+    }
+
+    scan_init(SCAN_SCALAR);
+    if (scan_header("cOnTeNt-LeNgTh", 14) != HEADER_CONTENT_LENGTH ||
+        scan_header("Content-Lengthx", 15) != HEADER_UNKNOWN) {
+        fprintf(stderr, "scalar: header lookup is wrong\n");
+        failures++;
+    }
+    return failures;
+}
+
+/**
+ * Scan a header block the way parse_request_headers does.
+ **/
+static size_t scan_block(const char *block, size_t n) {
+    const char *end   = block + n;
+    size_t      known = 0;
+    while (block < end) {
+        const char *eol = scan_find(block, end - block, "\r\n");
+        if (!eol || eol == block) {
+            break;
+        }
+        const char *colon = scan_find(block, eol - block, ":");
+        if (colon) {
+            scan_skip(colon + 1, eol - colon - 1, " \t");
+            known += scan_header(block, colon - block) != HEADER_UNKNOWN;
+        }
+        block = eol + 2;
+    }
+    return known;
+}
+
+/**
+ * Report nanoseconds per header byte for each implementation.
+ **/
+static void benchmark_scans(long iterations) {
+    size_t length = strlen(HeaderBlock);
+    printf("Header block: %zu bytes, %ld iterations\n", length, iterations);
+
+    for (size_t m = 0; m < NMODES; m++) {
+        if (!scan_init(Modes[m])) {
+            continue;
+        }
+
+        struct timespec start, stop;
+        volatile size_t sink = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < iterations; i++) {
+            sink += scan_block(HeaderBlock, length);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        double elapsed = (stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec);
+        printf("%-8s %8.3f ns/byte %10.1f ns/block\n", scan_name(),
+            elapsed / (iterations * length), elapsed / iterations);
+        (void)sink;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && streq(argv[1], "-b")) {
+        benchmark_scans(argc > 2 ? atol(argv[2]) : 200000);
+        return EXIT_SUCCESS;
+    }
+
+    int failures = test_scans();
+    printf("test_scan: %s\n", failures ? "Failure" : "Success");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
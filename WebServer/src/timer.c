@@ -0,0 +1,210 @@
+/* timer.c: Hierarchical Timer Wheel */
+
+#include "spidey.h"
+
+#include <time.h>
+
+/**
+ * The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots each.  A timer due
+ * within TIMER_SLOTS ticks sits in level 0, indexed by its expiry tick; timers
+ * further out sit in a coarser level and are cascaded down one level each
+ * time the level below wraps around.  Slots are circular doubly-linked lists
+ * with the slot itself as the sentinel, so adding and cancelling a timer are
+ * a handful of pointer updates.
+ **/
+
+#define TIMER_BITS      6
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+
+/**
+ * Return monotonic clock in milliseconds.
+ **/
+uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize timer wheel.
+ *
+ * @param   w           Timer wheel.
+ **/
+void timer_wheel_init(TimerWheel *w) {
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            Timer *head = &w->slots[level][slot];
+            head->next = head->prev = head;
+        }
+    }
+    w->tick  = timer_now() / TIMER_TICK_MS;
+    w->count = 0;
+}
+
+/* Link timer into the slot matching its expiry relative to the current tick */
+static void timer_link(TimerWheel *w, Timer *t) {
+    uint64_t delta = t->expires > w->tick ? t->expires - w->tick : 0;
+    int      level = 0;
+
+    while (level < TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_BITS * (level + 1)))) {
+        level++;
+    }
+
+    uint64_t expires = t->expires;
+    if (delta >= ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS))) {
+        expires = w->tick + ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+    if (expires <= w->tick) {
+        expires = w->tick + 1;
+    }
+
+    Timer *head = &w->slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    t->prev       = head->prev;
+    t->next       = head;
+    head->prev->next = t;
+    head->prev    = t;
+}
+
+static void timer_unlink(Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/**
+ * Schedule timer.
+ *
+ * @param   w           Timer wheel.
+ * @param   t           Timer (re-scheduled if already pending).
+ * @param   kind        What the deadline guards.
+ * @param   timeout     Milliseconds from now.
+ **/
+void timer_add(TimerWheel *w, Timer *t, TimerKind kind, uint64_t timeout) {
+    if (timer_pending(t)) {
+        timer_cancel(w, t);
+    }
+
+    t->kind    = kind;
+    t->expires = (timer_now() + timeout + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer_link(w, t);
+    w->count++;
+}
+
+/**
+ * Cancel timer (does nothing if the timer is not pending).
+ *
+ * @param   w           Timer wheel.
+ * @param   t           Timer.
+ **/
+void timer_cancel(TimerWheel *w, Timer *t) {
+    if (!timer_pending(t)) {
+        return;
+    }
+    timer_unlink(t);
+    w->count--;
+}
+
+/**
+ * Return milliseconds until timer expires (0 if already due).
+ **/
+uint64_t timer_remaining(const Timer *t) {
+    uint64_t now = timer_now();
+    uint64_t due = t->expires * TIMER_TICK_MS;
+    return due > now ? due - now : 0;
+}
+
+/**
+ * Advance the wheel to the current time and expire every due timer.
+ *
+ * @param   w           Timer wheel.
+ * @param   expire      Function called for each expired timer (which is no
+ *                      longer pending and may be re-scheduled).
+ * @param   arg         Argument passed to expire.
+ * @return  Number of expired timers.
+ **/
+size_t timer_expire(TimerWheel *w, void (*expire)(Timer *, void *), void *arg) {
+    uint64_t now     = timer_now() / TIMER_TICK_MS;
+    size_t   expired = 0;
+
+    if (w->count == 0) {
+        w->tick = now;
+        return 0;
+    }
+
+    while (w->tick < now && w->count > 0) {
+        w->tick++;
+
+        /* Cascade coarser levels whenever the level below wraps */
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if ((w->tick & (((uint64_t)1 << (TIMER_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            Timer *head = &w->slots[level][(w->tick >> (TIMER_BITS * level)) & TIMER_MASK];
+            while (head->next != head) {
+                Timer *t = head->next;
+                timer_unlink(t);
+                timer_link(w, t);
+            }
+        }
+
+        Timer *head = &w->slots[0][w->tick & TIMER_MASK];
+        while (head->next != head) {
+            Timer *t = head->next;
+            timer_unlink(t);
+            w->count--;
+            expired++;
+            expire(t, arg);
+        }
+    }
+
+    w->tick = now;
+    return expired;
+}
+
+/**
+ * Call a function for every pending timer.
+ *
+ * @param   w           Timer wheel.
+ * @param   each        Function called for each timer (which may cancel it).
+ * @param   arg         Argument passed to each.
+ **/
+void timer_each(TimerWheel *w, void (*each)(Timer *, void *), void *arg) {
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            Timer *head = &w->slots[level][slot];
+            for (Timer *t = head->next, *next; t != head; t = next) {
+                next = t->next;
+                each(t, arg);
+            }
+        }
+    }
+}
+
+/**
+ * Return milliseconds until the wheel next needs attention (-1 if empty).
+ *
+ * This is exact for timers in level 0 and otherwise returns the time until
+ * level 0 wraps and the next cascade happens, which is good enough for use as
+ * a poll timeout.
+ **/
+int timer_next(TimerWheel *w) {
+    if (w->count == 0) {
+        return -1;
+    }
+
+    uint64_t tick = timer_now() / TIMER_TICK_MS;
+    if (tick < w->tick) {
+        tick = w->tick;
+    }
+
+    for (uint64_t i = 1; i <= TIMER_SLOTS; i++) {
+        uint64_t next = w->tick + i;
+        Timer   *head = &w->slots[0][next & TIMER_MASK];
+        if (head->next != head || (next & TIMER_MASK) == 0) {
+            return next > tick ? (next - tick) * TIMER_TICK_MS : 0;
+        }
+    }
+    return TIMER_SLOTS * TIMER_TICK_MS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
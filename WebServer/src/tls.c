@@ -0,0 +1,318 @@
+/* tls.c: HTTPS Connections */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * HTTPS connections are accepted on their own socket and handshake inside the
+ * event loop without blocking.  Once the handshake is done, OpenSSL hands the
+ * session keys to the kernel (SOL_TLS) when the kernel supports it, and the
+ * socket then takes plaintext: responses are written to it directly and files
+ * still go out with sendfile.  Otherwise responses are encrypted in userspace
+ * through a stream that calls SSL_write.
+ *
+ * Sessions can be resumed with tickets (TLS 1.3) or from the server's session
+ * cache (TLS 1.2).  The handshake happens in the event loop process, so both
+ * work across forked children.  The ticket keys are handed to the new server
+ * on an upgrade, so tickets stay good across deploys.
+ **/
+
+#define TLS_SESSIONS        4096        /* Sessions kept for resumption */
+#define TLS_SESSION_TIMEOUT 3600        /* Seconds a session can be resumed */
+#define TLS_TICKET_KEYS     80          /* Bytes of ticket key name, HMAC and AES keys */
+
+/* Globals */
+
+int TlsSocket = -1;
+
+static SSL_CTX *Context = NULL;
+static const unsigned char SessionContext[] = "spidey";
+
+/* Log and clear OpenSSL's error queue */
+static void tls_error(const char *what) {
+    unsigned long error = ERR_get_error();
+    log("%s: %s", what, error ? ERR_reason_error_string(error) : strerror(errno));
+    ERR_clear_error();
+}
+
+/**
+ * Create the TLS context and listen for HTTPS connections on TlsPort.
+ *
+ * @return  0 on success, -1 on failure.
+ **/
+int tls_init(void) {
+    Context = SSL_CTX_new(TLS_server_method());
+    if (!Context) {
+        tls_error("Unable to create TLS context");
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(Context, TLS1_2_VERSION);
+    SSL_CTX_set_options(Context, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_mode(Context, SSL_MODE_RELEASE_BUFFERS);    /* Idle connections hold no record buffers */
+#ifdef SSL_OP_ENABLE_KTLS
+    if (TlsKernel) {
+        SSL_CTX_set_options(Context, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+
+    SSL_CTX_set_session_id_context(Context, SessionContext, sizeof(SessionContext) - 1);
+    SSL_CTX_set_session_cache_mode(Context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(Context, TLS_SESSIONS);
+    SSL_CTX_set_timeout(Context, TLS_SESSION_TIMEOUT);
+
+    if (SSL_CTX_use_certificate_chain_file(Context, TlsCertificate) != 1) {
+        tls_error("Unable to load certificate");
+        goto fail;
+    }
+    if (SSL_CTX_use_PrivateKey_file(Context, TlsKey, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(Context) != 1) {
+        tls_error("Unable to load private key");
+        goto fail;
+    }
+
+    TlsSocket = socket_listen(TlsPort);
+    if (TlsSocket < 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    SSL_CTX_free(Context);
+    Context = NULL;
+    return -1;
+}
+
+/**
+ * Start TLS on an accepted HTTPS connection.
+ *
+ * @param   r           Request structure.
+ * @return  0 on success, -1 on failure.
+ **/
+int tls_accept(Request *r) {
+    r->tls = SSL_new(Context);
+    if (!r->tls || SSL_set_fd(r->tls, r->fd) != 1) {
+        tls_error("Unable to start TLS");
+        return -1;
+    }
+    SSL_set_accept_state(r->tls);
+    return 0;
+}
+
+/* Userspace encryption: the response stream writes through SSL_write (and
+ * waits for the socket on a coroutine, retrying with the same buffer) */
+
+static ssize_t tls_write(void *cookie, const char *buffer, size_t size) {
+    Request *r = cookie;
+    size_t   nwritten;
+
+    while (SSL_write_ex(r->tls, buffer, size, &nwritten) != 1) {
+        int error = SSL_get_error(r->tls, 0);
+        if ((error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) &&
+            coroutine_poll(r->fd, error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN, -1) > 0) {
+            continue;
+        }
+        if (error != SSL_ERROR_SYSCALL || !errno) {
+            errno = EIO;
+        }
+        ERR_clear_error();
+        return -1;
+    }
+    return nwritten;
+}
+
+static const cookie_io_functions_t TlsStream = {
+    .write = tls_write,
+};
+
+/**
+ * Open a response stream that encrypts through SSL_write.
+ *
+ * @param   r           Request structure whose handshake is done.
+ * @return  Stream (or NULL on error).
+ **/
+FILE * tls_stream(Request *r) {
+    return fopencookie(r, "w", TlsStream);
+}
+
+/**
+ * Continue the TLS handshake.
+ *
+ * @param   r           Request structure.
+ * @return  1 once the handshake is done, 0 if more input is needed, and -1 if
+ * it failed.
+ *
+ * Once the kernel takes the session keys, the connection's bytes can be
+ * written to the socket as-is; otherwise responses go through tls_stream.
+ **/
+int tls_handshake(Request *r) {
+    if (SSL_is_init_finished(r->tls)) {
+        return 1;
+    }
+
+    int status = SSL_do_handshake(r->tls);
+    if (status != 1) {
+        /* Handshake messages fit in the socket buffer, so only reads wait */
+        int error = SSL_get_error(r->tls, status);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            return 0;
+        }
+        debug("TLS handshake with %s failed", request_peer(r));
+        ERR_clear_error();
+        return -1;
+    }
+
+    stats_add(tls_handshakes, 1);
+    if (SSL_session_reused(r->tls)) {
+        stats_add(tls_resumed, 1);
+    }
+
+    if (BIO_get_ktls_send(SSL_get_wbio(r->tls))) {
+        stats_add(tls_kernel, 1);
+        r->plaintext = true;
+    }
+    debug("TLS %s with %s (%s)", SSL_get_version(r->tls), request_peer(r),
+          r->plaintext ? "kernel" : "userspace");
+    return 1;
+}
+
+/**
+ * Read decrypted request bytes without blocking.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Where to store bytes.
+ * @param   size        Size of buffer.
+ * @return  Bytes read, 0 at the end of the connection, or -1 with errno set
+ * (EAGAIN if no complete record has arrived).
+ **/
+ssize_t tls_recv(Request *r, char *buffer, size_t size) {
+    size_t nread;
+
+    if (SSL_read_ex(r->tls, buffer, size, &nread) == 1) {
+        return nread;
+    }
+
+    switch (SSL_get_error(r->tls, 0)) {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        if (errno) {
+            break;
+        }
+        /* Fall through */
+    default:
+        errno = EPROTO;
+        break;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+/**
+ * Check whether decrypted input is buffered beyond what has been read.
+ *
+ * @param   r           Request structure.
+ * @return  Whether tls_recv would return bytes without waiting for the socket.
+ **/
+bool tls_pending(Request *r) {
+    return r->tls && SSL_has_pending(r->tls);
+}
+
+/**
+ * Send a short response without blocking.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Bytes to send.
+ * @param   size        Number of bytes.
+ *
+ * Nothing is sent before the handshake is done.
+ **/
+void tls_send(Request *r, const char *buffer, size_t size) {
+    size_t nwritten;
+
+    if (SSL_is_init_finished(r->tls) && SSL_write_ex(r->tls, buffer, size, &nwritten) != 1) {
+        ERR_clear_error();
+    }
+}
+
+/**
+ * Tell the client the connection is closing (close_notify).
+ *
+ * @param   r           Request structure.
+ *
+ * Clients treat a body that ends with the connection as truncated unless the
+ * close is announced.
+ **/
+void tls_shutdown(Request *r) {
+    if (r->tls && SSL_is_init_finished(r->tls)) {
+        SSL_shutdown(r->tls);
+        ERR_clear_error();
+    }
+}
+
+/**
+ * Release TLS state of a closed connection.
+ *
+ * @param   r           Request structure.
+ **/
+void tls_free(Request *r) {
+    SSL_free(r->tls);
+    r->tls = NULL;
+}
+
+/**
+ * Write the session ticket keys as a "tickets" line (for an upgrade).
+ *
+ * @param   stream      Stream to write to.
+ **/
+void tls_save(FILE *stream) {
+    unsigned char keys[TLS_TICKET_KEYS];
+
+    if (!Context || SSL_CTX_get_tlsext_ticket_keys(Context, keys, sizeof(keys)) != 1) {
+        return;
+    }
+    fputs("tickets ", stream);
+    for (size_t i = 0; i < sizeof(keys); i++) {
+        fprintf(stream, "%02x", keys[i]);
+    }
+    fputc('\n', stream);
+    OPENSSL_cleanse(keys, sizeof(keys));
+}
+
+/**
+ * Use session ticket keys saved by tls_save.
+ *
+ * @param   hex         Keys in hexadecimal.
+ **/
+void tls_restore(const char *hex) {
+    unsigned char keys[TLS_TICKET_KEYS];
+
+    if (!Context || strlen(hex) != 2 * sizeof(keys)) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(keys); i++) {
+        if (sscanf(hex + 2 * i, "%2hhx", &keys[i]) != 1) {
+            return;
+        }
+    }
+    if (SSL_CTX_set_tlsext_ticket_keys(Context, keys, sizeof(keys)) != 1) {
+        tls_error("Unable to restore session ticket keys");
+    }
+    OPENSSL_cleanse(keys, sizeof(keys));
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,123 @@
+/* trace.c: Sampling Request Tracer */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/**
+ * One request in every TraceSample is given a slot in a ring of TraceRecords
+ * when it starts, and the trace macro stamps each phase boundary it crosses
+ * into that slot.  The ring is shared with forked children, so phases handled
+ * in a child land in the same record, and trace_dump prints whatever the ring
+ * holds when the server is sent SIGUSR2.  Requests that are not sampled only
+ * pay for checking their NULL trace pointer.
+ **/
+
+/* Globals */
+
+static TraceRecord *Ring     = NULL;
+static unsigned long Sequence = 0;      /* Samples taken (only the server samples) */
+static unsigned long Counter  = 0;      /* Requests started since last sample */
+
+/* Functions */
+
+/**
+ * Return monotonic clock in nanoseconds.
+ **/
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Map the trace ring into memory shared with forked children.
+ *
+ * Does nothing if sampling is disabled, and disables it if the mapping fails.
+ **/
+void trace_init(void) {
+    if (TraceSample <= 0) {
+        return;
+    }
+
+    Ring = mmap(NULL, TRACE_RING * sizeof(TraceRecord), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Ring == MAP_FAILED) {
+        debug("Unable to map trace ring: %s", strerror(errno));
+        Ring        = NULL;
+        TraceSample = 0;
+    }
+}
+
+/**
+ * Begin a request, sampling it if it is the next 1 in TraceSample.
+ *
+ * @param   r           Request structure.
+ **/
+void trace_start(Request *r) {
+    r->trace = NULL;
+    if (Ring && ++Counter >= (unsigned long)TraceSample) {
+        Counter  = 0;
+        r->trace = &Ring[Sequence % TRACE_RING];
+        memset(r->trace, 0, sizeof(TraceRecord));
+        r->trace->sequence = ++Sequence;
+    }
+    trace(r, start);
+}
+
+/**
+ * Finish a request, completing its sample if it has one.
+ *
+ * @param   r           Request structure.
+ * @param   status      Response status.
+ **/
+void trace_finish(Request *r, int status) {
+    trace(r, done);
+    if (r->trace) {
+        r->trace->pid    = getpid();
+        r->trace->status = status;
+        if (r->uri) {
+            strncpy(r->trace->uri, r->uri, TRACE_URI - 1);
+        }
+        r->trace = NULL;
+    }
+}
+
+/**
+ * Write sampled requests, oldest first, with microseconds spent before each
+ * phase boundary.  Phases a request skipped are left out.
+ *
+ * @param   stream      Stream to write to.
+ **/
+void trace_dump(FILE *stream) {
+    if (!Ring) {
+        return;
+    }
+
+    unsigned long first = Sequence > TRACE_RING ? Sequence - TRACE_RING : 0;
+    for (unsigned long i = first; i < Sequence; i++) {
+        TraceRecord *t = &Ring[i % TRACE_RING];
+        uint64_t     last = t->start;
+
+        if (!t->headers) {
+            continue;   /* Connection closed before sending a request */
+        }
+
+        fprintf(stream, "trace %lu pid=%d status=%s uri=%s", t->sequence, t->pid,
+            t->done ? http_status_string(t->status) : "-", t->uri[0] ? t->uri : "-");
+#define TRACE_DUMP(name) \
+        if (t->name && t->name >= last && &t->name != &t->start) { \
+            fprintf(stream, " " #name "=%lu", (unsigned long)(t->name - last) / 1000); \
+            last = t->name; \
+        }
+        TRACE(TRACE_DUMP)
+#undef TRACE_DUMP
+        fprintf(stream, " total=%lu\n", (unsigned long)(last - t->start) / 1000);
+    }
+    fflush(stream);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
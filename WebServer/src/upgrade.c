@@ -0,0 +1,334 @@
+/* upgrade.c: Zero-Downtime Binary Upgrade */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * SIGHUP has the server start its binary again (as found on disk now, with
+ * the arguments it was started with) without ever closing its sockets.  The
+ * new server inherits every descriptor registered with upgrade_handoff (the
+ * listening sockets and the shared CGI cache) and finds each one under an
+ * environment variable SPIDEY_FD_<name>, so socket_listen adopts the socket
+ * already bound to its port instead of binding again, and connections keep
+ * queueing in the kernel throughout.
+ *
+ * The warm state that is private to the old server goes along in a memfd of
+ * "kind value" lines: the paths the negative cache knows to be missing (each
+ * checked again before it is trusted) and the TLS ticket keys, so clients
+ * keep resuming their sessions.  Once the new server is about to serve, it
+ * writes a byte to a pipe the old server watches.  The old server then stops
+ * accepting, closes its idle connections, finishes the requests it has in
+ * flight (for at most WriteTimeout seconds), and exits.  If the new server
+ * exits before it is ready, the old one logs it and carries on serving.
+ **/
+
+#define UPGRADE_FDS     8               /* Descriptors handed over at most */
+#define UPGRADE_PREFIX  "SPIDEY_FD_"    /* Environment variables naming them */
+
+typedef struct {
+    char    name[32];
+    int     fd;
+} Handoff;
+
+/* Globals */
+
+static char   **Argv = NULL;            /* Copy of arguments (parsing modifies them) */
+static Handoff  Handoffs[UPGRADE_FDS];
+static size_t   NHandoffs = 0;
+static pid_t    Successor = 0;          /* Server being started (0 if none) */
+
+/* Functions */
+
+/* Write the private warm state into a memfd, returning it (or -1) */
+static int upgrade_save(void) {
+    int   fd     = memfd_create("spidey-state", MFD_CLOEXEC);
+    int   copy   = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    FILE *stream = copy >= 0 ? fdopen(copy, "w") : NULL;
+    if (!stream) {
+        debug("Unable to save state: %s", strerror(errno));
+        if (copy >= 0) {
+            close(copy);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    negative_save(stream);
+    tls_save(stream);
+    if (fclose(stream) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Restore the warm state handed over by the previous server */
+static void upgrade_restore(void) {
+    char  line[BUFSIZ + 16];
+    int   fd = upgrade_inherited("STATE");
+    FILE *stream = fd >= 0 && lseek(fd, 0, SEEK_SET) == 0 ? fdopen(fd, "r") : NULL;
+    if (!stream) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    size_t restored = 0;
+    while (fgets(line, sizeof(line), stream)) {
+        char *value = strchr(line, ' ');
+        if (!value || line[strlen(line) - 1] != '\n') {
+            continue;
+        }
+        *value++ = '\0';
+        chomp(value);
+
+        if (streq(line, "missing")) {
+            negative_restore(value);
+        } else if (streq(line, "tickets")) {
+            tls_restore(value);
+        } else {
+            continue;
+        }
+        restored++;
+    }
+    fclose(stream);
+    log("Restored %zu entries of warm state", restored);
+}
+
+/**
+ * Remember the command line to start the new server with.
+ *
+ * @param   argc        Number of arguments.
+ * @param   argv        Arguments, before any are parsed.
+ **/
+void upgrade_init(int argc, char *argv[]) {
+    Argv = calloc(argc + 1, sizeof(char *));
+    for (int i = 0; Argv && i < argc; i++) {
+        Argv[i] = strdup(argv[i]);
+    }
+}
+
+/**
+ * Hand a descriptor over to the new server on upgrade.
+ *
+ * @param   name        Name the new server asks upgrade_inherited for.
+ * @param   fd          Descriptor (registering a name again replaces it).
+ **/
+void upgrade_handoff(const char *name, int fd) {
+    size_t i = 0;
+    while (i < NHandoffs && !streq(Handoffs[i].name, name)) {
+        i++;
+    }
+    if (i == UPGRADE_FDS) {
+        log("Too many descriptors to hand over; %s stays behind", name);
+        return;
+    }
+    if (i == NHandoffs) {
+        NHandoffs++;
+    }
+    snprintf(Handoffs[i].name, sizeof(Handoffs[i].name), "%s", name);
+    Handoffs[i].fd = fd;
+}
+
+/**
+ * Take a descriptor handed over by the previous server.
+ *
+ * @param   name        Name it was registered under with upgrade_handoff.
+ * @return  Descriptor (close-on-exec), or -1 if none was handed over.
+ **/
+int upgrade_inherited(const char *name) {
+    char variable[64];
+    snprintf(variable, sizeof(variable), UPGRADE_PREFIX "%s", name);
+
+    const char *value = getenv(variable);
+    if (!value) {
+        return -1;
+    }
+    int fd = atoi(value);
+    unsetenv(variable);
+    if (fd <= STDERR_FILENO || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        return -1;
+    }
+    debug("Inherited %s as descriptor %d", name, fd);
+    return fd;
+}
+
+/**
+ * Start the new server.
+ *
+ * @return  Read end of the pipe the new server reports readiness on (pass it
+ * to upgrade_finish once readable), or -1 if it could not be started.
+ **/
+int upgrade_start(void) {
+    extern char **environ;
+    int    ready[2];
+    size_t n = 0;
+
+    if (!Argv) {
+        return -1;
+    }
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        log("Unable to upgrade: %s", strerror(errno));
+        return -1;
+    }
+    warmup_save();
+    int state = upgrade_save();
+
+    /* Environment of the new server: ours plus a variable per descriptor */
+    while (environ[n]) {
+        n++;
+    }
+    char **env = calloc(n + NHandoffs + 3, sizeof(char *));
+    if (!env) {
+        close(ready[0]);
+        close(ready[1]);
+        if (state >= 0) {
+            close(state);
+        }
+        return -1;
+    }
+    memcpy(env, environ, n * sizeof(char *));
+    size_t first = n;
+    for (size_t i = 0; i < NHandoffs; i++) {
+        if (asprintf(&env[n], UPGRADE_PREFIX "%s=%d", Handoffs[i].name, Handoffs[i].fd) > 0) {
+            n++;
+        }
+    }
+    if (asprintf(&env[n], UPGRADE_PREFIX "READY=%d", ready[1]) > 0) {
+        n++;
+    }
+    if (state >= 0 && asprintf(&env[n], UPGRADE_PREFIX "STATE=%d", state) > 0) {
+        n++;
+    }
+    env[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Only the descriptors handed over survive the exec */
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC);
+        for (size_t i = 0; i < NHandoffs; i++) {
+            fcntl(Handoffs[i].fd, F_SETFD, 0);
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        if (state >= 0) {
+            fcntl(state, F_SETFD, 0);
+        }
+        execvpe(Argv[0], Argv, env);
+        log("Unable to execute %s: %s", Argv[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = first; i < n; i++) {
+        free(env[i]);
+    }
+    free(env);
+    close(ready[1]);
+    if (state >= 0) {
+        close(state);
+    }
+    if (pid < 0) {
+        log("Unable to upgrade: %s", strerror(errno));
+        close(ready[0]);
+        return -1;
+    }
+
+    log("Upgrading to new server %d", pid);
+    Successor = pid;
+    return ready[0];
+}
+
+/**
+ * Learn whether the new server started.
+ *
+ * @param   fd          Descriptor returned by upgrade_start (closed).
+ * @return  Whether the new server is serving (otherwise it has exited).
+ *
+ * A new server that is serving outlives this one, which never reaps it: once
+ * this server exits, init (or the nearest subreaper) adopts it.  One that
+ * failed has closed the pipe on its way out, so it is waited for here; no
+ * other mode reaps it (forking mode's reaper may already have, which leaves
+ * nothing to wait for).
+ **/
+bool upgrade_finish(int fd) {
+    char    byte;
+    ssize_t nread;
+
+    while ((nread = read(fd, &byte, 1)) < 0 && errno == EINTR);
+    close(fd);
+
+    if (nread == 1) {
+        log("New server %d is serving; draining connections", Successor);
+        Successor = 0;
+        return true;
+    }
+
+    log("New server %d failed to start; still serving", Successor);
+    while (waitpid(Successor, NULL, 0) < 0 && errno == EINTR);
+    Successor = 0;
+    return false;
+}
+
+/**
+ * Finish taking over from the previous server, if there is one.
+ *
+ * Restores the warm state it handed over and tells it this server is about
+ * to serve.  Descriptors it handed over that went unused (such as a port
+ * this server no longer listens on) are closed.
+ **/
+void upgrade_ready(void) {
+    extern char **environ;
+
+    upgrade_restore();
+
+    int fd = upgrade_inherited("READY");
+    if (fd >= 0) {
+        pid_t previous = getppid();     /* Before it exits */
+        if (write(fd, "", 1) != 1) {
+            debug("Unable to report readiness: %s", strerror(errno));
+        }
+        close(fd);
+        log("Took over from server %d", previous);
+    }
+
+    for (char **variable = environ; *variable; ) {
+        if (strncmp(*variable, UPGRADE_PREFIX, strlen(UPGRADE_PREFIX)) != 0) {
+            variable++;
+            continue;
+        }
+
+        char        name[32];
+        const char *rest   = *variable + strlen(UPGRADE_PREFIX);
+        size_t      length = strcspn(rest, "=");
+        if (length >= sizeof(name)) {
+            variable++;
+            continue;
+        }
+        memcpy(name, rest, length);
+        name[length] = '\0';
+
+        /* Taking it removes the variable, so start over */
+        if ((fd = upgrade_inherited(name)) >= 0) {
+            debug("Closing unused %s", name);
+            close(fd);
+        }
+        variable = environ;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
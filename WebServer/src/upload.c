@@ -0,0 +1,392 @@
+/* upload.c: Streaming PUT Uploads */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A PUT under an upload prefix stores its body at the URI's path beneath
+ * RootPath, in a directory that must already exist.  The path is resolved
+ * beneath the prefix's own directory, so neither a ".." segment (refused
+ * with 403 before routing, along with "." and empty segments) nor a symlink
+ * can put the file anywhere else.  On plain HTTP the body
+ * never passes through user memory: it is spliced from the socket into a
+ * pipe (grown to UPLOAD_PIPE) and from the pipe into an unnamed O_TMPFILE in
+ * the target's directory.  When the Content-Length is known, the file is
+ * preallocated with fallocate first, so the filesystem lays it out in one
+ * piece and a full disk is found out (507) before any of the body is read.
+ *
+ * Once the whole body is on disk and flushed, the file is linked into place,
+ * or renamed over the file it replaces, so readers see the old file or the
+ * new one and never a partial upload.  A filesystem without O_TMPFILE gets a
+ * hidden temporary name instead, removed if the upload fails.  The response
+ * is 201 Created for a new file and 200 OK for a replaced one.
+ *
+ * Uploads are held to MaxBody and to their prefix's own limit: a
+ * Content-Length beyond it is refused before the client is asked for the
+ * body, and a chunked body is cut off once it passes the limit.  Output the
+ * CGI cache holds for the path is dropped; the negative cache learns of the
+ * new file from inotify before its next lookup.  HTTP/2 streams are refused,
+ * as their request bodies are not read.
+ **/
+
+#define UPLOAD_MAX      8               /* URI prefixes accepting uploads */
+#define UPLOAD_PIPE     (1 << 20)       /* Pipe size asked for (bytes spliced at once) */
+
+struct upload {
+    char           *prefix;             /* URI prefix accepting uploads */
+    size_t          length;             /* Length of prefix */
+    off_t           limit;              /* Largest upload in bytes (0 for MaxBody alone) */
+};
+
+/* Globals */
+
+static Upload        Uploads[UPLOAD_MAX];
+static size_t        NUploads = 0;
+static unsigned long Temporaries = 0;   /* Temporary names handed out */
+
+/* Functions */
+
+/* Status answering a filesystem error */
+static Status upload_error(int error) {
+    switch (error) {
+    case ENOENT:
+    case ENOTDIR:
+    case EXDEV:
+    case ELOOP:
+        return HTTP_STATUS_NOT_FOUND;
+    case EACCES:
+    case EPERM:
+    case EROFS:
+        return HTTP_STATUS_FORBIDDEN;
+    case ENOSPC:
+    case EDQUOT:
+    case EFBIG:
+        return HTTP_STATUS_INSUFFICIENT_STORAGE;
+    case ETIMEDOUT:
+    case EINTR:
+        return HTTP_STATUS_REQUEST_TIMEOUT;
+    default:
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+}
+
+/* Whether a URI has an empty, "." or ".." segment */
+static bool upload_dotted(const char *uri) {
+    if (uri[0] != '/') {
+        return true;
+    }
+    for (const char *segment = uri + 1; ; segment++) {
+        size_t length = strcspn(segment, "/");
+        if (length == 0 || (segment[0] == '.' && (length == 1 || (length == 2 && segment[1] == '.')))) {
+            return true;
+        }
+        segment += length;
+        if (!*segment) {
+            return false;
+        }
+    }
+}
+
+/* Name a hidden temporary file in a directory */
+static void upload_temporary(char *name, size_t n) {
+    snprintf(name, n, ".upload.%d.%lu", getpid(), Temporaries++);
+}
+
+/* Give an unnamed file a name (AT_EMPTY_PATH needs a capability, /proc does not) */
+static int upload_link(int fd, int dirfd, const char *name) {
+    char proc[32];
+
+    if (linkat(fd, "", dirfd, name, AT_EMPTY_PATH) == 0) {
+        return 0;
+    }
+    if (errno != ENOENT && errno != EPERM) {
+        return -1;
+    }
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    return linkat(AT_FDCWD, proc, dirfd, name, AT_SYMLINK_FOLLOW);
+}
+
+/* Put the finished file in place under name, replacing whatever is there */
+static int upload_publish(int fd, int dirfd, const char *temporary, const char *name, bool *created) {
+    char other[NAME_MAX + 1];
+
+    *created = true;
+    if (*temporary) {
+        if (renameat2(dirfd, temporary, dirfd, name, RENAME_NOREPLACE) == 0) {
+            return 0;
+        }
+        if (errno != EEXIST && errno != EINVAL) {
+            return -1;
+        }
+        *created = errno == EINVAL && faccessat(dirfd, name, F_OK, AT_SYMLINK_NOFOLLOW) < 0;
+        return renameat(dirfd, temporary, dirfd, name);
+    }
+
+    if (upload_link(fd, dirfd, name) == 0) {
+        return 0;
+    }
+    if (errno != EEXIST) {
+        return -1;
+    }
+
+    /* Link under a temporary name and rename that over the old file */
+    *created = false;
+    upload_temporary(other, sizeof(other));
+    if (upload_link(fd, dirfd, other) < 0) {
+        return -1;
+    }
+    if (renameat(dirfd, other, dirfd, name) < 0) {
+        int error = errno;
+        unlinkat(dirfd, other, 0);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Move n bytes from a pipe into a file */
+static int upload_drain(int pipe, int fd, size_t n) {
+    while (n > 0) {
+        ssize_t moved = splice(pipe, NULL, fd, NULL, n, SPLICE_F_MOVE);
+        if (moved <= 0) {
+            if (moved == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        n -= moved;
+    }
+    return 0;
+}
+
+/* Stream the request body into a file */
+static Status upload_stream(Request *r, int fd, off_t limit, off_t *total) {
+    int     pipe[2];
+    ssize_t moved;
+    Status  status = HTTP_STATUS_OK;
+
+    if (pipe2(pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Never ask for more than the empty pipe holds, or the splice waits on itself */
+    int capacity = fcntl(pipe[1], F_SETPIPE_SZ, UPLOAD_PIPE);
+    if (capacity < 0) {
+        capacity = fcntl(pipe[1], F_GETPIPE_SZ);
+    }
+
+    *total = 0;
+    while ((moved = body_splice(r, pipe[1], capacity)) > 0) {
+        *total += moved;
+        if (limit > 0 && *total > limit) {
+            debug("Upload beyond its limit of %lld bytes", (long long)limit);
+            status = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+            break;
+        }
+        if (upload_drain(pipe[0], fd, moved) < 0) {
+            debug("Unable to write upload: %s", strerror(errno));
+            status = upload_error(errno);
+            break;
+        }
+    }
+    if (moved < 0) {
+        debug("Unable to receive request body: %s", strerror(errno));
+        switch (errno) {
+        case EFBIG:
+            status = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+            break;
+        case ETIMEDOUT:
+        case EINTR:
+            status = HTTP_STATUS_REQUEST_TIMEOUT;
+            break;
+        default:
+            status = HTTP_STATUS_BAD_REQUEST;
+            break;
+        }
+    }
+
+    close(pipe[0]);
+    close(pipe[1]);
+    return status;
+}
+
+/**
+ * Add an upload prefix.
+ *
+ * @param   spec        prefix[,MB] (largest upload in megabytes).
+ * @return  0 on success, -1 if spec is malformed or the table is full.
+ **/
+int upload_add(char *spec) {
+    char *limit = strchr(spec, ',');
+    if (spec[0] != '/' || NUploads == UPLOAD_MAX) {
+        return -1;
+    }
+    if (limit) {
+        *limit++ = '\0';
+        if (atoll(limit) <= 0) {
+            return -1;
+        }
+    }
+
+    Upload *upload = &Uploads[NUploads++];
+    upload->prefix = spec;
+    upload->length = strlen(spec);
+    upload->limit  = limit ? (off_t)atoll(limit) << 20 : 0;
+    return 0;
+}
+
+/**
+ * Find the upload prefix accepting a request.
+ *
+ * @param   r           Request structure.
+ * @return  Whether the request is a PUT under an upload prefix (the longest
+ * one is stored in r->upload).
+ *
+ * A URI with an empty, "." or ".." segment is refused: r->upload is NULL and
+ * r->error is 403.
+ **/
+bool upload_route(Request *r) {
+    if (NUploads == 0 || !streq(r->method, "PUT")) {
+        return false;
+    }
+
+    r->upload = NULL;
+    for (size_t i = 0; i < NUploads; i++) {
+        Upload *upload = &Uploads[i];
+        if (strncmp(r->uri, upload->prefix, upload->length) == 0) {
+            char next = r->uri[upload->length];
+            if ((next == '\0' || next == '/' || upload->prefix[upload->length - 1] == '/') &&
+                (!r->upload || upload->length > r->upload->length)) {
+                r->upload = upload;
+            }
+        }
+    }
+    if (r->upload && upload_dotted(r->uri)) {
+        debug("Refusing upload to %s", r->uri);
+        r->upload = NULL;
+        r->error  = HTTP_STATUS_FORBIDDEN;
+        return true;
+    }
+    return r->upload != NULL;
+}
+
+/**
+ * Store the body of a PUT request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the upload (HTTP_STATUS_OK once the response is sent).
+ *
+ * Nothing is sent on error, for the caller's error page.
+ **/
+Status upload_handle(Request *r) {
+    Upload     *upload    = r->upload;
+    const char *slash     = strrchr(r->uri, '/');
+    const char *name      = slash ? slash + 1 : "";
+    char        temporary[NAME_MAX + 1] = "";
+    char       *directory = NULL;
+    char       *path      = NULL;
+    int         base      = -1;
+    int         dirfd     = -1;
+    int         fd        = -1;
+    off_t       total     = 0;
+    bool        created   = false;
+    Status      status;
+
+    if (r->stream || name < r->uri + upload->length || !*name || strlen(name) > NAME_MAX) {
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+    if (upload->limit > 0 && r->length > upload->limit) {
+        debug("Upload too large: %lld bytes", (long long)r->length);
+        return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+    }
+
+    /* Open the directory the file goes in (the URI up to its last slash)
+     * beneath the prefix's own */
+    const char *rest     = r->uri + upload->length + strspn(r->uri + upload->length, "/");
+    char       *relative = strndup(rest, name - rest);
+    base  = determine_request_path(upload->prefix, &directory);
+    dirfd = base >= 0 && relative ? determine_beneath_path(base, directory, relative, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    free(relative);
+    if (dirfd < 0) {
+        debug("Unable to open directory of %s: %s", r->uri, strerror(errno));
+        status = upload_error(errno);
+        goto done;
+    }
+
+    /* Create the file unnamed, or hidden if the filesystem cannot */
+    fd = openat(dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        upload_temporary(temporary, sizeof(temporary));
+        fd = openat(dirfd, temporary, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            temporary[0] = '\0';
+        }
+    }
+    if (fd < 0) {
+        debug("Unable to create upload in %s: %s", directory, strerror(errno));
+        status = upload_error(errno);
+        goto done;
+    }
+
+    /* Reserve the space before asking for the body */
+    if (r->length > 0 && fallocate(fd, 0, 0, r->length) < 0 && errno != EOPNOTSUPP) {
+        debug("Unable to allocate %lld bytes: %s", (long long)r->length, strerror(errno));
+        status = upload_error(errno);
+        goto done;
+    }
+
+    if ((status = upload_stream(r, fd, upload->limit, &total)) != HTTP_STATUS_OK) {
+        goto done;
+    }
+    if (fdatasync(fd) < 0 || upload_publish(fd, dirfd, temporary, name, &created) < 0) {
+        debug("Unable to store upload as %s: %s", name, strerror(errno));
+        status = upload_error(errno);
+        goto done;
+    }
+    temporary[0] = '\0';
+
+    /* Drop output cached for the file's old contents */
+    if (asprintf(&path, "%s/%s", RootPath, r->uri + strspn(r->uri, "/")) > 0) {
+        cache_invalidate(path);
+    }
+    stats_add(uploads, 1);
+    stats_add(upload_bytes, total);
+    log("Stored %lld bytes as %s", (long long)total, path ? path : name);
+
+    Header location = {.name = "Location", .value = r->uri, .id = HEADER_UNKNOWN, .next = NULL};
+    r->responder->start(r, created ? 201 : 200, created ? "Created" : "OK", "text/plain", 0, created ? &location : NULL);
+    r->responder->finish(r);
+
+done:
+    if (*temporary) {
+        unlinkat(dirfd, temporary, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (dirfd >= 0) {
+        close(dirfd);
+    }
+    if (base >= 0) {
+        close(base);
+    }
+    if (status != HTTP_STATUS_OK && r->body != BODY_NONE) {
+        r->keep_alive = false;
+    }
+    free(directory);
+    free(path);
+    trace(r, body);
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
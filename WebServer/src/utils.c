@@ -1,14 +1,72 @@
 /* utils.c: spidey utilities */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 
+#include <linux/openat2.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#define MIMETYPE_CACHE      64          /* Extensions whose mimetype is remembered */
+#define MIMETYPE_EXTENSION  16          /* Longest extension remembered */
+
+/* Globals */
+
+int RootFd = -1;
+
+static struct {
+    char  extension[MIMETYPE_EXTENSION];
+    char *mimetype;
+} Mimetypes[MIMETYPE_CACHE];
+static size_t NMimetypes = 0;
+
+/* Scan MimeTypesPath for extension (NULL if it cannot be read) */
+static char * mimetype_scan(const char *ext) {
+    char buffer[BUFSIZ];
+    size_t extlen = strlen(ext);
+
+    FILE *mimetypes = fopen(MimeTypesPath, "r");
+    if (!mimetypes) {
+        fprintf(stderr, "Could not open MimeTypes with fdopen: %s\n", strerror(errno));
+        return NULL;
+    }
+    debug("Mimetypes file was opened successfully");
+
+    while (fgets(buffer, BUFSIZ, mimetypes)) {
+        if (!buffer[0] || buffer[0] == '#') {
+            continue;
+        }
+
+        /* Mimetype runs up to the first whitespace, extensions follow */
+        size_t      length = strlen(buffer);
+        const char *end    = buffer + length;
+        const char *token  = scan_find(buffer, length, WHITESPACE);
+        size_t      typelen = token ? (size_t)(token - buffer) : length;
+
+        while (token && (token = scan_skip(token, end - token, WHITESPACE))) {
+            const char *next = scan_find(token, end - token, WHITESPACE);
+            size_t      n    = next ? (size_t)(next - token) : (size_t)(end - token);
+            if (n == extlen && memcmp(token, ext, n) == 0) {
+                fclose(mimetypes);
+                debug("Extension maps to: %.*s", (int)typelen, buffer);
+                return strndup(buffer, typelen);
+            }
+            token = next;
+        }
+    }
+
+    fclose(mimetypes);
+    return strdup(DefaultMimeType);
+}
+
 /**
  * Determine mime-type from file extension.
  *
@@ -29,105 +87,158 @@
  * If no extension exists or no matching mimetype is found, then return
  * DefaultMimeType.
  *
+ * The answer for each extension is remembered, so MimeTypesPath is only read
+ * the first time an extension is seen (changes to it take a restart).
+ *
  * This function returns an allocated string that must be free'd.
  **/
 char * determine_mimetype(const char *path) {
-        char buffer[BUFSIZ];
-        char *searchExt;
-        char *ext = strrchr(path,'.')+1;
-        char *ret;
+    char *ext = strrchr(path, '.');
 
+    if (!ext || strchr(ext, '/')) {
+        debug("Did not find extention");
+        return strdup(DefaultMimeType);
+    }
+    ext++;
+    debug("Looking for extention: %s", ext);
 
-        if(!ext){
-            debug("Did not find extention");
-            return NULL;
+    for (size_t i = 0; i < NMimetypes; i++) {
+        if (streq(Mimetypes[i].extension, ext)) {
+            return strdup(Mimetypes[i].mimetype);
         }
-        debug("Looking for extention: %s", ext);
+    }
 
-        FILE *mimetypes = fopen(MimeTypesPath,"r");
-        if(!mimetypes){
-            fprintf(stderr, "Could not open MimeTypes with fdopen: %s\n", strerror(errno));
-            return NULL;
+    char *mimetype = mimetype_scan(ext);
+    if (!mimetype) {
+        return strdup(DefaultMimeType);
+    }
+    if (NMimetypes < MIMETYPE_CACHE && strlen(ext) < MIMETYPE_EXTENSION) {
+        char *copy = strdup(mimetype);
+        if (copy) {
+            strcpy(Mimetypes[NMimetypes].extension, ext);
+            Mimetypes[NMimetypes++].mimetype = copy;
         }
+    }
+    return mimetype;
+}
 
-        debug("Mimetypes file was opened successfully");
+/**
+ * Open RootPath once for resolving request paths beneath it.
+ *
+ * @return  O_PATH file descriptor of the root directory (or -1 on error).
+ *
+ * RootPath is replaced by its real path, so the paths given to CGI scripts
+ * are absolute.
+ **/
+int root_open(void) {
+    char *real = realpath(RootPath, NULL);
+    if(!real) {
+        debug("Unable to resolve %s: %s", RootPath, strerror(errno));
+        return -1;
+    }
+    RootPath = real;
 
-        while(fgets(buffer,BUFSIZ,mimetypes)){
-            chomp(buffer);
-            if (!(buffer[0]) || buffer[0]=='#')continue;
+    RootFd = open(RootPath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(RootFd < 0) {
+        debug("Unable to open %s: %s", RootPath, strerror(errno));
+    }
+    return RootFd;
+}
 
-            searchExt = strtok(skip_whitespace(skip_nonwhitespace(buffer)), WHITESPACE);
-            if(streq(searchExt, ext)){
-                debug("Found a matching extention: %s", searchExt);
-                goto breaker;
-            }
-            while((searchExt = strtok(NULL, WHITESPACE))){
-                if(streq(searchExt, ext)){
-                    debug("Found a matching extention: %s", searchExt);
-                    goto breaker;
-                }
-            }
-        }
-breaker:
+/* Resolve without openat2 (kernels before 5.6): realpath and a prefix check */
+static int resolve_realpath(const char *base, const char *relative, int flags) {
+    char path[BUFSIZ];
+    char real[PATH_MAX];
+    char root[PATH_MAX];
 
-        if(!(ret = strtok(buffer,WHITESPACE))){
-            fprintf(stderr, "Could not strtok buffer: %s\n", strerror(errno));
-            fclose(mimetypes);
-            return NULL;
-        }
-        fclose(mimetypes);
-        debug("Extension maps to: %s",ret);
+    if(snprintf(path, sizeof(path), "%s/%s", base, relative) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if(!realpath(base, root) || !realpath(path, real)) {
+        return -1;
+    }
+    size_t length = strlen(root);
+    if(strncmp(real, root, length) != 0 || (real[length] != '/' && real[length] != '\0')) {
+        errno = EXDEV;
+        return -1;
+    }
+    return open(real, flags);
+}
+
+/* Open path relative to directory dirfd (at path base) without leaving it */
+static int resolve_beneath(int dirfd, const char *base, const char *relative, int flags) {
+    static bool Unsupported = false;
+    struct open_how how = {
+        .flags   = flags,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
 
-        if(!ret) {
-            ret = DefaultMimeType;
-          }
-        return strdup(ret);
+    if(!Unsupported) {
+        int fd = syscall(SYS_openat2, dirfd, relative, &how, sizeof(how));
+        if(fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        Unsupported = true;
+    }
+    return resolve_realpath(base, relative, flags);
 }
 
 /**
- * Determine actual filesystem path based on RootPath and URI.
+ * Open the file a URI refers to beneath RootPath.
  *
  * @param   uri         Resource path of URI.
- * @return  An allocated string containing the full path of the resource on the
- * local filesystem.
+ * @param   path        Set to an allocated string with the resource's path on
+ * the local filesystem (for scripts and mimetypes); must later be free'd.
+ * @return  File descriptor of the resource (or -1 with errno set).
  *
- * This function uses realpath(3) to generate the realpath of the
- * file requested in the URI.
+ * The path is resolved in one openat2(2) relative to the root opened by
+ * root_open, and the kernel refuses to step outside of it through "..",
+ * absolute symlinks, or magic links (EXDEV).  The returned descriptor is
+ * the one the handlers fstat, send, and list, so a path swapped after it
+ * was checked has no effect.
  *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
- *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
+ * Resources that can be executed but not read are opened with O_PATH.
  **/
-char * determine_request_path(const char *uri) {
-    char buffer[BUFSIZ];
-    char path[BUFSIZ];
-
-    /* Attempt to copy variables */
-    if( snprintf(path, BUFSIZ, "%s%s",RootPath, uri) < 0) {
-        debug("Could not copy path: %s", strerror(errno));
-        return NULL;
+int determine_request_path(const char *uri, char **path) {
+    /* Paths beneath the root are relative to it */
+    const char *relative = uri + strspn(uri, "/");
+    if(!*relative) {
+        relative = ".";
     }
 
-    /* Get the real path */
-    realpath(path, buffer);
-
-    if(path == NULL) {
-        debug("Path is null. Return");
-        return NULL;
+    int fd = resolve_beneath(RootFd, RootPath, relative, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if(fd < 0 && errno == EACCES) {
+        fd = resolve_beneath(RootFd, RootPath, relative, O_PATH | O_CLOEXEC);
     }
-
-    if( streq(path, RootPath) < 0){
-        debug("Path and Rootpath do not equal");
-        return NULL;
+    if(fd < 0) {
+        debug("Unable to open %s beneath %s: %s", relative, RootPath, strerror(errno));
+        return -1;
     }
 
-    debug("Path: %s", path);
-    return strdup(path);
-
-
+    if(asprintf(path, "%s/%s", RootPath, relative) < 0) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    debug("Path: %s", *path);
+    return fd;
+}
 
+/**
+ * Open a path beneath a directory opened by determine_request_path.
+ *
+ * @param   dirfd       Directory.
+ * @param   directory   Its path, as determine_request_path set it.
+ * @param   relative    Path beneath the directory.
+ * @param   flags       Flags for open(2).
+ * @return  File descriptor (or -1 with errno set).
+ *
+ * As beneath the root, the kernel refuses to step outside of the directory
+ * (EXDEV).
+ **/
+int determine_beneath_path(int dirfd, const char *directory, const char *relative, int flags) {
+    return resolve_beneath(dirfd, directory, *relative ? relative : ".", flags);
 }
 
 /**
@@ -140,62 +251,48 @@ char * determine_request_path(const char *uri) {
  **/
 const char * http_status_string(Status status) {
     static char *StatusStrings[] = {
-        "200 OK",
-        "400 Bad Request",
-        "404 Not Found",
-        "500 Internal Server Error",
-        "418 I'm A Teapot",
+        [HTTP_STATUS_OK]                    = "200 OK",
+        [HTTP_STATUS_BAD_REQUEST]           = "400 Bad Request",
+        [HTTP_STATUS_NOT_FOUND]             = "404 Not Found",
+        [HTTP_STATUS_INTERNAL_SERVER_ERROR] = "500 Internal Server Error",
+        [HTTP_STATUS_REQUEST_TIMEOUT]       = "408 Request Timeout",
+        [HTTP_STATUS_SERVICE_UNAVAILABLE]   = "503 Service Unavailable",
+        [HTTP_STATUS_PAYLOAD_TOO_LARGE]     = "413 Payload Too Large",
+        [HTTP_STATUS_GATEWAY_TIMEOUT]       = "504 Gateway Timeout",
+        [HTTP_STATUS_BAD_GATEWAY]           = "502 Bad Gateway",
+        [HTTP_STATUS_FORBIDDEN]             = "403 Forbidden",
+        [HTTP_STATUS_INSUFFICIENT_STORAGE]  = "507 Insufficient Storage",
+        [HTTP_STATUS_NOT_IMPLEMENTED]       = "501 Not Implemented",
     };
 
-    const char *string_status;
-    switch(status) {
-        case 0:
-            string_status = StatusStrings[0];
-            break;
-        case 1:
-            string_status = StatusStrings[1];
-            break;
-        case 2:
-            string_status = StatusStrings[2];
-            break;
-        default:
-            string_status = StatusStrings[3];
-            break;
-    }
-
-    return string_status;
+    if((size_t)status >= sizeof(StatusStrings) / sizeof(StatusStrings[0]) || !StatusStrings[status]) {
+        return StatusStrings[HTTP_STATUS_INTERNAL_SERVER_ERROR];
+    }
+    return StatusStrings[status];
 }
 
 /**
  * Advance string pointer pass all nonwhitespace characters
  *
  * @param   s           String.
- * @return  Point to first whitespace character in s.
+ * @return  Point to first whitespace character in s (or the terminating NUL).
  **/
 char * skip_nonwhitespace(char *s) {
-    for(char *edit = s; *edit != '\0'; edit++) {
-        if(*edit == ' ' || *edit == '\n' || *edit == '\t') {
-            s = edit;
-            break;
-        }
-    }
-    return s;
+    size_t      n = strlen(s);
+    const char *p = scan_find(s, n, WHITESPACE);
+    return p ? (char *)p : s + n;
 }
 
 /**
  * Advance string pointer pass all whitespace characters
  *
  * @param   s           String.
- * @return  Point to first non-whitespace character in s.
+ * @return  Point to first non-whitespace character in s (or the terminating NUL).
  **/
 char * skip_whitespace(char *s) {
-    for(char *edit = s; *edit != '\0'; edit++) {
-        if(*edit != ' ' && *edit != '\n' && *edit != '\t') {
-            s = edit;
-            break;
-        }
-    }
-    return s;
+    size_t      n = strlen(s);
+    const char *p = scan_skip(s, n, WHITESPACE);
+    return p ? (char *)p : s + n;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
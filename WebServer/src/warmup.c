@@ -0,0 +1,379 @@
+/* warmup.c: Startup Warmup from an Access-Frequency Manifest */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Files served are counted in a table shared with forked children: each URI
+ * hashes to one slot, and a different URI landing on a busy slot wears its
+ * count down until it can take the slot over, so the table keeps the URIs
+ * that are hit most.  Every WARMUP_SAVE milliseconds (and before the server
+ * exits or upgrades) the event loop writes the hottest WARMUP_MANIFEST of
+ * them to the manifest at WarmupPath, one "hits size uri" line each, and
+ * halves every count so the manifest follows what is hot now.
+ *
+ * On startup the manifest is replayed, and counting picks up from its
+ * counts, so a quiet restart does not forget them.  The mimetype of each
+ * extension is looked up right away, in the event loop process, so forked
+ * children start with it remembered.  A thread then resolves each path
+ * beneath the root, which fills the kernel's dentry and inode caches, and
+ * reads the file ahead into the page cache, hottest first and at most
+ * WarmupRate megabytes a second so the warmup never crowds out requests.
+ * The time the warmup took is logged, and so is the p99 latency of the
+ * requests admitted in the first WARMUP_REPORT milliseconds.
+ **/
+
+#define WARMUP_ENTRIES  1024            /* URIs counted at once */
+#define WARMUP_URI      256             /* Longest URI counted */
+#define WARMUP_MANIFEST 512             /* URIs written to the manifest */
+#define WARMUP_SAVE     60000           /* Milliseconds between manifest writes */
+#define WARMUP_REPORT   60000           /* Milliseconds of latency reported after startup */
+#define WARMUP_BUCKETS  (64 * 8)        /* Latency buckets (8 per power of two) */
+
+typedef struct {
+    int           lock;                 /*< Spinlock guarding slot */
+    uint64_t      hash;                 /*< Hash of uri */
+    unsigned long hits;                 /*< Recent hits (0 if empty) */
+    off_t         size;                 /*< Size of file last served */
+    char          uri[WARMUP_URI];      /*< Request URI */
+} WarmupSlot;
+
+typedef struct {
+    unsigned long hits;
+    off_t         size;
+    char         *uri;
+} WarmupEntry;
+
+/* Globals */
+
+static WarmupSlot   *Slots   = NULL;
+static uint64_t      Saved   = 0;       /* Time manifest was last written (ms) */
+static uint64_t      Started = 0;       /* Time server started (ms) */
+static bool          Reported = false;
+static unsigned long Latencies[WARMUP_BUCKETS];
+static bool          Warmed  = false;   /* Whether the warmup is done */
+static unsigned long Took    = 0;       /* Milliseconds the warmup took */
+
+static WarmupEntry  *Entries  = NULL;   /* Manifest being replayed */
+static size_t        NEntries = 0;
+
+/* Functions */
+
+/* FNV-1a */
+static uint64_t warmup_hash(const char *s) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void slot_lock(WarmupSlot *s) {
+    while (__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void slot_unlock(WarmupSlot *s) {
+    __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Latency bucket of a number of microseconds (8 per power of two) */
+static size_t warmup_bucket(uint64_t us) {
+    if (us < 8) {
+        return us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    size_t bucket = msb * 8 + ((us >> (msb - 3)) & 7);
+    return bucket < WARMUP_BUCKETS ? bucket : WARMUP_BUCKETS - 1;
+}
+
+/* Largest latency in a bucket (microseconds) */
+static uint64_t warmup_bound(size_t bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    int msb = bucket / 8;
+    return (((uint64_t)8 + bucket % 8 + 1) << (msb - 3)) - 1;
+}
+
+/* Add hits to a URI's count, or wear down the count of the URI in its slot */
+static void warmup_count(const char *uri, unsigned long hits, off_t size) {
+    if (!Slots || strlen(uri) >= WARMUP_URI || strchr(uri, '\n')) {
+        return;
+    }
+
+    uint64_t    hash = warmup_hash(uri);
+    WarmupSlot *s    = &Slots[hash % WARMUP_ENTRIES];
+    slot_lock(s);
+    if (s->hits > 0 && s->hash == hash && streq(s->uri, uri)) {
+        s->hits += hits;
+        s->size  = size;
+    } else if (s->hits <= hits) {
+        s->hash = hash;
+        s->hits = hits;
+        s->size = size;
+        strcpy(s->uri, uri);
+    } else {
+        s->hits -= hits;
+    }
+    slot_unlock(s);
+}
+
+/* Hottest first */
+static int warmup_compare(const void *a, const void *b) {
+    const WarmupEntry *ea = a;
+    const WarmupEntry *eb = b;
+    return (eb->hits > ea->hits) - (eb->hits < ea->hits);
+}
+
+/* Read the manifest into Entries */
+static void warmup_load(void) {
+    char  line[WARMUP_URI + 64];
+    FILE *stream = fopen(WarmupPath, "r");
+    if (!stream) {
+        if (errno != ENOENT) {
+            log("Unable to read warmup manifest %s: %s", WarmupPath, strerror(errno));
+        }
+        return;
+    }
+
+    Entries = calloc(WARMUP_MANIFEST, sizeof(WarmupEntry));
+    while (Entries && NEntries < WARMUP_MANIFEST && fgets(line, sizeof(line), stream)) {
+        unsigned long hits;
+        long long     size;
+        int           offset;
+        if (sscanf(line, "%lu %lld %n", &hits, &size, &offset) < 2 || line[offset] != '/' ||
+            line[strlen(line) - 1] != '\n') {
+            continue;
+        }
+        chomp(line);
+        WarmupEntry *entry = &Entries[NEntries];
+        if ((entry->uri = strdup(line + offset))) {
+            entry->hits = hits;
+            entry->size = size;
+            NEntries++;
+        }
+    }
+    fclose(stream);
+}
+
+/* Resolve and read ahead every manifest entry, at most WarmupRate MB/s */
+static void *warmup_thread(void *arg) {
+    uint64_t started = timer_now();
+    size_t   resolved = 0;
+    uint64_t bytes    = 0;
+    (void)arg;
+
+    for (size_t i = 0; i < NEntries; i++) {
+        char *path = NULL;
+        int   fd   = determine_request_path(Entries[i].uri, &path);
+        free(path);
+        if (fd < 0) {
+            continue;
+        }
+        resolved++;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            if (readahead(fd, 0, st.st_size) < 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            }
+            bytes += st.st_size;
+
+            /* Stay under WarmupRate by the time spent so far */
+            uint64_t due = WarmupRate > 0 ? started + bytes * 1000 / ((uint64_t)WarmupRate << 20) : 0;
+            uint64_t now = timer_now();
+            if (due > now) {
+                struct timespec pause = { (due - now) / 1000, (due - now) % 1000 * 1000000L };
+                nanosleep(&pause, NULL);
+            }
+        }
+        close(fd);
+    }
+
+    Took = timer_now() - started;
+    log("Warmed %zu of %zu paths (%.1f MB read ahead) in %lu ms", resolved, NEntries, bytes / 1048576.0, Took);
+    __atomic_store_n(&Warmed, true, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < NEntries; i++) {
+        free(Entries[i].uri);
+    }
+    free(Entries);
+    return NULL;
+}
+
+/**
+ * Count served files and replay the manifest at WarmupPath.
+ *
+ * Does nothing if WarmupPath is NULL.  Call once RootPath is open.
+ **/
+void warmup_start(void) {
+    if (!WarmupPath) {
+        return;
+    }
+    Started = Saved = timer_now();
+
+    Slots = mmap(NULL, WARMUP_ENTRIES * sizeof(WarmupSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Slots == MAP_FAILED) {
+        debug("Unable to map warmup table: %s", strerror(errno));
+        Slots = NULL;
+    }
+
+    warmup_load();
+    if (NEntries == 0) {
+        free(Entries);
+        Entries = NULL;
+        Warmed  = true;
+        return;
+    }
+
+    /* Count from where the manifest left off, and remember every mimetype
+     * here, before any child is forked */
+    for (size_t i = 0; i < NEntries; i++) {
+        warmup_count(Entries[i].uri, Entries[i].hits, Entries[i].size);
+        free(determine_mimetype(Entries[i].uri));
+    }
+
+    pthread_t      thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    int error = pthread_create(&thread, &attributes, warmup_thread, NULL);
+    pthread_attr_destroy(&attributes);
+    if (error) {
+        log("Unable to start warmup: %s", strerror(error));
+        Warmed = true;
+    }
+}
+
+/**
+ * Count a file served.
+ *
+ * @param   r           Request structure.
+ * @param   size        Size of the file.
+ **/
+void warmup_record(Request *r, off_t size) {
+    warmup_count(r->uri, 1, size);
+}
+
+/**
+ * Record the latency of a request admitted shortly after startup.
+ *
+ * @param   us          Microseconds from admission to completion.
+ **/
+void warmup_latency(uint64_t us) {
+    if (Started && !Reported) {
+        Latencies[warmup_bucket(us)]++;
+    }
+}
+
+/**
+ * Write the hottest URIs to the manifest, replacing it.
+ **/
+void warmup_save(void) {
+    char         temporary[BUFSIZ];
+    WarmupEntry *hot = Slots ? calloc(WARMUP_ENTRIES, sizeof(WarmupEntry)) : NULL;
+    size_t       n   = 0;
+    if (!hot) {
+        return;
+    }
+    Saved = timer_now();
+
+    for (size_t i = 0; i < WARMUP_ENTRIES; i++) {
+        WarmupSlot *s = &Slots[i];
+        slot_lock(s);
+        if (s->hits > 0 && (hot[n].uri = strdup(s->uri))) {
+            hot[n].hits = s->hits;
+            hot[n].size = s->size;
+            n++;
+        }
+        s->hits -= s->hits / 2;
+        slot_unlock(s);
+    }
+    qsort(hot, n, sizeof(WarmupEntry), warmup_compare);
+
+    snprintf(temporary, sizeof(temporary), "%s.%d", WarmupPath, getpid());
+    FILE *stream = fopen(temporary, "w");
+    if (stream) {
+        for (size_t i = 0; i < n && i < WARMUP_MANIFEST; i++) {
+            fprintf(stream, "%lu %lld %s\n", hot[i].hits, (long long)hot[i].size, hot[i].uri);
+        }
+        if (fclose(stream) != 0 || rename(temporary, WarmupPath) < 0) {
+            log("Unable to write warmup manifest %s: %s", WarmupPath, strerror(errno));
+            unlink(temporary);
+        }
+    } else {
+        log("Unable to write warmup manifest %s: %s", WarmupPath, strerror(errno));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free(hot[i].uri);
+    }
+    free(hot);
+}
+
+/**
+ * Return milliseconds until the manifest is due to be written or the
+ * startup latency is due to be reported.
+ *
+ * @return  Milliseconds (0 if overdue), or -1 if nothing is due.
+ **/
+int warmup_due(void) {
+    if (!Slots) {
+        return -1;
+    }
+
+    uint64_t now  = timer_now();
+    uint64_t next = Saved + WARMUP_SAVE;
+    if (!Reported && Started + WARMUP_REPORT < next) {
+        next = Started + WARMUP_REPORT;
+    }
+    return next > now ? (int)(next - now) : 0;
+}
+
+/**
+ * Write the manifest and report the startup latency when they are due.
+ **/
+void warmup_tick(void) {
+    if (!Slots) {
+        return;
+    }
+
+    uint64_t now = timer_now();
+    if (!Reported && now >= Started + WARMUP_REPORT) {
+        unsigned long total = 0, seen = 0;
+        size_t        bucket;
+        for (bucket = 0; bucket < WARMUP_BUCKETS; bucket++) {
+            total += Latencies[bucket];
+        }
+        for (bucket = 0; bucket < WARMUP_BUCKETS && total > 0; bucket++) {
+            seen += Latencies[bucket];
+            if (seen * 100 >= total * 99) {
+                break;
+            }
+        }
+        bool warmed = __atomic_load_n(&Warmed, __ATOMIC_ACQUIRE);
+        log("First %d s: %lu requests, p99 %lu us (warmup %s %lu ms)", WARMUP_REPORT / 1000, total,
+            total ? (unsigned long)warmup_bound(bucket) : 0, warmed ? "took" : "still running after",
+            warmed ? Took : (unsigned long)(now - Started));
+        Reported = true;
+    }
+    if (now >= Saved + WARMUP_SAVE) {
+        warmup_save();
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
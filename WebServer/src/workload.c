@@ -0,0 +1,259 @@
+/* workload.c: Standard Request Workload */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Keeps a fixed number of connections busy against a running server for a
+ * fixed time, each one sending the next request of the mix, reading the
+ * response until the server closes, and reconnecting.  The default mix is
+ * the www tree's files, directories and CGI script in the proportions below,
+ * which is what the release build is trained and measured on.
+ **/
+
+/* Globals */
+
+static const char *DefaultMix[] = {
+    "/song.txt", "/html/index.html", "/", "/text/lyrics.txt",
+    "/song.txt", "/text/hackers.txt", "/text", "/html/index.html",
+    "/song.txt", "/scripts/env.sh", "/asdf", "/text/lyrics.txt",
+};
+
+#define DEFAULT_MIX     (sizeof(DefaultMix) / sizeof(DefaultMix[0]))
+
+static const char **Mix        = DefaultMix;
+static size_t       MixLength  = DEFAULT_MIX;
+static size_t       MixNext    = 0;
+static int          Clients    = 8;
+static double       Duration   = 5;
+static const char  *Host       = "localhost";
+static const char  *ServerPort = "9898";
+
+typedef struct {
+    int       fd;                       /*< Socket (-1 when idle) */
+    char      request[BUFSIZ];          /*< Request being sent */
+    size_t    length;                   /*< Length of request */
+    size_t    sent;                     /*< Bytes of request sent */
+    char      head[13];                 /*< Start of response ("HTTP/1.x NNN") */
+    size_t    received;                 /*< Bytes of response received */
+    uint64_t  started;                  /*< Time request was started (us) */
+} Client;
+
+static struct {
+    unsigned long responses[6];         /* By status class (0 for malformed) */
+    unsigned long errors;
+    unsigned long bytes;
+    uint64_t     *latencies;
+    size_t        nlatencies;
+    size_t        capacity;
+} Results;
+
+/* Functions */
+
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [-c clients -d seconds] host port [path...]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c clients    Concurrent connections (8)\n");
+    fprintf(stderr, "    -d seconds    Duration of workload (5)\n");
+    exit(status);
+}
+
+static uint64_t workload_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Connect client to server and queue the next request of the mix */
+static int client_start(Client *c, struct addrinfo *address, int efd) {
+    c->fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK, address->ai_protocol);
+    if (c->fd < 0) {
+        return -1;
+    }
+    if (connect(c->fd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    const char *path = Mix[MixNext++ % MixLength];
+    c->length   = snprintf(c->request, sizeof(c->request),
+        "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: workload\r\n\r\n", path, Host);
+    c->sent     = 0;
+    c->received = 0;
+    c->started  = workload_clock();
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = c };
+    return epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &event);
+}
+
+/* Record result of finished request and close its connection */
+static void client_finish(Client *c, bool failed) {
+    if (failed || c->received < sizeof(c->head) - 1) {
+        Results.errors++;
+    } else {
+        char digit = c->head[9];
+        int  class = digit >= '1' && digit <= '5' ? digit - '0' : 0;
+        Results.responses[class]++;
+
+        if (Results.nlatencies == Results.capacity) {
+            Results.capacity  = Results.capacity ? Results.capacity * 2 : 1024;
+            Results.latencies = realloc(Results.latencies, Results.capacity * sizeof(uint64_t));
+        }
+        Results.latencies[Results.nlatencies++] = workload_clock() - c->started;
+    }
+
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Make progress on client's request */
+static void client_event(Client *c, int efd) {
+    char buffer[BUFSIZ];
+
+    if (c->sent < c->length) {
+        ssize_t nwritten = send(c->fd, c->request + c->sent, c->length - c->sent, MSG_NOSIGNAL);
+        if (nwritten < 0) {
+            if (errno != EAGAIN) {
+                client_finish(c, true);
+            }
+            return;
+        }
+        c->sent += nwritten;
+        if (c->sent == c->length) {
+            struct epoll_event event = { .events = EPOLLIN, .data.ptr = c };
+            epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &event);
+        }
+        return;
+    }
+
+    while (true) {
+        ssize_t nread = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (nread < 0) {
+            if (errno != EAGAIN) {
+                client_finish(c, true);
+            }
+            return;
+        }
+        if (nread == 0) {
+            client_finish(c, false);
+            return;
+        }
+
+        if (c->received < sizeof(c->head) - 1) {
+            size_t n = sizeof(c->head) - 1 - c->received;
+            memcpy(c->head + c->received, buffer, (size_t)nread < n ? (size_t)nread : n);
+        }
+        c->received   += nread;
+        Results.bytes += nread;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        switch (arg[1]) {
+        case 'c':
+            Clients = argind < argc ? atoi(argv[argind++]) : 0;
+            break;
+        case 'd':
+            Duration = argind < argc ? atof(argv[argind++]) : 0;
+            break;
+        case 'h':
+            usage(argv[0], EXIT_SUCCESS);
+            break;
+        default:
+            usage(argv[0], EXIT_FAILURE);
+            break;
+        }
+    }
+    if (argc - argind < 2 || Clients < 1 || Duration <= 0) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+    Host       = argv[argind++];
+    ServerPort = argv[argind++];
+    if (argind < argc) {
+        Mix       = (const char **)&argv[argind];
+        MixLength = argc - argind;
+    }
+
+    struct addrinfo  hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *address;
+    int status = getaddrinfo(Host, ServerPort, &hints, &address);
+    if (status != 0) {
+        fprintf(stderr, "Unable to lookup %s:%s: %s\n", Host, ServerPort, gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    int     efd     = epoll_create1(EPOLL_CLOEXEC);
+    Client *clients = calloc(Clients, sizeof(Client));
+    if (efd < 0 || !clients) {
+        fprintf(stderr, "Unable to allocate clients: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = workload_clock();
+    uint64_t stop  = start + (uint64_t)(Duration * 1000000);
+    for (int i = 0; i < Clients; i++) {
+        clients[i].fd = -1;
+        client_start(&clients[i], address, efd);
+    }
+
+    struct epoll_event events[64];
+    while (workload_clock() < stop) {
+        int nevents = epoll_wait(efd, events, 64, 10);
+        for (int i = 0; i < nevents; i++) {
+            client_event(events[i].data.ptr, efd);
+        }
+        for (int i = 0; i < Clients; i++) {
+            if (clients[i].fd < 0 && client_start(&clients[i], address, efd) < 0) {
+                Results.errors++;
+            }
+        }
+    }
+    double elapsed = (workload_clock() - start) / 1e6;
+
+    unsigned long total = 0;
+    for (int class = 0; class < 6; class++) {
+        total += Results.responses[class];
+    }
+
+    qsort(Results.latencies, Results.nlatencies, sizeof(uint64_t), compare_latency);
+    uint64_t p50 = Results.nlatencies ? Results.latencies[Results.nlatencies / 2] : 0;
+    uint64_t p99 = Results.nlatencies ? Results.latencies[Results.nlatencies * 99 / 100] : 0;
+
+    printf("requests %lu errors %lu seconds %.2f rate %.1f p50_us %lu p99_us %lu mbytes %.2f\n",
+        total, Results.errors, elapsed, total / elapsed, (unsigned long)p50, (unsigned long)p99,
+        Results.bytes / 1e6);
+    printf("status 2xx %lu 3xx %lu 4xx %lu 5xx %lu other %lu\n", Results.responses[2],
+        Results.responses[3], Results.responses[4], Results.responses[5],
+        Results.responses[0] + Results.responses[1]);
+
+    for (int i = 0; i < Clients; i++) {
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+        }
+    }
+    free(clients);
+    free(Results.latencies);
+    freeaddrinfo(address);
+    return Results.errors && !total ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
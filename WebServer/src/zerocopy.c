@@ -0,0 +1,211 @@
+/* zerocopy.c: Zero-Copy Sends of In-Memory Bodies */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Bodies built in memory (directory listings, plugin output, files copied
+ * through a buffer) reach the socket in writes of up to the whole body.  A
+ * write of at least ZerocopyMin bytes on a plain TCP connection is sent with
+ * MSG_ZEROCOPY: the kernel transmits straight from our pages instead of
+ * copying them into the send buffer, and reports on the socket's error queue
+ * once it no longer needs them.  The write returns only after every send it
+ * made has been reported, so the caller's buffer stays untouched for exactly
+ * as long as the kernel holds it and may be freed or refilled right away.
+ *
+ * That makes each large write stop-and-wait: the reports come once the client
+ * has acknowledged the data, so a write lasts at least a round trip past its
+ * last send and the connection's next write cannot start before then.  At
+ * one write per round trip, a 256 KB listing to a client 50 ms away moves at
+ * about 5 MB/s, where plain writes would keep the window full.  ZerocopyMin
+ * should therefore leave MSG_ZEROCOPY to bodies large enough that the copy
+ * saved outweighs the wait.  Letting the reports drain in the event loop
+ * instead would need the caller's buffer kept alive past the write.
+ *
+ * The first such write on a connection also sets TCP_NOTSENT_LOWAT to
+ * NotsentLowat, so the kernel keeps at most that much unsent data queued and
+ * the rest of the body waits in our buffer rather than in socket memory; with
+ * many slow readers this bounds the kernel's share to about the bytes in
+ * flight.
+ *
+ * When the kernel reports that it copied the data after all (as it does for
+ * loopback and for kernel TLS), or refuses MSG_ZEROCOPY, the connection goes
+ * back to plain writes.  A connection whose deadline passes while its pages
+ * are still held is set to reset on close, so the kernel drops them instead
+ * of sending what the caller may reuse.
+ **/
+
+/* Functions */
+
+/* Write all of a buffer with plain writes (stdio takes a short write for an
+ * error, and the unsent limit makes them common) */
+static ssize_t zerocopy_copy(int fd, const char *buffer, size_t n) {
+    size_t written = 0;
+    while (written < n) {
+        ssize_t nwritten = coroutine_write(fd, buffer + written, n - written);
+        if (nwritten < 0) {
+            return written > 0 ? (ssize_t)written : -1;
+        }
+        written += nwritten;
+    }
+    return written;
+}
+
+/* Turn on MSG_ZEROCOPY and the unsent limit for a connection */
+static void zerocopy_enable(Request *r) {
+    int one = 1;
+
+    r->zerocopy = ZEROCOPY_OFF;
+    if (r->peer.ss_family != AF_INET && r->peer.ss_family != AF_INET6) {
+        return;
+    }
+    if (NotsentLowat > 0 &&
+        setsockopt(r->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &NotsentLowat, sizeof(NotsentLowat)) < 0) {
+        debug("Unable to set TCP_NOTSENT_LOWAT: %s", strerror(errno));
+    }
+    if (setsockopt(r->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        debug("Unable to set SO_ZEROCOPY: %s", strerror(errno));
+        return;
+    }
+    r->zerocopy = ZEROCOPY_ON;
+}
+
+/* Read the completion notifications queued, counting the sends they cover
+ * (and the ones the kernel copied) */
+static int zerocopy_reap(int fd, size_t *done, size_t *copied) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+
+    for (;;) {
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            /* ee_info to ee_data (inclusive) are the sends completed */
+            size_t n = ee->ee_data - ee->ee_info + 1;
+            *done += n;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                *copied += n;
+            }
+        }
+    }
+}
+
+/**
+ * Write a buffer to a request's socket, without copying it when it is large.
+ *
+ * @param   r           Request on a plain HTTP (or kernel TLS) connection.
+ * @param   buffer      Data to send.
+ * @param   n           Bytes of data.
+ * @return  Bytes written (n unless the connection failed or its deadline
+ * passed), or -1 with errno set, like coroutine_write.
+ *
+ * The kernel is done with buffer by the time this returns.
+ **/
+ssize_t zerocopy_write(Request *r, const char *buffer, size_t n) {
+    if (ZerocopyMin <= 0 || n < (size_t)ZerocopyMin) {
+        return zerocopy_copy(r->fd, buffer, n);
+    }
+    if (r->zerocopy == ZEROCOPY_UNTRIED) {
+        zerocopy_enable(r);
+    }
+    if (r->zerocopy != ZEROCOPY_ON) {
+        return zerocopy_copy(r->fd, buffer, n);
+    }
+
+    size_t sent = 0, sends = 0, done = 0, copied = 0;
+    int    error = 0;
+    while (sent < n) {
+        ssize_t nsent = send(r->fd, buffer + sent, n - sent, MSG_ZEROCOPY | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nsent > 0) {
+            sent += nsent;
+            sends++;
+            continue;
+        }
+        if (errno == ENOBUFS || errno == EOPNOTSUPP) {
+            /* Out of memory for notifications, or a socket that cannot
+             * send from our pages: copy the rest */
+            if (errno == EOPNOTSUPP) {
+                r->zerocopy = ZEROCOPY_OFF;
+            }
+            nsent = zerocopy_copy(r->fd, buffer + sent, n - sent);
+            if (nsent > 0) {
+                sent += nsent;
+                continue;
+            }
+        } else if (errno == EAGAIN) {
+            /* Completions free room as well, so collect them while waiting */
+            if (zerocopy_reap(r->fd, &done, &copied) < 0) {
+                error = errno;
+                break;
+            }
+            int ready = coroutine_poll(r->fd, POLLOUT, -1);
+            if (ready > 0) {
+                continue;
+            }
+            error = ready == 0 ? ETIMEDOUT : errno;
+            break;
+        }
+        error = errno;
+        break;
+    }
+
+    /* Hold the caller until the kernel lets go of every page sent (a round
+     * trip at least; see above) */
+    while (done < sends) {
+        int ready = coroutine_poll(r->fd, 0, -1);
+        if (ready <= 0) {
+            error = ready == 0 ? ETIMEDOUT : errno;
+            break;
+        }
+        size_t before = done;
+        if (zerocopy_reap(r->fd, &done, &copied) < 0) {
+            error = errno;
+            break;
+        }
+        /* A hung up socket polls ready before its notifications arrive */
+        if (done == before) {
+            coroutine_sleep(1);
+        }
+    }
+    if (done < sends) {
+        /* Reset on close, so the pages still held are dropped rather than sent */
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(r->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+
+    stats_add(zerocopy_sends, sends);
+    stats_add(zerocopy_copied, copied);
+    if (sends > 0 && copied == sends) {
+        debug("Kernel copied zero-copy sends; using plain writes");
+        r->zerocopy = ZEROCOPY_OFF;
+    }
+
+    if (error) {
+        errno = error;
+        return sent > 0 ? (ssize_t)sent : -1;
+    }
+    return sent;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,7 @@
+#!/bin/sh
+
+echo "HTTP/1.0 200 OK"
+echo "Content-type: application/octet-stream"
+echo
+
+cat